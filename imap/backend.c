@@ -168,6 +168,7 @@ static int do_compress(struct backend *s, struct simple_cmd_t *compress_cmd)
 
     prot_setcompress(s->in);
     prot_setcompress(s->out);
+    prot_setcompresslevel(s->out, config_getint(IMAPOPT_PROXY_COMPRESS_LEVEL));
 
     return 0;
 #endif /* HAVE_ZLIB */
@@ -668,6 +669,37 @@ int backend_ping(struct backend *s)
     }
 }
 
+/* switch an authenticated connection to act for 'userid' */
+int backend_proxyauth(struct backend *s, const char *userid)
+{
+    char buf[1024];
+
+    if (!s || !s->prot->proxyauth_cmd.cmd ||
+	!CAPA(s, s->prot->proxyauth_cmd.capa)) return -1;
+    if (s->sock == -1) return -1; /* Disconnected Socket */
+
+    prot_printf(s->out, "%s ", s->prot->proxyauth_cmd.cmd);
+    prot_printastring(s->out, userid);
+    prot_printf(s->out, "\r\n");
+    prot_flush(s->out);
+
+    for (;;) {
+	if (!prot_fgets(buf, sizeof(buf), s->in)) {
+	    /* connection closed? */
+	    return -1;
+	} else if (!strncmp(s->prot->proxyauth_cmd.ok, buf,
+			    strlen(s->prot->proxyauth_cmd.ok))) {
+	    return 0;
+	} else if (!strncmp(s->prot->proxyauth_cmd.fail, buf,
+			    strlen(s->prot->proxyauth_cmd.fail))) {
+	    syslog(LOG_WARNING, "%s refused PROXYAUTH %s: %.*s",
+		   s->hostname, userid, (int) strcspn(buf, "\r\n"), buf);
+	    return -1;
+	}
+	/* otherwise an unsolicited response */
+    }
+}
+
 void backend_disconnect(struct backend *s)
 {
     char buf[1024];
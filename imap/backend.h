@@ -89,6 +89,7 @@ struct backend *backend_connect(struct backend *cache, const char *server,
 				struct protocol_t *prot, const char *userid,
 				sasl_callback_t *cb, const char **auth_status);
 int backend_ping(struct backend *s);
+int backend_proxyauth(struct backend *s, const char *userid);
 void backend_disconnect(struct backend *s);
 
 #define CAPA(s, c) ((s)->capability & (c))
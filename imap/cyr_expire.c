@@ -56,6 +56,9 @@
 #include <syslog.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include <sasl/sasl.h>
 
@@ -67,6 +70,7 @@
 #include "hash.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -79,7 +83,8 @@ static int sigquit = 0;
 void usage(void)
 {
     fprintf(stderr,
-	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>] [-p prefix] [-a] [-v]\n");
+	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>] [-p prefix] [-a] [-v]\n"
+	    "           [-j <workers>] [-i <ops-per-sec>] [-b <bytes-per-sec>]\n");
     exit(-1);
 }
 
@@ -155,6 +160,44 @@ static int parse_duration(const char *s, int *secondsp)
     return 1;
 }
 
+/*
+ * Parse a non-negative rate such as "20" or "8M" into *ratep.
+ *
+ * Accepts the suffixes "k", "M" and "G" (binary multiples).
+ * Returns 1 if successful, or 0 on error.
+ */
+static int parse_rate(const char *s, unsigned long *ratep)
+{
+    char *end = NULL;
+    unsigned long val;
+
+    if (!Uisdigit(*s))
+	return 0;
+
+    val = strtoul(s, &end, 10);
+    if (*end) {
+	if (end[1]) return 0; /* trailing extra junk */
+
+	switch (*end) {
+	case 'k': case 'K':
+	    val *= 1024;
+	    break;
+	case 'm': case 'M':
+	    val *= 1024 * 1024;
+	    break;
+	case 'g': case 'G':
+	    val *= 1024 * 1024 * 1024;
+	    break;
+	default:
+	    return 0;
+	}
+    }
+
+    *ratep = val;
+
+    return 1;
+}
+
 /*
  * mailbox_expunge() callback to expunge expired articles.
  */
@@ -355,6 +398,613 @@ int delete(char *name,
     }
     return(0);
 }
+
+/* ====================================================================== */
+
+/* I/O budget.
+
+   A token bucket of I/O operations and bytes per second, holding at
+   most one second's worth.  Work is charged after it is done with what
+   it actually cost, so a large mailbox may leave the bucket in debt;
+   nothing more is started until the debt is paid off.  Operations are
+   mailboxes opened and messages removed; bytes are the block I/O the
+   kernel accounted to the process (getrusage, in 512-byte units), so
+   reads served from the page cache cost nothing. */
+
+struct io_budget {
+    unsigned long ops_per_sec;
+    unsigned long bytes_per_sec;
+    double ops;
+    double bytes;
+    double throttled;
+    struct timeval last;
+};
+
+static struct io_budget budget;
+
+static double timesub(const struct timeval *start, const struct timeval *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+	   (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static unsigned long io_blocks(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru)) return 0;
+
+    return ru.ru_inblock + ru.ru_oublock;
+}
+
+static void budget_init(struct io_budget *b)
+{
+    b->ops = b->ops_per_sec;
+    b->bytes = b->bytes_per_sec;
+    gettimeofday(&b->last, NULL);
+}
+
+static void budget_refill(struct io_budget *b)
+{
+    struct timeval now;
+    double elapsed;
+
+    gettimeofday(&now, NULL);
+    elapsed = timesub(&b->last, &now);
+    b->last = now;
+
+    b->ops += elapsed * b->ops_per_sec;
+    if (b->ops > b->ops_per_sec) b->ops = b->ops_per_sec;
+
+    b->bytes += elapsed * b->bytes_per_sec;
+    if (b->bytes > b->bytes_per_sec) b->bytes = b->bytes_per_sec;
+}
+
+static void budget_charge(struct io_budget *b,
+			  unsigned long ops, unsigned long bytes)
+{
+    if (!b->ops_per_sec && !b->bytes_per_sec) return;
+
+    budget_refill(b);
+    if (b->ops_per_sec) b->ops -= ops;
+    if (b->bytes_per_sec) b->bytes -= bytes;
+}
+
+/* Seconds until there is budget to start more work */
+static double budget_wait(struct io_budget *b)
+{
+    double wait = 0, w;
+
+    if (!b->ops_per_sec && !b->bytes_per_sec) return 0;
+
+    budget_refill(b);
+    if (b->ops_per_sec && b->ops < 0)
+	wait = -b->ops / b->ops_per_sec;
+    if (b->bytes_per_sec && b->bytes < 0) {
+	w = -b->bytes / b->bytes_per_sec;
+	if (w > wait) wait = w;
+    }
+
+    return wait;
+}
+
+static void budget_sleep(struct io_budget *b)
+{
+    double wait = budget_wait(b);
+    struct timeval tv;
+
+    if (wait <= 0) return;
+
+    tv.tv_sec = (time_t) wait;
+    tv.tv_usec = (wait - tv.tv_sec) * 1000000;
+    select(0, NULL, NULL, NULL, &tv);
+    b->throttled += wait;
+}
+
+/* ====================================================================== */
+
+/* Phases (expire, delete, prune) report their progress every
+   PROGRESS_INTERVAL seconds and their totals when they finish. */
+
+#define PROGRESS_INTERVAL 30
+
+struct expire_phase {
+    const char *name;
+    struct timeval start;
+    time_t lastreport;
+    unsigned long items;
+    unsigned long ops;
+    unsigned long bytes;
+    double throttled;
+    int verbose;
+};
+
+static void phase_start(struct expire_phase *ph, const char *name, int verbose)
+{
+    memset(ph, 0, sizeof(struct expire_phase));
+    ph->name = name;
+    ph->verbose = verbose;
+    ph->throttled = budget.throttled;
+    gettimeofday(&ph->start, NULL);
+    ph->lastreport = ph->start.tv_sec;
+}
+
+static void phase_done_one(struct expire_phase *ph,
+			   unsigned long ops, unsigned long bytes)
+{
+    struct timeval now;
+    double elapsed;
+
+    ph->items++;
+    ph->ops += ops;
+    ph->bytes += bytes;
+
+    gettimeofday(&now, NULL);
+    if (now.tv_sec - ph->lastreport < PROGRESS_INTERVAL) return;
+    ph->lastreport = now.tv_sec;
+
+    elapsed = timesub(&ph->start, &now);
+    syslog(LOG_INFO, "%s: %lu mailboxes after %.0f seconds (%.1f/sec)",
+	   ph->name, ph->items, elapsed, ph->items / elapsed);
+    if (ph->verbose) {
+	fprintf(stderr, "%s: %lu mailboxes after %.0f seconds (%.1f/sec)\n",
+		ph->name, ph->items, elapsed, ph->items / elapsed);
+    }
+}
+
+static void phase_end(struct expire_phase *ph)
+{
+    struct timeval now;
+    double elapsed;
+
+    gettimeofday(&now, NULL);
+    elapsed = timesub(&ph->start, &now);
+
+    syslog(LOG_NOTICE, "%s phase: %lu mailboxes in %.1f seconds, "
+	   "%lu I/O ops, %lu bytes, throttled %.1f seconds",
+	   ph->name, ph->items, elapsed, ph->ops, ph->bytes,
+	   budget.throttled - ph->throttled);
+    if (ph->verbose) {
+	fprintf(stderr, "%s phase: %lu mailboxes in %.1f seconds, "
+		"%lu I/O ops, %lu bytes, throttled %.1f seconds\n",
+		ph->name, ph->items, elapsed, ph->ops, ph->bytes,
+		budget.throttled - ph->throttled);
+    }
+}
+
+/* Expire one mailbox, charging what it cost to the phase and budget */
+static void expire_one(char *name, int matchlen, struct expire_rock *erock,
+		       unsigned long *opsp, unsigned long *bytesp)
+{
+    unsigned long deleted = erock->deleted;
+    unsigned long blocks = io_blocks();
+
+    expire(name, matchlen, 0, erock);
+
+    *opsp = 1 + erock->deleted - deleted;
+    *bytesp = (io_blocks() - blocks) * 512;
+}
+
+static int delete_one(char *name, int verbose,
+		      unsigned long *opsp, unsigned long *bytesp)
+{
+    unsigned long blocks = io_blocks();
+    int r;
+
+    if (verbose) {
+	fprintf(stderr, "Removing: %s\n", name);
+    }
+    r = mboxlist_deletemailbox(name, 1, NULL, NULL, 0, 0, 0);
+
+    *opsp = 1;
+    *bytesp = (io_blocks() - blocks) * 512;
+
+    return r;
+}
+
+struct expire_serial_rock {
+    struct expire_rock *erock;
+    struct expire_phase *phase;
+};
+
+/* mboxlist_findall() callback for expiring in this process */
+static int expire_serial(char *name, int matchlen,
+			 int maycreate __attribute__((unused)), void *rock)
+{
+    struct expire_serial_rock *srock = (struct expire_serial_rock *) rock;
+    unsigned long ops, bytes;
+
+    if (sigquit) return 1;
+
+    expire_one(name, matchlen, srock->erock, &ops, &bytes);
+    phase_done_one(srock->phase, ops, bytes);
+
+    budget_charge(&budget, ops, bytes);
+    budget_sleep(&budget);
+
+    return 0;
+}
+
+/* ====================================================================== */
+
+/* Parallel mode.
+
+   Worker processes are forked before any database is opened.  Each
+   has its own job pipe, so the parent always knows which mailbox a
+   worker holds, and all of them send a fixed-size report back on a
+   shared pipe when they are done with one.  Reports are smaller than
+   PIPE_BUF, so writes to the shared pipe are atomic.  The parent looks
+   for workers that have died while it waits; the job one was holding
+   is written off and its slot is not refilled.
+
+   The parent walks the mailbox list and hands a job to an idle worker
+   only when the I/O budget allows, so the budget is shared by all
+   workers and no worker ever has more than one job.
+   Mailboxes whose expire annotation applied are reported back, so the
+   parent can prune the duplicate delivery database for them. */
+
+#define MAX_WORKERS 32
+
+enum {
+    JOB_EXPIRE = 0,
+    JOB_DELETE = 1
+};
+
+struct expire_job {
+    int kind;
+    int matchlen;
+    char name[MAX_MAILBOX_BUFFER];
+};
+
+struct expire_report {
+    int worker;
+    int marked;
+    time_t expire_mark;
+    unsigned long mailboxes;
+    unsigned long messages;
+    unsigned long deleted;
+    unsigned long ops;
+    unsigned long bytes;
+    double elapsed;
+    char name[MAX_MAILBOX_BUFFER];
+};
+
+struct expire_worker {
+    pid_t pid;
+    int alive;
+    int jobfd;				/* our end of its job pipe */
+    char job[MAX_MAILBOX_BUFFER];	/* what it is working on, if anything */
+    unsigned long mailboxes;
+    double busy;
+};
+
+struct expire_pool {
+    int nworkers;
+    int alive;
+    struct expire_worker *workers;
+    int stopping;			/* no more jobs are coming */
+    int reportfd;
+    unsigned long queued;
+    unsigned long done;
+    struct expire_rock *erock;
+    struct expire_phase *phase;
+};
+
+static void expire_worker_run(int id, int jobfd, int reportfd,
+			      struct expire_rock *proto)
+{
+    struct expire_job job;
+    struct expire_report report;
+    struct expire_rock erock;
+    struct hash_table table;
+    struct timeval start, end;
+    time_t *mark;
+
+    erock = *proto;
+    erock.table = construct_hash_table(&table, 100, 0);
+
+    annotatemore_init(0, NULL, NULL);
+    annotatemore_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    while (!sigquit && read(jobfd, &job, sizeof(job)) == sizeof(job)) {
+	memset(&report, 0, sizeof(report));
+	report.worker = id;
+	strlcpy(report.name, job.name, sizeof(report.name));
+
+	gettimeofday(&start, NULL);
+
+	if (job.kind == JOB_DELETE) {
+	    delete_one(job.name, erock.verbose, &report.ops, &report.bytes);
+	}
+	else {
+	    erock.mailboxes = erock.messages = erock.deleted = 0;
+	    expire_one(job.name, job.matchlen, &erock,
+		       &report.ops, &report.bytes);
+
+	    report.mailboxes = erock.mailboxes;
+	    report.messages = erock.messages;
+	    report.deleted = erock.deleted;
+
+	    mark = (time_t *) hash_del(job.name, &table);
+	    if (mark) {
+		report.marked = 1;
+		report.expire_mark = *mark;
+		free(mark);
+	    }
+	}
+
+	gettimeofday(&end, NULL);
+	report.elapsed = timesub(&start, &end);
+
+	if (retry_write(reportfd, &report, sizeof(report)) < 0) {
+	    syslog(LOG_ERR, "cyr_expire worker %d: can't report to parent: %m",
+		   id);
+	    break;
+	}
+    }
+
+    free_hash_table(&table, free);
+
+    quotadb_close();
+    quotadb_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+}
+
+static void pool_start(struct expire_pool *pool, int nworkers,
+		       struct expire_rock *erock)
+{
+    int jobpipe[2], reportpipe[2];
+    int i, j;
+
+    memset(pool, 0, sizeof(struct expire_pool));
+    pool->nworkers = nworkers;
+    pool->erock = erock;
+
+    if (pipe(reportpipe) < 0)
+	fatal("unable to create worker pipes", EC_OSERR);
+
+    pool->workers = xzmalloc(nworkers * sizeof(struct expire_worker));
+    for (i = 0; i < nworkers; i++) {
+	pid_t pid;
+
+	if (pipe(jobpipe) < 0)
+	    fatal("unable to create worker pipes", EC_OSERR);
+
+	pid = fork();
+	if (pid < 0) fatal("unable to fork worker", EC_OSERR);
+
+	if (pid == 0) {
+	    /* only our own job pipe, or we'd never see EOF on it */
+	    for (j = 0; j < i; j++) close(pool->workers[j].jobfd);
+	    close(jobpipe[1]);
+	    close(reportpipe[0]);
+	    expire_worker_run(i, jobpipe[0], reportpipe[1], erock);
+	    cyrus_done();
+	    exit(0);
+	}
+
+	close(jobpipe[0]);
+	pool->workers[i].pid = pid;
+	pool->workers[i].alive = 1;
+	pool->workers[i].jobfd = jobpipe[1];
+    }
+    pool->alive = nworkers;
+    close(reportpipe[1]);
+
+    pool->reportfd = reportpipe[0];
+
+    syslog(LOG_INFO, "started %d expire workers", nworkers);
+}
+
+/* Wait for and account for one report */
+static void pool_collect(struct expire_pool *pool)
+{
+    struct expire_report report;
+    struct expire_worker *w;
+    time_t *mark;
+    int n;
+
+    n = retry_read(pool->reportfd, &report, sizeof(report));
+    if (n <= 0) {
+	/* every worker is gone: give up like on SIGQUIT */
+	syslog(LOG_ERR, "cyr_expire workers exited with %lu jobs pending",
+	       pool->queued - pool->done);
+	pool->done = pool->queued;
+	sigquit = 1;
+	return;
+    }
+    if (n != sizeof(report) ||
+	report.worker < 0 || report.worker >= pool->nworkers) {
+	fatal("short report from cyr_expire worker", EC_SOFTWARE);
+    }
+
+    w = &pool->workers[report.worker];
+    w->job[0] = '\0';
+
+    pool->done++;
+    w->mailboxes++;
+    w->busy += report.elapsed;
+
+    pool->erock->mailboxes += report.mailboxes;
+    pool->erock->messages += report.messages;
+    pool->erock->deleted += report.deleted;
+    if (report.marked) {
+	mark = (time_t *) xmalloc(sizeof(time_t));
+	*mark = report.expire_mark;
+	hash_insert(report.name, mark, pool->erock->table);
+    }
+
+    if (pool->phase) phase_done_one(pool->phase, report.ops, report.bytes);
+    budget_charge(&budget, report.ops, report.bytes);
+}
+
+/* Is there a report to collect within 'timeout' seconds? */
+static int pool_ready(struct expire_pool *pool, double timeout)
+{
+    struct timeval tv;
+    fd_set rfds;
+    int r;
+
+    FD_ZERO(&rfds);
+    FD_SET(pool->reportfd, &rfds);
+    tv.tv_sec = (time_t) timeout;
+    tv.tv_usec = (timeout - tv.tv_sec) * 1000000;
+
+    r = select(pool->reportfd + 1, &rfds, NULL, NULL, &tv);
+    if (r < 0 && errno != EINTR)
+	fatal("select failed waiting for expire workers", EC_OSERR);
+
+    return r > 0;
+}
+
+/* Notice workers that have died, and write off what they were doing */
+static void pool_reap(struct expire_pool *pool)
+{
+    struct expire_worker *w;
+    int i, status;
+
+    for (i = 0; i < pool->nworkers; i++) {
+	w = &pool->workers[i];
+	if (!w->alive || waitpid(w->pid, &status, WNOHANG) <= 0) continue;
+
+	w->alive = 0;
+	pool->alive--;
+	if (w->jobfd != -1) close(w->jobfd);
+	w->jobfd = -1;
+
+	/* anything it managed to report is in the pipe by now */
+	while (pool->done < pool->queued && pool_ready(pool, 0))
+	    pool_collect(pool);
+
+	if (w->job[0] || !WIFEXITED(status) || WEXITSTATUS(status)) {
+	    syslog(LOG_ERR, "cyr_expire worker %d (pid %d) failed: "
+		   "status %d%s%s", i, (int) w->pid, status,
+		   w->job[0] ? ", abandoning " : "", w->job);
+	}
+	if (w->job[0]) {
+	    w->job[0] = '\0';
+	    pool->done++;
+	    if (pool->phase) phase_done_one(pool->phase, 0, 0);
+	}
+    }
+
+    if (!pool->alive && pool->done < pool->queued) {
+	syslog(LOG_ERR, "cyr_expire workers exited with %lu jobs pending",
+	       pool->queued - pool->done);
+	pool->done = pool->queued;
+    }
+    /* nobody left to hand the rest to: give up like on SIGQUIT */
+    if (!pool->alive && !pool->stopping) sigquit = 1;
+}
+
+static void pool_submit(struct expire_pool *pool, int kind,
+			const char *name, int matchlen)
+{
+    struct expire_job job;
+    struct expire_worker *w;
+    struct timeval start, end;
+    double wait;
+    int i, idle, r;
+
+    for (;;) {
+	if (sigquit) return;
+
+	for (i = 0, w = NULL; i < pool->nworkers; i++) {
+	    if (pool->workers[i].alive && !pool->workers[i].job[0]) {
+		w = &pool->workers[i];
+		break;
+	    }
+	}
+	idle = (w != NULL);
+	wait = budget_wait(&budget);
+	if (idle && wait <= 0) break;
+
+	/* wake up now and then to look for dead workers */
+	if (!idle || wait > 1) wait = 1;
+
+	gettimeofday(&start, NULL);
+	r = pool_ready(pool, wait);
+	gettimeofday(&end, NULL);
+	if (idle) budget.throttled += timesub(&start, &end);
+
+	if (r) pool_collect(pool);
+	pool_reap(pool);
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.kind = kind;
+    job.matchlen = matchlen;
+    strlcpy(job.name, name, sizeof(job.name));
+
+    /* if it has just died, the job is written off when it is reaped */
+    strlcpy(w->job, name, sizeof(w->job));
+    pool->queued++;
+    if (retry_write(w->jobfd, &job, sizeof(job)) < 0 && errno != EPIPE)
+	fatal("unable to queue mailbox for expire workers", EC_OSERR);
+}
+
+/* Wait for the outstanding jobs */
+static void pool_drain(struct expire_pool *pool)
+{
+    while (pool->done < pool->queued) {
+	if (pool_ready(pool, 1)) pool_collect(pool);
+	pool_reap(pool);
+    }
+}
+
+static void pool_stop(struct expire_pool *pool)
+{
+    struct expire_worker *w;
+    int i, status;
+
+    pool->stopping = 1;
+    for (i = 0; i < pool->nworkers; i++) {
+	w = &pool->workers[i];
+	if (w->jobfd != -1) close(w->jobfd);
+	w->jobfd = -1;
+    }
+    pool_drain(pool);
+    close(pool->reportfd);
+
+    for (i = 0; i < pool->nworkers; i++) {
+	w = &pool->workers[i];
+	if (w->alive) {
+	    if (waitpid(w->pid, &status, 0) < 0) continue;
+	    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		syslog(LOG_ERR, "cyr_expire worker %d (pid %d) failed: "
+		       "status %d", i, (int) w->pid, status);
+	    }
+	}
+	syslog(LOG_INFO, "worker %d: %lu mailboxes, busy %.1f seconds",
+	       i, w->mailboxes, w->busy);
+    }
+
+    free(pool->workers);
+    pool->workers = NULL;
+}
+
+/* mboxlist_findall() callback for handing mailboxes to the workers */
+static int expire_dispatch(char *name, int matchlen,
+			   int maycreate __attribute__((unused)), void *rock)
+{
+    struct expire_pool *pool = (struct expire_pool *) rock;
+
+    if (sigquit) return 1;
+
+    pool_submit(pool, JOB_EXPIRE, name, matchlen);
+
+    return 0;
+}
+
 static void sighandler (int sig __attribute((unused)))
 {
     sigquit = 1;
@@ -376,6 +1026,11 @@ int main(int argc, char *argv[])
     struct delete_rock drock;
     const char *deletedprefix;
     struct sigaction action;
+    struct expire_pool pool;
+    struct expire_phase phase;
+    struct expire_serial_rock srock;
+    struct timeval start, prune, end;
+    int nworkers = 1;
 
     if ((geteuid()) == 0 && (become_cyrus() != 0)) {
 	fatal("must run as the Cyrus user", EC_USAGE);
@@ -384,8 +1039,9 @@ int main(int argc, char *argv[])
     /* zero the expire_rock & delete_rock */
     memset(&erock, 0, sizeof(erock));
     memset(&drock, 0, sizeof(drock));
+    memset(&pool, 0, sizeof(pool));
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:p:vax")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:D:E:X:p:vaxj:i:b:")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
 	    alt_config = optarg;
@@ -424,6 +1080,20 @@ int main(int argc, char *argv[])
 	    erock.skip_annotate = 1;
 	    break;
 
+	case 'j':
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1) usage();
+	    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+	    break;
+
+	case 'i':
+	    if (!parse_rate(optarg, &budget.ops_per_sec)) usage();
+	    break;
+
+	case 'b':
+	    if (!parse_rate(optarg, &budget.bytes_per_sec)) usage();
+	    break;
+
 	default:
 	    usage();
 	    break;
@@ -438,10 +1108,27 @@ int main(int argc, char *argv[])
     if (sigaction(SIGQUIT, &action, NULL) < 0) {
         fatal("unable to install signal handler for %d: %m", SIGQUIT);
     }
+    /* a worker may die with a job on the way to it */
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) < 0) {
+        fatal("unable to install signal handler for %d: %m", SIGPIPE);
+    }
 
     cyrus_init(alt_config, "cyr_expire", 0);
     global_sasl_init(1, 0, NULL);
 
+    gettimeofday(&start, NULL);
+    budget_init(&budget);
+
+    if (expunge_seconds >= 0) {
+	erock.expunge_mark = time(0) - expunge_seconds;
+    }
+
+    /* the workers open their own databases, so start them first */
+    if (nworkers > 1) {
+	pool_start(&pool, nworkers, &erock);
+    }
+
     annotatemore_init(0, NULL, NULL);
     annotatemore_open(NULL);
 
@@ -468,16 +1155,10 @@ int main(int argc, char *argv[])
 	 * so we can prune those immediately from the duplicate db.
 	 */
 	erock.table = &expire_table;
-	if (expunge_seconds < 0) {
-	    erock.expunge_mark = 0;
-	} else {
-	    erock.expunge_mark = time(0) - expunge_seconds;
-
-	    if (erock.verbose) {
-		fprintf(stderr,
-			"Expunging deleted messages in mailboxes older than %0.2f days\n",
-			((double)expunge_seconds/86400));
-	    }
+	if (expunge_seconds >= 0 && erock.verbose) {
+	    fprintf(stderr,
+		    "Expunging deleted messages in mailboxes older than %0.2f days\n",
+		    ((double)expunge_seconds/86400));
 	}
 
 	if (find_prefix) {
@@ -486,7 +1167,18 @@ int main(int argc, char *argv[])
 	    strlcpy(buf, "*", sizeof(buf));
 	}
 
-	mboxlist_findall(NULL, buf, 1, 0, 0, &expire, &erock);
+	phase_start(&phase, "expire", erock.verbose);
+	if (pool.workers) {
+	    pool.phase = &phase;
+	    mboxlist_findall(NULL, buf, 1, 0, 0, &expire_dispatch, &pool);
+	    pool_drain(&pool);
+	}
+	else {
+	    srock.erock = &erock;
+	    srock.phase = &phase;
+	    mboxlist_findall(NULL, buf, 1, 0, 0, &expire_serial, &srock);
+	}
+	phase_end(&phase);
 
 	syslog(LOG_NOTICE, "Expunged %lu out of %lu messages from %lu mailboxes",
 	       erock.deleted, erock.messages, erock.mailboxes);
@@ -519,16 +1211,27 @@ int main(int argc, char *argv[])
 
         mboxlist_findall(NULL, buf, 1, 0, 0, &delete, &drock);
 
+        phase_start(&phase, "delete", drock.verbose);
+        pool.phase = &phase;
         for (node = drock.head ; node ; node = node->next) {
 	    if (sigquit) {
 		goto finish;
 	    }
-            if (drock.verbose) {
-                fprintf(stderr, "Removing: %s\n", node->name);
-            }
-            r = mboxlist_deletemailbox(node->name, 1, NULL, NULL, 0, 0, 0);
+	    if (pool.workers) {
+		pool_submit(&pool, JOB_DELETE, node->name, 0);
+	    }
+	    else {
+		unsigned long ops, bytes;
+
+		r = delete_one(node->name, drock.verbose, &ops, &bytes);
+		phase_done_one(&phase, ops, bytes);
+		budget_charge(&budget, ops, bytes);
+		budget_sleep(&budget);
+	    }
             count++;
         }
+        if (pool.workers) pool_drain(&pool);
+        phase_end(&phase);
 
         if (drock.verbose) {
             if (count != 1) {
@@ -543,10 +1246,26 @@ int main(int argc, char *argv[])
 	goto finish;
     }
 
+    /* all the mailboxes are done; the duplicate db is a single sweep */
+    if (pool.workers) pool_stop(&pool);
+
     /* purge deliver.db entries of expired messages */
+    gettimeofday(&prune, NULL);
     r = duplicate_prune(expire_seconds, &expire_table);
+    gettimeofday(&end, NULL);
+    syslog(LOG_NOTICE, "prune phase: %.1f seconds",
+	   timesub(&prune, &end));
+    if (erock.verbose) {
+	fprintf(stderr, "prune phase: %.1f seconds\n",
+		timesub(&prune, &end));
+    }
 
 finish:
+    if (pool.workers) pool_stop(&pool);
+
+    gettimeofday(&end, NULL);
+    syslog(LOG_NOTICE, "finished in %.1f seconds", timesub(&start, &end));
+
     free_hash_table(&expire_table, free);
 
     quotadb_close();
@@ -82,6 +82,7 @@
 #include "retry.h"
 #include "cyr_lock.h"
 #include "prot.h"
+#include "mpool.h"
 
 #include "dlist.h"
 
@@ -207,6 +208,34 @@ error:
 
 /* DLIST STUFF */
 
+/* Same function used for keys read off the wire and names looked up */
+static unsigned dlist_hash(const char *name, size_t len)
+{
+    unsigned hash = 0;
+
+    while (len--)
+	hash = hash * 33 + (unsigned char)*name++;
+
+    return hash;
+}
+
+static struct dlist *dlist_alloc(struct mpool *pool)
+{
+    struct dlist *i;
+
+    if (!pool) return xzmalloc(sizeof(struct dlist));
+
+    i = mpool_malloc(pool, sizeof(struct dlist));
+    memset(i, 0, sizeof(struct dlist));
+    i->pool = pool;
+    return i;
+}
+
+static char *dlist_strdup(struct mpool *pool, const char *str)
+{
+    return pool ? mpool_strdup(pool, str) : xstrdup(str);
+}
+
 void dlist_stitch(struct dlist *dl, struct dlist *child)
 {
     if (dl->tail)
@@ -217,8 +246,9 @@ void dlist_stitch(struct dlist *dl, struct dlist *child)
 
 static struct dlist *dlist_child(struct dlist *dl, const char *name)
 {
-    struct dlist *i = xzmalloc(sizeof(struct dlist));
-    i->name = xstrdup(name);
+    struct dlist *i = dlist_alloc(dl ? dl->pool : NULL);
+    i->name = dlist_strdup(i->pool, name);
+    i->hash = dlist_hash(name, strlen(name));
     i->type = DL_NIL;
     if (dl)
 	dlist_stitch(dl, i);
@@ -229,7 +259,7 @@ struct dlist *dlist_atom(struct dlist *dl, const char *name, const char *val)
 {
     struct dlist *i = dlist_child(dl, name);
     i->type = DL_ATOM;
-    i->sval = xstrdup(val);
+    i->sval = dlist_strdup(i->pool, val);
     return i;
 }
 
@@ -237,7 +267,7 @@ struct dlist *dlist_flag(struct dlist *dl, const char *name, const char *val)
 {
     struct dlist *i = dlist_child(dl, name);
     i->type = DL_FLAG;
-    i->sval = xstrdup(val);
+    i->sval = dlist_strdup(i->pool, val);
     return i;
 }
 
@@ -283,9 +313,9 @@ struct dlist *dlist_file(struct dlist *dl, const char *name,
     struct dlist *i = dlist_child(dl, name);
     i->type = DL_FILE;
     message_guid_copy(&i->gval, guid);
-    i->sval = xstrdup(fname);
+    i->sval = dlist_strdup(i->pool, fname);
     i->nval = size;
-    i->part = xstrdup(part);
+    i->part = dlist_strdup(i->pool, part);
     return i;
 }
 
@@ -294,7 +324,7 @@ struct dlist *dlist_buf(struct dlist *dl, const char *name,
 {
     struct dlist *i = dlist_child(dl, name);
     i->type = DL_BUF;
-    i->sval = xmalloc(len+1);
+    i->sval = i->pool ? mpool_malloc(i->pool, len+1) : xmalloc(len+1);
     memcpy(i->sval, val, len);
     i->sval[len] = '\0'; /* make it string safe too */
     i->nval = len;
@@ -381,28 +411,25 @@ void dlist_print(const struct dlist *dl, int printkeys, struct protstream *out)
 
 void dlist_free(struct dlist **dlp)
 {
-    struct dlist *i, *next;
-    if (!*dlp) return;
-    i = (*dlp)->head;
-    while (i) {
-	free(i->name);
+    struct dlist *dl = *dlp, *i, *next;
+
+    if (!dl) return;
+    *dlp = NULL;
+
+    /* a parsed tree goes all at once, along with its arena */
+    if (dl->pool) {
+	if (dl->ownpool) free_mpool(dl->pool);
+	return;
+    }
+
+    for (i = dl->head; i; i = next) {
 	next = i->next;
-	switch (i->type) {
-	case DL_KVLIST:
-	case DL_ATOMLIST:
-	    dlist_free(&i);
-	    break;
-	case DL_FILE:
-	    free(i->part);
-	    /* drop through */
-	default:
-	    free(i->sval);
-	}
-	free(i);
-	i = next;
+	dlist_free(&i);
     }
-    free(*dlp);
-    *dlp = NULL;
+    free(dl->name);
+    free(dl->sval);
+    free(dl->part);
+    free(dl);
 }
 
 static char next_nonspace(struct protstream *in, char c)
@@ -413,20 +440,95 @@ static char next_nonspace(struct protstream *in, char c)
     return c;
 }
 
-char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
+/*
+ * Parsing state for one tree.  Every node and string goes into a single
+ * arena, which dlist_free() drops with the root.  Keys repeat for every
+ * record, so each distinct key is stored once and its hash kept with it.
+ */
+#define DLIST_POOL_SIZE 1024
+#define DLIST_KEY_BUCKETS 64
+
+struct dlist_key {
+    char *name;
+    size_t len;
+    unsigned hash;
+    struct dlist_key *next;
+};
+
+struct dlist_parser {
+    struct mpool *pool;
+    struct dlist_key *keys[DLIST_KEY_BUCKETS];
+};
+
+static struct dlist_key *parse_intern(struct dlist_parser *p,
+				      const char *name, size_t len)
+{
+    unsigned hash = dlist_hash(name, len);
+    struct dlist_key **kp = &p->keys[hash % DLIST_KEY_BUCKETS];
+    struct dlist_key *k;
+
+    for (k = *kp; k; k = k->next) {
+	if (k->hash == hash && k->len == len && !memcmp(k->name, name, len))
+	    return k;
+    }
+
+    k = mpool_malloc(p->pool, sizeof(struct dlist_key));
+    k->name = mpool_strndup(p->pool, name, len);
+    k->len = len;
+    k->hash = hash;
+    k->next = *kp;
+    *kp = k;
+
+    return k;
+}
+
+static struct dlist *parse_node(struct dlist_parser *p,
+				const struct dlist_key *key, int type)
+{
+    struct dlist *i = dlist_alloc(p->pool);
+    i->name = key->name;
+    i->hash = key->hash;
+    i->type = type;
+    return i;
+}
+
+/* words that are already buffered are copied straight from the stream */
+static char parse_key(struct dlist_parser *p, struct protstream *in,
+		      struct dlist_key **keyp)
 {
-    struct dlist *dl = NULL;
     static struct buf kbuf;
+    const char *word;
+    unsigned len;
+    char c;
+
+    word = prot_bufword(in, &len);
+    if (word && (!config_maxword || len <= config_maxword)) {
+	*keyp = parse_intern(p, word, len);
+	return prot_getc(in);
+    }
+
+    c = getword(in, &kbuf);
+    *keyp = parse_intern(p, kbuf.s, kbuf.len);
+    return c;
+}
+
+static char parse_value(struct dlist_parser *p, struct dlist **dlp,
+			int parsekey, struct protstream *in)
+{
+    struct dlist *dl = NULL;
+    struct dlist_key *key;
     static struct buf vbuf;
+    const char *word;
+    unsigned len;
     char c;
 
     /* handle the key if wanted */
     if (parsekey) {
-	c = getword(in, &kbuf);
+	c = parse_key(p, in, &key);
 	c = next_nonspace(in, c);
     }
     else {
-	buf_setcstr(&kbuf, "");
+	key = parse_intern(p, "", 0);
 	c = prot_getc(in);
     }
     
@@ -435,12 +537,12 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 
     /* check what sort of value we have */
     if (c == '(') {
-	dl = dlist_list(NULL, kbuf.s);
+	dl = parse_node(p, key, DL_ATOMLIST);
 	c = next_nonspace(in, ' ');
 	while (c != ')') {
 	    struct dlist *di = NULL;
 	    prot_ungetc(c, in);
-	    c = dlist_parse(&di, 0, in);
+	    c = parse_value(p, &di, 0, in);
 	    if (di) dlist_stitch(dl, di);
 	    c = next_nonspace(in, c);
 	    if (c == EOF) goto fail;
@@ -451,12 +553,12 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	/* no whitespace allowed here */
 	c = prot_getc(in);
 	if (c == '(') {
-	    dl = dlist_list(NULL, kbuf.s);
+	    dl = parse_node(p, key, DL_ATOMLIST);
 	    c = next_nonspace(in, ' ');
 	    while (c != ')') {
 		struct dlist *di = NULL;
 		prot_ungetc(c, in);
-		c = dlist_parse(&di, 1, in);
+		c = parse_value(p, &di, 1, in);
 		if (di) dlist_stitch(dl, di);
 		c = next_nonspace(in, c);
 		if (c == EOF) goto fail;
@@ -478,8 +580,12 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	    if (c != '\n') goto fail;
 	    if (!message_guid_decode(&tmp_guid, gbuf.s)) goto fail;
 	    if (reservefile(in, pbuf.s, &tmp_guid, size, &fname)) goto fail;
-	    dl = dlist_file(NULL, kbuf.s, pbuf.s, &tmp_guid, size, fname);
 	    /* file literal */
+	    dl = parse_node(p, key, DL_FILE);
+	    message_guid_copy(&dl->gval, &tmp_guid);
+	    dl->sval = mpool_strdup(p->pool, fname);
+	    dl->nval = size;
+	    dl->part = mpool_strdup(p->pool, pbuf.s);
 	}
 	else {
 	    /* unknown percent type */
@@ -491,14 +597,26 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	prot_ungetc(c, in);
 	/* could be binary in a literal */
 	c = getbastring(in, NULL, &vbuf);
-	dl = dlist_buf(NULL, kbuf.s, vbuf.s, vbuf.len);
+	dl = parse_node(p, key, DL_BUF);
+	dl->sval = mpool_malloc(p->pool, vbuf.len+1);
+	memcpy(dl->sval, vbuf.s, vbuf.len);
+	dl->sval[vbuf.len] = '\0'; /* make it string safe too */
+	dl->nval = vbuf.len;
     }
     else {
 	prot_ungetc(c, in);
-	c = getastring(in, NULL, &vbuf);
-	dl = dlist_atom(NULL, kbuf.s, vbuf.s);
-	if (imparse_isnumber(vbuf.s))
-	    dl->nval = atomodseq_t(vbuf.s);
+	dl = parse_node(p, key, DL_ATOM);
+	if (c != '"' && !Uisspace(c) && c != ')' &&
+	    (word = prot_bufword(in, &len))) {
+	    dl->sval = mpool_strndup(p->pool, word, len);
+	    c = prot_getc(in);
+	}
+	else {
+	    c = getastring(in, NULL, &vbuf);
+	    dl->sval = mpool_strdup(p->pool, vbuf.s);
+	}
+	if (imparse_isnumber(dl->sval))
+	    dl->nval = atomodseq_t(dl->sval);
     }
 
     /* success */
@@ -506,18 +624,41 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
     return c;
 
 fail:
-    dlist_free(&dl);
+    /* anything already parsed goes with the arena */
     return EOF;
 }
 
+char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
+{
+    struct dlist_parser parser;
+    struct dlist *dl = NULL;
+    char c;
+
+    memset(&parser, 0, sizeof(struct dlist_parser));
+    parser.pool = new_mpool(DLIST_POOL_SIZE);
+
+    c = parse_value(&parser, &dl, parsekey, in);
+
+    if (!dl) {
+	free_mpool(parser.pool);
+	return c;
+    }
+
+    dl->ownpool = 1;
+    *dlp = dl;
+    return c;
+}
+
 static struct dlist *dlist_getchild(struct dlist *dl, const char *name)
 {
     struct dlist *i;
+    unsigned hash;
 
     if (!dl) return NULL;
 
+    hash = dlist_hash(name, strlen(name));
     for (i = dl->head; i; i = i->next) {
-	if (!strcmp(name, i->name))
+	if (i->hash == hash && !strcmp(name, i->name))
 	    return i;
     }
     lastkey = name;
@@ -76,6 +76,9 @@ struct dlist {
     modseq_t nval; /* biggest type we need, more or less */
     struct message_guid gval; /* guid if any */
     char *part; /* so what if we're big! */
+    unsigned hash; /* of name, checked before comparing names */
+    struct mpool *pool; /* arena holding a parsed tree, NULL if malloced */
+    int ownpool; /* root of a parsed tree: freeing it frees the arena */
 };
 
 const char *dlist_reserve_path(const char *part, struct message_guid *guid);
@@ -99,6 +102,8 @@ struct dlist *dlist_new(const char *name);
 void dlist_free(struct dlist **dlp);
 
 void dlist_print(const struct dlist *dl, int printkeys, struct protstream *out);
+/* a parsed tree lives in its own arena: children added to it later are
+ * allocated there too, but a malloced node stitched into it would leak */
 char dlist_parse(struct dlist **dlp, int parsekeys, struct protstream *in);
 
 void dlist_stitch(struct dlist *dl, struct dlist *child);
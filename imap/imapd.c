@@ -165,6 +165,7 @@ static char *imapd_magicplus = NULL;
 struct auth_state *imapd_authstate = 0;
 static int imapd_userisadmin = 0;
 static int imapd_userisproxyadmin = 0;
+static int imapd_authcproxy = 0;	/* authenticated as a proxy server? */
 unsigned imapd_client_capa = 0;
 static sasl_conn_t *imapd_saslconn; /* the sasl connection context */
 static int imapd_starttls_done = 0; /* have we done a successful starttls? */
@@ -334,6 +335,7 @@ void fatal(const char *s, int code);
 void cmdloop(void);
 void cmd_login(char *tag, char *user);
 void cmd_authenticate(char *tag, char *authtype, char *resp);
+void cmd_proxyauth(char *tag, char *user);
 void cmd_noop(char *tag, char *cmd);
 void capa_response(int flags);
 void cmd_capability(char *tag);
@@ -648,17 +650,15 @@ static void imapd_reset(void)
     int i;
     int bytes_in = 0;
     int bytes_out = 0;
+    int write_calls = 0;
+    unsigned long write_avg = 0;
     
     proc_cleanup();
 
-    /* close backend connections */
+    /* close backend connections, or keep them for the next session */
     i = 0;
     while (backend_cached && backend_cached[i]) {
-	proxy_downserver(backend_cached[i]);
-	if (backend_cached[i]->last_result.s) {
-	    free(backend_cached[i]->last_result.s);
-	}
-	free(backend_cached[i]);
+	proxy_releaseserver(backend_cached[i]);
 	i++;
     }
     if (backend_cached) free(backend_cached);
@@ -682,12 +682,14 @@ static void imapd_reset(void)
 	/* Flush the outgoing buffer */
 	prot_flush(imapd_out);
 	bytes_out = prot_bytes_out(imapd_out);
+	write_calls = prot_write_calls(imapd_out);
+	write_avg = prot_write_avg(imapd_out);
 	prot_free(imapd_out);
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> writes=<%d> avgwrite=<%lu>", 
+			   session_id(), bytes_in, bytes_out, write_calls, write_avg);
     
     imapd_in = imapd_out = NULL;
 
@@ -727,6 +729,7 @@ static void imapd_reset(void)
     }
     imapd_userisadmin = 0;
     imapd_userisproxyadmin = 0;
+    imapd_authcproxy = 0;
     imapd_client_capa = 0;
     if (imapd_saslconn) {
 	sasl_dispose(&imapd_saslconn);
@@ -935,6 +938,7 @@ int service_main(int argc __attribute__((unused)),
     imapd_timeout *= 60;
     prot_settimeout(imapd_in, imapd_timeout);
     prot_setflushonread(imapd_in, imapd_out);
+    prot_setflushdelay(imapd_out, config_getint(IMAPOPT_IMAPFLUSHDELAY));
 
     /* we were connected on imaps port so we should do 
        TLS negotiation immediately */
@@ -990,6 +994,8 @@ void shut_down(int code)
     int i;
     int bytes_in = 0;
     int bytes_out = 0;
+    int write_calls = 0;
+    unsigned long write_avg = 0;
 
     in_shutdown = 1;
 
@@ -1005,6 +1011,7 @@ void shut_down(int code)
 	i++;
     }
     if (backend_cached) free(backend_cached);
+    proxy_pool_done();
 
     if (idling)
 	idle_done(imapd_index ? imapd_index->mailbox->name : NULL);
@@ -1043,6 +1050,8 @@ void shut_down(int code)
 	/* Flush the outgoing buffer */
 	prot_flush(imapd_out);
 	bytes_out = prot_bytes_out(imapd_out);
+	write_calls = prot_write_calls(imapd_out);
+	write_avg = prot_write_avg(imapd_out);
 	prot_free(imapd_out);
 	
 	/* one less active connection */
@@ -1050,8 +1059,8 @@ void shut_down(int code)
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> writes=<%d> avgwrite=<%lu>", 
+			   session_id(), bytes_in, bytes_out, write_calls, write_avg);
 
     if (protin) protgroup_free(protin);
 
@@ -1170,8 +1179,8 @@ void cmdloop()
     }
 
     for (;;) {
-	/* Flush any buffered output */
-	prot_flush(imapd_out);
+	/* Flush any buffered output (maybe not yet, if pipelined) */
+	prot_flush_pipelined(imapd_out, imapd_in);
 	if (backend_current) prot_flush(backend_current->out);
 
 	/* Check for shutdown file */
@@ -1678,6 +1687,19 @@ void cmdloop()
 	    else goto badcmd;
 	    break;
 
+	case 'P':
+	    if (!imapd_userid) goto nologin;
+	    else if (!strcmp(cmd.s, "Proxyauth")) {
+		if (c != ' ') goto missingargs;
+		c = getastring(imapd_in, imapd_out, &arg1);
+		if (c == EOF) goto missingargs;
+		if (c == '\r') c = prot_getc(imapd_in);
+		if (c != '\n') goto extraargs;
+		cmd_proxyauth(tag.s, arg1.s);
+	    }
+	    else goto badcmd;
+	    break;
+
 	case 'R':
 	    if (!strcmp(cmd.s, "Rename")) {
 		havepartition = 0;
@@ -2470,6 +2492,14 @@ void cmd_authenticate(char *tag, char *authtype, char *resp)
 			VARIABLE_AUTH, 0, /* hash_simple(authtype) */
 			VARIABLE_LISTEND);
 
+    /* a proxy may later switch this connection to another user */
+    if (sasl_getprop(imapd_saslconn, SASL_AUTHUSER, &val) == SASL_OK && val) {
+	struct auth_state *authstate = auth_newstate((const char *) val);
+
+	imapd_authcproxy = global_authisa(authstate, IMAPOPT_PROXYSERVERS);
+	auth_freestate(authstate);
+    }
+
     if (!saslprops.ssf) {
 	prot_printf(imapd_out, "%s OK [CAPABILITY ", tag);
 	capa_response(CAPA_PREAUTH|CAPA_POSTAUTH);
@@ -2486,6 +2516,78 @@ void cmd_authenticate(char *tag, char *authtype, char *resp)
     authentication_success();
 }
 
+/*
+ * Perform a PROXYAUTH command
+ *
+ * Lets a frontend that authenticated as one of the proxyservers hand
+ * this connection to another user, as if it had authenticated with
+ * that user as the authorization id, without tearing it down.
+ */
+void cmd_proxyauth(char *tag, char *user)
+{
+    char userbuf[MAX_MAILBOX_BUFFER];
+    unsigned userlen;
+    int r;
+
+    if (!imapd_authcproxy) {
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_PERMISSION_DENIED));
+	return;
+    }
+
+    if (backend_cached) {
+	/* our own backend connections belong to the current user */
+	prot_printf(imapd_out, "%s NO Cannot switch users while proxying\r\n",
+		    tag);
+	return;
+    }
+
+    r = imapd_canon_user(imapd_saslconn, NULL, user, 0,
+			 SASL_CU_AUTHID | SASL_CU_AUTHZID, NULL,
+			 userbuf, sizeof(userbuf), &userlen);
+    if (r) {
+	syslog(LOG_NOTICE, "badlogin: %s proxyauth %s invalid user",
+	       imapd_clienthost, beautify_string(user));
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_INVALID_USER));
+	return;
+    }
+
+    if (userdeny(userbuf, config_ident, NULL, 0)) {
+	syslog(LOG_ERR, "user '%s' denied access to service '%s'",
+	       userbuf, config_ident);
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_PERMISSION_DENIED));
+	return;
+    }
+
+    /* forget everything about the previous user */
+    if (imapd_index) index_close(&imapd_index);
+    if (imapd_logfd != -1) {
+	close(imapd_logfd);
+	imapd_logfd = -1;
+    }
+    free(imapd_userid);
+    if (proxy_userid) free(proxy_userid);
+    proxy_userid = NULL;
+    if (imapd_magicplus) free(imapd_magicplus);
+    imapd_magicplus = NULL;
+    auth_freestate(imapd_authstate);
+    imapd_client_capa = 0;
+
+    imapd_userid = xstrdup(userbuf);
+    imapd_authstate = auth_newstate(imapd_userid);
+    imapd_userisproxyadmin = global_authisa(imapd_authstate, IMAPOPT_ADMINS);
+
+    syslog(LOG_NOTICE, "login: %s %s proxyauth%s User logged in SESSIONID=<%s>",
+	   imapd_clienthost, imapd_userid,
+	   imapd_starttls_done ? "+TLS" : "", session_id());
+
+    prot_printf(imapd_out, "%s OK User logged in\r\n", tag);
+
+    authentication_success();
+}
+
 /*
  * Perform a NOOP command
  */
@@ -2878,6 +2980,10 @@ void capa_response(int flags)
     if (idle_enabled()) {
 	prot_printf(imapd_out, " IDLE");
     }
+
+    if (imapd_authcproxy) {
+	prot_printf(imapd_out, " PROXYAUTH");
+    }
 }
 
 /*
@@ -11030,6 +11136,11 @@ void cmd_compress(char *tag, char *alg)
 	prot_setcompress(imapd_in);
 	prot_setcompress(imapd_out);
 
+	/* murder frontends get the level configured for server links */
+	if (imapd_userisproxyadmin)
+	    prot_setcompresslevel(imapd_out,
+				  config_getint(IMAPOPT_PROXY_COMPRESS_LEVEL));
+
 	imapd_compress_done = 1;
     }
 }
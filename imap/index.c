@@ -70,7 +70,9 @@
 #include "mailbox.h"
 #include "map.h"
 #include "message.h"
+#include "mpool.h"
 #include "parseaddr.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "seen.h"
 #include "statuscache.h"
@@ -141,21 +143,21 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 			    struct fetchargs *fetchargs);
 static void index_printflags(struct index_state *state, uint32_t msgno, int usinguid);
 static void index_checkflags(struct index_state *state, int dirty);
-static char *find_msgid(char *str, char **rem);
-static char *get_localpart_addr(const char *header);
-static char *get_displayname(const char *header);
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
+static char *find_msgid(struct mpool *pool, char *str, char **rem);
+static char *get_localpart_addr(struct mpool *pool, const char *header);
+static char *get_displayname(struct mpool *pool, const char *header);
+static char *index_extract_subject(struct mpool *pool, const char *subj,
+				   size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
-static void index_get_ids(MsgData *msgdata,
+static void index_get_ids(struct mpool *pool, MsgData *msgdata,
 			  char *envtokens[], const char *headers, unsigned size);
 static MsgData *index_msgdata_load(struct index_state *state, unsigned *msgno_list, int n,
-				   struct sortcrit *sortcrit);
+				   struct sortcrit *sortcrit, struct mpool *pool);
 
 static void *index_sort_getnext(MsgData *node);
 static void index_sort_setnext(MsgData *node, MsgData *next);
 static int index_sort_compare(MsgData *md1, MsgData *md2,
 			      struct sortcrit *call_data);
-static void index_msgdata_free(MsgData *md);
 
 static void *index_thread_getnext(Thread *thread);
 static void index_thread_setnext(Thread *thread, Thread *next);
@@ -177,6 +179,10 @@ static struct seqset *_parse_sequence(struct index_state *state,
 				      const char *sequence, int usinguid);
 static void massage_header(char *hdr);
 
+/* Initial arena size for the msgdata of 'n' messages: the array itself
+ * plus a rough allowance for the strings hanging off it */
+#define MSGDATA_POOL_SIZE(n) ((n) * (sizeof(MsgData) + 64))
+
 /* NOTE: Make sure these are listed in CAPABILITY_STRING */
 static const struct thread_algorithm thread_algs[] = {
     { "ORDEREDSUBJECT", index_thread_orderedsubj },
@@ -197,6 +203,8 @@ int index_close(struct index_state **stateptr)
     free(state->map);
     for (i = 0; i < MAX_USER_FLAGS; i++)
 	free(state->flagname[i]);
+    if (state->sortcache_base)
+	map_free(&state->sortcache_base, &state->sortcache_len);
     mailbox_close(&state->mailbox);
     free(state);
 
@@ -216,6 +224,8 @@ int index_open(const char *name, struct index_init *init,
     struct index_state *state = xzmalloc(sizeof(struct index_state));
     struct seqset *vanishedlist = NULL;
 
+    state->msgfd = -1;
+
     r = mailbox_open_iwl(name, &state->mailbox);
     if (r) goto fail;
 
@@ -1318,7 +1328,8 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 	       struct searchargs *searchargs, int usinguid)
 {
     unsigned *msgno_list;
-    MsgData *msgdata = NULL, *freeme = NULL;
+    MsgData *msgdata = NULL;
+    struct mpool *pool;
     int nmsg;
     clock_t start;
     modseq_t highestmodseq = 0;
@@ -1349,7 +1360,8 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 
     if (nmsg) {
 	/* Create/load the msgdata array */
-	freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
+	pool = new_mpool(MSGDATA_POOL_SIZE(nmsg));
+	msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit, pool);
 	free(msgno_list);
 
 	/* Sort the messages based on the given criteria */
@@ -1365,14 +1377,11 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 				   : msgdata->msgno;
 	    prot_printf(state->out, " %u", no);
 
-	    /* free contents of the current node */
-	    index_msgdata_free(msgdata);
-
 	    msgdata = msgdata->next;
 	}
 
-	/* free the msgdata array */
-	free(freeme);
+	/* free the msgdata array and everything it points to */
+	free_mpool(pool);
     }
 
     if (highestmodseq)
@@ -1768,7 +1777,10 @@ unsigned octet_count;
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg_base + offset, n);
+    if (state->msgfd != -1 && n >= PROT_SENDFILE_MIN)
+	prot_sendfile(state->out, state->msgfd, offset, n);
+    else
+	prot_write(state->out, msg_base + offset, n);
     while (n++ < size) {
 	/* File too short, resynch client.
 	 *
@@ -1795,6 +1807,7 @@ static int index_fetchsection(struct index_state *state, const char *resp,
     int fetchmime = 0;
     unsigned offset = 0;
     char *decbuf = NULL;
+    const char *orig_base = msg_base;
 
     p = section;
 
@@ -1906,8 +1919,19 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 
     /* Output body part */
     prot_printf(state->out, "%s", resp);
-    index_fetchmsg(state, msg_base, msg_size, offset, size,
-		   start_octet, octet_count);
+    if (msg_base != orig_base) {
+	/* decoded data no longer lines up with the message file */
+	int msgfd = state->msgfd;
+
+	state->msgfd = -1;
+	index_fetchmsg(state, msg_base, msg_size, offset, size,
+		       start_octet, octet_count);
+	state->msgfd = msgfd;
+    }
+    else {
+	index_fetchmsg(state, msg_base, msg_size, offset, size,
+		       start_octet, octet_count);
+    }
 
     if (decbuf) free(decbuf);
     return 0;
@@ -2481,6 +2505,13 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	    prot_printf(state->out, "\r\n");
 	    return 0;
 	}
+
+	/* Large literals can go straight from the file to the socket */
+	if ((fetchitems & (FETCH_TEXT|FETCH_RFC822) || fetchargs->bodysections) &&
+	    msg_size >= PROT_SENDFILE_MIN && prot_can_sendfile(state->out)) {
+	    state->msgfd = open(mailbox_message_fname(mailbox, im->record.uid),
+				O_RDONLY, 0);
+	}
     }
 
     /* display flags if asked _OR_ if they've changed */
@@ -2684,6 +2715,10 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	/* finsh the response if we have one */
 	prot_printf(state->out, ")\r\n");
     }
+    if (state->msgfd != -1) {
+	close(state->msgfd);
+	state->msgfd = -1;
+    }
     if (msg_base) 
 	mailbox_unmap_message(mailbox, im->record.uid, &msg_base, &msg_size);
 
@@ -3502,32 +3537,570 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
     return 0;
 }
 
+/*
+ * Sort cache
+ *
+ * Everything index_msgdata_load() needs from cyrus.cache is a function
+ * of the message alone, so it can be kept for each UID in a sidecar
+ * file and reused until the message is expunged.  Each record carries the
+ * cache_crc of the message it was made from, and the file is good for a
+ * view as long as it has a matching record for every message in it, so
+ * flag changes (or a file written from a newer view) don't invalidate
+ * it.  Otherwise the file is rewritten with the entries of the messages
+ * still present carried over and only the new ones parsed from
+ * cyrus.cache.
+ *
+ * All numbers are in network byte order:
+ *
+ * header:  "CYRSORT2" uidvalidity num_records strings_len
+ * record:  uid is_refwd flags cache_crc offset[SC_NUMFIELDS]
+ * strings: NUL terminated strings; references are a run of strings
+ *          ended by an empty one
+ *
+ * Records are in UID order.  An offset of SC_NULL means the field is NULL.
+ */
+#define SC_MAGIC		"CYRSORT2"
+#define SC_OFFSET_UIDVALIDITY	8
+#define SC_OFFSET_NUM_RECORDS	12
+#define SC_OFFSET_STRINGS_LEN	16
+#define SC_HEADER_SIZE		32
+
+/* a half-written cyrus.sortcache.NEW older than this was left by a
+ * session which died, rather than one still writing it */
+#define SC_STALE_NEW		60
+
+enum {
+    SC_CC = 0,
+    SC_FROM,
+    SC_TO,
+    SC_DISPLAYFROM,
+    SC_DISPLAYTO,
+    SC_XSUBJ,
+    SC_MSGID,
+    SC_REFS,
+    SC_NUMFIELDS
+};
+
+#define SC_OFFSET_CACHE_CRC	12
+#define SC_OFFSET_FIELDS	16
+#define SC_RECORD_SIZE		(SC_OFFSET_FIELDS + 4 * SC_NUMFIELDS)
+#define SC_NULL			0xffffffff
+
+/* record flags */
+#define SC_NOIDS		(1<<0)	/* envelope too short to load ids */
+#define SC_EMPTYID		(1<<1)	/* no Message-ID, make one up */
+
+struct sortcache {
+    const char *records;
+    const char *strings;
+    unsigned num_records;
+    unsigned long strings_len;
+    unsigned hint;
+};
+
+static int sortcache_needed(struct sortcrit *sortcrit)
+{
+    int j;
+
+    for (j = 0; sortcrit[j].key; j++) {
+	switch (sortcrit[j].key) {
+	case SORT_CC:
+	case SORT_FROM:
+	case SORT_TO:
+	case SORT_SUBJECT:
+	case SORT_DISPLAYFROM:
+	case SORT_DISPLAYTO:
+	case LOAD_IDS:
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/* Check the mapped file 'base' and fill in 'sc'.  Returns 0 if the file
+ * is usable for this mailbox at all. */
+static int sortcache_parse(struct index_state *state, const char *base,
+			   unsigned long len, struct sortcache *sc)
+{
+    if (len < SC_HEADER_SIZE || memcmp(base, SC_MAGIC, 8))
+	return IMAP_MAILBOX_BADFORMAT;
+    if (ntohl(*((bit32 *)(base+SC_OFFSET_UIDVALIDITY))) !=
+	state->mailbox->i.uidvalidity)
+	return IMAP_MAILBOX_BADFORMAT;
+
+    sc->num_records = ntohl(*((bit32 *)(base+SC_OFFSET_NUM_RECORDS)));
+    sc->strings_len = ntohl(*((bit32 *)(base+SC_OFFSET_STRINGS_LEN)));
+    sc->records = base + SC_HEADER_SIZE;
+    sc->strings = sc->records + sc->num_records * SC_RECORD_SIZE;
+    sc->hint = 0;
+
+    /* everything must add up, and the last string must be terminated */
+    if (sc->num_records > (len - SC_HEADER_SIZE) / SC_RECORD_SIZE ||
+	len != SC_HEADER_SIZE + sc->num_records * SC_RECORD_SIZE
+	       + sc->strings_len ||
+	(sc->strings_len && sc->strings[sc->strings_len - 1]))
+	return IMAP_MAILBOX_BADFORMAT;
+
+    return 0;
+}
+
+/* Find the record for 'uid', or NULL.  Lookups usually come in UID
+ * order, so try just after the last one found before searching. */
+static const char *sortcache_find(struct sortcache *sc, unsigned long uid)
+{
+    unsigned lo = 0, hi = sc->num_records;
+    unsigned mid = sc->hint;
+
+    while (lo < hi) {
+	unsigned long ruid;
+
+	if (mid < lo || mid >= hi) mid = lo + (hi - lo) / 2;
+	ruid = ntohl(*((bit32 *)(sc->records + mid * SC_RECORD_SIZE)));
+	if (ruid == uid) {
+	    sc->hint = mid + 1;
+	    return sc->records + mid * SC_RECORD_SIZE;
+	}
+	if (ruid < uid) lo = mid + 1;
+	else hi = mid;
+	mid = lo + (hi - lo) / 2;
+    }
+
+    return NULL;
+}
+
+/* Returns the string for 'field' of record 'rec', or NULL. */
+static const char *sortcache_string(struct sortcache *sc, const char *rec,
+				    int field)
+{
+    bit32 offset = ntohl(*((bit32 *)(rec + SC_OFFSET_FIELDS + 4 * field)));
+
+    if (offset == SC_NULL || offset >= sc->strings_len)
+	return NULL;
+
+    return sc->strings + offset;
+}
+
+static bit32 sortcache_crc(const char *rec)
+{
+    return ntohl(*((bit32 *)(rec + SC_OFFSET_CACHE_CRC)));
+}
+
+/* Does 'sc' have an up to date record for every message in the view?
+ * A file which is mostly expunged messages is worth rewriting too. */
+static int sortcache_current(struct index_state *state, struct sortcache *sc)
+{
+    const char *rec;
+    uint32_t msgno;
+
+    if (sc->num_records > 2 * state->exists + 64)
+	return 0;
+
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	struct index_record *record = &state->map[msgno-1].record;
+
+	rec = sortcache_find(sc, record->uid);
+	if (!rec || sortcache_crc(rec) != record->cache_crc)
+	    return 0;
+    }
+    sc->hint = 0;
+
+    return 1;
+}
+
+static void sortcache_putstring(struct buf *recs, struct buf *strs,
+				const char *s)
+{
+    if (!s) {
+	buf_appendbit32(recs, SC_NULL);
+	return;
+    }
+
+    buf_appendbit32(recs, buf_len(strs));
+    buf_appendmap(strs, s, strlen(s) + 1);
+}
+
+/* Append the record for message 'msgno' to 'recs' and 'strs', taking it
+ * from 'old' if it's there and parsing cyrus.cache if not. */
+static int sortcache_addrecord(struct index_state *state, uint32_t msgno,
+			       struct sortcache *old, struct mpool *pool,
+			       struct buf *recs, struct buf *strs)
+{
+    struct index_map *im = &state->map[msgno-1];
+    const char *rec = old ? sortcache_find(old, im->record.uid) : NULL;
+    MsgData md;
+    int i, field, flags = 0;
+
+    /* the message was rewritten since */
+    if (rec && sortcache_crc(rec) != im->record.cache_crc)
+	rec = NULL;
+
+    if (rec) {
+	buf_appendmap(recs, rec, SC_OFFSET_FIELDS);
+	for (field = 0; field < SC_REFS; field++)
+	    sortcache_putstring(recs, strs, sortcache_string(old, rec, field));
+
+	/* copy the references, terminator and all */
+	if (!sortcache_string(old, rec, SC_REFS)) {
+	    buf_appendbit32(recs, SC_NULL);
+	}
+	else {
+	    const char *p = sortcache_string(old, rec, SC_REFS);
+	    const char *end = old->strings + old->strings_len;
+
+	    buf_appendbit32(recs, buf_len(strs));
+	    do {
+		i = strlen(p) + 1;
+		buf_appendmap(strs, p, i);
+		p += i;
+	    } while (i > 1 && p < end);
+	    if (i > 1) buf_putc(strs, '\0');
+	}
+	return 0;
+    }
+
+    if (mailbox_cacherecord(state->mailbox, &im->record))
+	return IMAP_IOERROR;
+
+    memset(&md, 0, sizeof(MsgData));
+    md.msgno = msgno;
+
+    md.cc = get_localpart_addr(pool, cacheitem_base(&im->record, CACHE_CC));
+    md.from = get_localpart_addr(pool,
+				 cacheitem_base(&im->record, CACHE_FROM));
+    md.to = get_localpart_addr(pool, cacheitem_base(&im->record, CACHE_TO));
+    md.displayfrom = get_displayname(pool,
+				     cacheitem_base(&im->record, CACHE_FROM));
+    md.displayto = get_displayname(pool,
+				   cacheitem_base(&im->record, CACHE_TO));
+    md.xsubj = index_extract_subject(pool,
+				     cacheitem_base(&im->record, CACHE_SUBJECT),
+				     cacheitem_size(&im->record, CACHE_SUBJECT),
+				     &md.is_refwd);
+
+    if (cacheitem_size(&im->record, CACHE_ENVELOPE) <= 2) {
+	flags |= SC_NOIDS;
+    }
+    else {
+	char *envtokens[NUMENVTOKENS];
+	char *tmpenv =
+	    mpool_strndup(pool, cacheitem_base(&im->record, CACHE_ENVELOPE) + 1,
+			  cacheitem_size(&im->record, CACHE_ENVELOPE) - 2);
+
+	parse_cached_envelope(tmpenv, envtokens, VECTOR_SIZE(envtokens));
+	index_get_ids(pool, &md, envtokens,
+		      cacheitem_base(&im->record, CACHE_HEADERS),
+		      cacheitem_size(&im->record, CACHE_HEADERS));
+
+	/* made up IDs depend on the msgno, which isn't stable */
+	if (!strncmp(md.msgid, "<Empty-ID: ", 11)) {
+	    flags |= SC_EMPTYID;
+	    md.msgid = NULL;
+	}
+    }
+
+    buf_appendbit32(recs, im->record.uid);
+    buf_appendbit32(recs, md.is_refwd);
+    buf_appendbit32(recs, flags);
+    buf_appendbit32(recs, im->record.cache_crc);
+    sortcache_putstring(recs, strs, md.cc);
+    sortcache_putstring(recs, strs, md.from);
+    sortcache_putstring(recs, strs, md.to);
+    sortcache_putstring(recs, strs, md.displayfrom);
+    sortcache_putstring(recs, strs, md.displayto);
+    sortcache_putstring(recs, strs, md.xsubj);
+    sortcache_putstring(recs, strs, md.msgid);
+    if (!md.nref) {
+	buf_appendbit32(recs, SC_NULL);
+    }
+    else {
+	buf_appendbit32(recs, buf_len(strs));
+	for (i = 0; i < md.nref; i++)
+	    buf_appendmap(strs, md.ref[i], strlen(md.ref[i]) + 1);
+	buf_putc(strs, '\0');
+    }
+
+    return 0;
+}
+
+/* Write a new sort cache for the current view, reusing what we can
+ * from 'old', and map it in place of whatever was mapped before. */
+static int sortcache_rebuild(struct index_state *state, struct sortcache *old)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    char tmpname[MAX_MAILBOX_PATH+1];
+    struct buf recs = BUF_INITIALIZER;
+    struct buf strs = BUF_INITIALIZER;
+    char header[SC_HEADER_SIZE];
+    struct iovec iov[3];
+    struct stat sbuf;
+    unsigned num_records = 0;
+    uint32_t msgno;
+    const char *base;
+    struct mpool *pool = new_mpool(0);
+    int len, fd, r = 0;
+
+    /* mailbox_cacherecord() reuses the buffer mailbox_meta_fname()
+     * returns, so take a copy */
+    strlcpy(fname, mailbox_meta_fname(state->mailbox, META_SORTCACHE),
+	    sizeof(fname));
+
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	if (!sortcache_addrecord(state, msgno, old, pool, &recs, &strs))
+	    num_records++;
+
+	/* don't let the scratch strings pile up */
+	if (msgno % 1024 == 0) {
+	    free_mpool(pool);
+	    pool = new_mpool(0);
+	}
+    }
+    free_mpool(pool);
+
+    memset(header, 0, SC_HEADER_SIZE);
+    memcpy(header, SC_MAGIC, 8);
+    *((bit32 *)(header+SC_OFFSET_UIDVALIDITY)) =
+	htonl(state->mailbox->i.uidvalidity);
+    *((bit32 *)(header+SC_OFFSET_NUM_RECORDS)) = htonl(num_records);
+    *((bit32 *)(header+SC_OFFSET_STRINGS_LEN)) = htonl(buf_len(&strs));
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = SC_HEADER_SIZE;
+    buf_getmap(&recs, &base, &len);
+    iov[1].iov_base = (char *) base;
+    iov[1].iov_len = len;
+    buf_getmap(&strs, &base, &len);
+    iov[2].iov_base = (char *) base;
+    iov[2].iov_len = len;
+
+    /* only one session writes the file at a time; the others carry on
+     * without it.  One which died half way mustn't block it forever */
+    snprintf(tmpname, sizeof(tmpname), "%s.NEW", fname);
+    fd = open(tmpname, O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST &&
+	!stat(tmpname, &sbuf) && sbuf.st_mtime < time(NULL) - SC_STALE_NEW) {
+	syslog(LOG_NOTICE, "removing stale %s", tmpname);
+	unlink(tmpname);
+	fd = open(tmpname, O_RDWR|O_CREAT|O_EXCL, 0666);
+    }
+    if (fd == -1) {
+	if (errno == EEXIST) {
+	    r = IMAP_AGAIN;
+	    goto done;
+	}
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", tmpname);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    if (retry_writev(fd, iov, 3) == -1 || fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", tmpname);
+	r = IMAP_IOERROR;
+	close(fd);
+	unlink(tmpname);
+	goto done;
+    }
+
+    if (rename(tmpname, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", tmpname);
+	r = IMAP_IOERROR;
+	close(fd);
+	unlink(tmpname);
+	goto done;
+    }
+
+    if (state->sortcache_base)
+	map_free(&state->sortcache_base, &state->sortcache_len);
+    map_refresh(fd, 1, &state->sortcache_base, &state->sortcache_len,
+		sbuf.st_size, fname, state->mailbox->name);
+    close(fd);
+    state->sortcache_checked = state->highestmodseq;
+
+ done:
+    buf_free(&recs);
+    buf_free(&strs);
+
+    return r;
+}
+
+/* Make sure the sort cache mapped for 'state' is current, loading or
+ * rebuilding it as necessary.  Returns 0 and fills in 'sc' on success. */
+static int sortcache_load(struct index_state *state, struct sortcache *sc)
+{
+    const char *fname;
+    struct stat sbuf;
+    int fd, r;
+
+    /* still good from last time? */
+    if (state->sortcache_base &&
+	!sortcache_parse(state, state->sortcache_base,
+			 state->sortcache_len, sc) &&
+	(state->sortcache_checked == state->highestmodseq ||
+	 sortcache_current(state, sc))) {
+	state->sortcache_checked = state->highestmodseq;
+	return 0;
+    }
+
+    /* see if another session has brought the file up to date */
+    if (state->sortcache_base)
+	map_free(&state->sortcache_base, &state->sortcache_len);
+    state->sortcache_checked = 0;
+
+    fname = mailbox_meta_fname(state->mailbox, META_SORTCACHE);
+    fd = open(fname, O_RDONLY, 0);
+    if (fd != -1) {
+	if (fstat(fd, &sbuf) == -1) {
+	    syslog(LOG_ERR, "IOERROR: fstating %s: %m", fname);
+	}
+	else {
+	    map_refresh(fd, 1, &state->sortcache_base, &state->sortcache_len,
+			sbuf.st_size, fname, state->mailbox->name);
+	}
+	close(fd);
+    }
+
+    if (state->sortcache_base &&
+	!sortcache_parse(state, state->sortcache_base,
+			 state->sortcache_len, sc)) {
+	if (sortcache_current(state, sc)) {
+	    state->sortcache_checked = state->highestmodseq;
+	    return 0;
+	}
+
+	/* rebuild, carrying over the messages which are still here */
+	r = sortcache_rebuild(state, sc);
+    }
+    else {
+	r = sortcache_rebuild(state, NULL);
+    }
+    if (r) return r;
+
+    return sortcache_parse(state, state->sortcache_base,
+			   state->sortcache_len, sc);
+}
+
+/* Fill in the field for sort criterion 'label' of 'md' from sort cache
+ * record 'rec'.  Returns 0 if the criterion doesn't come from the cache. */
+static int sortcache_fill(struct sortcache *sc, const char *rec,
+			  struct mpool *pool, MsgData *md, int label)
+{
+    const char *s;
+    int flags;
+
+    switch (label) {
+    case SORT_CC:
+	s = sortcache_string(sc, rec, SC_CC);
+	md->cc = mpool_strdup(pool, s);
+	return 1;
+    case SORT_FROM:
+	s = sortcache_string(sc, rec, SC_FROM);
+	md->from = mpool_strdup(pool, s);
+	return 1;
+    case SORT_TO:
+	s = sortcache_string(sc, rec, SC_TO);
+	md->to = mpool_strdup(pool, s);
+	return 1;
+    case SORT_DISPLAYFROM:
+	s = sortcache_string(sc, rec, SC_DISPLAYFROM);
+	md->displayfrom = mpool_strdup(pool, s);
+	return 1;
+    case SORT_DISPLAYTO:
+	s = sortcache_string(sc, rec, SC_DISPLAYTO);
+	md->displayto = mpool_strdup(pool, s);
+	return 1;
+    case SORT_SUBJECT:
+	s = sortcache_string(sc, rec, SC_XSUBJ);
+	md->xsubj = mpool_strdup(pool, s ? s : "");
+	md->xsubj_hash = strhash(md->xsubj);
+	md->is_refwd = ntohl(*((bit32 *)(rec+4)));
+	return 1;
+    case LOAD_IDS:
+	flags = ntohl(*((bit32 *)(rec+8)));
+	if (flags & SC_NOIDS)
+	    return 1;
+
+	if (flags & SC_EMPTYID) {
+	    char buf[40];
+
+	    snprintf(buf, sizeof(buf), "<Empty-ID: %u>", md->msgno);
+	    md->msgid = mpool_strdup(pool, buf);
+	}
+	else {
+	    s = sortcache_string(sc, rec, SC_MSGID);
+	    md->msgid = mpool_strdup(pool, s);
+	}
+
+	s = sortcache_string(sc, rec, SC_REFS);
+	if (s) {
+	    const char *end = sc->strings + sc->strings_len;
+	    const char *p;
+	    int n = 0;
+
+	    for (p = s; p < end && *p; p += strlen(p) + 1)
+		n++;
+	    md->ref = (char **) mpool_malloc(pool, n * sizeof(char *));
+	    for (p = s; md->nref < n; p += strlen(p) + 1)
+		md->ref[md->nref++] = mpool_strdup(pool, p);
+	}
+	return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the first sizeof(unsigned long) bytes of 's' as a number which
+ * orders the same way strcmp() orders the strings, padded with NULs.
+ */
+static unsigned long sort_prefix(const char *s)
+{
+    unsigned long prefix = 0;
+    unsigned i;
+
+    for (i = 0; i < sizeof(prefix); i++) {
+	prefix <<= 8;
+	if (s && *s) prefix |= (unsigned char) *s++;
+    }
+
+    return prefix;
+}
+
 /*
  * Creates a list of msgdata.
  *
  * We fill these structs with the processed info that will be needed
- * by the specified sort criteria.
+ * by the specified sort criteria.  The array and everything hanging off
+ * it is allocated from 'pool', which the caller frees when done.
  */
-#define ANNOTGROWSIZE 10
-
 static MsgData *index_msgdata_load(struct index_state *state,
 				   unsigned *msgno_list, int n,
-				   struct sortcrit *sortcrit)
+				   struct sortcrit *sortcrit,
+				   struct mpool *pool)
 {
     MsgData *md, *cur;
     int i, j;
-    char *tmpenv;
+    struct buf tmpenv = BUF_INITIALIZER;
     char *envtokens[NUMENVTOKENS];
     int did_cache, did_env, did_conv;
     int label;
-    int annotsize;
+    int nannot = 0;
     struct mailbox *mailbox = state->mailbox;
     struct index_map *im;
+    struct sortcache sc;
+    int use_sortcache = 0;
+    const char *rec;
 
     if (!n) return NULL;
 
+    if (config_getswitch(IMAPOPT_SORTCACHE) && sortcache_needed(sortcrit))
+	use_sortcache = !sortcache_load(state, &sc);
+
+    for (j = 0; sortcrit[j].key; j++) {
+	if (sortcrit[j].key == SORT_ANNOTATION) nannot++;
+    }
+
     /* create an array of MsgData to use as nodes of linked list */
-    md = (MsgData *) xmalloc(n * sizeof(MsgData));
+    md = (MsgData *) mpool_malloc(pool, n * sizeof(MsgData));
     memset(md, 0, n * sizeof(MsgData));
 
     for (i = 0, cur = md; i < n; i++, cur = cur->next) {
@@ -3540,13 +4113,17 @@ static MsgData *index_msgdata_load(struct index_state *state,
 	cur->next = (i+1 < n ? cur+1 : NULL);
 
 	did_cache = did_env = did_conv = 0;
-	tmpenv = NULL;
-	annotsize = 0;
+	rec = use_sortcache ? sortcache_find(&sc, cur->uid) : NULL;
+	if (nannot)
+	    cur->annot = (char **) mpool_malloc(pool, nannot * sizeof(char *));
 
 	for (j = 0; sortcrit[j].key; j++) {
 	    label = sortcrit[j].key;
 
-	    if ((label == SORT_CC || label == SORT_DATE ||
+	    if (rec && sortcache_fill(&sc, rec, pool, cur, label))
+		continue;
+
+	    if ((label == SORT_CC ||
 		 label == SORT_FROM || label == SORT_SUBJECT ||
 		 label == SORT_TO || label == LOAD_IDS ||
 		 label == SORT_DISPLAYFROM || label == SORT_DISPLAYTO) &&
@@ -3567,11 +4144,11 @@ static MsgData *index_msgdata_load(struct index_state *state,
 		/* make a working copy of envelope -- strip outer ()'s */
 		/* +1 -> skip the leading paren */
 		/* -2 -> don't include the size of the outer parens */
-		tmpenv = xstrndup(cacheitem_base(&im->record, CACHE_ENVELOPE) + 1, 
-				  cacheitem_size(&im->record, CACHE_ENVELOPE) - 2);
+		buf_setmap(&tmpenv, cacheitem_base(&im->record, CACHE_ENVELOPE) + 1,
+			   cacheitem_size(&im->record, CACHE_ENVELOPE) - 2);
 
 		/* parse envelope into tokens */
-		parse_cached_envelope(tmpenv, envtokens,
+		parse_cached_envelope((char *) buf_cstring(&tmpenv), envtokens,
 				      VECTOR_SIZE(envtokens));
 
 		did_env++;
@@ -3579,7 +4156,8 @@ static MsgData *index_msgdata_load(struct index_state *state,
 
 	    switch (label) {
 	    case SORT_CC:
-		cur->cc = get_localpart_addr(cacheitem_base(&im->record, CACHE_CC));
+		cur->cc = get_localpart_addr(pool,
+				cacheitem_base(&im->record, CACHE_CC));
 		break;
 	    case SORT_DATE:
 		cur->date = im->record.gmtime;
@@ -3588,7 +4166,8 @@ static MsgData *index_msgdata_load(struct index_state *state,
 		cur->internaldate = im->record.internaldate;
 		break;
 	    case SORT_FROM:
-		cur->from = get_localpart_addr(cacheitem_base(&im->record, CACHE_FROM));
+		cur->from = get_localpart_addr(pool,
+				cacheitem_base(&im->record, CACHE_FROM));
 		break;
 	    case SORT_MODSEQ:
 		cur->modseq = im->record.modseq;
@@ -3597,48 +4176,52 @@ static MsgData *index_msgdata_load(struct index_state *state,
 		cur->size = im->record.size;
 		break;
 	    case SORT_SUBJECT:
-		cur->xsubj = index_extract_subject(cacheitem_base(&im->record, CACHE_SUBJECT),
-						   cacheitem_size(&im->record, CACHE_SUBJECT),
-						   &cur->is_refwd);
+		cur->xsubj = index_extract_subject(pool,
+				cacheitem_base(&im->record, CACHE_SUBJECT),
+				cacheitem_size(&im->record, CACHE_SUBJECT),
+				&cur->is_refwd);
 		cur->xsubj_hash = strhash(cur->xsubj);
 		break;
 	    case SORT_TO:
-		cur->to = get_localpart_addr(cacheitem_base(&im->record, CACHE_TO));
+		cur->to = get_localpart_addr(pool,
+				cacheitem_base(&im->record, CACHE_TO));
 		break;
  	    case SORT_ANNOTATION:
- 		/* reallocate space for the annotation values if necessary */
- 		if (cur->nannot == annotsize) {
- 		    annotsize += ANNOTGROWSIZE;
- 		    cur->annot = (char **)
- 			xrealloc(cur->annot, annotsize * sizeof(char *));
- 		}
-
  		/* fetch attribute value - we fake it for now */
- 		cur->annot[cur->nannot] = xstrdup(sortcrit[j].args.annot.attrib);
+ 		cur->annot[cur->nannot] = sortcrit[j].args.annot.attrib;
  		cur->nannot++;
  		break;
 	    case LOAD_IDS:
-		index_get_ids(cur, envtokens, cacheitem_base(&im->record, CACHE_HEADERS),
-					      cacheitem_size(&im->record, CACHE_HEADERS));
+		index_get_ids(pool, cur, envtokens,
+			      cacheitem_base(&im->record, CACHE_HEADERS),
+			      cacheitem_size(&im->record, CACHE_HEADERS));
 		break;
 	    case SORT_DISPLAYFROM:
-		cur->displayfrom = get_displayname(
+		cur->displayfrom = get_displayname(pool,
 				   cacheitem_base(&im->record, CACHE_FROM));
 		break;
 	    case SORT_DISPLAYTO:
-		cur->displayto = get_displayname(
+		cur->displayto = get_displayname(pool,
 				 cacheitem_base(&im->record, CACHE_TO));
 		break;
 	    }
 	}
 
-	free(tmpenv);
+	/* fixed-width prefixes settle most string comparisons */
+	cur->cc_prefix = sort_prefix(cur->cc);
+	cur->from_prefix = sort_prefix(cur->from);
+	cur->to_prefix = sort_prefix(cur->to);
+	cur->displayfrom_prefix = sort_prefix(cur->displayfrom);
+	cur->displayto_prefix = sort_prefix(cur->displayto);
+	cur->xsubj_prefix = sort_prefix(cur->xsubj);
     }
 
+    buf_free(&tmpenv);
+
     return md;
 }
 
-static char *get_localpart_addr(const char *header)
+static char *get_localpart_addr(struct mpool *pool, const char *header)
 {
     struct address *addr = NULL;
     char *ret = NULL;
@@ -3647,7 +4230,7 @@ static char *get_localpart_addr(const char *header)
     if (!addr) return NULL;
 
     if (addr->mailbox)
-	ret = xstrdup(addr->mailbox);
+	ret = mpool_strdup(pool, addr->mailbox);
 
     parseaddr_free(addr);
 
@@ -3657,7 +4240,7 @@ static char *get_localpart_addr(const char *header)
 /*
  * Get the 'display-name' of an address from a header
  */
-static char *get_displayname(const char *header)
+static char *get_displayname(struct mpool *pool, const char *header)
 {
     struct address *addr = NULL;
     char *ret = NULL;
@@ -3667,18 +4250,18 @@ static char *get_displayname(const char *header)
 
     if (addr->name && addr->name[0]) {
 	char *p;
-	ret = xstrdup(addr->name);
+	ret = mpool_strdup(pool, addr->name);
 	for (p = ret; *p; p++)
 	    *p = toupper(*p);
     }
     else if (addr->domain && addr->mailbox) {
 	/* mailbox@domain */
 	int len = strlen(addr->mailbox) + strlen(addr->domain) + 2;
-	ret = xmalloc(len);
+	ret = mpool_malloc(pool, len);
 	snprintf(ret, len, "%s@%s", addr->mailbox, addr->domain);
     }
     else if (addr->mailbox) {
-	ret = xstrdup(addr->mailbox);
+	ret = mpool_strdup(pool, addr->mailbox);
     }
 
     parseaddr_free(addr);
@@ -3692,18 +4275,19 @@ static char *get_displayname(const char *header)
  * This is a wrapper around _index_extract_subject() which preps the
  * subj NSTRING and checks for Netscape "[Fwd: ]".
  */
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
+static char *index_extract_subject(struct mpool *pool, const char *subj,
+				   size_t len, int *is_refwd)
 {
     char *buf, *s, *base;
 
     /* parse the subj NSTRING and make a working copy */
     if (!strcmp(subj, "NIL")) {		       	/* NIL? */
-	return xstrdup("");			/* yes, return empty */
+	return mpool_strdup(pool, "");		/* yes, return empty */
     } else if (*subj == '"') {			/* quoted? */
-	buf = xstrndup(subj + 1, len - 2);	/* yes, strip quotes */
+	buf = mpool_strndup(pool, subj + 1, len - 2);	/* yes, strip quotes */
     } else {
 	s = strchr(subj, '}') + 3;		/* literal, skip { }\r\n */
-	buf = xstrndup(s, len - (s - subj));
+	buf = mpool_strndup(pool, s, len - (s - subj));
     }
 
     for (s = buf;;) {
@@ -3726,10 +4310,7 @@ static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
 	    break;
     }
 
-    base = xstrdup(base);
-
-    free(buf);
-
+    /* the base is part of the working copy, so upcase it in place */
     for (s = base; *s; s++) {
 	*s = toupper(*s);
     }
@@ -3863,7 +4444,8 @@ static char *_index_extract_subject(char *s, int *is_refwd)
 }
 
 /* Find a message-id looking thingy in a string.  Returns a pointer to the
- * alloc'd id and the remaining string is returned in the **loc parameter.
+ * id, allocated from 'pool', and the remaining string is returned in the
+ * **loc parameter.
  *
  * This is a poor-man's way of finding the message-id.  We simply look for
  * any string having the format "< ... @ ... >" and assume that the mail
@@ -3871,7 +4453,7 @@ static char *_index_extract_subject(char *s, int *is_refwd)
  */
 #define MSGID_SPECIALS "<> @\\"
 
-static char *find_msgid(char *str, char **rem)
+static char *find_msgid(struct mpool *pool, char *str, char **rem)
 {
     char *msgid, *src, *dst, *cp;
 
@@ -3919,7 +4501,7 @@ static char *find_msgid(char *str, char **rem)
 	    return NULL;
 
 	/* alloc space for the msgid */
-	dst = msgid = (char*) xrealloc(msgid, cp - src + 2);
+	dst = msgid = (char*) mpool_malloc(pool, cp - src + 2);
 
 	*dst++ = *src++;
 
@@ -3955,15 +4537,14 @@ static char *find_msgid(char *str, char **rem)
 	return msgid;
     }
 
-    if (msgid) free(msgid);
     return NULL;
 }
 
 /* Get message-id, and references/in-reply-to */
 #define REFGROWSIZE 20
 
-void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
-		   unsigned size)
+void index_get_ids(struct mpool *pool, MsgData *msgdata, char *envtokens[],
+		   const char *headers, unsigned size)
 {
     static char *buf;
     static unsigned bufsize;
@@ -3977,11 +4558,11 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
     }
 
     /* get msgid */
-    msgdata->msgid = find_msgid(envtokens[ENV_MSGID], NULL);
+    msgdata->msgid = find_msgid(pool, envtokens[ENV_MSGID], NULL);
      /* if we don't have one, create one */
     if (!msgdata->msgid) {
 	snprintf(buf, bufsize, "<Empty-ID: %u>", msgdata->msgno);
-	msgdata->msgid = xstrdup(buf);
+	msgdata->msgid = mpool_strdup(pool, buf);
     }
 
     /* Copy headers to the buffer */
@@ -3993,16 +4574,19 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
     index_pruneheader(buf, &refhdr, 0);
     if (*buf) {
 	/* allocate some space for refs */
-	msgdata->ref = (char **) xmalloc(refsize * sizeof(char *));
+	msgdata->ref = (char **) mpool_malloc(pool, refsize * sizeof(char *));
 	/* find references */
 	massage_header(buf);
 	refstr = buf;
-	while ((ref = find_msgid(refstr, &refstr)) != NULL) {
+	while ((ref = find_msgid(pool, refstr, &refstr)) != NULL) {
 	    /* reallocate space for this msgid if necessary */
 	    if (msgdata->nref == refsize) {
-		refsize += REFGROWSIZE;
-		msgdata->ref = (char **)
-		    xrealloc(msgdata->ref, refsize * sizeof(char *));
+		char **newref;
+
+		refsize *= 2;
+		newref = (char **) mpool_malloc(pool, refsize * sizeof(char *));
+		memcpy(newref, msgdata->ref, msgdata->nref * sizeof(char *));
+		msgdata->ref = newref;
 	    }
 	    /* store this msgid in the array */
 	    msgdata->ref[msgdata->nref++] = ref;
@@ -4012,10 +4596,10 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers,
     /* if we have no references, try in-reply-to */
     if (!msgdata->nref) {
 	/* get in-reply-to id */
-	in_reply_to = find_msgid(envtokens[ENV_INREPLYTO], NULL);
+	in_reply_to = find_msgid(pool, envtokens[ENV_INREPLYTO], NULL);
 	/* if we have an in-reply-to id, make it the ref */
 	if (in_reply_to) {
-	    msgdata->ref = (char **) xmalloc(sizeof(char *));
+	    msgdata->ref = (char **) mpool_malloc(pool, sizeof(char *));
 	    msgdata->ref[msgdata->nref++] = in_reply_to;
 	}
     }
@@ -4045,6 +4629,20 @@ static int numcmp(modseq_t n1, modseq_t n2)
     return ((n1 < n2) ? -1 : (n1 > n2) ? 1 : 0);
 }
 
+/*
+ * Function for comparing two strings with precomputed sort_prefix()es.
+ */
+static int prefixcmp(unsigned long p1, const char *s1,
+		     unsigned long p2, const char *s2)
+{
+    if (p1 != p2) return (p1 < p2) ? -1 : 1;
+
+    /* a prefix which ends in a NUL holds all of both strings */
+    if (!(p1 & 0xff)) return 0;
+
+    return strcmpsafe(s1, s2);
+}
+
 /*
  * Comparison function for sorting message lists.
  */
@@ -4065,7 +4663,8 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
 	    ret = numcmp(md1->internaldate, md2->internaldate);
 	    break;
 	case SORT_CC:
-	    ret = strcmpsafe(md1->cc, md2->cc);
+	    ret = prefixcmp(md1->cc_prefix, md1->cc,
+			    md2->cc_prefix, md2->cc);
 	    break;
 	case SORT_DATE: {
 	    time_t d1 = md1->date ? md1->date : md1->internaldate;
@@ -4074,16 +4673,19 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
 	    break;
 	}
 	case SORT_FROM:
-	    ret = strcmpsafe(md1->from, md2->from);
+	    ret = prefixcmp(md1->from_prefix, md1->from,
+			    md2->from_prefix, md2->from);
 	    break;
 	case SORT_SIZE:
 	    ret = numcmp(md1->size, md2->size);
 	    break;
 	case SORT_SUBJECT:
-	    ret = strcmpsafe(md1->xsubj, md2->xsubj);
+	    ret = prefixcmp(md1->xsubj_prefix, md1->xsubj,
+			    md2->xsubj_prefix, md2->xsubj);
 	    break;
 	case SORT_TO:
-	    ret = strcmpsafe(md1->to, md2->to);
+	    ret = prefixcmp(md1->to_prefix, md1->to,
+			    md2->to_prefix, md2->to);
 	    break;
 	case SORT_ANNOTATION:
 	    ret = strcmpsafe(md1->annot[ann], md2->annot[ann]);
@@ -4093,10 +4695,12 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
 	    ret = numcmp(md1->modseq, md2->modseq);
 	    break;
 	case SORT_DISPLAYFROM:
-	    ret = strcmpsafe(md1->displayfrom, md2->displayfrom);
+	    ret = prefixcmp(md1->displayfrom_prefix, md1->displayfrom,
+			    md2->displayfrom_prefix, md2->displayfrom);
 	    break;
 	case SORT_DISPLAYTO:
-	    ret = strcmpsafe(md1->displayto, md2->displayto);
+	    ret = prefixcmp(md1->displayto_prefix, md1->displayto,
+			    md2->displayto_prefix, md2->displayto);
 	    break;
 	}
     } while (!ret && sortcrit[i++].key != SORT_SEQUENCE);
@@ -4104,31 +4708,6 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
     return (reverse ? -ret : ret);
 }
 
-/*
- * Free a msgdata node.
- */
-static void index_msgdata_free(MsgData *md)
-{
-#define FREE(x)	if (x) free(x)
-    int i;
-
-    if (!md)
-	return;
-    FREE(md->cc);
-    FREE(md->from);
-    FREE(md->to);
-    FREE(md->displayfrom);
-    FREE(md->displayto);
-    FREE(md->xsubj);
-    FREE(md->msgid);
-    for (i = 0; i < md->nref; i++)
-	free(md->ref[i]);
-    FREE(md->ref);
-    for (i = 0; i < md->nannot; i++)
-	free(md->annot[i]);
-    FREE(md->annot);
-}
-
 /*
  * Getnext function for sorting thread lists.
  */
@@ -4190,7 +4769,8 @@ static void index_thread_orderedsubj(struct index_state *state,
 				     unsigned *msgno_list, int nmsg,
 				     int usinguid)
 {
-    MsgData *msgdata, *freeme;
+    MsgData *msgdata;
+    struct mpool *pool;
     struct sortcrit sortcrit[] = {{ SORT_SUBJECT,  0, {{NULL, NULL}} },
 				  { SORT_DATE,     0, {{NULL, NULL}} },
 				  { SORT_SEQUENCE, 0, {{NULL, NULL}} }};
@@ -4199,7 +4779,8 @@ static void index_thread_orderedsubj(struct index_state *state,
     Thread *head, *newnode, *cur, *parent, *last;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
+    pool = new_mpool(MSGDATA_POOL_SIZE(nmsg));
+    msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit, pool);
 
     /* Sort messages by subject and date */
     msgdata = lsort(msgdata,
@@ -4266,13 +4847,11 @@ static void index_thread_orderedsubj(struct index_state *state,
     free(head);
 
     /* free the msgdata array */
-    free(freeme);
+    free_mpool(pool);
 }
 
 /*
  * Guts of thread printing.  Recurses over children when necessary.
- *
- * Frees contents of msgdata as a side effect.
  */
 static void _index_thread_print(struct index_state *state,
 				Thread *thread, int usinguid)
@@ -4294,9 +4873,6 @@ static void _index_thread_print(struct index_state *state,
 
 	    /* if we have a child, print the parent-child separator */
 	    if (thread->child) prot_printf(state->out, " ");
-
-	    /* free contents of the current node */
-	    index_msgdata_free(thread->msgdata);
 	}
 
 	/* for each child, grandchild, etc... */
@@ -4316,9 +4892,6 @@ static void _index_thread_print(struct index_state *state,
 		/* if we have a child, print the parent-child separator */
 		if (child->child) prot_printf(state->out, " ");
 
-		/* free contents of the child node */
-		index_msgdata_free(child->msgdata);
-
 		child = child->child;
 	    }
 	}
@@ -4431,7 +5004,7 @@ static void thread_orphan_child(Thread *child)
  * Link messages together using message-id and references.
  */
 static void ref_link_messages(MsgData *msgdata, Thread **newnode,
-		       struct hash_table *id_table)
+		       struct hash_table *id_table, struct mpool *pool)
 {
     Thread *cur, *parent, *ref;
     int dup_count = 0;
@@ -4450,10 +5023,12 @@ static void ref_link_messages(MsgData *msgdata, Thread **newnode,
 	     * on the old one.
 	     */
 	    if (cur->msgdata) {
+		char *msgid = msgdata->msgid;
+
 		snprintf(buf, sizeof(buf), "-dup%d", dup_count++);
 		msgdata->msgid =
-		    (char *) xrealloc(msgdata->msgid,
-				      strlen(msgdata->msgid) + strlen(buf) + 1);
+		    (char *) mpool_malloc(pool, strlen(msgid) + strlen(buf) + 1);
+		strcpy(msgdata->msgid, msgid);
 		strcat(msgdata->msgid, buf);
 		/* clear cur so that we create a new container */
 		cur = NULL;
@@ -4788,24 +5363,6 @@ static void ref_group_subjects(Thread *root, unsigned nroot, Thread **newnode)
     free_hash_table(&subj_table, NULL);
 }
 
-/*
- * Free an entire thread.
- */
-static void index_thread_free(Thread *thread)
-{
-    Thread *child;
-
-    /* free the head node */
-    if (thread->msgdata) index_msgdata_free(thread->msgdata);
-
-    /* free the children recursively */
-    child = thread->child;
-    while (child) {
-	index_thread_free(child);
-	child = child->next;
-    }
-}
-
 /*
  * Guts of thread searching.  Recurses over children when necessary.
  */
@@ -4849,9 +5406,6 @@ static void index_thread_search(struct index_state *state,
 	    else
 		prev->next = cur->next;
 
-	    /* free all nodes in the thread */
-	    index_thread_free(cur);
-
 	    /* we just removed cur from our list,
 	     * so we need to keep the same prev for the next pass
 	     */
@@ -4869,14 +5423,16 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, i
 			      int (*searchproc) (MsgData *),
 			      struct sortcrit sortcrit[], int usinguid)
 {
-    MsgData *msgdata, *freeme, *md;
+    MsgData *msgdata, *md;
+    struct mpool *pool;
     int tref, nnode;
     Thread *newnode;
     struct hash_table id_table;
     struct rootset rootset;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit);
+    pool = new_mpool(MSGDATA_POOL_SIZE(nmsg));
+    msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit, pool);
 
     /* calculate the sum of the number of references for all messages */
     for (md = msgdata, tref = 0; md; md = md->next)
@@ -4912,7 +5468,7 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, i
     construct_hash_table(&id_table, nmsg + tref, 1);
 
     /* Step 1: link messages together */
-    ref_link_messages(msgdata, &newnode, &id_table);
+    ref_link_messages(msgdata, &newnode, &id_table, pool);
 
     /* Step 2: find the root set (gather all of the orphan messages) */
     rootset.nroot = 0;
@@ -4944,7 +5500,7 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, i
     free(rootset.root);
 
     /* free the msgdata array */
-    free(freeme);
+    free_mpool(pool);
 }
 
 /*
@@ -118,6 +118,10 @@ struct index_state {
     struct protstream *out;
     int qresync;
     struct auth_state *authstate;
+    const char *sortcache_base;	/* mapped cyrus.sortcache, if any */
+    unsigned long sortcache_len;
+    modseq_t sortcache_checked;	/* view the mapped file was last good for */
+    int msgfd;			/* message file being fetched, or -1 */
 };
 
 struct copyargs {
@@ -149,6 +153,12 @@ typedef struct msgdata {
     char *displayto;            /* display-name of first "to" address */
     char *xsubj;		/* extracted subject text */
     unsigned xsubj_hash;	/* hash of extracted subject text */
+    unsigned long cc_prefix;	/* leading bytes of the strings above, */
+    unsigned long from_prefix;	/*   for comparing without touching */
+    unsigned long to_prefix;	/*   the strings themselves */
+    unsigned long displayfrom_prefix;
+    unsigned long displayto_prefix;
+    unsigned long xsubj_prefix;
     int is_refwd;		/* is message a reply or forward? */
     char **annot;		/* array of annotation attribute values
 				   (stored in order of sortcrit) */
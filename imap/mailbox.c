@@ -54,6 +54,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <utime.h>
+#include <sys/time.h>
 
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
@@ -111,6 +112,7 @@ static struct mailboxlist *open_mailboxes = NULL;
 
 static int mailbox_index_unlink(struct mailbox *mailbox);
 static int mailbox_index_repack(struct mailbox *mailbox);
+static int mailbox_repack_online(struct mailboxlist *listitem);
 
 static struct mailboxlist *create_listitem(const char *name)
 {
@@ -800,7 +802,8 @@ int mailbox_mboxlock_reopen(struct mailboxlist *listitem, int locktype)
 
     mailbox_release_resources(mailbox);
 
-    mboxname_release(&listitem->l);
+    /* a failed reopen leaves us without one */
+    if (listitem->l) mboxname_release(&listitem->l);
     r = mboxname_lock(mailbox->name, &listitem->l, locktype);
     if (r) return r;
 
@@ -1012,22 +1015,32 @@ void mailbox_close(struct mailbox **mailboxptr)
     /* do we need to try and clean up? (not if doing a shutdown,
      * speed is probably more important!) */
     if (!in_shutdown && (mailbox->i.options & MAILBOX_CLEANUP_MASK)) {
-	int r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
-	if (!r) r = mailbox_open_index(mailbox);
-	if (!r) r = mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
-	if (!r) {
-	    /* finish cleaning up */
-	    if (mailbox->i.options & OPT_MAILBOX_DELETED)
-		mailbox_delete_cleanup(mailbox->part, mailbox->name);
-	    else if (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)
-		mailbox_index_repack(mailbox);
-	    else if (mailbox->i.options & OPT_MAILBOX_NEEDS_UNLINK)
-		mailbox_index_unlink(mailbox);
-	    /* or we missed out - someone else beat us to it */
+	/* most of a repack can be done without shutting anybody out,
+	 * unless nobody else can get in anyway */
+	if ((mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK) &&
+	    !(mailbox->i.options & OPT_MAILBOX_DELETED) &&
+	    config_getint(IMAPOPT_MAILBOX_REPACK_BATCH) > 0 &&
+	    listitem->l->locktype != LOCK_EXCLUSIVE) {
+	    mailbox_repack_online(listitem);
+	}
+	else {
+	    int r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+	    if (!r) r = mailbox_open_index(mailbox);
+	    if (!r) r = mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+	    if (!r) {
+		/* finish cleaning up */
+		if (mailbox->i.options & OPT_MAILBOX_DELETED)
+		    mailbox_delete_cleanup(mailbox->part, mailbox->name);
+		else if (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)
+		    mailbox_index_repack(mailbox);
+		else if (mailbox->i.options & OPT_MAILBOX_NEEDS_UNLINK)
+		    mailbox_index_unlink(mailbox);
+		/* or we missed out - someone else beat us to it */
+	    }
+	    /* otherwise someone else has the mailbox locked 
+	     * already, so they can handle the cleanup in
+	     * THEIR mailbox_close call */
 	}
-	/* otherwise someone else has the mailbox locked 
-	 * already, so they can handle the cleanup in
-	 * THEIR mailbox_close call */
     }
 
     mailbox_release_resources(mailbox);
@@ -2161,6 +2174,37 @@ int mailbox_rewrite_index_record(struct mailbox *mailbox,
     return mailbox_refresh_index_map(mailbox);
 }
 
+/* fill in the dates a new record may be missing, and give the message
+ * file a matching timestamp */
+static int mailbox_append_prepare(struct mailbox *mailbox,
+				  struct index_record *record)
+{
+    struct utimbuf settime;
+
+    if (!record->internaldate)
+	record->internaldate = time(NULL);
+    if (!record->gmtime)
+	record->gmtime = record->internaldate;
+    if (!record->sentdate) {
+	struct tm *tm = localtime(&record->internaldate);
+	/* truncate to the day */
+	tm->tm_sec = 0;
+	tm->tm_min = 0;
+	tm->tm_hour = 0;
+	record->sentdate = mktime(tm);
+    }
+
+    if (record->system_flags & FLAG_UNLINKED)
+	return 0;
+
+    /* make the file timestamp correct */
+    settime.actime = settime.modtime = record->internaldate;
+    if (utime(mailbox_message_fname(mailbox, record->uid), &settime) == -1)
+	return IMAP_IOERROR;
+
+    return 0;
+}
+
 /* append a single message to a mailbox - also updates everything
  * automatically.  These two functions are the ONLY way to modify
  * the contents or tracking fields of a message */
@@ -2172,7 +2216,6 @@ int mailbox_append_index_record(struct mailbox *mailbox,
     size_t offset;
     int r;
     int n;
-    struct utimbuf settime;
     uint32_t recno;
 
     assert(mailbox_index_islocked(mailbox, 1));
@@ -2199,25 +2242,10 @@ int mailbox_append_index_record(struct mailbox *mailbox,
 	}
     }
 
-    if (!record->internaldate)
-	record->internaldate = time(NULL);
-    if (!record->gmtime)
-	record->gmtime = record->internaldate;
-    if (!record->sentdate) {
-	struct tm *tm = localtime(&record->internaldate);
-	/* truncate to the day */
-	tm->tm_sec = 0;
-	tm->tm_min = 0;
-	tm->tm_hour = 0;
-	record->sentdate = mktime(tm);
-    }
+    r = mailbox_append_prepare(mailbox, record);
+    if (r) return r;
 
     if (!(record->system_flags & FLAG_UNLINKED)) {
-	/* make the file timestamp correct */
-	settime.actime = settime.modtime = record->internaldate;
-	if (utime(mailbox_message_fname(mailbox, record->uid), &settime) == -1)
-	    return IMAP_IOERROR;
-
 	/* write the cache record before buffering the message, it
 	 * will set the cache_offset field. */
 	r = mailbox_append_cache(mailbox, record);
@@ -2348,11 +2376,22 @@ int mailbox_repack_setup(struct mailbox *mailbox,
     repack->newindex_fd = -1;
     repack->newcache_fd = -1;
 
-    /* new files */
+    /* new files.  An online repack builds them without the exclusive
+     * namelock, so the lock on the new index says whose they are */
     fname = mailbox_meta_newfname(mailbox, META_INDEX);
-    repack->newindex_fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    repack->newindex_fd = open(fname, O_RDWR|O_CREAT, 0666);
     if (repack->newindex_fd == -1) goto fail;
 
+    if (lock_nonblocking(repack->newindex_fd)) {
+	syslog(LOG_NOTICE, "%s: another repack is already in progress",
+	       mailbox->name);
+	close(repack->newindex_fd);
+	free(repack);
+	return IMAP_MAILBOX_LOCKED;
+    }
+
+    if (ftruncate(repack->newindex_fd, 0) == -1) goto fail;
+
     fname = mailbox_meta_newfname(mailbox, META_CACHE);
     repack->newcache_fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
     if (repack->newcache_fd == -1) goto fail;
@@ -2417,6 +2456,43 @@ int mailbox_repack_add(struct mailbox_repack *repack,
 
     repack->i.num_records++;
 
+    /* expunged tracking */
+    if (record->system_flags & FLAG_EXPUNGED) {
+	if (!repack->i.first_expunged ||
+	    repack->i.first_expunged > record->last_updated)
+	    repack->i.first_expunged = record->last_updated;
+    }
+
+    return 0;
+}
+
+/* add a new message to the end of a repack - the counterpart of
+ * mailbox_append_index_record for a mailbox being rebuilt in bulk.
+ * The message file must already be in place */
+int mailbox_repack_append(struct mailbox_repack *repack,
+			  struct index_record *record)
+{
+    struct mailbox *mailbox = repack->mailbox;
+    int r;
+
+    /* same rules as a normal append */
+    assert(record->uid > repack->i.last_uid);
+    assert(record->size);
+    assert(!message_guid_isnull(&record->guid));
+
+    r = mailbox_append_prepare(mailbox, record);
+    if (r) return r;
+
+    r = mailbox_repack_add(repack, record);
+    if (r) return r;
+
+    repack->i.last_uid = record->uid;
+
+    if (config_auditlog)
+	syslog(LOG_NOTICE, "auditlog: append sessionid=<%s> mailbox=<%s> uniqueid=<%s> uid=<%u> guid=<%s>",
+	    session_id(), mailbox->name, mailbox->uniqueid, record->uid,
+	    message_guid_encode(&record->guid));
+
     return 0;
 }
 
@@ -2481,15 +2557,62 @@ int mailbox_repack_commit(struct mailbox_repack **repackptr)
     return r;
 }
 
+/*
+ * Commit a repack of a mailbox which stays open, and carry on with the
+ * new files.  Needs the exclusive namelock, since the index lock is
+ * dropped along with the old file.  The quota root is charged the
+ * difference at the next commit.
+ */
+int mailbox_repack_swap(struct mailbox_repack **repackptr)
+{
+    struct mailbox *mailbox = (*repackptr)->mailbox;
+    struct mailboxlist *listitem = find_listitem(mailbox->name);
+    int r;
+
+    assert(listitem && listitem->l->locktype == LOCK_EXCLUSIVE);
+    assert(mailbox_index_islocked(mailbox, 1));
+
+    /* anything pending goes to the old index first */
+    r = mailbox_commit(mailbox);
+    if (!r) {
+	/* which may have rewritten the header */
+	(*repackptr)->i.header_file_crc = mailbox->i.header_file_crc;
+	mailbox_quota_dirty(mailbox);
+	r = mailbox_repack_commit(repackptr);
+    }
+    if (r) {
+	mailbox_repack_abort(repackptr);
+	return r;
+    }
+
+    /* closing the old index releases its lock */
+    mailbox->index_locktype = 0;
+    r = mailbox_open_index(mailbox);
+    if (r) return r;
+
+    return mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+}
+
+static unsigned long repack_msec(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+	   (now.tv_usec - start->tv_usec) / 1000;
+}
+
 /* need a mailbox exclusive lock, we're rewriting files */
 static int mailbox_index_repack(struct mailbox *mailbox)
 {
     struct mailbox_repack *repack = NULL;
     uint32_t recno;
     struct index_record record;
+    struct timeval start;
     int r = IMAP_IOERROR;
 
     syslog(LOG_INFO, "Repacking mailbox %s", mailbox->name);
+    gettimeofday(&start, NULL);
 
     r = mailbox_repack_setup(mailbox, &repack);
     if (r) goto fail;
@@ -2525,13 +2648,314 @@ static int mailbox_index_repack(struct mailbox *mailbox)
     /* we unlinked any "needs unlink" in the process */
     repack->i.options &= ~(OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK);
 
-    return mailbox_repack_commit(&repack);
+    recno = repack->i.num_records;
+    r = mailbox_repack_commit(&repack);
+    if (!r)
+	syslog(LOG_INFO, "Repacked mailbox %s: %u records, "
+	       "exclusive lock held %lums",
+	       mailbox->name, recno, repack_msec(&start));
+    return r;
 
 fail:
     mailbox_repack_abort(&repack);
     return r;
 }
 
+/*
+ * Online repack.  Records are copied into the new files in batches of
+ * mailbox_repack_batch, each under a shared index lock, so deliveries
+ * and other sessions get in between.  The CRC of every record copied is
+ * kept: anything rewritten meanwhile, silently or not, has a new one.
+ * Once the namelock is exclusive only those records and any appended
+ * since are copied again before the new files are renamed into place.
+ */
+#define REPACK_CATCHUP_ROUNDS	8	/* shared passes over the changes */
+#define REPACK_LOCK_TRIES	5	/* for the exclusive namelock */
+#define REPACK_LOCK_WAIT	10000	/* usecs, doubled after each try */
+
+struct repack_online {
+    struct mailbox_repack *repack;
+    uint32_t ncopied;		/* old records seen so far */
+    uint32_t alloc;
+    uint32_t *newrecno;		/* where each one went, 0 if dropped */
+    bit32 *crc;			/* its record CRC at the time */
+    unsigned recopied;
+};
+
+/* copy a record not seen before onto the end of the new files */
+static int repack_online_copy(struct repack_online *ro, uint32_t recno)
+{
+    struct mailbox_repack *repack = ro->repack;
+    struct mailbox *mailbox = repack->mailbox;
+    struct index_record record;
+    int r;
+
+    r = mailbox_read_index_record(mailbox, recno, &record);
+    if (r) return r;
+
+    if (recno > ro->alloc) {
+	ro->alloc = recno + 1024;
+	ro->newrecno = xrealloc(ro->newrecno, ro->alloc * sizeof(uint32_t));
+	ro->crc = xrealloc(ro->crc, ro->alloc * sizeof(bit32));
+    }
+    ro->newrecno[recno-1] = 0;
+    ro->crc[recno-1] = record.record_crc;
+    ro->ncopied = recno;
+
+    /* same rules as mailbox_index_repack */
+    if (!record.uid) return 0;
+
+    if (record.system_flags & FLAG_UNLINKED) {
+	mailbox_message_unlink(mailbox, record.uid);
+	if (record.modseq > repack->i.deletedmodseq)
+	    repack->i.deletedmodseq = record.modseq;
+	return 0;
+    }
+
+    r = mailbox_cacherecord(mailbox, &record);
+    if (r) return r;
+
+    r = mailbox_repack_add(repack, &record);
+    if (r) return r;
+
+    ro->newrecno[recno-1] = repack->i.num_records;
+    return 0;
+}
+
+/* overwrite the copy of a record which has changed since */
+static int repack_online_recopy(struct repack_online *ro, uint32_t recno)
+{
+    struct mailbox_repack *repack = ro->repack;
+    struct mailbox *mailbox = repack->mailbox;
+    struct index_record record, old;
+    indexbuffer_t ibuf;
+    unsigned char *buf = ibuf.buf;
+    off_t offset;
+    int r;
+
+    r = mailbox_read_index_record(mailbox, recno, &record);
+    if (r) return r;
+
+    ro->crc[recno-1] = record.record_crc;
+    ro->recopied++;
+
+    /* dropped as unlinked, and nothing comes back from that */
+    if (!ro->newrecno[recno-1]) return 0;
+
+    offset = INDEX_HEADER_SIZE +
+	     (off_t)(ro->newrecno[recno-1] - 1) * INDEX_RECORD_SIZE;
+    if (pread(repack->newindex_fd, buf, INDEX_RECORD_SIZE, offset) !=
+	INDEX_RECORD_SIZE)
+	return IMAP_IOERROR;
+    r = mailbox_buf_to_index_record((char *)buf, &old);
+    if (r) return r;
+
+    header_update_counts(&repack->i, &old, 0);
+    repack->i.sync_crc ^= make_sync_crc(mailbox, &old);
+
+    if (record.system_flags & FLAG_UNLINKED) {
+	/* too late to drop it from the new index: it stays unlinked
+	 * there with its cache record, for the next repack */
+	record.cache_offset = old.cache_offset;
+	record.cache_crc = old.cache_crc;
+	repack->i.options |= OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK;
+    }
+    else if (record.cache_crc == old.cache_crc) {
+	/* flags changes don't touch the cache record */
+	record.cache_offset = old.cache_offset;
+    }
+    else {
+	r = mailbox_cacherecord(mailbox, &record);
+	if (r) return r;
+	record.cache_offset = 0;
+	r = cache_append_record(repack->newcache_fd, &record);
+	if (r) return r;
+	/* the first copy is still in the new cache file */
+	repack->i.leaked_cache_records++;
+    }
+
+    header_update_counts(&repack->i, &record, 1);
+    repack->i.sync_crc ^= make_sync_crc(mailbox, &record);
+
+    if (record.system_flags & FLAG_EXPUNGED) {
+	if (!repack->i.first_expunged ||
+	    repack->i.first_expunged > record.last_updated)
+	    repack->i.first_expunged = record.last_updated;
+    }
+
+    mailbox_index_record_to_buf(&record, buf);
+    if (pwrite(repack->newindex_fd, buf, INDEX_RECORD_SIZE, offset) !=
+	INDEX_RECORD_SIZE)
+	return IMAP_IOERROR;
+
+    return 0;
+}
+
+/* bring the copy up to date with the index as it is now */
+static int repack_online_delta(struct repack_online *ro)
+{
+    struct mailbox *mailbox = ro->repack->mailbox;
+    uint32_t recno, ncopied = ro->ncopied;
+    const char *base;
+    int r = 0;
+
+    /* the CRC is enough to tell, no need to parse the record */
+    base = mailbox->index_base + mailbox->i.start_offset + OFFSET_RECORD_CRC;
+    for (recno = 1; !r && recno <= ncopied; recno++) {
+	bit32 crc = ntohl(*((bit32 *)(base +
+				       (recno-1) * mailbox->i.record_size)));
+	if (crc != ro->crc[recno-1])
+	    r = repack_online_recopy(ro, recno);
+    }
+
+    for (recno = ncopied + 1; !r && recno <= mailbox->i.num_records; recno++)
+	r = repack_online_copy(ro, recno);
+
+    return r;
+}
+
+static int mailbox_repack_online(struct mailboxlist *listitem)
+{
+    struct mailbox *mailbox = &listitem->m;
+    struct repack_online ro;
+    struct index_header *i;
+    uint32_t kept;
+    struct timeval start, hold;
+    unsigned long ms, shared_max = 0, shared_total = 0;
+    int batch = config_getint(IMAPOPT_MAILBOX_REPACK_BATCH);
+    int nbatches = 0, rounds = 0, tries, n, r;
+    useconds_t wait = REPACK_LOCK_WAIT;
+    uint32_t changed;
+
+    /* only start if nobody else has it open right now - if they do,
+     * they'll get to it when they close it */
+    r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+    if (r) return r;
+
+    /* but there's no need to keep them out while copying */
+    r = mailbox_mboxlock_reopen(listitem, LOCK_SHARED);
+    if (!r) r = mailbox_open_index(mailbox);
+    if (r) return r;
+
+    memset(&ro, 0, sizeof(struct repack_online));
+    gettimeofday(&start, NULL);
+
+    do {
+	r = mailbox_lock_index(mailbox, LOCK_SHARED);
+	if (r) goto done;
+	gettimeofday(&hold, NULL);
+
+	if (!ro.repack) {
+	    /* someone else beat us to it */
+	    if (!(mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)) {
+		mailbox_unlock_index(mailbox, NULL);
+		goto done;
+	    }
+	    syslog(LOG_INFO, "Repacking mailbox %s online", mailbox->name);
+	    r = mailbox_repack_setup(mailbox, &ro.repack);
+	    /* set again only for records unlinked after they're copied */
+	    if (!r) ro.repack->i.options &=
+			~(OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK);
+	}
+
+	for (n = 0; !r && n < batch &&
+		    ro.ncopied < mailbox->i.num_records; n++)
+	    r = repack_online_copy(&ro, ro.ncopied + 1);
+	n = (ro.ncopied < mailbox->i.num_records);
+
+	mailbox_unlock_index(mailbox, NULL);
+	ms = repack_msec(&hold);
+	if (ms > shared_max) shared_max = ms;
+	shared_total += ms;
+	nbatches++;
+    } while (!r && n);
+
+    /* catch up with the changes made meanwhile, until they're few or
+     * it's clear they keep coming; the exclusive step copies the rest */
+    do {
+	if (r) goto done;
+	r = mailbox_lock_index(mailbox, LOCK_SHARED);
+	if (r) goto done;
+	gettimeofday(&hold, NULL);
+
+	changed = ro.recopied + ro.ncopied;
+	r = repack_online_delta(&ro);
+	changed = ro.recopied + ro.ncopied - changed;
+
+	mailbox_unlock_index(mailbox, NULL);
+	ms = repack_msec(&hold);
+	if (ms > shared_max) shared_max = ms;
+	shared_total += ms;
+	nbatches++;
+    } while (changed >= (uint32_t)batch && ++rounds < REPACK_CATCHUP_ROUNDS);
+    if (r) goto done;
+
+    /* now shut everybody out for the rest.  A session that is just
+     * passing through gets a short while; one that stays open will
+     * repack the mailbox itself when it closes, so don't keep our
+     * caller waiting on it */
+    for (tries = 0; tries < REPACK_LOCK_TRIES; tries++) {
+	if (tries) {
+	    usleep(wait);
+	    wait *= 2;
+	}
+	r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+	if (r != IMAP_MAILBOX_LOCKED) break;
+    }
+    if (!r) r = mailbox_open_index(mailbox);
+    if (!r) r = mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+    if (r) {
+	syslog(LOG_INFO, "Repack of mailbox %s abandoned after copying "
+	       "%u records: %s", mailbox->name, ro.ncopied, error_message(r));
+	goto done;
+    }
+    gettimeofday(&hold, NULL);
+
+    /* somebody repacked it while the namelock changed hands */
+    if (ro.repack->i.generation_no != mailbox->i.generation_no + 1) {
+	r = IMAP_AGAIN;
+	goto done;
+    }
+
+    changed = ro.recopied + ro.ncopied;
+    r = repack_online_delta(&ro);
+    if (r) goto done;
+    changed = ro.recopied + ro.ncopied - changed;
+
+    /* the counts are ours, everything else is as the index is now */
+    i = &ro.repack->i;
+    i->uidvalidity = mailbox->i.uidvalidity;
+    i->last_uid = mailbox->i.last_uid;
+    i->highestmodseq = mailbox->i.highestmodseq;
+    i->recentuid = mailbox->i.recentuid;
+    i->recenttime = mailbox->i.recenttime;
+    i->last_appenddate = mailbox->i.last_appenddate;
+    i->pop3_last_login = mailbox->i.pop3_last_login;
+    i->header_file_crc = mailbox->i.header_file_crc;
+    if (mailbox->i.deletedmodseq > i->deletedmodseq)
+	i->deletedmodseq = mailbox->i.deletedmodseq;
+    i->options = (mailbox->i.options &
+		  ~(OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK)) |
+		 (i->options &
+		  (OPT_MAILBOX_NEEDS_REPACK|OPT_MAILBOX_NEEDS_UNLINK));
+
+    kept = i->num_records;
+    r = mailbox_repack_commit(&ro.repack);
+    if (r) goto done;
+
+    syslog(LOG_INFO, "Repacked mailbox %s online: %u records in %lums, "
+	   "shared lock held %lums in %d batches (longest %lums), "
+	   "exclusive lock held %lums for %u changed records",
+	   mailbox->name, kept, repack_msec(&start),
+	   shared_total, nbatches, shared_max, repack_msec(&hold), changed);
+
+ done:
+    mailbox_repack_abort(&ro.repack);
+    free(ro.newrecno);
+    free(ro.crc);
+    return r;
+}
+
 /*
  * Used by mailbox_rename() to expunge all messages in INBOX
  */
@@ -3034,6 +3458,7 @@ static struct meta_file meta_files[] = {
     { META_INDEX,  0, 1 },
     { META_CACHE,  0, 1 },
     { META_SQUAT,  1, 0 },
+    { META_SORTCACHE, 1, 0 },
     { 0, 0, 0 }
 };
 
@@ -76,13 +76,15 @@
 #define FNAME_CACHE "/cyrus.cache"
 #define FNAME_SQUAT "/cyrus.squat"
 #define FNAME_EXPUNGE "/cyrus.expunge"
+#define FNAME_SORTCACHE "/cyrus.sortcache"
 
 enum meta_filename {
   META_HEADER = 1,
   META_INDEX,
   META_CACHE,
   META_SQUAT,
-  META_EXPUNGE
+  META_EXPUNGE,
+  META_SORTCACHE
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -441,6 +443,9 @@ extern int mailbox_open_irl(const char *name,
 			    struct mailbox **mailboxptr);
 extern int mailbox_open_exclusive(const char *name,
 			          struct mailbox **mailboxptr);
+extern int mailbox_open_advanced(const char *name,
+				 struct mailbox **mailboxptr,
+				 int locktype, int index_locktype);
 extern void mailbox_close(struct mailbox **mailboxptr);
 extern int mailbox_delete(struct mailbox **mailboxptr);
 
@@ -502,6 +507,8 @@ extern int mailbox_copyfile(const char *from, const char *to, int nolink);
 extern int mailbox_reconstruct(const char *name, int flags);
 
 extern int mailbox_index_recalc(struct mailbox *mailbox);
+extern bit32 make_sync_crc(struct mailbox *mailbox,
+			   struct index_record *record);
 
 /* for upgrade index */
 extern int mailbox_open_index(struct mailbox *mailbox);
@@ -522,7 +529,10 @@ extern int mailbox_repack_setup(struct mailbox *mailbox,
 			        struct mailbox_repack **repackptr);
 extern int mailbox_repack_add(struct mailbox_repack *repack,
 			      struct index_record *record);
+extern int mailbox_repack_append(struct mailbox_repack *repack,
+				 struct index_record *record);
 extern void mailbox_repack_abort(struct mailbox_repack **repackptr);
 extern int mailbox_repack_commit(struct mailbox_repack **repackptr);
+extern int mailbox_repack_swap(struct mailbox_repack **repackptr);
 
 #endif /* INCLUDED_MAILBOX_H */
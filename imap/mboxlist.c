@@ -2584,7 +2584,7 @@ mboxlist_opensubs(const char *userid,
 	flags |= CYRUSDB_MBOXSORT;
     }
 
-    r = (SUBDB->open)(subsfname, flags, ret);
+    r = cyrusdb_cachedopen(SUBDB, subsfname, flags, ret);
     if (r != CYRUSDB_OK) {
 	r = IMAP_IOERROR;
     }
@@ -2598,7 +2598,7 @@ mboxlist_opensubs(const char *userid,
  */
 static void mboxlist_closesubs(struct db *sub)
 {
-    (SUBDB->close)(sub);
+    cyrusdb_cachedclose(SUBDB, sub);
 }
 
 /*
@@ -1183,6 +1183,11 @@ char *mboxname_metapath(const char *partition, const char *mboxname,
 	metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
 	filename = FNAME_SQUAT;
 	break;
+    case META_SORTCACHE:
+	snprintf(confkey, 256, "metadir-sortcache-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_SORTCACHE;
+	filename = FNAME_SORTCACHE;
+	break;
     case 0:
 	break;
     default:
@@ -640,6 +640,17 @@ int mupdate_scarf(mupdate_handle *handle,
 		break;
 	    }
 	    goto badcmd;
+	case 'S':
+	    if(!strncmp(handle->cmd.s, "SEQUENCE", 8)) {
+		ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg1));
+		CHECKNEWLINE(handle, ch);
+
+		/* remember it; the caller decides when it is safe to keep */
+		strlcpy(handle->sequence, handle->arg1.s,
+			sizeof(handle->sequence));
+		break;
+	    }
+	    goto badcmd;
 
 	default:
 	badcmd:
@@ -169,6 +169,88 @@ static int get_kick_fds(int kicksock,
 
 #define KICK_FDS_LEN 5
 
+/* have we told the server threads to accept connections? */
+static int listening = 0;
+
+/* The sequence token from the master that our mailboxes.db reflects,
+ * kept across restarts so a reconnect can RESUME instead of pulling the
+ * whole mailbox list again. */
+static void read_sequence(char *buf, size_t len)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    FILE *f;
+
+    buf[0] = '\0';
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, FNAME_MUPDATE_SEQUENCE);
+    f = fopen(fname, "r");
+    if (!f) return;
+
+    if (!fgets(buf, len, f)) buf[0] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+
+    fclose(f);
+}
+
+static void write_sequence(const char *seq)
+{
+    char fname[MAX_MAILBOX_PATH+1], newfname[MAX_MAILBOX_PATH+1];
+    FILE *f;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, FNAME_MUPDATE_SEQUENCE);
+    snprintf(newfname, sizeof(newfname), "%s.NEW", fname);
+
+    f = fopen(newfname, "w");
+    if (!f) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	return;
+    }
+
+    fprintf(f, "%s\n", seq);
+    if (fclose(f) == EOF || rename(newfname, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+	unlink(newfname);
+    }
+}
+
+/* Ask the master for only the changes since our saved sequence,
+ * applying them as they arrive just like streamed updates.
+ * Returns 0 if we are streaming again, 1 if a full resync is needed
+ * and -1 if the connection failed. */
+static int mupdate_resume(mupdate_handle *handle)
+{
+    char seq[sizeof(handle->sequence)];
+    enum mupdate_cmd_response response = MUPDATE_NONE;
+    int r;
+
+    /* sent even without a saved sequence, so the master reports
+     * SEQUENCE during the full UPDATE that follows */
+    read_sequence(seq, sizeof(seq));
+
+    prot_printf(handle->conn->out, "R%u RESUME {" SIZE_T_FMT "+}\r\n%s\r\n",
+		handle->tagn++, strlen(seq), seq);
+
+    r = mupdate_scarf(handle, cmd_change, NULL, 1, &response);
+    if (r) return -1;
+
+    if (response != MUPDATE_OK) {
+	/* log truncated, master restarted, or an older master */
+	if (seq[0]) {
+	    syslog(LOG_NOTICE,
+		   "can't resume after %s, full resync needed", seq);
+	}
+	return 1;
+    }
+
+    syslog(LOG_NOTICE, "resumed mailbox list from master at %s",
+	   handle->sequence[0] ? handle->sequence : seq);
+
+    if (handle->sequence[0] && strcmp(handle->sequence, seq)) {
+	write_sequence(handle->sequence);
+    }
+    return 0;
+}
+
 static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 {
     int gotdata = 0;
@@ -179,33 +261,46 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     int num_kick_fds = 0;
     struct mbent_queue remote_boxes;
     struct mpool *pool;
+    char seq[sizeof(handle->sequence)];
     int r;
     enum mupdate_cmd_response response;
     
     if (!handle || !handle->saslcompleted) return;
 
-    pool = new_mpool(131072); /* Arbitrary, but large (128k) */
+    /* pick up where we left off, if the master still remembers */
+    r = mupdate_resume(handle);
+    if (r < 0) return;
 
-    /* first get the list of remote mailboxes from the mupdate master */
-    r = mupdate_synchronize_remote(handle, &remote_boxes, pool);
     if (r) {
-	free_mpool(pool);
-	return;
-    }
+	pool = new_mpool(131072); /* Arbitrary, but large (128k) */
+
+	/* get the list of remote mailboxes from the mupdate master */
+	r = mupdate_synchronize_remote(handle, &remote_boxes, pool);
+	if (r) {
+	    free_mpool(pool);
+	    return;
+	}
+
+	/* don't handle connections (and drop current connections)
+	 * while we sync */
+	mupdate_unready();
+	listening = 0;
 
-    /* don't handle connections (and drop current connections)
-     * while we sync */
-    mupdate_unready();
+	/* Now, resync the database by comparing the remote mbox with our local*/
+	r = mupdate_synchronize(&remote_boxes, pool);
+	free_mpool(pool);
+	if (r) return;
 
-    /* Now, resync the database by comparing the remote mbox with our local*/
-    r = mupdate_synchronize(&remote_boxes, pool);
-    free_mpool(pool);
-    if (r) return;
+	if (handle->sequence[0]) write_sequence(handle->sequence);
+    }
 
     mupdate_signal_db_synced();
     
     /* Okay, we're all set to go */
-    mupdate_ready();
+    if (!listening) {
+	mupdate_ready();
+	listening = 1;
+    }
 
     kicksock = open_kick_socket();
     highest_fd = ((kicksock > handle->conn->sock) ? kicksock : handle->conn->sock) + 1;
@@ -235,11 +330,17 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 	    if (FD_ISSET(handle->conn->sock, &rset)) {
 		/* If there is a fatal error, die, other errors ignore */
 		response = MUPDATE_NONE;
+		strlcpy(seq, handle->sequence, sizeof(seq));
 		if ((r = mupdate_scarf(handle, cmd_change, NULL, 
 				  waiting_for_noop, &response)) != 0) {
 		    syslog(LOG_ERR, "mupdate_scarf: %d", r);
 		    break;
 		}
+
+		/* the changes it covers have been written by cmd_change */
+		if (strcmp(seq, handle->sequence)) {
+		    write_sequence(handle->sequence);
+		}
 	    } 
 	    
 	    /* If we were waiting on a noop, we no longer are.
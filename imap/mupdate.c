@@ -106,13 +106,8 @@ typedef enum {
 
 enum {
     poll_interval = 1,
-    update_wait = 5
-};
-
-struct pending {
-    struct pending *next;
-
-    char mailbox[MAX_MAILBOX_BUFFER];
+    update_wait = 5,
+    changelog_min = 1024
 };
 
 struct stringlist 
@@ -156,11 +151,10 @@ struct conn {
     const char *streaming; /* tag */
     struct stringlist *streaming_hosts; /* partial updates */
 
-    /* pending changes to send, in reverse order */
-    pthread_mutex_t m;
-    struct pending *plist;
-    struct pending *ptail;
-    struct conn *updatelist_next;
+    /* position in the change log */
+    unsigned long sentseq; /* last change sent to the client */
+    int sequenced;	   /* client has asked for SEQUENCE responses */
+    struct buf updates;	   /* formatted updates waiting to be written */
     struct prot_waitevent *ev; /* invoked every 'update_wait' seconds
 				  to send out updates */
 
@@ -208,7 +202,59 @@ static int conn_pipe[2];
 
 /* ---- database access ---- */
 pthread_mutex_t mailboxes_mutex = PTHREAD_MUTEX_INITIALIZER;
-struct conn *updatelist = NULL;
+
+/* ---- batched commits ----
+ * With mupdate_group_commit on the master, cmd_set() writes into a
+ * transaction shared by all worker threads and then waits for the
+ * committer thread, so updates that arrive together share one commit
+ * (and one fsync).  Lookups in the meantime go through the same
+ * transaction.  Protected by mailboxes_mutex. */
+static int group_commit = 0;
+static struct txn *batch_tid = NULL;
+static int batch_ops = 0;		/* updates in the open batch */
+static unsigned long batch_gen = 1;	/* batch being filled */
+static unsigned long commit_gen = 0;	/* last batch committed */
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long commit_count = 0, commit_ops = 0;
+static int batch_waiters = 0;		/* cmd_set()s waiting on the batch */
+
+/* batches whose commit failed, kept until each waiter has looked */
+struct failed_batch {
+    unsigned long gen;
+    int r;
+    int waiters;
+};
+static struct failed_batch *failed_batches = NULL;
+static int nfailed_batches = 0;
+
+/* ---- change log ----
+ * Every change passed to log_update() gets the next sequence number and
+ * the resulting mailbox state is kept in a ring of the last
+ * mupdate_changelog_size changes.  Streaming connections send from the
+ * ring at their own pace, so posting a change costs the same however
+ * many slaves there are, and a slave that reconnects with RESUME is sent
+ * only what it missed.  The log is only in memory; the epoch (our start
+ * time and pid) in each sequence token makes tokens from a previous run
+ * miss.  Entries from a batch whose commit failed are kept, with no
+ * mailbox, so the numbering stays intact; they are never sent.  Written
+ * with both mailboxes_mutex and changelog_mutex held; readers only need
+ * changelog_mutex. */
+struct changelog_entry {
+    unsigned long seq;
+    enum settype t;
+    char *mailbox;
+    char *server;
+    char *acl;
+    char *oldserver;	/* host parts, for PARTIAL-UPDATE */
+    char *thisserver;
+};
+static pthread_mutex_t changelog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct changelog_entry *changelog = NULL;
+static int changelog_size = 0;
+static unsigned long changelog_seq = 0;
+static unsigned long changelog_committed = 0; /* safe to send up to here */
+static char changelog_epoch[64];
 
 /* --- prototypes --- */
 static void conn_free(struct conn *C);
@@ -224,11 +270,15 @@ void cmd_find(struct conn *C, const char *tag, const char *mailbox,
 void cmd_list(struct conn *C, const char *tag, const char *host_prefix);
 void cmd_startupdate(struct conn *C, const char *tag,
 		     struct stringlist *partial);
+void cmd_resume(struct conn *C, const char *tag, const char *token,
+		struct stringlist *partial);
 void cmd_starttls(struct conn *C, const char *tag);
 void cmd_compress(struct conn *C, const char *tag, const char *alg);
 void shut_down(int code);
 static int reset_saslconn(struct conn *c);
 void database_init();
+static void database_flush(void);
+static void *committer_main(void *rock);
 void sendupdates(struct conn *C, int flushnow);
 
 extern int saslserver(sasl_conn_t *conn, const char *mech,
@@ -359,29 +409,6 @@ static void conn_free(struct conn *C)
 {
     assert(!C->idle); /* Not allowed to free idle connections */
     
-    if (C->streaming) {		/* remove from updatelist */
-	struct conn *upc;
-
-	pthread_mutex_lock(&mailboxes_mutex);
-
-	if (C == updatelist) {
-	    /* first thing in updatelist */
-	    updatelist = C->updatelist_next;
-	} else {
-	    /* find in update list */
-	    for (upc = updatelist; upc->updatelist_next != NULL; 
-		 upc = upc->updatelist_next) {
-		if (upc->updatelist_next == C) break;
-	    }
-	    /* must find it ! */
-	    assert(upc->updatelist_next == C);
-
-	    upc->updatelist_next = C->updatelist_next;
-	}
-
-	pthread_mutex_unlock(&mailboxes_mutex);
-    }
-
     /* decrease connection counter */
     pthread_mutex_lock(&connection_count_mutex);
     connection_count--;
@@ -429,6 +456,7 @@ static void conn_free(struct conn *C)
     buf_free(&(C->arg3));
 
     if(C->streaming_hosts) stringlist_free(&(C->streaming_hosts));
+    buf_free(&C->updates);
 
     free(C);
 }
@@ -637,6 +665,23 @@ int service_init(int argc, char **argv,
 
     database_init();
 
+    changelog_size = config_getint(IMAPOPT_MUPDATE_CHANGELOG_SIZE);
+    if (changelog_size < changelog_min) changelog_size = changelog_min;
+    changelog = xzmalloc(changelog_size * sizeof(struct changelog_entry));
+    snprintf(changelog_epoch, sizeof(changelog_epoch), "%lu-%d",
+	     (unsigned long) time(NULL), (int) getpid());
+
+    if (masterp && config_getswitch(IMAPOPT_MUPDATE_GROUP_COMMIT)) {
+	r = pthread_create(&t, NULL, &committer_main, NULL);
+	if (r == 0) {
+	    pthread_detach(t);
+	    group_commit = 1;
+	} else {
+	    syslog(LOG_ERR, "could not start committer thread");
+	    return EC_SOFTWARE;
+	}
+    }
+
     if (!masterp) {
 	r = pthread_create(&t, NULL, &mupdate_client_start, NULL);
 	if(r == 0) {
@@ -915,6 +960,35 @@ mupdate_docmd_result_t docmd(struct conn *c)
 	    
 	    cmd_set(c, c->tag.s, c->arg1.s, c->arg2.s, NULL, SET_RESERVE);
 	}
+	else if (!strcmp(c->cmd.s, "Resume")) {
+	    struct stringlist *arg = NULL;
+	    int counter = 30; /* limit on number of processed hosts */
+
+	    if (ch != ' ') goto missingargs;
+	    ch = getstring(c->pin, c->pout, &(c->arg1));
+
+	    while(ch == ' ') {
+		/* same PARTIAL-UPDATE host list as UPDATE */
+		ch = getstring(c->pin, c->pout, &(c->arg2));
+		if(c->arg2.s[0] == '\0') {
+		    stringlist_free(&arg);
+		    goto badargs;
+		}
+		if(counter-- == 0) {
+		    stringlist_free(&arg);
+		    goto extraargs;
+		}
+		stringlist_add(&arg,c->arg2.s);
+	    }
+
+	    CHECKNEWLINE(c, ch);
+	    if (c->streaming) {
+		stringlist_free(&arg);
+		goto notwhenstreaming;
+	    }
+
+	    cmd_resume(c, c->tag.s, c->arg1.s, arg);
+	}
 	else goto badcmd;
 	break;
 	
@@ -1455,6 +1529,106 @@ void database_init()
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 }
 
+/* commit the open batch and let its waiters go.  database must be locked. */
+static void database_commit(void)
+{
+    unsigned long seq;
+    int r = 0;
+
+    if (batch_tid) {
+	/* a failed commit is aborted, so none of the batch is on disk */
+	r = mboxlist_commit(batch_tid);
+	if (r) {
+	    syslog(LOG_ERR, "DBERROR: committing %d updates: %s",
+		   batch_ops, cyrusdb_strerror(r));
+	}
+	batch_tid = NULL;
+    }
+
+    if (r && batch_waiters) {
+	struct failed_batch *f;
+
+	failed_batches = xrealloc(failed_batches, (nfailed_batches + 1) *
+				  sizeof(struct failed_batch));
+	f = &failed_batches[nfailed_batches++];
+	f->gen = batch_gen;
+	f->r = r;
+	f->waiters = batch_waiters;
+    }
+
+    commit_count++;
+    commit_ops += batch_ops;
+    batch_ops = 0;
+    batch_waiters = 0;
+    commit_gen = batch_gen++;
+
+    pthread_mutex_lock(&changelog_mutex);
+    if (r) {
+	/* the slaves must not hear about changes we don't have */
+	seq = changelog_seq > (unsigned long) changelog_size ?
+	    changelog_seq - changelog_size : 0;
+	if (seq < changelog_committed) seq = changelog_committed;
+	for (seq++; seq <= changelog_seq; seq++) {
+	    struct changelog_entry *e = &changelog[seq % changelog_size];
+
+	    free(e->mailbox);
+	    e->mailbox = NULL;
+	}
+    }
+    /* slaves may now be told about everything logged so far */
+    changelog_committed = changelog_seq;
+    pthread_mutex_unlock(&changelog_mutex);
+
+    pthread_cond_broadcast(&commit_cond);
+}
+
+/* how the commit of batch 'gen' went, for one of its waiters.
+ * database must be locked. */
+static int database_commit_result(unsigned long gen)
+{
+    int i, r;
+
+    for (i = 0; i < nfailed_batches; i++) {
+	if (failed_batches[i].gen != gen) continue;
+
+	r = failed_batches[i].r;
+	if (!--failed_batches[i].waiters) {
+	    failed_batches[i] = failed_batches[--nfailed_batches];
+	}
+	return r;
+    }
+
+    return 0;
+}
+
+/* make everything written so far visible outside the batch, e.g. before
+ * a mboxlist_findall().  database must be locked. */
+static void database_flush(void)
+{
+    if (batch_ops) database_commit();
+}
+
+/* the batch committer (master with mupdate_group_commit) */
+static void *committer_main(void *rock __attribute__((unused)))
+{
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+
+    for (;;) {
+	while (!batch_ops) {
+	    pthread_cond_wait(&batch_cond, &mailboxes_mutex);
+	}
+
+	database_commit();
+
+	if (commit_count % 10000 == 0) {
+	    syslog(LOG_INFO, "group commit: %lu updates in %lu commits",
+		   commit_ops, commit_count);
+	}
+    }
+
+    return NULL;
+}
+
 /* log change to database. database must be locked. */
 void database_log(const struct mbent *mb, struct txn **mytid)
 {
@@ -1491,7 +1665,8 @@ struct mbent *database_lookup(const char *name, struct mpool *pool)
     
     if (!name) return NULL;
     
-    r = mboxlist_lookup(name, &mbentry, NULL);
+    /* with a batch open we have to read through it */
+    r = mboxlist_lookup(name, &mbentry, batch_tid ? &batch_tid : NULL);
 
     switch (r) {
     case IMAP_MAILBOX_RESERVED:
@@ -1586,43 +1761,51 @@ void cmd_authenticate(struct conn *C,
     return;
 }
 
-/* Log the update out to anyone who is in our updatelist */
+/* does a change between these servers concern a PARTIAL-UPDATE client? */
+static int streaming_match(struct stringlist *hosts,
+			   const char *oldserver,
+			   const char *thisserver)
+{
+    if (!hosts) return 1;
+
+    return (oldserver && stringlist_contains(hosts, oldserver))
+	|| (thisserver && stringlist_contains(hosts, thisserver));
+}
+
+/* Log the update for anyone streaming from us */
 /* INVARIANT: caller MUST hold mailboxes_mutex */
-/* oldserver is the previous value of the server in this update,
+/* m is the mailbox's new state (NULL or SET_DELETE if it is gone),
+   oldserver is the previous value of the server in this update,
    thisserver is the current value of the mailbox's server */
-void log_update(const char *mailbox,
+void log_update(const struct mbent *m, const char *mailbox,
 		const char *oldserver,
 		const char *thisserver) 
 {
-    struct conn *upc;
-    
-    for (upc = updatelist; upc != NULL; upc = upc->updatelist_next) {
-	/* for each connection, add to pending list */
-	struct pending *p = (struct pending *) xmalloc(sizeof(struct pending));
-	p->next = NULL;
-	strlcpy(p->mailbox, mailbox, sizeof(p->mailbox));
-	
-	/* this might need to be inside the mutex, but I doubt it */
-	if(upc->streaming_hosts
-	   && (!oldserver || !stringlist_contains(upc->streaming_hosts,
-						  oldserver))
-	   && (!thisserver || !stringlist_contains(upc->streaming_hosts,
-						   thisserver))) {
-	    /* No Match! Continue! */
-	    continue;
-	}
-
-	pthread_mutex_lock(&upc->m);
-
-	if ( upc->plist == NULL ) {
-	    upc->plist = upc->ptail = p;
-	} else {
-	    upc->ptail->next = p;
-	    upc->ptail = p;
-	}
-
-	pthread_mutex_unlock(&upc->m);
-    }
+    struct changelog_entry *e;
+    unsigned long seq;
+
+    pthread_mutex_lock(&changelog_mutex);
+
+    seq = ++changelog_seq;
+    e = &changelog[seq % changelog_size];
+
+    free(e->mailbox);
+    free(e->server);
+    free(e->acl);
+    free(e->oldserver);
+    free(e->thisserver);
+    e->seq = seq;
+    e->t = (m && m->t != SET_DELETE) ? m->t : SET_DELETE;
+    e->mailbox = xstrdup(mailbox);
+    e->server = e->t != SET_DELETE ? xstrdup(m->server) : NULL;
+    e->acl = e->t == SET_ACTIVE ? xstrdup(m->acl) : NULL;
+    e->oldserver = oldserver ? xstrdup(oldserver) : NULL;
+    e->thisserver = thisserver ? xstrdup(thisserver) : NULL;
+
+    /* otherwise database_commit() publishes it */
+    if (!group_commit) changelog_committed = seq;
+
+    pthread_mutex_unlock(&changelog_mutex);
 }
 
 void cmd_set(struct conn *C, 
@@ -1636,7 +1819,7 @@ void cmd_set(struct conn *C,
 
     /* Hold any output that we need to do */
     enum {
-	EXISTS, NOTACTIVE, DOESNTEXIST, ISOK, NOOUTPUT
+	EXISTS, NOTACTIVE, DOESNTEXIST, DBERROR, ISOK, NOOUTPUT
     } msg = NOOUTPUT;
     
     syslog(LOG_DEBUG, "cmd_set(fd:%d, %s)", C->fd, mailbox);
@@ -1710,8 +1893,8 @@ void cmd_set(struct conn *C,
 	}
     }
 
-    /* write to disk */
-    if (m) database_log(m, NULL);
+    /* write to disk, or to the batch the committer thread will commit */
+    if (m) database_log(m, group_commit ? &batch_tid : NULL);
 
     if(oldserver) {
 	tmp = strchr(oldserver, '!');
@@ -1725,7 +1908,23 @@ void cmd_set(struct conn *C,
     }
 
     /* post pending changes */
-    log_update(mailbox, oldserver, thisserver);
+    log_update(m, mailbox, oldserver, thisserver);
+
+    if (group_commit) {
+	/* don't say OK until it is on disk */
+	unsigned long gen = batch_gen;
+
+	batch_ops++;
+	batch_waiters++;
+	pthread_cond_signal(&batch_cond);
+	while (commit_gen < gen) {
+	    pthread_cond_wait(&commit_cond, &mailboxes_mutex);
+	}
+	if (database_commit_result(gen)) {
+	    msg = DBERROR;
+	    goto done;
+	}
+    }
 
     msg = ISOK;
  done:
@@ -1747,6 +1946,9 @@ void cmd_set(struct conn *C,
     case DOESNTEXIST:
 	prot_printf(C->pout, "%s NO \"mailbox doesn't exist\"\r\n", tag);
 	break;
+    case DBERROR:
+	prot_printf(C->pout, "%s NO \"database error\"\r\n", tag);
+	break;
     case ISOK:
 	prot_printf(C->pout, "%s OK \"done\"\r\n", tag);
 	break;
@@ -1867,6 +2069,9 @@ void cmd_list(struct conn *C, const char *tag, const char *host_prefix)
     /* indicate interest in updates */
     pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
 
+    /* the list has to come from the database itself */
+    database_flush();
+
     /* since this isn't valid when streaming, just use the same callback */
     C->streaming = tag;
     C->list_prefix = host_prefix;
@@ -1907,8 +2112,7 @@ void cmd_startupdate(struct conn *C, const char *tag,
 		     struct stringlist *partial)
 {
     char pattern[2] = {'*','\0'};
-
-    /* initialize my condition variable */
+    unsigned long seq;
 
     /* The inital dump of the database can result in a lot of data,
      * let's do this nonblocking */
@@ -1917,17 +2121,23 @@ void cmd_startupdate(struct conn *C, const char *tag,
     /* indicate interest in updates */
     pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
 
-    C->updatelist_next = updatelist;
-    updatelist = C;
     C->streaming = xstrdup(tag);
     C->streaming_hosts = partial;
 
     /* dump initial list */
+    database_flush();
     mboxlist_findall(NULL, pattern, 1, NULL,
 		     NULL, sendupdate, (void*)C);
 
+    /* the dump reflects every change so far */
+    seq = C->sentseq = changelog_seq;
+
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 
+    if (C->sequenced) {
+	prot_printf(C->pout, "%s SEQUENCE \"%s.%lu\"\r\n",
+		    tag, changelog_epoch, seq);
+    }
     prot_printf(C->pout, "%s OK \"streaming starts\"\r\n", tag);
 
     prot_BLOCK(C->pout);
@@ -1938,34 +2148,139 @@ void cmd_startupdate(struct conn *C, const char *tag,
 			      sendupdates_evt, C);
 }
 
+/* like UPDATE, but if 'token' (from an earlier SEQUENCE response) is
+ * still covered by the change log, send only the mailboxes that changed
+ * since then.  Otherwise reply NO and the client falls back to UPDATE. */
+void cmd_resume(struct conn *C, const char *tag, const char *token,
+		struct stringlist *partial)
+{
+    const char *dot = strrchr(token, '.');
+    unsigned long since = 0, seq;
+    char *end = NULL;
+
+    /* from here on the client wants SEQUENCE responses, even if it has
+     * to fall back to a full UPDATE */
+    C->sequenced = 1;
+
+    if (dot) since = strtoul(dot + 1, &end, 10);
+
+    pthread_mutex_lock(&changelog_mutex);
+    seq = changelog_committed;
+
+    if (!dot || !*(dot + 1) || *end ||
+	(size_t) (dot - token) != strlen(changelog_epoch) ||
+	strncmp(token, changelog_epoch, dot - token) ||
+	since > seq ||
+	changelog_seq - since > (unsigned long) changelog_size) {
+	pthread_mutex_unlock(&changelog_mutex);
+
+	syslog(LOG_NOTICE, "%s: can't resume after %s (now at %s.%lu)",
+	       C->clienthost, token, changelog_epoch, seq);
+	stringlist_free(&partial);
+	prot_printf(C->pout, "%s NO \"sequence not available\"\r\n", tag);
+	return;
+    }
+
+    /* sendupdates() takes it from here */
+    C->streaming = xstrdup(tag);
+    C->streaming_hosts = partial;
+    C->sentseq = since;
+
+    pthread_mutex_unlock(&changelog_mutex);
+
+    syslog(LOG_NOTICE, "%s: resuming after %s, %lu changes since",
+	   C->clienthost, token, seq - since);
+
+    C->ev = prot_addwaitevent(C->pin, time(NULL) + update_wait, 
+			      sendupdates_evt, C);
+
+    sendupdates(C, 0);
+
+    prot_printf(C->pout, "%s OK \"streaming resumes\"\r\n", tag);
+    prot_flush(C->pout);
+}
+
+/* append the response for one change log entry, as a FIND would send
+ * it except that deletes are sent too */
+static void changelog_format(struct buf *out, const char *tag,
+			     const struct changelog_entry *e)
+{
+    switch (e->t) {
+    case SET_ACTIVE:
+	buf_printf(out, "%s MAILBOX {" SIZE_T_FMT "+}\r\n%s"
+		   " {" SIZE_T_FMT "+}\r\n%s {" SIZE_T_FMT "+}\r\n%s\r\n",
+		   tag,
+		   strlen(e->mailbox), e->mailbox,
+		   strlen(e->server), e->server,
+		   strlen(e->acl), e->acl);
+	break;
+    case SET_RESERVE:
+	buf_printf(out, "%s RESERVE {" SIZE_T_FMT "+}\r\n%s"
+		   " {" SIZE_T_FMT "+}\r\n%s\r\n",
+		   tag,
+		   strlen(e->mailbox), e->mailbox,
+		   strlen(e->server), e->server);
+	break;
+    default:
+	buf_printf(out, "%s DELETE {" SIZE_T_FMT "+}\r\n%s\r\n",
+		   tag, strlen(e->mailbox), e->mailbox);
+	break;
+    }
+}
+
 /* send out any pending updates.
    if 'flushnow' is set, flush the output buffer */
 void sendupdates(struct conn *C, int flushnow)
 {
-    struct pending *p, *q;
+    unsigned long seq, last;
+    int lagged = 0;
 
-    pthread_mutex_lock(&C->m);
+    /* reschedule event for 'update_wait' seconds */
+    C->ev->mark = time(NULL) + update_wait;
 
-    /* just grab the update list and release the lock */
-    p = C->plist;
-    C->plist = NULL;
-    C->ptail = NULL;
-    pthread_mutex_unlock(&C->m);
+    /* copy out what is new for this client; nothing here touches the
+     * database or waits on the network */
+    buf_reset(&C->updates);
+
+    pthread_mutex_lock(&changelog_mutex);
+    last = changelog_committed;
+    if (changelog_seq - C->sentseq > (unsigned long) changelog_size) {
+	/* what it hasn't seen yet has been overwritten */
+	lagged = 1;
+    } else {
+	for (seq = C->sentseq + 1; seq <= last; seq++) {
+	    struct changelog_entry *e = &changelog[seq % changelog_size];
 
-    while (p != NULL) {
-	/* send update */
-	q = p;
-	p = p->next;
+	    if (!e->mailbox) continue;	/* its commit failed */
+	    if (streaming_match(C->streaming_hosts,
+				e->oldserver, e->thisserver)) {
+		changelog_format(&C->updates, C->streaming, e);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&changelog_mutex);
 
-	/* notify just like a FIND - except enable sending of DELETE
-	 * notifications */
-	cmd_find(C, C->streaming, q->mailbox, 0, 1);
+    if (lagged) {
+	syslog(LOG_WARNING,
+	       "%s: more than %d changes behind, dropping connection",
+	       C->clienthost, changelog_size);
+	prot_printf(C->pout, "* BYE \"too far behind\"\r\n");
+	prot_flush(C->pout);
+	/* the worker sees EOF and cleans up; the slave resyncs */
+	shutdown(C->fd, SHUT_RDWR);
+	return;
+    }
 
-	free(q);
+    if (C->updates.len) {
+	prot_write(C->pout, C->updates.s, C->updates.len);
     }
 
-    /* reschedule event for 'update_wait' seconds */
-    C->ev->mark = time(NULL) + update_wait;
+    /* tell a resuming client how far it has got */
+    if (C->sequenced && last != C->sentseq) {
+	prot_printf(C->pout, "%s SEQUENCE \"%s.%lu\"\r\n",
+		    C->streaming, changelog_epoch, last);
+    }
+    C->sentseq = last;
 
     if (flushnow) {
 	prot_flush(C->pout);
@@ -2085,6 +2400,8 @@ void cmd_compress(struct conn *C, const char *tag, const char *alg)
 	/* enable (de)compression for the prot layer */
 	prot_setcompress(C->pin);
 	prot_setcompress(C->pout);
+	prot_setcompresslevel(C->pout,
+			      config_getint(IMAPOPT_PROXY_COMPRESS_LEVEL));
 
 	C->compress_done = 1;
     }
@@ -2257,7 +2574,7 @@ int cmd_change(struct mupdate_mailboxdata *mdata,
     }
 
     /* post pending changes to anyone we are talking to */
-    log_update(mdata->mailbox, oldserver, thisserver);
+    log_update(m, mdata->mailbox, oldserver, thisserver);
 
  done:
     if(oldserver) free(oldserver);
@@ -78,8 +78,14 @@ struct mupdate_handle_s {
     struct mupdate_mailboxdata mailboxdata_buf;
 
     int saslcompleted;
+
+    /* last SEQUENCE response from the server */
+    char sequence[64];
 };
 
+/* where a slave keeps the last SEQUENCE reflected in mailboxes.db */
+#define FNAME_MUPDATE_SEQUENCE "/mupdate.sequence"
+
 enum settype {
     SET_ACTIVE,
     SET_RESERVE,
@@ -55,6 +55,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -78,6 +79,7 @@
 #include "imapd.h"
 #include "imap_err.h"
 #include "mailbox.h"
+#include "map.h"
 #include "version.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -187,6 +189,7 @@ static void cmd_pass(char *pass);
 static void cmd_user(char *user);
 static void cmd_starttls(int pop3s);
 static int blat(int msg, int lines);
+static void blat_sendfile(int fd);
 static int openinbox(void);
 static void cmdloop(void);
 static void kpop(void);
@@ -323,6 +326,8 @@ static void popd_reset(void)
 {
     int bytes_in = 0;
     int bytes_out = 0;
+    int write_calls = 0;
+    unsigned long write_avg = 0;
 
     proc_cleanup();
 
@@ -353,12 +358,14 @@ static void popd_reset(void)
     if (popd_out) {
 	prot_flush(popd_out);
 	bytes_out = prot_bytes_out(popd_out);
+	write_calls = prot_write_calls(popd_out);
+	write_avg = prot_write_avg(popd_out);
 	prot_free(popd_out);
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> writes=<%d> avgwrite=<%lu>", 
+			   session_id(), bytes_in, bytes_out, write_calls, write_avg);
     
     popd_in = popd_out = NULL;
 
@@ -629,6 +636,8 @@ void shut_down(int code)
 {
     int bytes_in = 0;
     int bytes_out = 0;
+    int write_calls = 0;
+    unsigned long write_avg = 0;
 
     in_shutdown = 1;
 
@@ -677,12 +686,14 @@ void shut_down(int code)
     if (popd_out) {
 	prot_flush(popd_out);
 	bytes_out = prot_bytes_out(popd_out);
+	write_calls = prot_write_calls(popd_out);
+	write_avg = prot_write_avg(popd_out);
 	prot_free(popd_out);
     }
 
     if (config_auditlog)
-	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>", 
-			   session_id(), bytes_in, bytes_out);
+	syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d> writes=<%d> avgwrite=<%lu>", 
+			   session_id(), bytes_in, bytes_out, write_calls, write_avg);
 
 #ifdef HAVE_SSL
     tls_shutdown_serverengine();
@@ -1949,26 +1960,32 @@ static int blat(int msgno, int lines)
 	return IMAP_IOERROR;
     }
     prot_printf(popd_out, "+OK Message follows\r\n");
-    while (lines != thisline) {
-	if (!fgets(buf, sizeof(buf), msgfile)) break;
+    if (lines == -1 && prot_can_sendfile(popd_out)) {
+	/* whole message on a plain connection */
+	blat_sendfile(fileno(msgfile));
+    }
+    else {
+	while (lines != thisline) {
+	    if (!fgets(buf, sizeof(buf), msgfile)) break;
 
-	if (thisline < 0) {
-	    if (buf[0] == '\r' && buf[1] == '\n') thisline = 0;
-	}
-	else thisline++;
+	    if (thisline < 0) {
+		if (buf[0] == '\r' && buf[1] == '\n') thisline = 0;
+	    }
+	    else thisline++;
 
-	if (buf[0] == '.') 
-	    (void)prot_putc('.', popd_out);
-	do {
-	    prot_printf(popd_out, "%s", buf);
+	    if (buf[0] == '.') 
+		(void)prot_putc('.', popd_out);
+	    do {
+		prot_printf(popd_out, "%s", buf);
+	    }
+	    while (buf[strlen(buf)-1] != '\n' && fgets(buf, sizeof(buf), msgfile));
 	}
-	while (buf[strlen(buf)-1] != '\n' && fgets(buf, sizeof(buf), msgfile));
+
+	/* Protect against messages not ending in CRLF */
+	if (buf[strlen(buf)-1] != '\n') prot_printf(popd_out, "\r\n");
     }
     fclose(msgfile);
 
-    /* Protect against messages not ending in CRLF */
-    if (buf[strlen(buf)-1] != '\n') prot_printf(popd_out, "\r\n");
-
     prot_printf(popd_out, ".\r\n");
 
     /* Reset inactivity timer in case we spend a long time
@@ -1978,6 +1995,52 @@ static int blat(int msgno, int lines)
     return 0;
 }
 
+/*
+ * Send the whole message file open on 'fd', dot-stuffed.  The runs of
+ * data between lines starting with '.' are handed to prot_sendfile(),
+ * so only the stuffing dots are copied through the protstream buffer.
+ */
+static void blat_sendfile(int fd)
+{
+    const char *base = NULL;
+    unsigned long len = 0;
+    unsigned long start = 0, pos = 0;
+    const char *p;
+    struct stat sbuf;
+
+    if (fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat on message file: %m");
+	fatal("can't fstat message file", EC_OSFILE);
+    }
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, "message file",
+		popd_mailbox->name);
+
+    while (pos < len) {
+	if (base[pos] == '.') {
+	    /* flush the run before this line, then stuff the dot */
+	    if (pos - start >= PROT_SENDFILE_MIN)
+		prot_sendfile(popd_out, fd, start, pos - start);
+	    else
+		prot_write(popd_out, base + start, pos - start);
+	    (void)prot_putc('.', popd_out);
+	    start = pos;
+	}
+
+	p = memchr(base + pos, '\n', len - pos);
+	pos = p ? (unsigned long) (p - base) + 1 : len;
+    }
+
+    if (len - start >= PROT_SENDFILE_MIN)
+	prot_sendfile(popd_out, fd, start, len - start);
+    else
+	prot_write(popd_out, base + start, len - start);
+
+    /* Protect against messages not ending in CRLF */
+    if (len && base[len-1] != '\n') prot_printf(popd_out, "\r\n");
+
+    map_free(&base, &len);
+}
+
 /* Reset the given sasl_conn_t to a sane state */
 static int reset_saslconn(sasl_conn_t **conn) 
 {
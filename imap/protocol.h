@@ -47,7 +47,7 @@
 
 #include "saslclient.h"
 
-#define MAX_CAPA 8
+#define MAX_CAPA 9
 
 enum {
     /* generic capabilities */
@@ -99,6 +99,13 @@ struct simple_cmd_t {
     const char *ok;		/* success response */
 };
 
+struct proxyauth_cmd_t {
+    const char *cmd;		/* [OPTIONAL] command string (userid follows) */
+    const char *ok;		/* success response */
+    const char *fail;		/* failure response */
+    unsigned long capa;		/* capability flag advertising the command */
+};
+
 struct protocol_t {
     const char *service;	/* INET service name */
     const char *sasl_service;	/* SASL service name */
@@ -109,6 +116,7 @@ struct protocol_t {
     struct simple_cmd_t compress_cmd;
     struct simple_cmd_t ping_cmd;
     struct simple_cmd_t logout_cmd;
+    struct proxyauth_cmd_t proxyauth_cmd;
 };
 
 #endif /* _INCLUDED_PROTOCOL_H */
@@ -49,6 +49,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/time.h>
 #include <sys/un.h>
 
 #include "assert.h"
@@ -141,6 +142,146 @@ backend_timeout(struct protstream *s __attribute__((unused)),
     }
 }
 
+/*
+ * Pool of idle backend connections (proxy_pool_size in imapd.conf).
+ *
+ * When a session ends, connections to backends that support the
+ * protocol's proxyauth command are parked here instead of being
+ * logged out.  The next session in this process that needs the same
+ * server takes one over and switches it to its own user, skipping the
+ * connect, CAPABILITY, STARTTLS, AUTHENTICATE and COMPRESS exchanges.
+ */
+struct pool_entry {
+    struct backend *be;
+    time_t idle_since;
+};
+
+static struct pool_entry *pool = NULL;
+static int pool_size = 0;
+
+static struct {
+    unsigned long leases;	/* connections needed by sessions */
+    unsigned long hits;		/* ... of those, served from the pool */
+    double connect_ms;		/* total time for fresh connections */
+    double reauth_ms;		/* total time for pooled ones */
+} pool_stats;
+
+static double ms_since(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+	(now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void pool_drop(struct pool_entry *e)
+{
+    backend_disconnect(e->be);
+    if (e->be->last_result.s) free(e->be->last_result.s);
+    free(e->be);
+    e->be = NULL;
+}
+
+static struct backend *pool_lease(const char *server,
+				  struct protocol_t *prot,
+				  const char *userid)
+{
+    struct timeval start;
+    struct backend *be;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < pool_size; i++) {
+	struct pool_entry *e = &pool[i];
+
+	if (!e->be) continue;
+	if (e->idle_since + IDLE_TIMEOUT < now) {
+	    /* the backend may well have given up on it by now */
+	    pool_drop(e);
+	    continue;
+	}
+	if (e->be->prot != prot || strcmp(e->be->hostname, server)) continue;
+
+	be = e->be;
+	e->be = NULL;
+
+	gettimeofday(&start, NULL);
+	if (!backend_proxyauth(be, userid)) {
+	    pool_stats.hits++;
+	    pool_stats.reauth_ms += ms_since(&start);
+	    return be;
+	}
+
+	e->be = be;
+	pool_drop(e);
+    }
+
+    return NULL;
+}
+
+/* the session is done with this backend: keep it in the pool or drop it */
+void proxy_releaseserver(struct backend *s)
+{
+    struct pool_entry *slot = NULL;
+    int i;
+
+    if (pool_size && s->sock != -1 && s->prot->proxyauth_cmd.cmd &&
+	CAPA(s, s->prot->proxyauth_cmd.capa) && !prot_error(s->in)) {
+	/* detach it from the session */
+	if (s->timeout) prot_removewaitevent(s->clientin, s->timeout);
+	s->timeout = NULL;
+	s->clientin = NULL;
+	if (s->inbox && (s == *(s->inbox))) *(s->inbox) = NULL;
+	if (s->current && (s == *(s->current))) *(s->current) = NULL;
+	s->inbox = s->current = NULL;
+
+	/* make sure it is alive and idle, and find it a slot */
+	if (!backend_ping(s)) {
+	    for (i = 0; i < pool_size; i++) {
+		if (!pool[i].be) {
+		    slot = &pool[i];
+		    break;
+		}
+		if (!slot || pool[i].idle_since < slot->idle_since) {
+		    slot = &pool[i];
+		}
+	    }
+	    if (slot->be) pool_drop(slot);
+	    slot->be = s;
+	    slot->idle_since = time(NULL);
+	    return;
+	}
+    }
+
+    proxy_downserver(s);
+    if (s->last_result.s) free(s->last_result.s);
+    free(s);
+}
+
+/* log out of every pooled backend */
+void proxy_pool_done(void)
+{
+    int i;
+
+    for (i = 0; i < pool_size; i++) {
+	if (pool[i].be) pool_drop(&pool[i]);
+    }
+
+    if (pool_stats.leases) {
+	unsigned long misses = pool_stats.leases - pool_stats.hits;
+	double connect = misses ? pool_stats.connect_ms / misses : 0;
+	double reauth = pool_stats.hits ?
+	    pool_stats.reauth_ms / pool_stats.hits : 0;
+
+	syslog(LOG_INFO, "backend pool: %lu/%lu connections reused (%lu%%), "
+	       "connect %.1fms, proxyauth %.1fms, saved %.0fms",
+	       pool_stats.hits, pool_stats.leases,
+	       100 * pool_stats.hits / pool_stats.leases, connect, reauth,
+	       misses ? pool_stats.hits * (connect - reauth) : 0);
+    }
+}
+
 /* return the connection to the server */
 struct backend *
 proxy_findserver(const char *server,		/* hostname of backend */
@@ -175,9 +316,27 @@ proxy_findserver(const char *server,		/* hostname of backend */
     }
 
     if (!ret || (ret->sock == -1)) {
-	/* need to (re)establish connection to server or create one */
-	ret = backend_connect(ret, server, prot, userid, NULL, NULL);
-	if (!ret) return NULL;
+	struct backend *pooled = NULL;
+	struct timeval start;
+
+	if (!pool) {
+	    pool_size = config_getint(IMAPOPT_PROXY_POOL_SIZE);
+	    if (pool_size < 0) pool_size = 0;
+	    pool = xzmalloc((pool_size + 1) * sizeof(struct pool_entry));
+	}
+
+	if (pool_size) {
+	    pool_stats.leases++;
+	    if (!ret) ret = pooled = pool_lease(server, prot, userid);
+	}
+
+	if (!pooled) {
+	    /* need to (re)establish connection to server or create one */
+	    gettimeofday(&start, NULL);
+	    ret = backend_connect(ret, server, prot, userid, NULL, NULL);
+	    if (!ret) return NULL;
+	    if (pool_size) pool_stats.connect_ms += ms_since(&start);
+	}
 
 	if (clientin) {
 	    /* add the timeout */
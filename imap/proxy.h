@@ -76,6 +76,8 @@ proxy_findserver(const char *server, struct protocol_t *prot,
 		 struct protstream *clientin);
 
 void proxy_downserver(struct backend *s);
+void proxy_releaseserver(struct backend *s);
+void proxy_pool_done(void);
 
 int proxy_check_input(struct protgroup *protin,
 		      struct protstream *clientin,
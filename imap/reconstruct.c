@@ -58,6 +58,8 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <stdlib.h>
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -134,6 +136,644 @@ extern cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
 int reconstruct_flags = RECONSTRUCT_MAKE_CHANGES | RECONSTRUCT_DO_STAT;
 
+/* ====================================================================== */
+
+/* Parallel and resumable reconstruct.
+
+   The mailboxes are collected up front, so that they can be ordered
+   (largest or most recently used first) and so that the ones a previous
+   run got through can be skipped.  With more than one worker, the
+   workers are forked before any database is opened, pull mailboxes off
+   a shared job pipe and send a fixed-size report back after each one;
+   both records are smaller than PIPE_BUF, so writes to the shared pipes
+   are atomic.  The parent does everything else: uniqueid clash checks,
+   output, progress and checkpoints.
+
+   Checkpoints are kept per partition, in
+   {configdirectory}/reconstruct/<partition>: a header line saying which
+   run it belongs to (when it started, its flags and mailbox arguments),
+   then the names of the mailboxes reconstructed successfully, one per
+   line, appended as reports come in.  Only a run with the same flags and
+   arguments resumes from one, and only for RECON_CHECKPOINT_MAXAGE;
+   anything else is started over.  They are removed once a run has done
+   every mailbox. */
+
+#define RECON_PROGRESS_INTERVAL 30
+#define RECON_SYNC_EVERY 100
+#define RECON_CHECKPOINT_MAXAGE (7*86400)
+#define RECON_CHECKPOINT_MAGIC "#reconstruct"
+
+enum {
+    RECON_ORDER_NONE = 0,
+    RECON_ORDER_SIZE,
+    RECON_ORDER_ACCESS
+};
+
+struct recon_job {
+    unsigned long weight;
+    char partition[MAX_PARTITION_LEN];
+    char name[MAX_MAILBOX_BUFFER];
+};
+
+struct recon_report {
+    int worker;
+    int r;
+    unsigned long messages;
+    unsigned long bytes;
+    double elapsed;
+    char uniqueid[64];
+    char name[MAX_MAILBOX_BUFFER];
+    char partition[MAX_PARTITION_LEN];
+};
+
+struct recon_worker {
+    pid_t pid;
+    unsigned long mailboxes;
+    unsigned long messages;
+    unsigned long bytes;
+    double busy;
+};
+
+struct recon_checkpoint {
+    char *fname;
+    FILE *f;
+    unsigned unsynced;
+};
+
+struct recon_driver {
+    int nworkers;
+    int order;
+    int checkpoint;
+    time_t started;		/* run identity, for the checkpoints */
+    int flags;
+    char *pattern;
+
+    /* the work */
+    struct recon_job *jobs;
+    int njobs;
+    int alloc;
+    unsigned long skipped;
+    char lastname[MAX_MAILBOX_BUFFER];
+
+    /* checkpoints by partition, and the mailboxes they say are done */
+    hash_table checkpoints;
+    hash_table done;
+
+    /* parallel mode */
+    struct recon_worker *workers;
+    int jobfd;
+    int reportfd;
+
+    /* results */
+    int ndone;
+    int nfailed;
+    unsigned long messages;
+    unsigned long bytes;
+    struct timeval start;
+    time_t lastreport;
+};
+
+static double recon_timesub(const struct timeval *start,
+			    const struct timeval *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+	   (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Read a checkpoint's header: is it from an earlier attempt at this run?
+   If not, say why. */
+static int recon_checkpoint_ours(struct recon_driver *drv, FILE *f,
+				 const char *fname)
+{
+    char buf[MAX_MAILBOX_BUFFER + 1024];
+    const char *why = NULL;
+    unsigned long started;
+    int flags, n = 0;
+    char *p;
+
+    if (!fgets(buf, sizeof(buf), f) || !(p = strchr(buf, '\n')) ||
+	sscanf(buf, RECON_CHECKPOINT_MAGIC " %lu %x %n",
+	       &started, &flags, &n) < 2 || !n) {
+	why = "no run header";
+    }
+    else if ((time_t) started > time(NULL) ||
+	     time(NULL) - (time_t) started > RECON_CHECKPOINT_MAXAGE) {
+	why = "too old";
+    }
+    else if (flags != drv->flags) {
+	why = "made with different options";
+    }
+    else {
+	*p = '\0';
+	if (strcmp(buf + n, drv->pattern)) why = "made for other mailboxes";
+    }
+
+    if (why) {
+	syslog(LOG_WARNING, "ignoring checkpoint %s: %s", fname, why);
+	fprintf(stderr, "ignoring checkpoint %s: %s\n", fname, why);
+	return 0;
+    }
+
+    return 1;
+}
+
+/* Find (and on first use, load and open) the checkpoint for 'partition' */
+static struct recon_checkpoint *recon_checkpoint(struct recon_driver *drv,
+						 const char *partition)
+{
+    struct recon_checkpoint *ckpt;
+    char buf[MAX_MAILBOX_BUFFER];
+    int resume = 0;
+    FILE *f;
+    char *p;
+
+    ckpt = hash_lookup(partition, &drv->checkpoints);
+    if (ckpt) return ckpt;
+
+    ckpt = xzmalloc(sizeof(struct recon_checkpoint));
+    ckpt->fname = strconcat(config_dir, "/reconstruct/", partition,
+			    (char *)NULL);
+    hash_insert(partition, ckpt, &drv->checkpoints);
+
+    f = fopen(ckpt->fname, "r");
+    if (f && (resume = recon_checkpoint_ours(drv, f, ckpt->fname))) {
+	unsigned long n = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+	    /* a line cut short by a crash wasn't done */
+	    p = strchr(buf, '\n');
+	    if (!p) break;
+	    *p = '\0';
+	    hash_insert(buf, (void *) 1, &drv->done);
+	    n++;
+	}
+	syslog(LOG_NOTICE, "resuming partition %s: %lu mailboxes done",
+	       partition, n);
+    }
+    if (f) fclose(f);
+
+    /* anything but our own is started over */
+    if (cyrus_mkdir(ckpt->fname, 0755) == 0)
+	ckpt->f = fopen(ckpt->fname, resume ? "a" : "w");
+    if (ckpt->f && !resume &&
+	(fprintf(ckpt->f, RECON_CHECKPOINT_MAGIC " %lu %x %s\n",
+		 (unsigned long) drv->started, drv->flags,
+		 drv->pattern) < 0 || fflush(ckpt->f) == EOF)) {
+	fclose(ckpt->f);
+	ckpt->f = NULL;
+    }
+    if (!ckpt->f) {
+	syslog(LOG_ERR, "IOERROR: opening checkpoint %s: %m", ckpt->fname);
+	fprintf(stderr, "can't open checkpoint %s: %s\n",
+		ckpt->fname, strerror(errno));
+	exit(EC_IOERR);
+    }
+
+    return ckpt;
+}
+
+static void recon_checkpoint_add(struct recon_driver *drv,
+				 const char *partition, const char *name)
+{
+    struct recon_checkpoint *ckpt = recon_checkpoint(drv, partition);
+
+    fprintf(ckpt->f, "%s\n", name);
+    fflush(ckpt->f);
+    if (++ckpt->unsynced >= RECON_SYNC_EVERY) {
+	fsync(fileno(ckpt->f));
+	ckpt->unsynced = 0;
+    }
+}
+
+static void recon_checkpoint_free(void *data)
+{
+    struct recon_checkpoint *ckpt = (struct recon_checkpoint *) data;
+
+    if (ckpt->f) {
+	fflush(ckpt->f);
+	fsync(fileno(ckpt->f));
+	fclose(ckpt->f);
+    }
+    free(ckpt->fname);
+    free(ckpt);
+}
+
+static void recon_checkpoint_remove(char *partition __attribute__((unused)),
+				    void *data,
+				    void *rock __attribute__((unused)))
+{
+    struct recon_checkpoint *ckpt = (struct recon_checkpoint *) data;
+
+    if (unlink(ckpt->fname) && errno != ENOENT) {
+	syslog(LOG_ERR, "IOERROR: removing checkpoint %s: %m", ckpt->fname);
+    }
+}
+
+/*
+ * mboxlist_findall() callback function to queue a mailbox
+ */
+static int recon_collect(char *name,
+			 int matchlen,
+			 int maycreate __attribute__((unused)),
+			 void *rock)
+{
+    struct recon_driver *drv = (struct recon_driver *) rock;
+    struct mboxlist_entry mbentry;
+    struct recon_job *job;
+    struct stat sbuf;
+    char *path;
+    int r;
+
+    /* don't repeat */
+    if (matchlen == (int) strlen(drv->lastname) &&
+	!strncmp(name, drv->lastname, matchlen)) return 0;
+
+    if (matchlen >= (int) sizeof(drv->lastname))
+	matchlen = sizeof(drv->lastname) - 1;
+
+    strncpy(drv->lastname, name, matchlen);
+    drv->lastname[matchlen] = '\0';
+
+    if (drv->njobs == drv->alloc) {
+	drv->alloc = drv->alloc ? 2 * drv->alloc : 1024;
+	drv->jobs = xrealloc(drv->jobs, drv->alloc * sizeof(struct recon_job));
+    }
+    job = &drv->jobs[drv->njobs];
+    memset(job, 0, sizeof(struct recon_job));
+    strlcpy(job->name, drv->lastname, sizeof(job->name));
+
+    do {
+	r = mboxlist_lookup(job->name, &mbentry, NULL);
+    } while (r == IMAP_AGAIN);
+    if (r) {
+	com_err(job->name, r, "looking up mailbox");
+	return 0;
+    }
+    strlcpy(job->partition, mbentry.partition, sizeof(job->partition));
+
+    /* done by a previous run? */
+    if (drv->checkpoint) {
+	recon_checkpoint(drv, job->partition);
+	if (hash_lookup(job->name, &drv->done)) {
+	    drv->skipped++;
+	    return 0;
+	}
+    }
+
+    /* the index is the cheapest thing to ask; it may be gone, though */
+    path = mboxname_metapath(job->partition, job->name, META_INDEX, 0);
+    if (path && !stat(path, &sbuf)) {
+	if (drv->order == RECON_ORDER_SIZE) {
+	    job->weight = sbuf.st_size;
+	    path = mboxname_metapath(job->partition, job->name, META_CACHE, 0);
+	    if (path && !stat(path, &sbuf)) job->weight += sbuf.st_size;
+	}
+	else if (drv->order == RECON_ORDER_ACCESS) {
+	    job->weight = sbuf.st_atime > sbuf.st_mtime ?
+			  sbuf.st_atime : sbuf.st_mtime;
+	}
+    }
+
+    drv->njobs++;
+
+    return 0;
+}
+
+static int recon_compare_job(const void *a, const void *b)
+{
+    const struct recon_job *ja = (const struct recon_job *) a;
+    const struct recon_job *jb = (const struct recon_job *) b;
+
+    if (ja->weight < jb->weight) return 1;
+    if (ja->weight > jb->weight) return -1;
+    return strcmp(ja->name, jb->name);
+}
+
+/* Reconstruct one mailbox, in whichever process we are */
+static void recon_run_job(struct recon_job *job, struct recon_report *report)
+{
+    struct mailbox *mailbox = NULL;
+    struct timeval start, end;
+    int r;
+
+    signals_poll();
+
+    strlcpy(report->name, job->name, sizeof(report->name));
+    strlcpy(report->partition, job->partition, sizeof(report->partition));
+
+    gettimeofday(&start, NULL);
+
+    r = mailbox_reconstruct(job->name, reconstruct_flags);
+    if (r) {
+	com_err(job->name, r, "%s",
+		(r == IMAP_IOERROR) ? error_message(errno) : NULL);
+    }
+    else {
+	r = mailbox_open_irl(job->name, &mailbox);
+	if (r) {
+	    com_err(job->name, r, "Failed to open after reconstruct");
+	}
+	else {
+	    strlcpy(report->uniqueid, mailbox->uniqueid,
+		    sizeof(report->uniqueid));
+	    report->messages = mailbox->i.exists;
+	    report->bytes = mailbox->i.quota_mailbox_used;
+	    mailbox_close(&mailbox);
+	}
+    }
+
+    gettimeofday(&end, NULL);
+    report->r = r;
+    report->elapsed = recon_timesub(&start, &end);
+}
+
+static void recon_progress(struct recon_driver *drv, int force)
+{
+    struct timeval now;
+    double elapsed, rate;
+    int left;
+
+    gettimeofday(&now, NULL);
+    if (!force && now.tv_sec - drv->lastreport < RECON_PROGRESS_INTERVAL)
+	return;
+    drv->lastreport = now.tv_sec;
+
+    elapsed = recon_timesub(&drv->start, &now);
+    if (elapsed <= 0) elapsed = 1;
+    rate = drv->ndone / elapsed;
+    left = drv->njobs - drv->ndone;
+
+    syslog(LOG_NOTICE, "reconstructed %d/%d mailboxes (%d failed) "
+	   "in %.0f seconds: %.1f mailboxes/sec, %.1f msgs/sec, "
+	   "%.0f bytes/sec, %.0f seconds to go",
+	   drv->ndone, drv->njobs, drv->nfailed, elapsed, rate,
+	   drv->messages / elapsed, drv->bytes / elapsed,
+	   rate > 0 ? left / rate : 0);
+    if (!(reconstruct_flags & RECONSTRUCT_QUIET)) {
+	fflush(stdout);
+	fprintf(stderr, "reconstructed %d/%d mailboxes (%d failed) "
+		"in %.0f seconds: %.1f mailboxes/sec, %.1f msgs/sec, "
+		"%.0f bytes/sec, %.0f seconds to go\n",
+		drv->ndone, drv->njobs, drv->nfailed, elapsed, rate,
+		drv->messages / elapsed, drv->bytes / elapsed,
+		rate > 0 ? left / rate : 0);
+    }
+}
+
+/* Account for a finished mailbox */
+static void recon_handle_report(struct recon_driver *drv,
+				struct recon_report *report)
+{
+    struct mailbox *mailbox = NULL;
+    char buf[MAX_MAILBOX_NAME];
+    char *other;
+    int r;
+
+    drv->ndone++;
+
+    if (drv->workers) {
+	struct recon_worker *w = &drv->workers[report->worker];
+
+	w->mailboxes++;
+	w->messages += report->messages;
+	w->bytes += report->bytes;
+	w->busy += report->elapsed;
+    }
+
+    if (report->r) {
+	drv->nfailed++;
+	recon_progress(drv, 0);
+	return;
+    }
+
+    drv->messages += report->messages;
+    drv->bytes += report->bytes;
+
+    other = hash_lookup(report->uniqueid, &unqid_table);
+    if (other) {
+	r = mailbox_open_iwl(report->name, &mailbox);
+	if (r) {
+	    com_err(report->name, r, "Failed to open to change uniqueid");
+	}
+	else {
+	    syslog (LOG_ERR, "uniqueid clash with %s for %s - changing %s",
+		    other, mailbox->uniqueid, mailbox->name);
+	    /* uniqueid change required! */
+	    mailbox_make_uniqueid(mailbox);
+	    strlcpy(report->uniqueid, mailbox->uniqueid,
+		    sizeof(report->uniqueid));
+	    mailbox_close(&mailbox);
+	}
+    }
+
+    hash_insert(report->uniqueid, xstrdup(report->name), &unqid_table);
+
+    /* Convert internal name to external */
+    (*recon_namespace.mboxname_toexternal)(&recon_namespace, report->name,
+					   NULL, buf);
+    if (!(reconstruct_flags & RECONSTRUCT_QUIET))
+	printf("%s\n", buf);
+
+    if (drv->checkpoint)
+	recon_checkpoint_add(drv, report->partition, report->name);
+
+    recon_progress(drv, 0);
+}
+
+static void recon_worker_run(int id, int jobfd, int reportfd)
+{
+    struct recon_job job;
+    struct recon_report report;
+
+    sync_log_init();
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    while (read(jobfd, &job, sizeof(job)) == sizeof(job)) {
+	memset(&report, 0, sizeof(report));
+	report.worker = id;
+
+	recon_run_job(&job, &report);
+
+	if (retry_write(reportfd, &report, sizeof(report)) < 0) {
+	    syslog(LOG_ERR, "reconstruct worker %d: can't report to parent: %m",
+		   id);
+	    break;
+	}
+    }
+
+    sync_log_done();
+
+    mboxlist_close();
+    mboxlist_done();
+
+    quotadb_close();
+    quotadb_done();
+}
+
+/* Fork the workers; this must happen before any database is opened */
+static void recon_start_workers(struct recon_driver *drv)
+{
+    int jobpipe[2], reportpipe[2];
+    int i;
+
+    if (pipe(jobpipe) < 0 || pipe(reportpipe) < 0)
+	fatal("unable to create worker pipes", EC_OSERR);
+
+    drv->workers = xzmalloc(drv->nworkers * sizeof(struct recon_worker));
+    for (i = 0; i < drv->nworkers; i++) {
+	pid_t pid = fork();
+
+	if (pid < 0) fatal("unable to fork worker", EC_OSERR);
+
+	if (pid == 0) {
+	    close(jobpipe[1]);
+	    close(reportpipe[0]);
+	    recon_worker_run(i, jobpipe[0], reportpipe[1]);
+	    cyrus_done();
+	    exit(0);
+	}
+
+	drv->workers[i].pid = pid;
+    }
+    close(jobpipe[0]);
+    close(reportpipe[1]);
+
+    drv->jobfd = jobpipe[1];
+    drv->reportfd = reportpipe[0];
+}
+
+/* Hand out the jobs and collect the reports */
+static void recon_dispatch(struct recon_driver *drv)
+{
+    struct recon_report report;
+    int next = 0, maxfd, n;
+
+    maxfd = drv->jobfd > drv->reportfd ? drv->jobfd : drv->reportfd;
+    if (!drv->njobs) close(drv->jobfd);
+
+    /* the report pipe reads EOF once every worker has exited */
+    for (;;) {
+	fd_set rfds, wfds;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_SET(drv->reportfd, &rfds);
+	if (next < drv->njobs) FD_SET(drv->jobfd, &wfds);
+
+	if (select(maxfd + 1, &rfds, &wfds, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    fatal("select failed waiting for reconstruct workers", EC_OSERR);
+	}
+
+	if (next < drv->njobs && FD_ISSET(drv->jobfd, &wfds)) {
+	    if (retry_write(drv->jobfd, &drv->jobs[next],
+			    sizeof(struct recon_job)) < 0)
+		fatal("unable to queue mailbox", EC_OSERR);
+	    if (++next == drv->njobs) close(drv->jobfd);
+	}
+
+	if (!FD_ISSET(drv->reportfd, &rfds)) continue;
+
+	n = retry_read(drv->reportfd, &report, sizeof(report));
+	if (n <= 0) break;
+	if (n != sizeof(report) ||
+	    report.worker < 0 || report.worker >= drv->nworkers) {
+	    fatal("short report from reconstruct worker", EC_SOFTWARE);
+	}
+
+	recon_handle_report(drv, &report);
+    }
+    if (next < drv->njobs) close(drv->jobfd);
+    close(drv->reportfd);
+}
+
+static void recon_stop_workers(struct recon_driver *drv)
+{
+    struct recon_worker *w;
+    double busy;
+    int i, status;
+
+    for (i = 0; i < drv->nworkers; i++) {
+	w = &drv->workers[i];
+	if (waitpid(w->pid, &status, 0) < 0) continue;
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	    syslog(LOG_ERR, "reconstruct worker %d (pid %d) failed: status %d",
+		   i, (int) w->pid, status);
+	    fprintf(stderr, "reconstruct worker %d (pid %d) failed\n",
+		    i, (int) w->pid);
+	}
+
+	busy = w->busy > 0 ? w->busy : 1;
+	syslog(LOG_INFO, "worker %d: %lu mailboxes, %lu messages, "
+	       "%lu bytes in %.1f seconds (%.1f msgs/sec, %.0f bytes/sec)",
+	       i, w->mailboxes, w->messages, w->bytes,
+	       w->busy, w->messages / busy, w->bytes / busy);
+	if (!(reconstruct_flags & RECONSTRUCT_QUIET)) {
+	    fflush(stdout);
+	    fprintf(stderr, "worker %d: %lu mailboxes, %lu messages, "
+		    "%lu bytes in %.1f seconds (%.1f msgs/sec, "
+		    "%.0f bytes/sec)\n",
+		    i, w->mailboxes, w->messages, w->bytes,
+		    w->busy, w->messages / busy, w->bytes / busy);
+	}
+    }
+
+    free(drv->workers);
+    drv->workers = NULL;
+}
+
+/* Reconstruct everything collected into 'drv' */
+static void recon_run(struct recon_driver *drv)
+{
+    struct recon_report report;
+    int i;
+
+    if (drv->order != RECON_ORDER_NONE)
+	qsort(drv->jobs, drv->njobs, sizeof(struct recon_job),
+	      recon_compare_job);
+
+    syslog(LOG_NOTICE, "reconstructing %d mailboxes with %d workers "
+	   "(%lu already done)", drv->njobs, drv->nworkers, drv->skipped);
+    if (drv->skipped && !(reconstruct_flags & RECONSTRUCT_QUIET)) {
+	fprintf(stderr, "skipping %lu mailboxes done by a previous run\n",
+		drv->skipped);
+    }
+
+    gettimeofday(&drv->start, NULL);
+    drv->lastreport = drv->start.tv_sec;
+
+    if (drv->workers) {
+	recon_dispatch(drv);
+	recon_stop_workers(drv);
+    }
+    else {
+	for (i = 0; i < drv->njobs; i++) {
+	    memset(&report, 0, sizeof(report));
+	    recon_run_job(&drv->jobs[i], &report);
+	    recon_handle_report(drv, &report);
+	}
+    }
+
+    recon_progress(drv, 1);
+
+    /* all done: the next run starts over */
+    if (drv->checkpoint && drv->ndone == drv->njobs && !drv->nfailed) {
+	hash_enumerate(&drv->checkpoints, recon_checkpoint_remove, NULL);
+    }
+    else if (drv->checkpoint) {
+	syslog(LOG_NOTICE, "%d mailboxes not reconstructed; "
+	       "rerun with -c to retry them", drv->njobs - drv->ndone +
+	       drv->nfailed);
+    }
+}
+
+/* ====================================================================== */
+
 int main(int argc, char **argv)
 {
     int opt, i, r;
@@ -146,8 +786,14 @@ int main(int argc, char **argv)
     struct discovered head;
     char *alt_config = NULL;
     char *start_part = NULL;
+    struct recon_driver drv;
+    struct buf pattern = BUF_INITIALIZER;
+    int (*proc)() = do_reconstruct;
+    void *rock;
 
     memset(&head, 0, sizeof(head));
+    memset(&drv, 0, sizeof(drv));
+    drv.nworkers = 1;
 
     if ((geteuid()) == 0 && (become_cyrus() != 0)) {
 	fatal("must run as the Cyrus user", EC_USAGE);
@@ -159,7 +805,7 @@ int main(int argc, char **argv)
 
     construct_hash_table(&unqid_table, 2047, 1);
 
-    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUoOn")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUoOnj:cS:")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
 	    alt_config = optarg;
@@ -225,6 +871,21 @@ int main(int argc, char **argv)
 	    reconstruct_flags |= RECONSTRUCT_REMOVE_ODDFILES;
 	    break;
 
+	case 'j':
+	    drv.nworkers = atoi(optarg);
+	    if (drv.nworkers < 1) usage();
+	    break;
+
+	case 'c':
+	    drv.checkpoint = 1;
+	    break;
+
+	case 'S':
+	    if (!strcmp(optarg, "size")) drv.order = RECON_ORDER_SIZE;
+	    else if (!strcmp(optarg, "access")) drv.order = RECON_ORDER_ACCESS;
+	    else usage();
+	    break;
+
 	default:
 	    usage();
 	}
@@ -239,8 +900,6 @@ int main(int argc, char **argv)
 	fatal(error_message(r), EC_CONFIG);
     }
 
-    sync_log_init();
-
     if (mflag) {
 	if (rflag || fflag || optind != argc) {
 	    cyrus_done();
@@ -249,6 +908,39 @@ int main(int argc, char **argv)
 	do_mboxlist();
     }
 
+    rock = fflag ? &head : NULL;
+
+    /* mailboxes are collected first and then handed out */
+    if (drv.nworkers > 1 || drv.checkpoint || drv.order) {
+	if (fflag) {
+	    fprintf(stderr, "-f can't be used with -j, -c or -S\n");
+	    cyrus_done();
+	    exit(EC_USAGE);
+	}
+	construct_hash_table(&drv.checkpoints, 64, 0);
+	construct_hash_table(&drv.done, 65536, 1);
+	proc = recon_collect;
+	rock = &drv;
+
+	/* what a checkpoint has to match to be resumed from; being
+	 * quiet doesn't change the work */
+	drv.started = time(NULL);
+	drv.flags = reconstruct_flags & ~RECONSTRUCT_QUIET;
+	if (rflag) buf_appendcstr(&pattern, "-r ");
+	for (i = optind; i < argc; i++) {
+	    if (i > optind) buf_putc(&pattern, ' ');
+	    buf_appendcstr(&pattern, argv[i]);
+	}
+	if (optind == argc) buf_appendcstr(&pattern, "*");
+	drv.pattern = xstrdup(buf_cstring(&pattern));
+	buf_free(&pattern);
+
+	/* the workers open their own databases */
+	if (drv.nworkers > 1) recon_start_workers(&drv);
+    }
+
+    sync_log_init();
+
     mboxlist_init(0);
     mboxlist_open(NULL);
 
@@ -324,7 +1016,7 @@ int main(int argc, char **argv)
 	assert(!rflag);
 	strlcpy(buf, "*", sizeof(buf));
 	(*recon_namespace.mboxlist_findall)(&recon_namespace, buf, 1, 0, 0,
-					    do_reconstruct, NULL);
+					    proc, rock);
     }
 
     for (i = optind; i < argc; i++) {
@@ -341,8 +1033,7 @@ int main(int argc, char **argv)
 
 	/* reconstruct the first mailbox/pattern */
 	(*recon_namespace.mboxlist_findall)(&recon_namespace, buf, 1, 0,
-					    0, do_reconstruct, 
-					    fflag ? &head : NULL);
+					    0, proc, rock);
 	if (rflag) {
 	    /* build a pattern for submailboxes */
 	    char *p = strchr(buf, '@');
@@ -354,11 +1045,19 @@ int main(int argc, char **argv)
 
 	    /* reconstruct the submailboxes */
 	    (*recon_namespace.mboxlist_findall)(&recon_namespace, buf, 1, 0,
-						0, do_reconstruct, 
-						fflag ? &head : NULL);
+						0, proc, rock);
 	}
     }
 
+    if (proc == recon_collect) {
+	recon_run(&drv);
+
+	free_hash_table(&drv.checkpoints, recon_checkpoint_free);
+	free_hash_table(&drv.done, NULL);
+	free(drv.jobs);
+	free(drv.pattern);
+    }
+
     /* examine our list to see if we discovered anything */
     while (head.next) {
 	struct discovered *p;
@@ -401,7 +1100,8 @@ int main(int argc, char **argv)
 void usage(void)
 {
     fprintf(stderr,
-	    "usage: reconstruct [-C <alt_config>] [-p partition] [-ksrfx] mailbox...\n");
+	    "usage: reconstruct [-C <alt_config>] [-p partition] [-ksrfx]\n"
+	    "                   [-j workers] [-c] [-S size|access] mailbox...\n");
     fprintf(stderr, "       reconstruct [-C <alt_config>] -m\n");
     exit(EC_USAGE);
 }    
@@ -69,8 +69,51 @@ typedef struct {
   int found_validity;
 } SquatSearchResult;
 
+/* Vectors are padded to a whole number of words so that they can be
+   combined a word at a time rather than a byte at a time. */
+#define VECTOR_WORD sizeof(unsigned long)
+
 static int vector_len(struct index_state *state) {
-  return (state->exists >> 3) + 1;
+  int len = (state->exists >> 3) + 1;
+
+  return (len + VECTOR_WORD - 1) / VECTOR_WORD * VECTOR_WORD;
+}
+
+/* output &= in */
+static void vector_and(unsigned char* output, unsigned char const* in,
+                       int len) {
+  unsigned long* o = (unsigned long*)output;
+  unsigned long const* a = (unsigned long const*)in;
+  int i;
+
+  for (i = 0; i < len / (int)VECTOR_WORD; i++) {
+    o[i] &= a[i];
+  }
+}
+
+/* output &= (in1 | in2) */
+static void vector_and_or(unsigned char* output, unsigned char const* in1,
+                          unsigned char const* in2, int len) {
+  unsigned long* o = (unsigned long*)output;
+  unsigned long const* a = (unsigned long const*)in1;
+  unsigned long const* b = (unsigned long const*)in2;
+  int i;
+
+  for (i = 0; i < len / (int)VECTOR_WORD; i++) {
+    o[i] &= a[i] | b[i];
+  }
+}
+
+/* output |= in */
+static void vector_or(unsigned char* output, unsigned char const* in,
+                      int len) {
+  unsigned long* o = (unsigned long*)output;
+  unsigned long const* a = (unsigned long const*)in;
+  int i;
+
+  for (i = 0; i < len / (int)VECTOR_WORD; i++) {
+    o[i] |= a[i];
+  }
 }
 
 /* The document name is of the form
@@ -145,7 +188,6 @@ static int search_strlist(SquatSearchIndex* index, struct index_state *state,
   unsigned char* output, unsigned char* tmp, struct strlist* strs,
   char const* part_types) {
   SquatSearchResult r;
-  int i;
   int len = vector_len(state);
 
   r.part_types = part_types;
@@ -163,9 +205,7 @@ static int search_strlist(SquatSearchIndex* index, struct index_state *state,
              "with part types %s", s, part_types);
       return 0;
     }
-    for (i = 0; i < len; i++) {
-      output[i] &= tmp[i];
-    }
+    vector_and(output, tmp, len);
 
     strs = strs->next;
   }
@@ -207,7 +247,6 @@ static unsigned char* search_squat_do_query(SquatSearchIndex* index,
       unsigned char* sub1_vect =
         search_squat_do_query(index, state, args->sublist->sub1);
       unsigned char* sub2_vect;
-      int i;
 
       if (sub1_vect == NULL) {
         found_something = 0;
@@ -222,9 +261,7 @@ static unsigned char* search_squat_do_query(SquatSearchIndex* index,
         goto cleanup;
       }
 
-      for (i = 0; i < vlen; i++) {
-        vect[i] &= sub1_vect[i] | sub2_vect[i];
-      }
+      vector_and_or(vect, sub1_vect, sub2_vect, vlen);
 
       free(sub1_vect);
       free(sub2_vect);
@@ -283,9 +320,7 @@ static int search_squat(unsigned* msg_list, struct index_state *state,
       result = -1;
     } else {
       /* Add in any unindexed messages. They must be searched manually. */
-      for (i = 0; i < vlen; i++) {
-        msg_vector[i] |= unindexed_vector[i];
-      }
+      vector_or(msg_vector, unindexed_vector, vlen);
 
       result = 0;
       for (i = 1; i <= state->exists; i++) {
@@ -136,7 +136,7 @@ int seen_open(const char *user,
     /* open the seendb corresponding to user */
     fname = seen_getpath(user);
     if (flags & SEEN_CREATE) cyrus_mkdir(fname, 0755);
-    r = (DB->open)(fname, dbflags, &seendb->db);
+    r = cyrusdb_cachedopen(DB, fname, dbflags, &seendb->db);
     if (r) {
 	if (!(flags & SEEN_SILENT)) {
 	    int level = (flags & SEEN_CREATE) ? LOG_ERR : LOG_DEBUG;
@@ -350,7 +350,7 @@ int seen_close(struct seen **seendbptr)
 	seendb->tid = NULL;
     }
 
-    r = (DB->close)(seendb->db);
+    r = cyrusdb_cachedclose(DB, seendb->db);
     if (r) {
 	syslog(LOG_ERR, "DBERROR: error closing: %s",
 	       cyrusdb_strerror(r));
@@ -69,6 +69,7 @@ struct _SquatSearchIndex {
   unsigned char valid_char_bits[32];  /* which characters are valid in
 					 queries according to whoever
 					 created the index */
+  int         version;                /* file format version, 1 or 2 */
 };
 
 /* For each 0 <= i < 256, bit_counts[i] is the number of bits set in i */
@@ -125,10 +126,18 @@ SquatSearchIndex* squat_search_open(int fd) {
   word_list_offset = squat_decode_64(header->word_list_offset);
   doc_ID_list_offset = squat_decode_64(header->doc_ID_list_offset);
 
+  if (memcmp(header->header_text, squat_index_file_header_v2, 8) == 0) {
+    index->version = 2;
+  } else if (memcmp(header->header_text, squat_index_file_header, 8) == 0) {
+    index->version = 1;
+  } else {
+    squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+    goto cleanup_unmap;
+  }
+
   /* Do some sanity checking in case the header was corrupted. We wouldn't
      want to dereference any bad pointers... */
-  if (memcmp(header->header_text, squat_index_file_header, 8) != 0
-      || doc_list_offset < 0 || doc_list_offset >= data_len
+  if (doc_list_offset < 0 || doc_list_offset >= data_len
       || word_list_offset < 0 || word_list_offset >= data_len
       || doc_ID_list_offset < 0 || doc_ID_list_offset >= data_len
       || !memconst(index->data + data_len, SQUAT_SAFETY_ZONE, 0)) {
@@ -266,6 +275,76 @@ static char const* lookup_word_docs(SquatSearchIndex* index,
   return s;
 }
 
+/* A cursor over the blocks of a version 2 document list. Blocks are
+   stepped over using the skip table and only decoded on request. */
+typedef struct {
+  char const* skip;   /* the next entry in the skip table */
+  char const* block;  /* the current block */
+  char const* end;    /* the end of the document list */
+  int remaining;      /* documents in the blocks after the current one */
+  int prev;           /* last document in the previous block */
+  int last;           /* last document in the current block */
+  int count;          /* documents in the current block */
+  int size;           /* bytes in the current block */
+} SquatBlockList;
+
+/* 'doc_list' points just past the adjusted-run-size, which was 'size'. */
+static int block_list_init(SquatBlockList* l, char const* doc_list,
+                           int size) {
+  char const* s = doc_list;
+  int num_blocks;
+
+  l->end = doc_list + size;
+  l->remaining = (int)squat_decode_I(&s);
+  if (l->remaining <= 0) {
+    return SQUAT_ERR;
+  }
+  num_blocks = (l->remaining + SQUAT_BLOCK_DOCS - 1)/SQUAT_BLOCK_DOCS;
+
+  l->skip = s;
+  l->block = squat_decode_skip_I(s, 2*num_blocks);
+  if (l->block > l->end) {
+    return SQUAT_ERR;
+  }
+  l->prev = l->last = 0;
+  l->count = l->size = 0;
+
+  return SQUAT_OK;
+}
+
+/* Step to the next block. Returns 1 if there is one, 0 at the end of
+   the list and -1 if the list is corrupt. */
+static int block_list_next(SquatBlockList* l) {
+  l->block += l->size;
+  l->prev = l->last;
+
+  if (l->remaining == 0) {
+    return l->block == l->end ? 0 : -1;
+  }
+
+  l->count = l->remaining < SQUAT_BLOCK_DOCS ? l->remaining : SQUAT_BLOCK_DOCS;
+  l->remaining -= l->count;
+  l->last = (int)squat_decode_I(&l->skip);
+  l->size = (int)squat_decode_I(&l->skip);
+
+  if (l->last < l->prev || l->size <= 0 || l->block + l->size > l->end) {
+    return -1;
+  }
+
+  return 1;
+}
+
+/* Decode the current block into 'docs'. */
+static int block_list_decode(SquatBlockList* l, int* docs) {
+  if (squat_decode_block(l->block, l->size, docs, l->count, l->prev)
+        != l->size
+      || docs[l->count - 1] != l->last) {
+    return SQUAT_ERR;
+  }
+
+  return SQUAT_OK;
+}
+
 /* Get the pointer to the list of documents containing 'data' into
    '*run_start', and return the number of documents in the list. */
 static int count_docs_containing_word(SquatSearchIndex* index,
@@ -283,6 +362,17 @@ static int count_docs_containing_word(SquatSearchIndex* index,
   i = (int)squat_decode_I(&raw_doc_list);
   if ((i & 1) != 0) {
     return 1; /* singleton */
+  } else if (index->version >= 2) {
+    /* the count is stored up front */
+    int size = i >> 1;
+    int count;
+
+    if (size <= 0 || raw_doc_list + size >= index->data_end) {
+      return -1;
+    }
+    count = (int)squat_decode_I(&raw_doc_list);
+
+    return count > 0 ? count : -1;
   } else {
     int size = i >> 1;
     char const* s = raw_doc_list;
@@ -326,7 +416,7 @@ typedef struct {
    'doc_list' which refers to 'doc_count' documents.
 */
 static int
-set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
+set_to_docs_containing_word(SquatSearchIndex* index,
 			    SquatDocSet* set,
 			    char const* data __attribute__((unused)),
 			    int doc_count, char const* doc_list)
@@ -339,6 +429,24 @@ set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
   i = (int)squat_decode_I(&doc_list);
   if ((i & 1) != 0) {
     set->array_data[0] = i >> 1;
+  } else if (index->version >= 2) {
+    SquatBlockList l;
+    int j = 0;
+    int r;
+
+    if (block_list_init(&l, doc_list, i >> 1) != SQUAT_OK) {
+      goto corrupt;
+    }
+    while ((r = block_list_next(&l)) > 0) {
+      if (j + l.count > set->array_len
+          || block_list_decode(&l, set->array_data + j) != SQUAT_OK) {
+        goto corrupt;
+      }
+      j += l.count;
+    }
+    if (r < 0 || j != set->array_len) {
+      goto corrupt;
+    }
   } else {
     int size = i >> 1;
     char const* s = doc_list;
@@ -364,6 +472,11 @@ set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
   }
 
   return SQUAT_OK;
+
+corrupt:
+  squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+  free(set->array_data);
+  return SQUAT_ERR;
 }
 
 /* Advance the "current document" in the set to the first document
@@ -387,12 +500,22 @@ static void filter_doc(SquatDocSet* set, int doc) {
   set->index = i;
 }
 
+/* Remove from the set whatever is left after the current document;
+   those documents come after the end of the list being filtered on. */
+static void filter_rest(SquatDocSet* set) {
+  int i;
+
+  for (i = set->index; i < set->array_len; i++) {
+    set->array_data[i] = -1;
+  }
+}
+
 /* Remove from a SquatDocSet any documents not in the list of
    documents containing the word 'data'. The list is extracted from
    the index file data 'doc_list'.
 */
-static void
-filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
+static int
+filter_to_docs_containing_word(SquatSearchIndex* index,
 			       SquatDocSet* set,
 			       char const* data __attribute__((unused)),
 			       char const* doc_list)
@@ -403,6 +526,37 @@ filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
 
   if ((i & 1) != 0) {
     filter_doc(set, i >> 1); 
+  } else if (index->version >= 2) {
+    SquatBlockList l;
+    int docs[SQUAT_BLOCK_DOCS];
+    int r, j;
+
+    if (block_list_init(&l, doc_list, i >> 1) != SQUAT_OK) {
+      return SQUAT_ERR;
+    }
+    while ((r = block_list_next(&l)) > 0) {
+      /* Skip straight past any block that ends before the next document
+	 still in the set; none of it can match. */
+      while (set->index < set->array_len && set->array_data[set->index] < 0) {
+        set->index++;
+      }
+      if (set->index == set->array_len) {
+        break;
+      }
+      if (l.last < set->array_data[set->index]) {
+        continue;
+      }
+
+      if (block_list_decode(&l, docs) != SQUAT_OK) {
+        return SQUAT_ERR;
+      }
+      for (j = 0; j < l.count; j++) {
+        filter_doc(set, docs[j]);
+      }
+    }
+    if (r < 0) {
+      return SQUAT_ERR;
+    }
   } else {
     int size = i >> 1;
     char const* s = doc_list;
@@ -425,6 +579,10 @@ filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
       }
     }
   }
+
+  filter_rest(set);
+
+  return SQUAT_OK;
 }
 
 /* Advance the "current document" pointer to the first document in the set. */
@@ -548,8 +706,11 @@ int squat_search_execute(SquatSearchIndex* index, char const* data,
   /* Scan through the other document lists and throw out any documents
      that aren't in all those lists. */
   for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    if (i != min_doc_count_word) {
-      filter_to_docs_containing_word(index, &set, data + i, run_starts[i]);
+    if (i != min_doc_count_word
+        && filter_to_docs_containing_word(index, &set, data + i,
+                                          run_starts[i]) != SQUAT_OK) {
+      squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+      goto cleanup_docset;
     }
   }
 
@@ -634,7 +795,7 @@ int squat_search_close(SquatSearchIndex* index) {
  *
  */
 
-static int squat_scan_leaf(char const* doc_list, char *name,
+static int squat_scan_leaf(char const* doc_list, int version, char *name,
                            SquatScanCallback handler, void* closure)
 {
   int i;
@@ -642,6 +803,25 @@ static int squat_scan_leaf(char const* doc_list, char *name,
   i = (int)squat_decode_I(&doc_list);
   if ((i & 1) != 0) {
     handler(closure, name, i >> 1);
+  } else if (version >= 2) {
+    SquatBlockList l;
+    int docs[SQUAT_BLOCK_DOCS];
+    int r, j;
+
+    if (block_list_init(&l, doc_list, i >> 1) != SQUAT_OK) {
+      return(SQUAT_ERR);
+    }
+    while ((r = block_list_next(&l)) > 0) {
+      if (block_list_decode(&l, docs) != SQUAT_OK) {
+        return(SQUAT_ERR);
+      }
+      for (j = 0; j < l.count; j++) {
+        handler(closure, name, docs[j]);
+      }
+    }
+    if (r < 0) {
+      return(SQUAT_ERR);
+    }
   } else {
     int size = i >> 1;
     char const* s = doc_list;
@@ -669,7 +849,7 @@ static int squat_scan_leaf(char const* doc_list, char *name,
 }
 
 static int squat_scan_recurse(char const* s, char const* data_end,
-                              char *name, int level,
+                              int version, char *name, int level,
                               SquatScanCallback handler, void* closure)
 {
   int r = SQUAT_OK;
@@ -698,9 +878,10 @@ static int squat_scan_recurse(char const* s, char const* data_end,
       if (next_offset < 0 || s >= data_end) {
         return(SQUAT_ERR);
       }
-      r = squat_scan_recurse(s, data_end, name, level+1, handler, closure);
+      r = squat_scan_recurse(s, data_end, version, name, level+1,
+                             handler, closure);
     } else {
-      r = squat_scan_leaf(s, name, handler, closure);
+      r = squat_scan_leaf(s, version, name, handler, closure);
     }
     return(r);
   }
@@ -746,7 +927,8 @@ static int squat_scan_recurse(char const* s, char const* data_end,
       if (next_offset < 0 || s >= data_end) {
         return(SQUAT_ERR);
       }
-      r = squat_scan_recurse(s, data_end, name, level+1, handler, closure);
+      r = squat_scan_recurse(s, data_end, version, name, level+1,
+                             handler, closure);
     } else {
       /* leaf case. We need to scan through the document lists for each
          leaf to skip. */
@@ -760,7 +942,7 @@ static int squat_scan_recurse(char const* s, char const* data_end,
           s = t + (v >> 1); /* run-list; size is in v>>1 */
         }
       }
-      r = squat_scan_leaf(s, name, handler, closure);
+      r = squat_scan_leaf(s, version, name, handler, closure);
     }
   }
   return(r);
@@ -870,7 +1052,8 @@ int squat_scan(SquatSearchIndex* index, char first_char,
   memset(buf, 0, sizeof(buf));
   buf[0] = first_char;
 
-  return(squat_scan_recurse(s, index->data_end, buf, 1, handler, closure));
+  return(squat_scan_recurse(s, index->data_end, index->version, buf, 1,
+                            handler, closure));
 
   return SQUAT_OK;
 }
@@ -949,6 +1132,6 @@ int squat_count_docs(SquatSearchIndex* index, char first_char, int *counter)
   memset(buf, 0, sizeof(buf));
   buf[0] = first_char;
 
-  return(squat_scan_recurse(s, index->data_end, buf, 1,
+  return(squat_scan_recurse(s, index->data_end, index->version, buf, 1,
                             squat_count_docs_callback, counter));
 }
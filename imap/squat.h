@@ -131,6 +131,7 @@ typedef int       SquatInt32;
 
 /* All SQUAT index files start with this magic 8 bytes */
 extern char const squat_index_file_header[8]; /* "SQUAT 1\n" */
+extern char const squat_index_file_header_v2[8]; /* "SQUAT 2\n" */
 
 /* SQUAT return values */
 #define SQUAT_OK           1
@@ -189,7 +190,8 @@ typedef void (* SquatStatsCallback)(void* closure, SquatStatsEvent* params);
    SQUAT indexing takes space that may be up to 5 times the size of
    the input documents in the worst case (average case is much
    lower!). SQUAT will create hundreds of temporary files in /tmp or
-   the directory you specify.
+   the directory you specify, unless given a memory budget, in which
+   case temporary files are only created once the budget is exceeded.
 
    Once a SquatIndex is successfully initialized, the caller is
    obligated to call "squat_index_destroy" or "squat_index_finish" on
@@ -199,6 +201,8 @@ typedef void (* SquatStatsCallback)(void* closure, SquatStatsEvent* params);
 #define SQUAT_OPTION_VALID_CHARS 0x02  /* The valid_chars options field is valid. */
 #define SQUAT_OPTION_STATISTICS  0x04  /* The stats_callback* options
 					  fields are valid. */
+#define SQUAT_OPTION_MEMORY_BUDGET 0x08 /* The memory_budget options
+					  field is valid. */
 typedef struct {
   int option_mask;                   /* Which options fields have been
 					initialized? */
@@ -225,6 +229,12 @@ typedef struct {
   SquatStatsCallback stats_callback; /* See above */
   void* stats_callback_closure;      /* Private data passed down into
 					the callback function */
+  int memory_budget;                 /* Keep the per-byte word lists
+					in memory rather than in
+					temporary files, spilling
+					them to disk only when they
+					grow beyond this many
+					bytes. */
 } SquatOptions;
 SquatIndex* squat_index_init(int fd, SquatOptions const* options);
 
@@ -87,7 +87,17 @@
 
   Each "all document" trie assumes a fixed first word byte, and
   therefore is only of depth 3. The leaves store the list of document
-  IDs containing the word.
+  IDs containing the word. Its nodes are carved out of a memory pool
+  which is thrown away in one go once the trie has been written out.
+
+  If the caller gives us a memory budget, the per-byte word lists are
+  accumulated in memory instead of in temporary files. When their
+  total size exceeds the budget, they are all appended to their
+  temporary files (created on demand) and the memory is reused.
+  Document IDs only ever increase, so a spilled file followed by the
+  remaining in-memory data is still a single run in document ID order
+  and can be fed into the trie as is. Small mailboxes never touch the
+  disk at all.
 */
 
 #include <config.h>
@@ -102,6 +112,7 @@
 
 #include "assert.h"
 #include "index.h"
+#include "mpool.h"
 #include "xmalloc.h"
 
 /* A simple write-buffering module which avoids copying of the output data. */
@@ -114,6 +125,10 @@ typedef struct {
   int fd;                  /* The fd to write to. */
   int total_output_bytes;  /* How much data have we written out
 			      through this buffer in total? */
+  int in_memory;           /* Grow the buffer rather than writing it
+			      out when it fills up. Any data is
+			      written to 'fd' (if there is one yet)
+			      only when it is explicitly spilled. */
 } SquatWriteBuffer;
 
 static int init_write_buffer(SquatWriteBuffer* b, int buf_size, int fd) {
@@ -122,6 +137,7 @@ static int init_write_buffer(SquatWriteBuffer* b, int buf_size, int fd) {
   b->fd = fd;
   b->data_len = 0;
   b->total_output_bytes = 0;
+  b->in_memory = 0;
 
   return SQUAT_OK;
 }
@@ -129,7 +145,15 @@ static int init_write_buffer(SquatWriteBuffer* b, int buf_size, int fd) {
 /* Make sure that there is enough space in the buffer to write 'len' bytes.
    Return a pointer to where the written data should be placed. */
 static char* prepare_buffered_write(SquatWriteBuffer* b, int len) {
-  if (b->data_len + len >= b->buf_size) {
+  if (b->data_len + len >= b->buf_size && b->in_memory) {
+    int new_size = b->buf_size * 2;
+
+    while (b->data_len + len >= new_size) {
+      new_size *= 2;
+    }
+    b->buf = (char*)xrealloc(b->buf, new_size);
+    b->buf_size = new_size;
+  } else if (b->data_len + len >= b->buf_size) {
     if (write(b->fd, b->buf, b->data_len) != b->data_len) {
       squat_set_last_error(SQUAT_ERR_SYSERR);
       return NULL;
@@ -295,6 +319,14 @@ struct _SquatIndex {
   struct doc_ID_map doc_ID_map;       /* Map doc_IDs in old index to new */
   SquatDocChooserCallback select_doc; /* Decide whether we want doc in new */
   void *select_doc_closure;           /* Data for handler */
+  int memory_budget;                  /* Saved memory_budget option,
+					 or 0 to use temporary files
+					 throughout */
+  struct mpool* trie_pool;            /* Holds the nodes of the "all
+					 documents" trie being built */
+  int* doc_scratch;                   /* Scratch array for flattening
+					 a word's document list */
+  int doc_scratch_size;
 
   /* put the big structures at the end */
 
@@ -475,6 +507,17 @@ SquatIndex* squat_index_init(int fd, SquatOptions const* options) {
     index->stats_callback = NULL;
   }
 
+  if (options != NULL &&
+      (options->option_mask & SQUAT_OPTION_MEMORY_BUDGET) != 0 &&
+      options->memory_budget > 0) {
+    index->memory_budget = options->memory_budget;
+  } else {
+    index->memory_budget = 0;
+  }
+  index->trie_pool = NULL;
+  index->doc_scratch_size = 256;
+  index->doc_scratch = (int*)xmalloc(index->doc_scratch_size*sizeof(int));
+
   /* Finish initializing the SquatIndex */
   for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
     index->index_buffers[i].buf = NULL;
@@ -512,6 +555,7 @@ cleanup_out_buffer:
 
 cleanup_doc_ID_list:
   free(index->doc_ID_list);
+  free(index->doc_scratch);
 
 /*cleanup_tmp_path:*/
   free(index->tmp_path);
@@ -521,33 +565,100 @@ cleanup_doc_ID_list:
   return NULL;
 }
 
-/* Initialize a write buffer for a temporary file. We generate the
-   temporary file name here. The file is unlinked right away so if we
-   crash, the temporary file doesn't need to be cleaned up. */
-static int init_write_buffer_to_temp(SquatIndex* index, SquatWriteBuffer* b) {
+/* Create a temporary file. We generate the temporary file name here.
+   The file is unlinked right away so if we crash, the temporary file
+   doesn't need to be cleaned up. */
+static int open_temp_file(SquatIndex* index) {
   int fd = mkstemp(index->tmp_path);
 
   if (fd < 0) {
     squat_set_last_error(SQUAT_ERR_SYSERR);
-    return SQUAT_ERR;
+    return -1;
   }
 
   if (unlink(index->tmp_path) < 0) {
     squat_set_last_error(SQUAT_ERR_SYSERR);
-    goto cleanup_fd;
+    close(fd);
+    return -1;
   }
   
   strcpy(index->tmp_path + strlen(index->tmp_path) - 6, "XXXXXX");
 
+  return fd;
+}
+
+/* Initialize a write buffer for a temporary file. */
+static int init_write_buffer_to_temp(SquatIndex* index, SquatWriteBuffer* b) {
+  int fd = open_temp_file(index);
+
+  if (fd < 0) {
+    return SQUAT_ERR;
+  }
+
   if (init_write_buffer(b, 64*1024, fd) != SQUAT_OK) {
-    goto cleanup_fd;
+    close(fd);
+    return SQUAT_ERR;
+  }
+
+  return SQUAT_OK;
+}
+
+/* Initialize a write buffer that stays in memory until spilled. */
+#define SQUAT_MEMORY_BUFFER_SIZE 4096
+static int init_write_buffer_in_memory(SquatWriteBuffer* b) {
+  if (init_write_buffer(b, SQUAT_MEMORY_BUFFER_SIZE, -1) != SQUAT_OK) {
+    return SQUAT_ERR;
   }
+  b->in_memory = 1;
 
   return SQUAT_OK;
+}
 
-cleanup_fd:
-  close(fd);
-  return SQUAT_ERR;
+/* How much memory the in-memory word lists are currently using. */
+static int word_buffers_memory(SquatIndex* index) {
+  unsigned i;
+  int total = 0;
+
+  for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
+    if (index->index_buffers[i].buf != NULL
+        && index->index_buffers[i].in_memory) {
+      total += index->index_buffers[i].buf_size;
+    }
+  }
+
+  return total;
+}
+
+/* Append every in-memory word list to its temporary file (creating it
+   if need be) and shrink the buffer back down. */
+static int spill_word_buffers(SquatIndex* index) {
+  unsigned i;
+
+  for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
+    SquatWriteBuffer* b = index->index_buffers + i;
+
+    if (b->buf == NULL || !b->in_memory || b->data_len == 0) {
+      continue;
+    }
+
+    if (b->fd < 0 && (b->fd = open_temp_file(index)) < 0) {
+      return SQUAT_ERR;
+    }
+
+    if (write(b->fd, b->buf, b->data_len) != b->data_len) {
+      squat_set_last_error(SQUAT_ERR_SYSERR);
+      return SQUAT_ERR;
+    }
+    b->data_len = 0;
+
+    if (b->buf_size > SQUAT_MEMORY_BUFFER_SIZE) {
+      free(b->buf);
+      b->buf_size = SQUAT_MEMORY_BUFFER_SIZE;
+      b->buf = xmalloc(b->buf_size);
+    }
+  }
+
+  return SQUAT_OK;
 }
 
 int squat_index_open_document(SquatIndex* index, char const* name) {
@@ -643,6 +754,37 @@ static int set_presence_bit(SquatWordTableLeafPresence* p, int ch) {
   }
 }
 
+/* Allocate a trie node. Nodes of the "all documents" trie (word_entry
+   is non-NULL) come from the trie pool; the "per document" trie is
+   reused from one document to the next, so it uses plain malloc. */
+static void* alloc_trie_node(SquatIndex* index, WordDocEntry* word_entry,
+                             size_t size) {
+  if (word_entry != NULL) {
+    assert(index->trie_pool != NULL);
+    return mpool_malloc(index->trie_pool, size);
+  }
+
+  return xmalloc(size);
+}
+
+/* Start a fresh pool for an "all documents" trie. */
+static void init_trie_pool(SquatIndex* index) {
+  index->trie_pool = new_mpool(64*sizeof(SquatWordTable));
+}
+
+/* Throw away the "all documents" trie in one go. The root table itself
+   is not pool memory, but anything it points to is. */
+static void release_trie_pool(SquatIndex* index) {
+  SquatWordTable* t = index->doc_word_table;
+
+  free_mpool(index->trie_pool);
+  index->trie_pool = NULL;
+
+  t->first_valid_entry = 256;
+  t->last_valid_entry = 0;
+  memset(t->entries, 0, sizeof(t->entries));
+}
+
 /* Add a word to the SquatWordTable trie.
    If word_entry is NULL then we are in "per document" mode and just record
    the presence or absence of a word, not the actual document.
@@ -671,7 +813,8 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
     t = e->table;
     /* Allocate the next branch node if it doesn't already exist. */
     if (t == NULL) {
-      t = (SquatWordTable*)xmalloc(sizeof(SquatWordTable));
+      t = (SquatWordTable*)alloc_trie_node(index, word_entry,
+                                           sizeof(SquatWordTable));
       e->table = t;
       /* Initially there are no valid entries. Set things up so that
 	 the obvious tests will set first_valid_entry and
@@ -742,7 +885,7 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
     /* Make a new leaf table if we don't already have one. */
     if (docs == NULL) {
       docs = (SquatWordTableLeafDocs*)
-        xmalloc(sizeof(SquatWordTableLeafDocs));
+        alloc_trie_node(index, word_entry, sizeof(SquatWordTableLeafDocs));
       docs->first_valid_entry = 256;
       docs->last_valid_entry = 0;
       memset(docs->docs, 0, sizeof(docs->docs));
@@ -1013,9 +1156,14 @@ int squat_index_close_document(SquatIndex* index) {
 
       if (index->index_buffers[i].buf == NULL) {
 	/* This is the first document that used a word starting with this byte.
-	   We need to create the temporary file. */
-        if (init_write_buffer_to_temp(index, index->index_buffers + i)
-            != SQUAT_OK) {
+	   We need to create the temporary file (or its in-memory stand-in). */
+        if (index->memory_budget > 0) {
+          if (init_write_buffer_in_memory(index->index_buffers + i)
+              != SQUAT_OK) {
+            return SQUAT_ERR;
+          }
+        } else if (init_write_buffer_to_temp(index, index->index_buffers + i)
+                   != SQUAT_OK) {
           return SQUAT_ERR;
         }
       }
@@ -1050,6 +1198,14 @@ int squat_index_close_document(SquatIndex* index) {
     }
   }
 
+  /* Keep the in-memory word lists within the budget. */
+  if (index->memory_budget > 0
+      && word_buffers_memory(index) > index->memory_budget) {
+    if (spill_word_buffers(index) != SQUAT_OK) {
+      return SQUAT_ERR;
+    }
+  }
+
   index->current_doc_len = -1;
 
   index->current_doc_ID++;
@@ -1186,7 +1342,9 @@ static int dump_doc_list_present_bits(SquatIndex* index,
   return SQUAT_OK;
 }
 
-/* Write out the document lists for an "all documents" trie leaf. */
+/* Write out the document lists for an "all documents" trie leaf, in
+   the version 2 format: a document count, a skip table with one entry
+   per block, then the bit-packed blocks of document ID deltas. */
 static int dump_doc_list_docs(SquatIndex* index,
                               SquatWordTableLeafDocs* docs) {
   int i;
@@ -1196,44 +1354,46 @@ static int dump_doc_list_docs(SquatIndex* index,
     if (doc_list[i] != NULL) {
       WordDocEntry* first_doc;
       WordDocEntry* doc;
-      int run_size = 0;   /* Bytes required to store the doclist for this word */
-      int last_doc_ID;
-      int run_seq_delta = 0;
-      int run_seq_count;
       int doc_count = 0;  /* number of documents containing this word */
+      int run_size;       /* Bytes required to store the doclist for this word */
+      int* doc_IDs;
+      int block, prev;
       char* buf;
 
+      /* Flatten the circular list into the scratch array */
       doc = first_doc = doc_list[i]->next;
-
-      last_doc_ID = 0;
-      run_seq_count = 0;
-      /* First compute the run_size bytes required to store the doclist */
       do {
-        if (doc->doc_ID == last_doc_ID + 1 && run_seq_count > 0) {
-          run_seq_count++;
-        } else {
-          if (run_seq_count > 0) {
-            if (run_seq_count > 1) {
-              run_size += squat_count_encode_I(run_seq_count << 1)
-                + squat_count_encode_I(run_seq_delta);
-            } else {
-              run_size += squat_count_encode_I((run_seq_delta << 1) | 1);
-            }
-          }
-          run_seq_count = 1;
-          run_seq_delta = doc->doc_ID - last_doc_ID;
+        if (doc_count == index->doc_scratch_size) {
+          index->doc_scratch_size *= 2;
+          index->doc_scratch = (int*)xrealloc(index->doc_scratch,
+                                 index->doc_scratch_size*sizeof(int));
         }
-        last_doc_ID = doc->doc_ID;
+        index->doc_scratch[doc_count++] = doc->doc_ID;
         doc = doc->next;
-        doc_count++;
       } while (doc != first_doc);
-      if (run_seq_count > 0) {
-        if (run_seq_count > 1) {
-          run_size += squat_count_encode_I(run_seq_count << 1)
-            + squat_count_encode_I(run_seq_delta);
-        } else {
-          run_size += squat_count_encode_I((run_seq_delta << 1) | 1);
+      doc_IDs = index->doc_scratch;
+
+      /* If there's only one document, use singleton document format */
+      if (doc_count == 1) {
+        if ((buf = prepare_buffered_write(&index->out, 10)) == NULL) {
+          return SQUAT_ERR;
         }
+        buf = squat_encode_I(buf, (doc_IDs[0] << 1) | 1);
+        complete_buffered_write(&index->out, buf);
+        continue;
+      }
+
+      /* First compute the run_size bytes required to store the doclist */
+      run_size = squat_count_encode_I(doc_count);
+      for (block = 0, prev = 0; block < doc_count; block += SQUAT_BLOCK_DOCS) {
+        int n = doc_count - block;
+        int bytes;
+
+        if (n > SQUAT_BLOCK_DOCS) n = SQUAT_BLOCK_DOCS;
+        bytes = squat_block_size(n, squat_block_width(doc_IDs + block, n, prev));
+        prev = doc_IDs[block + n - 1];
+        run_size += squat_count_encode_I(prev) + squat_count_encode_I(bytes)
+          + bytes;
       }
 
       /* reserve more than enough space in the buffer */
@@ -1242,42 +1402,27 @@ static int dump_doc_list_docs(SquatIndex* index,
         return SQUAT_ERR;
       }
 
-      /* If there's only one document, use singleton document format */
-      if (doc_count == 1) {
-        buf = squat_encode_I(buf, (doc->doc_ID << 1) | 1);
-      } else {
-	/* Store the entire document list, with its size first. */
-        buf = squat_encode_I(buf, run_size << 1);
-
-        last_doc_ID = 0;
-        run_seq_count = 0;
-	/* This logic should mirror the logic above that counts the bytes. */
-        do {
-          if (doc->doc_ID == last_doc_ID + 1 && run_seq_count > 0) {
-            run_seq_count++;
-          } else {
-            if (run_seq_count > 0) {
-              if (run_seq_count > 1) {
-                buf = squat_encode_I(buf, run_seq_count << 1);
-                buf = squat_encode_I(buf, run_seq_delta);
-              } else {
-                buf = squat_encode_I(buf, (run_seq_delta << 1) | 1);
-              }
-            }
-            run_seq_count = 1;
-            run_seq_delta = doc->doc_ID - last_doc_ID;
-          }
-          last_doc_ID = doc->doc_ID;
-          doc = doc->next;
-        } while (doc != first_doc);
-        if (run_seq_count > 0) {
-          if (run_seq_count > 1) {
-            buf = squat_encode_I(buf, run_seq_count << 1);
-            buf = squat_encode_I(buf, run_seq_delta);
-          } else {
-            buf = squat_encode_I(buf, (run_seq_delta << 1) | 1);
-          }
-        }
+      /* Store the entire document list, with its size first. */
+      buf = squat_encode_I(buf, run_size << 1);
+      buf = squat_encode_I(buf, doc_count);
+
+      /* This logic should mirror the logic above that counts the bytes. */
+      for (block = 0, prev = 0; block < doc_count; block += SQUAT_BLOCK_DOCS) {
+        int n = doc_count - block;
+
+        if (n > SQUAT_BLOCK_DOCS) n = SQUAT_BLOCK_DOCS;
+        buf = squat_encode_I(buf, doc_IDs[block + n - 1]);
+        buf = squat_encode_I(buf, squat_block_size(n,
+                squat_block_width(doc_IDs + block, n, prev)));
+        prev = doc_IDs[block + n - 1];
+      }
+      for (block = 0, prev = 0; block < doc_count; block += SQUAT_BLOCK_DOCS) {
+        int n = doc_count - block;
+
+        if (n > SQUAT_BLOCK_DOCS) n = SQUAT_BLOCK_DOCS;
+        buf = squat_encode_block(buf, doc_IDs + block, n, prev,
+                squat_block_width(doc_IDs + block, n, prev));
+        prev = doc_IDs[block + n - 1];
       }
 
       complete_buffered_write(&index->out, buf);
@@ -1289,7 +1434,8 @@ static int dump_doc_list_docs(SquatIndex* index,
 
 /* Write an "all documents" subtrie to the index file.
    'result_offset' is an absolute offset within the file where this
-   subtrie was stored. We free the trie leaves as we go. */
+   subtrie was stored. We unlink the trie nodes as we go; their memory
+   belongs to the trie pool. */
 static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
                                 int* result_offset) {
   int i;
@@ -1309,7 +1455,7 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
             != SQUAT_OK) {
           return SQUAT_ERR;
         }
-        free(entries[i].table);
+        /* the node itself goes when the trie pool is released */
         entries[i].table = NULL;
       } else {
         offsets[i] = 0;
@@ -1327,7 +1473,6 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
             || dump_doc_list_docs(index, leaf_docs) != SQUAT_OK) {
           return SQUAT_ERR;
         }
-        free(entries[i].leaf_docs);
         entries[i].leaf_docs = NULL;
       } else {
         offsets[i] = 0;
@@ -1357,18 +1502,45 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
   return r;
 }
 
-/* Dump out a complete trie for the given initial byte from its temporary file.
-   The absolute offset of the trie's root table within the file is
-   returned in 'result_offset'. */
+/* Feed a run of word records, as written by squat_index_close_document,
+   into the "all documents" trie. Returns the number of words added. */
+static int add_word_run(SquatIndex* index, char const* word_ptr, int len) {
+  char const* end = word_ptr + len;
+  int added = 0;
+
+  while (word_ptr < end) {
+    /* For each document, add all its words to the trie with this document ID */
+    int doc_ID = (int)squat_decode_I(&word_ptr);
+    int doc_words = (int)squat_decode_I(&word_ptr);
+
+    added += doc_words;
+
+    while (doc_words > 0) {
+      add_word_to_trie(index, word_ptr, doc_ID);
+      word_ptr += SQUAT_WORD_SIZE - 1;
+      doc_words--;
+    }
+  }
+
+  /* Make sure we read exactly the bytes that were written. */
+  assert(word_ptr == end);
+
+  return added;
+}
+
+/* Dump out a complete trie for the given initial byte from its temporary
+   file and/or in-memory word list. The absolute offset of the trie's root
+   table within the file is returned in 'result_offset'. */
 static int dump_index_trie_words(SquatIndex* index, int first_char,
                                  int* result_offset) {
   SquatSearchIndex* old_index = index->old_index;
   SquatWriteBuffer* buf = index->index_buffers + first_char;
   int num_words = index->total_num_words[first_char];
+  int file_bytes = buf->total_output_bytes - buf->data_len;
   WordDocEntry* doc_table;
-  char const* word_list_ptr;
+  char const* word_list_ptr = NULL;
   int r = SQUAT_OK;
-  char const* word_ptr;
+  int added = 0;
   int existing = 0;
 
   if (old_index &&
@@ -1379,6 +1551,7 @@ static int dump_index_trie_words(SquatIndex* index, int first_char,
   /* Allocate all the necessary document-ID linked list entries at once. */
   doc_table = (WordDocEntry*)xmalloc(sizeof(WordDocEntry)*(num_words+existing));
   index->word_doc_allocator = doc_table;
+  init_trie_pool(index);
 
   /* Send existing trie across first as those leafs have lowest doc IDs */
   if (old_index) {
@@ -1389,50 +1562,39 @@ static int dump_index_trie_words(SquatIndex* index, int first_char,
     }
   }
 
-  /* mmap the temporary file. */
-  word_list_ptr = mmap(NULL, buf->total_output_bytes, PROT_READ, MAP_SHARED,
-                       buf->fd, 0);
-  if (word_list_ptr == MAP_FAILED) {
-    squat_set_last_error(SQUAT_ERR_SYSERR);
-    r = SQUAT_ERR;
-    goto cleanup;
-  }
-  word_ptr = word_list_ptr;
+  /* mmap the temporary file, if anything went to disk. */
+  if (file_bytes > 0) {
+    word_list_ptr = mmap(NULL, file_bytes, PROT_READ, MAP_SHARED,
+                         buf->fd, 0);
+    if (word_list_ptr == MAP_FAILED) {
+      squat_set_last_error(SQUAT_ERR_SYSERR);
+      r = SQUAT_ERR;
+      goto cleanup;
+    }
 
-  /* Scan through the file */
-  while (num_words > 0) {
-    /* For each document, add all its words to the trie with this document ID */
-    int doc_ID = (int)squat_decode_I(&word_ptr);
-    int doc_words = (int)squat_decode_I(&word_ptr);
-   
-    num_words -= doc_words;
+    added += add_word_run(index, word_list_ptr, file_bytes);
+  }
 
-    while (doc_words > 0) {
-      if (add_word_to_trie(index, word_ptr, doc_ID)
-          != SQUAT_OK) {
-        r = SQUAT_ERR;
-        goto cleanup_map;
-      }
-      word_ptr += SQUAT_WORD_SIZE - 1;
-      doc_words--;
-    }
+  /* Whatever is still in memory comes after the file contents. */
+  if (buf->in_memory && buf->data_len > 0) {
+    added += add_word_run(index, buf->buf, buf->data_len);
   }
 
-  /* Make sure we read all the bytes from the temporary file. */
-  assert(word_ptr - word_list_ptr == buf->total_output_bytes);
+  assert(added == num_words);
  
   /* Now dump the trie to the index file. */
   r = write_trie_word_data(index, index->doc_word_table,
                            SQUAT_WORD_SIZE - 1, result_offset);
 
-cleanup_map:
-  if (munmap((void*)word_list_ptr, buf->total_output_bytes) != 0
-    && r == SQUAT_OK) {
+  if (word_list_ptr != NULL
+      && munmap((void*)word_list_ptr, file_bytes) != 0
+      && r == SQUAT_OK) {
     squat_set_last_error(SQUAT_ERR_SYSERR);
     r = SQUAT_ERR;
   }
 
 cleanup:
+  release_trie_pool(index);
   free(doc_table);
 
   return r;
@@ -1457,6 +1619,7 @@ static int dump_index_trie_words_no_file(SquatIndex* index,
   /* Allocate all the necessary document-ID linked list entries at once. */
   doc_table = (WordDocEntry*)xmalloc(sizeof(WordDocEntry)*existing);
   index->word_doc_allocator = doc_table;
+  init_trie_pool(index);
 
   /* Send existing trie across first as those leafs have lowest doc IDs */
   r = squat_scan(old_index, first_char, add_word_callback, index);
@@ -1472,6 +1635,7 @@ static int dump_index_trie_words_no_file(SquatIndex* index,
   }
 
  cleanup:
+  release_trie_pool(index);
   free(doc_table);
   return r;
 }
@@ -1531,7 +1695,9 @@ static int index_close_internal(SquatIndex* index, int OK) {
       event.completed_initial_char.num_words = index->total_num_words[i];
       if (index->index_buffers[i].buf != NULL) {
         event.completed_initial_char.temp_file_size =
-          index->index_buffers[i].total_output_bytes;
+          index->index_buffers[i].total_output_bytes
+          - (index->index_buffers[i].in_memory
+             ? index->index_buffers[i].data_len : 0);
       } else {
         event.completed_initial_char.temp_file_size = 0;
       }
@@ -1540,15 +1706,18 @@ static int index_close_internal(SquatIndex* index, int OK) {
 
     if (index->index_buffers[i].buf != NULL) {
       /* We have to flush the temporary file output buffer before we try to use
-	 the temporary file. */
-      if (flush_and_reset_buffered_writes(index->index_buffers + i) != SQUAT_OK
+	 the temporary file. In-memory word lists are used where they are. */
+      if ((!index->index_buffers[i].in_memory
+           && flush_and_reset_buffered_writes(index->index_buffers + i)
+              != SQUAT_OK)
           || dump_index_trie_words(index, i, offset_buf + i) != SQUAT_OK) {
         r = SQUAT_ERR;
         goto cleanup;
       }
       /* Close files and free memory as we go. This could be important
 	 if disk space is low and we're generating a huge index. */
-      if (close(index->index_buffers[i].fd) < 0) {
+      if (index->index_buffers[i].fd >= 0
+          && close(index->index_buffers[i].fd) < 0) {
         squat_set_last_error(SQUAT_ERR_SYSERR);
         r = SQUAT_ERR;
       }
@@ -1607,7 +1776,7 @@ static int index_close_internal(SquatIndex* index, int OK) {
     r = SQUAT_ERR;
     goto cleanup;
   }
-  memcpy(header->header_text, squat_index_file_header, 8);
+  memcpy(header->header_text, squat_index_file_header_v2, 8);
   squat_encode_64(header->doc_list_offset, doc_list_offset);
   squat_encode_64(header->doc_ID_list_offset, doc_ID_list_offset);
   squat_encode_64(header->word_list_offset, word_list_offset);
@@ -1630,12 +1799,15 @@ cleanup:
      released all the temporary file resources. */
   for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
     if (index->index_buffers[i].buf != NULL) {
-      close(index->index_buffers[i].fd);
+      if (index->index_buffers[i].fd >= 0) {
+        close(index->index_buffers[i].fd);
+      }
       free(index->index_buffers[i].buf);
     }
   }
   free(index->tmp_path);
   free(index->doc_ID_list);
+  free(index->doc_scratch);
   doc_ID_map_free(&index->doc_ID_map);
   free(index);
 
@@ -49,6 +49,7 @@
 static int last_err = SQUAT_ERR_OK;
 
 char const squat_index_file_header[8] = "SQUAT 1\n";
+char const squat_index_file_header_v2[8] = "SQUAT 2\n";
 
 void squat_set_last_error(int err) {
   last_err = err;
@@ -193,3 +194,82 @@ char* squat_encode_I(char* s, SquatInt64 v64) {
   return s + 2;
 }
 
+int squat_block_width(int const* docs, int count, int prev) {
+  unsigned max_delta = 0;
+  int width = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    unsigned delta = (unsigned)(docs[i] - prev);
+
+    max_delta |= delta;
+    prev = docs[i];
+  }
+  while (max_delta != 0) {
+    width++;
+    max_delta >>= 1;
+  }
+
+  return width;
+}
+
+int squat_block_size(int count, int width) {
+  return 1 + (count*width + 7)/8;
+}
+
+char* squat_encode_block(char* s, int const* docs, int count, int prev,
+                         int width) {
+  unsigned long long acc = 0;
+  int bits = 0;
+  int i;
+
+  *s++ = (char)width;
+  for (i = 0; i < count; i++) {
+    acc |= (unsigned long long)(unsigned)(docs[i] - prev) << bits;
+    bits += width;
+    prev = docs[i];
+    while (bits >= 8) {
+      *s++ = (char)(acc & 0xFF);
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) {
+    *s++ = (char)(acc & 0xFF);
+  }
+
+  return s;
+}
+
+int squat_decode_block(char const* s, int size, int* docs, int count,
+                       int prev) {
+  unsigned char const* p = (unsigned char const*)s;
+  int width;
+  unsigned long long acc = 0;
+  unsigned long long mask;
+  int bits = 0;
+  int i;
+
+  /* the width comes from the file: check it before reading on */
+  if (size < 1) {
+    return -1;
+  }
+  width = *p++;
+  if (width > 32 || squat_block_size(count, width) != size) {
+    return -1;
+  }
+  mask = (1ULL << width) - 1;
+
+  for (i = 0; i < count; i++) {
+    while (bits < width) {
+      acc |= (unsigned long long)*p++ << bits;
+      bits += 8;
+    }
+    prev += (int)(acc & mask);
+    docs[i] = prev;
+    acc >>= width;
+    bits -= width;
+  }
+
+  return squat_block_size(count, width);
+}
@@ -103,10 +103,13 @@
 
 #define SQUAT_SAFETY_ZONE 16
 
+/* Number of documents in each packed block of a version 2 doc list */
+#define SQUAT_BLOCK_DOCS 128
+
 /* The format of a SQUAT index file. This record is stored at the
    beginning of the file. */
 typedef struct {
-  char header_text[8];       /* "SQUAT 1\n" */
+  char header_text[8];       /* "SQUAT 1\n" or "SQUAT 2\n" */
   char doc_list_offset[8];   /* offset to a doc-list structure (see below) */
   char doc_ID_list_offset[8];/* offset to a doc-ID-list structure (see below) */
   char word_list_offset[8];  /* offset to a word-list structure (see below) */
@@ -159,6 +162,22 @@ typedef struct {
 
    The last SQUAT_SAFETY_ZONE bytes of the index file must be 0.
    This helps protect us against corrupt index files.
+
+   Version 2 files ("SQUAT 2\n") are identical except for the document
+   lists of words that occur in more than one document:
+
+   <index-run> = I"adjusted-single-index"
+               | I"adjusted-run-size" I"doc-count" <skip-entry>* <block>*
+   <skip-entry> = I"last-index-in-block" I"block-size"
+   <block> = 8"bit-width" <packed-deltas>
+
+   The documents are split into blocks of SQUAT_BLOCK_DOCS (the last
+   block may be shorter), with one skip entry per block. Each block
+   stores the differences between consecutive document indices (the
+   first relative to the last index of the previous block, or to 0),
+   packed least significant bit first into bit-width bits each. The
+   skip entries let a reader step over whole blocks without decoding
+   them, and give the document count without reading the list at all.
 */
 
 void squat_set_last_error(int err);
@@ -195,4 +214,20 @@ char* squat_encode_I(char* s, SquatInt64 v);
 /* We return the number of bytes required to encode the given value. */
 int squat_count_encode_I(SquatInt64 v64);
 
+/* Bit-packed blocks of document index deltas, for version 2 doc lists.
+   squat_block_width returns the number of bits needed for the largest
+   delta in 'docs' (which are absolute, increasing indices following
+   'prev'); squat_block_size returns the number of bytes the encoded
+   block takes, including its bit-width byte. */
+int squat_block_width(int const* docs, int count, int prev);
+int squat_block_size(int count, int width);
+/* We return a pointer past the encoded block. */
+char* squat_encode_block(char* s, int const* docs, int count, int prev,
+                         int width);
+/* Decode 'count' documents into 'docs' from the 'size' bytes at 's'.
+   Returns the number of bytes consumed, or -1 if the block is corrupt
+   or its width doesn't fit 'size'; nothing past 's + size' is read. */
+int squat_decode_block(char const* s, int size, int* docs, int count,
+                       int prev);
+
 #endif
@@ -81,6 +81,10 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "annotate.h"
 #include "assert.h"
@@ -98,6 +102,7 @@
 #include "map.h"
 #include "squat.h"
 #include "index.h"
+#include "retry.h"
 #include "util.h"
 
 /* global state */
@@ -125,6 +130,7 @@ static int verbose = 0;
 static int mailbox_count = 0;
 static int skip_unmodified = 0;
 static int incremental_mode = 0;
+static int memory_budget = 0;
 static SquatStats total_stats;
 
 static void start_stats(SquatStats* stats) {
@@ -145,10 +151,20 @@ static void print_stats(FILE* out, SquatStats* stats) {
           stats->index_size, (int) (stats->end_time - stats->start_time));
 }
 
+/* ru_maxrss is in kilobytes on the platforms that fill it in */
+static void print_peak_memory(FILE* out) {
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0 && ru.ru_maxrss > 0) {
+    fprintf(out, "Peak memory use: %ld kilobytes\n", (long) ru.ru_maxrss);
+  }
+}
+
 static int usage(const char *name)
 {
     fprintf(stderr,
-	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [mailbox...]\n",
+	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [-j <workers>]"
+	    " [-M <megabytes>] [mailbox...]\n",
 	    name);
  
     exit(EC_USAGE);
@@ -371,6 +387,23 @@ static void stats_callback(void* closure __attribute__((unused)),
   }
 }
 
+/* Ask the kernel to start reading a message file that we are about to
+   index, so the disk read overlaps with feeding the previous message
+   through the trie builder. */
+static void prefetch_message(struct mailbox *mailbox, unsigned long uid)
+{
+#ifdef POSIX_FADV_WILLNEED
+    char *fname = mailbox_message_fname(mailbox, uid);
+    int fd;
+
+    if (!fname) return;
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
 /* Squat a single open mailbox */
 static int squat_single(struct index_state *state, int incremental)
 {
@@ -401,6 +434,10 @@ static int squat_single(struct index_state *state, int incremental)
     options.tmp_path = mailbox_datapath(mailbox);
     options.stats_callback = stats_callback;
     options.stats_callback_closure = NULL;
+    if (memory_budget) {
+	options.option_mask |= SQUAT_OPTION_MEMORY_BUDGET;
+	options.memory_budget = memory_budget;
+    }
     data.index = squat_index_init(new_index_fd, &options);
     if (data.index == NULL)
 	fatal_squat_error("Initializing index");
@@ -474,6 +511,15 @@ static int squat_single(struct index_state *state, int incremental)
 	if ((uid_item->uid == uid) && uid_item->flagged)
 	    continue;
 
+	/* Start reading the next message that will need indexing */
+	if (msgno < state->exists) {
+	    unsigned nextuid = state->map[msgno].record.uid;
+	    struct uid_item *next = find_uid_item(&uid_info, nextuid);
+
+	    if (!next || !next->flagged)
+		prefetch_message(mailbox, nextuid);
+	}
+
 	/* This UID didn't appear in the old index file */
 	index_getsearchtext_single(state, msgno, search_text_receiver, &data);
 	uid_item->flagged = 1;
@@ -662,11 +708,294 @@ static int addmbox(char *name,
     return 0;
 }
 
+/* ====================================================================== */
+
+/* Parallel mode.
+
+   The parent sorts the mailboxes largest-first and feeds their names
+   through a pipe to a pool of worker processes.  Each worker pulls the
+   next name as soon as it is done with the previous one, so the big
+   mailboxes get started early and the small ones fill in the gaps at
+   the end.  SQUAT is not thread-safe, so each worker is a separate
+   process building its own (independent) per-mailbox indexes.
+
+   Workers send a fixed-size report back to the parent after every
+   mailbox.  Both records are smaller than PIPE_BUF, so writes to the
+   shared pipes are atomic and need no further locking. */
+
+struct squat_job {
+    unsigned long size;
+    char name[MAX_MAILBOX_BUFFER];
+};
+
+struct squat_report {
+    int worker;
+    unsigned long indexed_messages;
+    unsigned long indexed_bytes;
+    unsigned long index_size;
+    double elapsed;
+    char name[MAX_MAILBOX_BUFFER];
+};
+
+struct squat_worker {
+    pid_t pid;
+    int mailboxes;
+    unsigned long indexed_messages;
+    unsigned long indexed_bytes;
+    double busy;
+};
+
+static double timesub(struct timeval *start, struct timeval *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+	   (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int compare_job_size(const void *a, const void *b)
+{
+    const struct squat_job *ja = (const struct squat_job *) a;
+    const struct squat_job *jb = (const struct squat_job *) b;
+
+    if (ja->size < jb->size) return 1;
+    if (ja->size > jb->size) return -1;
+    return strcmp(ja->name, jb->name);
+}
+
+/* Use the size of the cache file as a cheap estimate of how much work
+   a mailbox will be, without having to open it */
+static unsigned long mailbox_size_estimate(const char *name)
+{
+    struct mboxlist_entry mbentry;
+    struct stat sbuf;
+    char *path;
+
+    if (mboxlist_lookup(name, &mbentry, NULL)) return 0;
+    if (mbentry.mbtype & MBTYPE_REMOTE) return 0;
+
+    path = mboxname_metapath(mbentry.partition, name, META_CACHE, 0);
+    if (!path || stat(path, &sbuf)) return 0;
+
+    return sbuf.st_size;
+}
+
+static void squat_worker_run(int id, int jobfd, int reportfd, int *use_annot)
+{
+    struct squat_job job;
+    struct squat_report report;
+    struct timeval start, end;
+    SquatStats before;
+
+    /* per-mailbox chatter from several processes at once is unreadable;
+       the parent reports progress, workers only talk at -vv and above */
+    if (verbose) verbose--;
+
+    annotatemore_init(0, NULL, NULL);
+    annotatemore_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    while (read(jobfd, &job, sizeof(job)) == sizeof(job)) {
+	before = total_stats;
+	gettimeofday(&start, NULL);
+
+	index_me(job.name, 0, 0, use_annot);
+
+	gettimeofday(&end, NULL);
+
+	memset(&report, 0, sizeof(report));
+	report.worker = id;
+	report.indexed_messages =
+	    total_stats.indexed_messages - before.indexed_messages;
+	report.indexed_bytes = total_stats.indexed_bytes - before.indexed_bytes;
+	report.index_size = total_stats.index_size - before.index_size;
+	report.elapsed = timesub(&start, &end);
+	strlcpy(report.name, job.name, sizeof(report.name));
+
+	if (retry_write(reportfd, &report, sizeof(report)) < 0) {
+	    syslog(LOG_ERR, "squatter worker %d: can't report to parent: %m",
+		   id);
+	    break;
+	}
+    }
+
+    seen_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+}
+
+static void squat_parallel(struct tmplist *l, int nworkers, int *use_annot)
+{
+    struct tmpnode *current;
+    struct squat_job *jobs;
+    struct squat_worker *workers;
+    struct squat_report report;
+    struct timeval start, end;
+    int jobpipe[2], reportpipe[2];
+    int njobs = 0, next = 0, done = 0;
+    int i, n, maxfd, status;
+    double elapsed;
+
+    for (current = l->head; current; current = current->next)
+	njobs++;
+    if (!njobs) return;
+
+    /* Size up and order the work while we still have the databases open */
+    jobs = xzmalloc(njobs * sizeof(struct squat_job));
+    for (i = 0, current = l->head; current; current = current->next, i++) {
+	strlcpy(jobs[i].name, current->name, sizeof(jobs[i].name));
+	jobs[i].size = mailbox_size_estimate(current->name);
+    }
+    qsort(jobs, njobs, sizeof(struct squat_job), compare_job_size);
+
+    if (nworkers > njobs) nworkers = njobs;
+
+    if (verbose > 0) {
+	printf("Indexing %d mailboxes with %d workers\n", njobs, nworkers);
+    }
+    syslog(LOG_INFO, "indexing %d mailboxes with %d workers",
+	   njobs, nworkers);
+
+    /* The children open their own database handles */
+    mboxlist_close();
+    annotatemore_close();
+
+    if (pipe(jobpipe) < 0 || pipe(reportpipe) < 0)
+	fatal_syserror("Unable to create worker pipes");
+
+    workers = xzmalloc(nworkers * sizeof(struct squat_worker));
+    for (i = 0; i < nworkers; i++) {
+	pid_t pid = fork();
+
+	if (pid < 0) fatal_syserror("Unable to fork worker");
+
+	if (pid == 0) {
+	    close(jobpipe[1]);
+	    close(reportpipe[0]);
+	    squat_worker_run(i, jobpipe[0], reportpipe[1], use_annot);
+	    cyrus_done();
+	    exit(0);
+	}
+
+	workers[i].pid = pid;
+    }
+    close(jobpipe[0]);
+    close(reportpipe[1]);
+
+    gettimeofday(&start, NULL);
+
+    /* Hand out jobs as the pipe drains and collect reports as they
+       arrive; the report pipe reads EOF once every worker has exited */
+    maxfd = jobpipe[1] > reportpipe[0] ? jobpipe[1] : reportpipe[0];
+    for (;;) {
+	fd_set rfds, wfds;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_SET(reportpipe[0], &rfds);
+	if (next < njobs) FD_SET(jobpipe[1], &wfds);
+
+	if (select(maxfd + 1, &rfds, &wfds, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    fatal_syserror("select");
+	}
+
+	if (next < njobs && FD_ISSET(jobpipe[1], &wfds)) {
+	    if (retry_write(jobpipe[1], &jobs[next], sizeof(struct squat_job)) < 0)
+		fatal_syserror("Unable to queue mailbox");
+	    if (++next == njobs) close(jobpipe[1]);
+	}
+
+	if (!FD_ISSET(reportpipe[0], &rfds)) continue;
+
+	n = retry_read(reportpipe[0], &report, sizeof(report));
+	if (n <= 0) break;
+	if (n != sizeof(report) ||
+	    report.worker < 0 || report.worker >= nworkers) {
+	    fatal("short report from squatter worker", EC_SOFTWARE);
+	}
+
+	done++;
+	workers[report.worker].mailboxes++;
+	workers[report.worker].indexed_messages += report.indexed_messages;
+	workers[report.worker].indexed_bytes += report.indexed_bytes;
+	workers[report.worker].busy += report.elapsed;
+	total_stats.indexed_messages += report.indexed_messages;
+	total_stats.indexed_bytes += report.indexed_bytes;
+	total_stats.index_size += report.index_size;
+	mailbox_count++;
+
+	if (verbose > 0) {
+	    char extname[MAX_MAILBOX_BUFFER];
+
+	    (*squat_namespace.mboxname_toexternal)(&squat_namespace,
+						   report.name, NULL, extname);
+	    printf("[%d/%d] worker %d indexed %s: %lu messages "
+		   "(%lu bytes) in %.2f seconds\n",
+		   done, njobs, report.worker, extname,
+		   report.indexed_messages, report.indexed_bytes,
+		   report.elapsed);
+	}
+    }
+    if (next < njobs) close(jobpipe[1]);
+    close(reportpipe[0]);
+
+    for (i = 0; i < nworkers; i++) {
+	if (waitpid(workers[i].pid, &status, 0) < 0) continue;
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	    syslog(LOG_ERR, "squatter worker %d (pid %d) failed: status %d",
+		   i, (int) workers[i].pid, status);
+	    fprintf(stderr, "squatter worker %d (pid %d) failed\n",
+		    i, (int) workers[i].pid);
+	}
+    }
+
+    gettimeofday(&end, NULL);
+    elapsed = timesub(&start, &end);
+
+    for (i = 0; i < nworkers; i++) {
+	struct squat_worker *w = &workers[i];
+	double busy = w->busy > 0 ? w->busy : 1;
+
+	syslog(LOG_INFO, "worker %d: %d mailboxes, %lu messages, "
+	       "%lu bytes in %.1f seconds (%.1f msgs/sec, %.0f bytes/sec)",
+	       i, w->mailboxes, w->indexed_messages, w->indexed_bytes,
+	       w->busy, w->indexed_messages / busy, w->indexed_bytes / busy);
+	if (verbose > 0) {
+	    printf("Worker %d: %d mailboxes, %lu messages, %lu bytes "
+		   "in %.1f seconds (%.1f msgs/sec, %.0f bytes/sec)\n",
+		   i, w->mailboxes, w->indexed_messages, w->indexed_bytes,
+		   w->busy, w->indexed_messages / busy,
+		   w->indexed_bytes / busy);
+	}
+    }
+    if (verbose > 0 && elapsed > 0) {
+	printf("Aggregate throughput: %.1f msgs/sec, %.0f bytes/sec "
+	       "over %.1f seconds\n",
+	       total_stats.indexed_messages / elapsed,
+	       total_stats.indexed_bytes / elapsed, elapsed);
+    }
+
+    if (done < njobs) {
+	syslog(LOG_ERR, "only %d of %d mailboxes were indexed", done, njobs);
+    }
+
+    free(workers);
+    free(jobs);
+
+    /* Reopen for the caller's cleanup */
+    annotatemore_open(NULL);
+    mboxlist_open(NULL);
+}
+
 int main(int argc, char **argv)
 {
     int opt;
     char *alt_config = NULL;
     int rflag = 0, use_annot = 0;
+    int nworkers = 1;
     int i;
     char buf[MAX_MAILBOX_PATH+1];
     int r;
@@ -677,7 +1006,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:rsiav")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rsiavj:M:")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
           alt_config = optarg;
@@ -703,6 +1032,17 @@ int main(int argc, char **argv)
 	  use_annot = 1;
 	  break;
 
+	case 'j': /* parallel workers */
+	  nworkers = atoi(optarg);
+	  if (nworkers < 1) usage("squatter");
+	  break;
+
+	case 'M': /* build in memory, up to this many MB */
+	  memory_budget = atoi(optarg);
+	  if (memory_budget < 1 || memory_budget > 2047) usage("squatter");
+	  memory_budget *= 1024 * 1024;
+	  break;
+
 	default:
 	    usage("squatter");
 	}
@@ -725,37 +1065,68 @@ int main(int argc, char **argv)
 
     start_stats(&total_stats);
 
-    if (optind == argc) {
-        struct tmplist *l;
-        struct tmpnode *current;
+    if (nworkers > 1) {
+	struct tmplist *l;
 
-        l = xmalloc(sizeof(struct tmplist));
-        l->head = l->tail = NULL;
+	l = xmalloc(sizeof(struct tmplist));
+	l->head = l->tail = NULL;
 
-	if (rflag) {
-	    fprintf(stderr, "please specify a mailbox to recurse from\n");
-	    exit(EC_USAGE);
+	if (optind == argc) {
+	    if (rflag) {
+		fprintf(stderr, "please specify a mailbox to recurse from\n");
+		exit(EC_USAGE);
+	    }
+	    strlcpy(buf, "*", sizeof(buf));
+	    (*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
+						0, 0, addmbox, &l);
 	}
-	assert(!rflag);
-	strlcpy(buf, "*", sizeof(buf));
-	(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
-					    0, 0, addmbox, &l);
-
-        for (current = l->head; current; current = current->next) {
-            index_me(current->name, strlen(current->name), 0, &use_annot);
-            /* Ignore errors: most will be mailboxes moving around */
-        }
+
+	for (i = optind; i < argc; i++) {
+	    (*squat_namespace.mboxname_tointernal)(&squat_namespace, argv[i],
+						   NULL, buf);
+	    addmbox(buf, 0, 0, &l);
+	    if (rflag) {
+		strlcat(buf, ".*", sizeof(buf));
+		(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
+						    0, 0, addmbox, &l);
+	    }
+	}
+
+	squat_parallel(l, nworkers, &use_annot);
     }
+    else {
+	if (optind == argc) {
+	    struct tmplist *l;
+	    struct tmpnode *current;
+
+	    l = xmalloc(sizeof(struct tmplist));
+	    l->head = l->tail = NULL;
 
-    for (i = optind; i < argc; i++) {
-	/* Translate any separators in mailboxname */
-	(*squat_namespace.mboxname_tointernal)(&squat_namespace, argv[i],
-					       NULL, buf);
-	index_me(buf, 0, 0, &use_annot);
-	if (rflag) {
-	    strlcat(buf, ".*", sizeof(buf));
+	    if (rflag) {
+		fprintf(stderr, "please specify a mailbox to recurse from\n");
+		exit(EC_USAGE);
+	    }
+	    assert(!rflag);
+	    strlcpy(buf, "*", sizeof(buf));
 	    (*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
-						0, 0, index_me, &use_annot);
+						0, 0, addmbox, &l);
+
+	    for (current = l->head; current; current = current->next) {
+		index_me(current->name, strlen(current->name), 0, &use_annot);
+		/* Ignore errors: most will be mailboxes moving around */
+	    }
+	}
+
+	for (i = optind; i < argc; i++) {
+	    /* Translate any separators in mailboxname */
+	    (*squat_namespace.mboxname_tointernal)(&squat_namespace, argv[i],
+						   NULL, buf);
+	    index_me(buf, 0, 0, &use_annot);
+	    if (rflag) {
+		strlcat(buf, ".*", sizeof(buf));
+		(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
+						    0, 0, index_me, &use_annot);
+	    }
 	}
     }
 
@@ -764,6 +1135,9 @@ int main(int argc, char **argv)
       printf("Total over all mailboxes: ");
       print_stats(stdout, &total_stats);
     }
+    if (verbose > 0 && nworkers == 1) {
+      print_peak_memory(stdout);
+    }
 
     syslog(LOG_NOTICE, "done indexing mailboxes");
 
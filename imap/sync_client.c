@@ -92,6 +92,9 @@
 #include "xstrlcpy.h"
 #include "signals.h"
 #include "cyrusdb.h"
+#include "crc32.h"
+#include "hash.h"
+#include "retry.h"
 
 /* signal to config.c */
 const int config_need_data = CONFIG_NEED_PARTITION_DATA;
@@ -116,12 +119,21 @@ static int connect_once    = 0;
 static int background      = 0;
 static int do_compress     = 0;
 
+enum {
+    CAPA_PIPELINING	= (1 << 3),
+    CAPA_INVENTORY	= (1 << 4),
+    CAPA_CRCRANGES	= (1 << 5)
+};
+
 static struct protocol_t csync_protocol =
 { "csync", "csync",
   { 1, "* OK" },
   { NULL, NULL, "* OK", NULL,
     { { "* SASL ", CAPA_AUTH },
       { "* STARTTLS", CAPA_STARTTLS },
+      { "* PIPELINING", CAPA_PIPELINING },
+      { "* INVENTORY", CAPA_INVENTORY },
+      { "* CRCRANGES", CAPA_CRCRANGES },
       { NULL, 0 } } },
   { "STARTTLS", "OK", "NO", 1 },
   { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
@@ -131,12 +143,178 @@ static struct protocol_t csync_protocol =
 };
 
 static int do_meta(char *user);
+static void stop_shards(void);
+
+/* ====================================================================== */
+
+/* Pipelined APPLY commands.
+ *
+ * Between pipeline_begin() and pipeline_end() send_apply() tags each
+ * command and goes on without waiting for the answer, up to
+ * sync_pipeline_window commands ahead.  Answers are matched up by tag,
+ * so the replica may return them in any order.  An error is returned
+ * by whichever later call collects it, except that a failed command
+ * sent on behalf of a folder (its MESSAGE upload or MAILBOX update)
+ * notes that folder on the retry list, for the caller to redo one at a
+ * time with a full update.  Nothing else may be sent while commands
+ * are in flight: lookups call pipeline_flush() first. */
+
+struct pipeline_cmd {
+    unsigned tag;
+    char *cmd;
+    char *uniqueid;		/* folder commands only */
+    char *mboxname;
+    struct pipeline_cmd *next;
+};
+
+static struct {
+    int window;			/* 0 if the replica can't pipeline */
+    int active;
+    unsigned tag;
+    int count;
+    struct pipeline_cmd *head;
+    struct pipeline_cmd **tailp;
+    struct sync_name_list *retry;
+} pipeline;
+
+static void pipeline_free(struct pipeline_cmd *p)
+{
+    free(p->cmd);
+    free(p->uniqueid);
+    free(p->mboxname);
+    free(p);
+}
+
+static void pipeline_reset(void)
+{
+    struct pipeline_cmd *p;
+
+    while ((p = pipeline.head)) {
+	pipeline.head = p->next;
+	pipeline_free(p);
+    }
+    pipeline.tailp = &pipeline.head;
+    pipeline.count = 0;
+}
+
+/* collect one answer */
+static int pipeline_wait(void)
+{
+    static struct buf tag;
+    struct pipeline_cmd **pp, *p;
+    unsigned long t;
+    int c, r;
+
+    prot_flush(sync_out);
+
+    c = getword(sync_in, &tag);
+    if (c == EOF) {
+	syslog(LOG_ERR, "IOERROR: connection lost with %d commands pending",
+	       pipeline.count);
+	pipeline_reset();
+	return IMAP_PROTOCOL_ERROR;
+    }
+
+    t = strtoul(tag.s, NULL, 10);
+    for (pp = &pipeline.head; *pp; pp = &(*pp)->next)
+	if ((*pp)->tag == t) break;
+
+    if (c != ' ' || !Uisdigit(tag.s[0]) || !*pp) {
+	/* out of step with the replica, nothing more can be trusted */
+	syslog(LOG_ERR, "IOERROR: unexpected response tag '%s'", tag.s);
+	eatline(sync_in, c);
+	pipeline_reset();
+	return IMAP_PROTOCOL_ERROR;
+    }
+
+    p = *pp;
+    *pp = p->next;
+    if (pipeline.tailp == &p->next) pipeline.tailp = pp;
+    pipeline.count--;
+
+    r = sync_parse_response(p->cmd, sync_in, NULL);
+    if (r && r != IMAP_PROTOCOL_ERROR && p->uniqueid && pipeline.retry) {
+	/* answer for the folder that sent it, not whoever collected it */
+	syslog(LOG_ERR, "%s failed on sync for %s (%s), trying full update",
+	       p->cmd, p->mboxname, error_message(r));
+	if (!sync_name_lookup(pipeline.retry, p->uniqueid))
+	    sync_name_list_add(pipeline.retry, p->uniqueid);
+	r = 0;
+    }
+
+    pipeline_free(p);
+
+    return r;
+}
+
+/* collect every outstanding answer, returning the first error */
+static int pipeline_flush(void)
+{
+    int r = 0, r2;
+
+    while (pipeline.count) {
+	r2 = pipeline_wait();
+	if (!r) r = r2;
+    }
+
+    return r;
+}
+
+static void pipeline_begin(struct sync_name_list *retry)
+{
+    if (pipeline.window <= 1) return;
+
+    pipeline.active = 1;
+    pipeline.retry = retry;
+}
+
+static int pipeline_end(void)
+{
+    int r = pipeline_flush();
+
+    pipeline.active = 0;
+    pipeline.retry = NULL;
+
+    return r;
+}
+
+static int send_apply(struct dlist *kl, struct sync_folder *folder)
+{
+    struct pipeline_cmd *p;
+    int r = 0;
+
+    if (!pipeline.active) {
+	sync_send_apply(kl, sync_out);
+	return sync_parse_response(kl->name, sync_in, NULL);
+    }
+
+    if (pipeline.count >= pipeline.window)
+	r = pipeline_wait();
+
+    p = xzmalloc(sizeof(struct pipeline_cmd));
+    p->tag = ++pipeline.tag;
+    p->cmd = xstrdup(kl->name);
+    if (folder) {
+	p->uniqueid = xstrdup(folder->uniqueid);
+	p->mboxname = xstrdup(folder->name);
+    }
+    *pipeline.tailp = p;
+    pipeline.tailp = &p->next;
+    pipeline.count++;
+
+    /* sync_send_apply flushes; the answer is collected later */
+    prot_printf(sync_out, "%u ", p->tag);
+    sync_send_apply(kl, sync_out);
+
+    return r;
+}
 
 static void shut_down(int code) __attribute__((noreturn));
 static void shut_down(int code)
 {
     in_shutdown = 1;
 
+    stop_shards();
     seen_done();
     annotatemore_close();
     annotatemore_done();
@@ -299,6 +477,109 @@ static int mark_missing (struct dlist *kin,
     return 0;
 }
 
+/* The replica's GUID inventory (sync_inventory), fetched at most once
+ * per connection.  Only GUIDs the filter says the replica probably has
+ * are worth asking it to find. */
+static struct {
+    int state;			/* 0 = not fetched, -1 = unavailable */
+    uint32_t nbits;
+    unsigned char *filter;
+} inventory;
+
+static void inventory_reset(void)
+{
+    free(inventory.filter);
+    memset(&inventory, 0, sizeof(inventory));
+}
+
+static int inventory_load(void)
+{
+    const char *cmd = "INVENTORY";
+    struct dlist *kl;
+    struct dlist *kin = NULL;
+    const char *filter;
+    size_t len;
+    uint32_t nbits;
+    int r;
+
+    inventory.state = -1;
+
+    if (!config_getswitch(IMAPOPT_SYNC_INVENTORY) ||
+	!CAPA(sync_backend, CAPA_INVENTORY))
+	return 0;
+
+    kl = dlist_kvlist(NULL, cmd);
+    sync_send_lookup(kl, sync_out);
+    dlist_free(&kl);
+
+    r = sync_parse_response(cmd, sync_in, &kin);
+    if (r) return r;
+
+    kl = kin->head;
+    if (kl && dlist_getnum(kl, "BITS", &nbits) && nbits &&
+	dlist_getbuf(kl, "FILTER", &filter, &len) && len == nbits / 8) {
+	inventory.filter = xmalloc(len);
+	memcpy(inventory.filter, filter, len);
+	inventory.nbits = nbits;
+	inventory.state = 1;
+    }
+    else
+	syslog(LOG_ERR, "SYNCERROR: unusable INVENTORY response");
+
+    dlist_free(&kin);
+
+    return 0;
+}
+
+/* ask the replica to look anywhere for GUIDs not found in the user's
+ * own folders */
+static int reserve_inventory(char *partition,
+			     struct sync_msgid_list *part_list)
+{
+    const char *cmd = "RESERVE";
+    struct sync_msgid *msgid;
+    struct dlist *kl;
+    struct dlist *kin = NULL;
+    struct dlist *ki;
+    int n = 0;
+    int r = 0;
+
+    if (!inventory.state) {
+	r = inventory_load();
+	if (r) return r;
+    }
+    if (inventory.state < 0)
+	return 0;
+
+    kl = dlist_new(cmd);
+    dlist_atom(kl, "PARTITION", partition);
+    dlist_list(kl, "MBOXNAME");
+
+    ki = dlist_list(kl, "GUID");
+    for (msgid = part_list->head; msgid; msgid = msgid->next) {
+	if (msgid->mark)
+	    continue;
+	if (!sync_inventory_test(inventory.filter, inventory.nbits,
+				 &msgid->guid))
+	    continue;
+	dlist_atom(ki, "GUID", message_guid_encode(&msgid->guid));
+	msgid->mark = 1;
+	part_list->marked++;
+	n++;
+    }
+
+    if (n) {
+	sync_send_apply(kl, sync_out);
+	r = sync_parse_response(cmd, sync_in, &kin);
+	if (!r) r = mark_missing(kin, part_list);
+	dlist_free(&kin);
+    }
+
+    dlist_free(&kl);
+
+    return r;
+}
+
 static int reserve_partition(char *partition,
 			     struct sync_folder_list *replica_folders,
 			     struct sync_msgid_list *part_list)
@@ -309,13 +590,13 @@ static int reserve_partition(char *partition,
     struct dlist *kl;
     struct dlist *kin = NULL;
     struct dlist *ki;
-    int r;
+    int r = 0;
 
     if (!part_list->count)
 	return 0; /* nothing to reserve */
 
     if (!replica_folders->head)
-	return 0; /* nowhere to reserve */
+	goto elsewhere; /* nothing of this user's to reserve from */
 
     kl = dlist_new(cmd);
     dlist_atom(kl, "PARTITION", partition);
@@ -339,6 +620,11 @@ static int reserve_partition(char *partition,
 
     r = mark_missing(kin, part_list);
     dlist_free(&kin);
+    if (r) return r;
+
+ elsewhere:
+    if (part_list->marked < part_list->count)
+	r = reserve_inventory(partition, part_list);
 
     return r;
 }
@@ -509,18 +795,20 @@ static int folder_delete(char *mboxname)
 {
     const char *cmd = "UNMAILBOX";
     struct dlist *kl;
+    int r;
 
     kl = dlist_atom(NULL, cmd, mboxname);
-    sync_send_apply(kl, sync_out);
+    r = send_apply(kl, NULL);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 static int set_sub(const char *userid, const char *mboxname, int add)
 {
     const char *cmd = add ? "SUB" : "UNSUB";
     struct dlist *kl;
+    int r;
 
     if (verbose) 
         printf("%s %s %s\n", cmd, userid, mboxname);
@@ -531,10 +819,10 @@ static int set_sub(const char *userid, const char *mboxname, int add)
     kl = dlist_new(cmd);
     dlist_atom(kl, "USERID", userid);
     dlist_atom(kl, "MBOXNAME", mboxname);
-    sync_send_apply(kl, sync_out);
+    r = send_apply(kl, NULL);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 static int folder_setannotation(const char *mboxname, const char *entry,
@@ -1021,21 +1309,37 @@ static int compare_one_record(struct mailbox *mailbox,
 }
 
 
+/* with 'ranges', the replica only sent the records in those ranges
+ * and everything outside them is known to match */
 static int mailbox_update_loop(struct mailbox *mailbox,
 			       struct dlist *ki,
 			       uint32_t last_uid,
 			       modseq_t highestmodseq,
+			       const struct seq_range *ranges,
+			       int nranges,
 			       struct dlist *kaction)
 {
     struct index_record mrecord;
     struct index_record rrecord;
     uint32_t recno = 1;
     uint32_t old_num_records = mailbox->i.num_records;
+    int range = 0;
     int r;
 
     /* while there are more records on either master OR replica,
      * work out what to do with them */
     while (ki || recno <= old_num_records) {
+	if (ranges && recno <= old_num_records) {
+	    r = mailbox_read_index_record(mailbox, recno, &mrecord);
+	    if (r) return r;
+	    while (range < nranges && mrecord.uid > ranges[range].high)
+		range++;
+	    if (range == nranges || mrecord.uid < ranges[range].low) {
+		recno++;
+		continue;
+	    }
+	}
+
 	/* most common case - both a master AND a replica record exist */
 	if (ki && recno <= old_num_records) {
 	    r = mailbox_read_index_record(mailbox, recno, &mrecord);
@@ -1122,6 +1426,156 @@ static int mailbox_update_loop(struct mailbox *mailbox,
     return 0;
 }
 
+static int local_crc_ranges(const char *mboxname,
+			    const struct seq_range *ranges, int nranges,
+			    uint32_t *crcs, uint32_t *last_uidp)
+{
+    struct mailbox *mailbox = NULL;
+    int r;
+
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r) return r;
+
+    r = sync_crc_ranges(mailbox, ranges, nranges, crcs);
+    if (last_uidp) *last_uidp = mailbox->i.last_uid;
+    mailbox_close(&mailbox);
+
+    return r;
+}
+
+static int remote_crc_ranges(const char *mboxname,
+			     const struct seq_range *ranges, int nranges,
+			     uint32_t *crcs)
+{
+    const char *cmd = "CRCRANGES";
+    struct dlist *kin = NULL;
+    struct dlist *kl;
+    struct dlist *ki;
+    int i = 0;
+    int r;
+
+    kl = dlist_kvlist(NULL, cmd);
+    dlist_atom(kl, "MBOXNAME", mboxname);
+    sync_print_ranges(kl, "RANGES", ranges, nranges);
+    sync_send_lookup(kl, sync_out);
+    dlist_free(&kl);
+
+    r = sync_parse_response(cmd, sync_in, &kin);
+    if (r) return r;
+
+    r = IMAP_PROTOCOL_BAD_PARAMETERS;
+    if (!kin->head || !dlist_getlist(kin->head, "CRC", &kl))
+	goto done;
+    for (ki = kl->head; ki && i < nranges; ki = ki->next)
+	crcs[i++] = ki->nval;
+    if (!ki && i == nranges)
+	r = 0;
+
+ done:
+    dlist_free(&kin);
+    return r;
+}
+
+static void add_range(struct seq_range **rangesp, int *np, int *allocp,
+		      uint32_t low, uint32_t high)
+{
+    if (*np == *allocp) {
+	*allocp += 64;
+	*rangesp = xrealloc(*rangesp, *allocp * sizeof(struct seq_range));
+    }
+    (*rangesp)[*np].low = low;
+    (*rangesp)[*np].high = high;
+    (*np)++;
+}
+
+static void split_range(struct seq_range **rangesp, int *np, int *allocp,
+			uint32_t low, uint32_t high)
+{
+    uint32_t width = (high - low) / SYNC_CRC_FANOUT + 1;
+
+    while (high - low >= width) {
+	add_range(rangesp, np, allocp, low, low + width - 1);
+	low += width;
+    }
+    add_range(rangesp, np, allocp, low, high);
+}
+
+/*
+ * Find the UID ranges where the records here and on the replica
+ * differ, by comparing CRCs over ever smaller ranges.  Everything
+ * past our LAST_UID is one range, it can only hold records which
+ * exist just on the replica.
+ */
+static int crc_ranges_differ(const char *mboxname,
+			     struct seq_range **diffp, int *ndiffp)
+{
+    struct seq_range *ranges = NULL, *next = NULL, *diff = NULL;
+    int nranges = 0, nnext = 0, ndiff = 0;
+    int aranges = 0, anext = 0, adiff = 0;
+    uint32_t *lcrcs = NULL, *rcrcs = NULL;
+    uint32_t last_uid;
+    int rounds = 0;
+    int i;
+    int r;
+
+    r = local_crc_ranges(mboxname, NULL, 0, NULL, &last_uid);
+    if (r) return r;
+
+    if (last_uid)
+	split_range(&ranges, &nranges, &aranges, 1, last_uid);
+    if (last_uid < UINT32_MAX)
+	add_range(&ranges, &nranges, &aranges, last_uid + 1, UINT32_MAX);
+
+    while (nranges) {
+	rounds++;
+	lcrcs = xrealloc(lcrcs, nranges * sizeof(uint32_t));
+	rcrcs = xrealloc(rcrcs, nranges * sizeof(uint32_t));
+
+	r = local_crc_ranges(mboxname, ranges, nranges, lcrcs, NULL);
+	if (!r) r = remote_crc_ranges(mboxname, ranges, nranges, rcrcs);
+	if (r) goto done;
+
+	nnext = 0;
+	for (i = 0; i < nranges; i++) {
+	    if (lcrcs[i] == rcrcs[i])
+		continue;
+	    if (ranges[i].low > last_uid ||
+		ranges[i].high - ranges[i].low < SYNC_CRC_LEAF)
+		add_range(&diff, &ndiff, &adiff,
+			  ranges[i].low, ranges[i].high);
+	    else
+		split_range(&next, &nnext, &anext,
+			    ranges[i].low, ranges[i].high);
+	}
+
+	/* next round */
+	free(ranges);
+	ranges = next;
+	nranges = nnext;
+	aranges = anext;
+	next = NULL;
+	anext = 0;
+    }
+
+    syslog(LOG_NOTICE, "SYNCNOTICE: %s differs from replica in %d UID "
+	   "ranges, found in %d rounds", mboxname, ndiff, rounds);
+
+ done:
+    free(ranges);
+    free(next);
+    free(lcrcs);
+    free(rcrcs);
+    if (r) {
+	free(diff);
+	return r;
+    }
+    /* an empty list still means "only these" */
+    if (!diff) diff = xmalloc(sizeof(struct seq_range));
+    *diffp = diff;
+    *ndiffp = ndiff;
+    return 0;
+}
+
 static int mailbox_full_update(const char *mboxname)
 {
     const char *cmd = "FULLMAILBOX";
@@ -1134,11 +1588,26 @@ static int mailbox_full_update(const char *mboxname)
     struct dlist *kl = NULL;
     struct dlist *kaction = NULL;
     struct dlist *kexpunge = NULL;
+    struct seq_range *ranges = NULL;
+    int nranges = 0;
     modseq_t highestmodseq;
     uint32_t uidvalidity;
     uint32_t last_uid;
 
-    kl = dlist_atom(NULL, cmd, mboxname);
+    /* answers to anything pipelined come first */
+    r = pipeline_flush();
+    if (r) return r;
+
+    /* only fetch the parts of a big mailbox which differ */
+    if (CAPA(sync_backend, CAPA_CRCRANGES)) {
+	r = crc_ranges_differ(mboxname, &ranges, &nranges);
+	if (r) return r;
+	kl = dlist_kvlist(NULL, cmd);
+	dlist_atom(kl, "MBOXNAME", mboxname);
+	sync_print_ranges(kl, "RANGES", ranges, nranges);
+    }
+    else
+	kl = dlist_atom(NULL, cmd, mboxname);
     sync_send_lookup(kl, sync_out);
     dlist_free(&kl);
 
@@ -1209,7 +1678,7 @@ static int mailbox_full_update(const char *mboxname)
     }
 
     r = mailbox_update_loop(mailbox, kr->head, last_uid,
-			    highestmodseq, NULL);
+			    highestmodseq, ranges, nranges, NULL);
     if (r) {
 	syslog(LOG_ERR, "SYNCNOTICE: failed to prepare update for %s: %s",
 	       mailbox->name, error_message(r));
@@ -1220,7 +1689,7 @@ static int mailbox_full_update(const char *mboxname)
 
     kaction = dlist_list(NULL, "ACTION");
     r = mailbox_update_loop(mailbox, kr->head, last_uid,
-			    highestmodseq, kaction);
+			    highestmodseq, ranges, nranges, kaction);
     if (r) goto cleanup;
 
     /* if replica still has a higher last_uid, bump our local
@@ -1271,6 +1740,7 @@ done:
     dlist_free(&kin);
     dlist_free(&kaction);
     dlist_free(&kexpunge);
+    free(ranges);
     return r;
 }
 
@@ -1354,8 +1824,7 @@ static int update_mailbox_once(struct sync_folder *local,
 	 * but don't close it, because we need to guarantee that message 
 	 * files don't get deleted until we're finished with them... */
 	mailbox_unlock_index(mailbox, NULL);
-	sync_send_apply(kupload, sync_out);
-	r = sync_parse_response("MESSAGE", sync_in, NULL);
+	r = send_apply(kupload, local);
 	if (!r) {
 	    /* update our list of reserved messages on the replica */
 	    struct dlist *ki;
@@ -1373,9 +1842,8 @@ static int update_mailbox_once(struct sync_folder *local,
     /* close before sending the apply - all data is already read */
     mailbox_close(&mailbox);
 
-    /* update the mailbox */
-    sync_send_apply(kl, sync_out);
-    r = sync_parse_response("MAILBOX", sync_in, NULL);
+    /* update the mailbox, unless its messages didn't make it */
+    if (!r) r = send_apply(kl, local);
 
 done:
     if (mailbox) mailbox_close(&mailbox);
@@ -1412,6 +1880,7 @@ static int update_seen_work(const char *user, const char *uniqueid,
 {
     const char *cmd = "SEEN";
     struct dlist *kl;
+    int r;
 
     /* Update seen list */
     kl = dlist_new(cmd);
@@ -1421,10 +1890,10 @@ static int update_seen_work(const char *user, const char *uniqueid,
     dlist_num(kl, "LASTUID", sd->lastuid);
     dlist_date(kl, "LASTCHANGE", sd->lastchange);
     dlist_atom(kl, "SEENUIDS", sd->seenuids);
-    sync_send_apply(kl, sync_out);
+    r = send_apply(kl, NULL);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 static int do_seen(char *user, char *uniqueid)
@@ -1590,9 +2059,12 @@ int do_folders(struct sync_name_list *mboxname_list,
     struct sync_folder_list *master_folders;
     struct sync_rename_list *rename_folders;
     struct sync_reserve_list *reserve_guids;
+    struct sync_name_list *crc_folders;
     struct sync_folder *mfolder, *rfolder;
+    struct sync_name *item;
 
     master_folders = sync_folder_list_create();
+    crc_folders = sync_name_list_create();
     rename_folders = sync_rename_list_create();
     reserve_guids = sync_reserve_list_create(SYNC_MSGID_LIST_HASH_SIZE);
 
@@ -1667,6 +2139,7 @@ int do_folders(struct sync_name_list *mboxname_list,
 	}
     }
 
+    pipeline_begin(crc_folders);
     for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
 	/* NOTE: rfolder->name may now be wrong, but we're guaranteed that
 	 * it was successfully renamed above, so just use mfolder->name for
@@ -1679,8 +2152,29 @@ int do_folders(struct sync_name_list *mboxname_list,
 	    goto bail;
 	}
     }
+    r = pipeline_end();
+    if (r) {
+	syslog(LOG_ERR, "do_folders(): update failed: %s",
+	       error_message(r));
+	goto bail;
+    }
+
+    /* pipelined updates which failed */
+    for (item = crc_folders->head; item; item = item->next) {
+	mfolder = sync_folder_lookup(master_folders, item->name);
+	rfolder = sync_folder_lookup(replica_folders, item->name);
+	r = mailbox_full_update(mfolder->name);
+	if (!r) r = update_mailbox_once(mfolder, rfolder, reserve_guids, 1);
+	if (r) {
+	    syslog(LOG_ERR, "do_folders(): update failed: %s '%s'", 
+		   mfolder->name, error_message(r));
+	    goto bail;
+	}
+    }
 
  bail:
+    pipeline_end();
+    sync_name_list_free(&crc_folders);
     sync_folder_list_free(&master_folders);
     sync_rename_list_free(&rename_folders);
     sync_reserve_list_free(&reserve_guids);
@@ -1835,12 +2329,14 @@ int do_user_sub(const char *userid, struct sync_name_list *replica_subs)
 {
     struct sync_name_list *master_subs = sync_name_list_create();
     struct sync_name *msubs, *rsubs;
-    int r = 0;
+    int r = 0, r2;
 
     /* Includes subsiduary nodes automatically */
     r = mboxlist_allsubs(userid, addmbox_sub, master_subs);
     if (r) goto bail;
 
+    pipeline_begin(NULL);
+
     /* add any folders that need adding, and mark any which
      * still exist */
     for (msubs = master_subs->head; msubs; msubs = msubs->next) {
@@ -1862,6 +2358,8 @@ int do_user_sub(const char *userid, struct sync_name_list *replica_subs)
     }
 
  bail:
+    r2 = pipeline_end();
+    if (!r) r = r2;
     sync_name_list_free(&master_subs);
     return r;
 }
@@ -1878,7 +2376,7 @@ static int get_seen(const char *uniqueid, struct seendata *sd, void *rock)
 
 static int do_user_seen(char *user, struct sync_seen_list *replica_seen)
 {
-    int r;
+    int r, r2;
     struct sync_seen *mseen, *rseen;
     struct seen *seendb = NULL;
     struct sync_seen_list *list;
@@ -1892,6 +2390,7 @@ static int do_user_seen(char *user, struct sync_seen_list *replica_seen)
     seen_foreach(seendb, get_seen, list);
     seen_close(&seendb);
 
+    pipeline_begin(NULL);
     for (mseen = list->head; mseen; mseen = mseen->next) {
 	rseen = sync_seen_list_lookup(replica_seen, mseen->uniqueid);
 	if (rseen) {
@@ -1900,13 +2399,16 @@ static int do_user_seen(char *user, struct sync_seen_list *replica_seen)
 		continue; /* nothing changed */
 	}
 	r = update_seen_work(user, mseen->uniqueid, &mseen->sd);
+	if (r) break;
     }
+    r2 = pipeline_end();
+    if (!r) r = r2;
 
     /* XXX - delete seen on the replica for records that don't exist? */
 
     sync_seen_list_free(&list);
 
-    return 0;
+    return r;
 }
 
 int do_user_sieve(char *userid, struct sync_sieve_list *replica_sieve)
@@ -2415,12 +2917,12 @@ enum {
     RESTART_RECONNECT
 };
 
-int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
+int do_daemon_work(const char *sync_log_file, const char *work_file_name,
+		   const char *sync_shutdown_file,
 		   unsigned long timeout, unsigned long min_delta,
 		   int *restartp)
 {
     int r = 0;
-    char *work_file_name;
     time_t session_start;
     time_t single_start;
     int    delta;
@@ -2428,12 +2930,6 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
 
     *restartp = RESTART_NONE;
 
-    /* Create a work log filename.  Use the PID so we can
-     * try to reprocess it if the sync fails */
-    work_file_name = xmalloc(strlen(sync_log_file)+20);
-    snprintf(work_file_name, strlen(sync_log_file)+20,
-             "%s-%d", sync_log_file, getpid());
-
     session_start = time(NULL);
 
     while (1) {
@@ -2499,7 +2995,6 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
         if (((unsigned) delta < min_delta) && ((min_delta-delta) > 0))
             sleep(min_delta-delta);
     }
-    free(work_file_name);
 
     if (*restartp == RESTART_NORMAL) {
 	prot_printf(sync_out, "RESTART\r\n"); 
@@ -2534,6 +3029,10 @@ static int get_intconfig(const char *channel, const char *val)
     if (response == -1) {
 	if (!strcmp(val, "sync_repeat_interval"))
 	    response = config_getint(IMAPOPT_SYNC_REPEAT_INTERVAL);
+	else if (!strcmp(val, "sync_shards"))
+	    response = config_getint(IMAPOPT_SYNC_SHARDS);
+	else if (!strcmp(val, "sync_pipeline_window"))
+	    response = config_getint(IMAPOPT_SYNC_PIPELINE_WINDOW);
     }
 
     return response;
@@ -2672,6 +3171,8 @@ void replica_connect(const char *channel)
 	else {
 	    prot_setcompress(sync_backend->in);
 	    prot_setcompress(sync_backend->out);
+	    prot_setcompresslevel(sync_backend->out,
+				  config_getint(IMAPOPT_SYNC_COMPRESS_LEVEL));
         }
     }
 #endif
@@ -2680,6 +3181,11 @@ void replica_connect(const char *channel)
     sync_in = sync_backend->in;
     sync_out = sync_backend->out;
 
+    pipeline_reset();
+    pipeline.window = CAPA(sync_backend, CAPA_PIPELINING) ?
+	get_intconfig(channel, "sync_pipeline_window") : 0;
+    inventory_reset();
+
     /* Force use of LITERAL+ so we don't need two way communications */
     prot_setisclient(sync_in, 1);
     prot_setisclient(sync_out, 1);
@@ -2691,17 +3197,28 @@ static void replica_disconnect()
     backend_disconnect(sync_backend);
 }
 
-void do_daemon(const char *sync_log_file, const char *sync_shutdown_file,
+void do_daemon(const char *sync_log_file, const char *work_file_name,
+	       const char *sync_shutdown_file,
 	       const char *channel, unsigned long timeout, unsigned long min_delta)
 {
     int r = 0;
     int restart = 1;
+    char *pid_file_name = NULL;
 
     signal(SIGPIPE, SIG_IGN); /* don't fail on server disconnects */
 
+    if (!work_file_name) {
+	/* Create a work log filename.  Use the PID so we can
+	 * try to reprocess it if the sync fails */
+	pid_file_name = xmalloc(strlen(sync_log_file)+20);
+	snprintf(pid_file_name, strlen(sync_log_file)+20,
+		 "%s-%d", sync_log_file, getpid());
+	work_file_name = pid_file_name;
+    }
+
     while (restart) {
 	replica_connect(channel);
-	r = do_daemon_work(sync_log_file, sync_shutdown_file,
+	r = do_daemon_work(sync_log_file, work_file_name, sync_shutdown_file,
 			   timeout, min_delta, &restart);
 	if (r) {
 	    /* See if we're still connected to the server.
@@ -2712,6 +3229,449 @@ void do_daemon(const char *sync_log_file, const char *sync_shutdown_file,
 	}
 	replica_disconnect();
     }
+
+    free(pid_file_name);
+}
+
+/* ====================================================================== */
+
+/*
+ * Sharded rolling replication (sync_shards > 1).
+ *
+ * The parent process no longer talks to the replica.  It takes the
+ * sync log as before, drops duplicate lines and appends each record to
+ * one of N shard logs, chosen by a hash of the user the record is
+ * about, so everything for one user stays in order in one place.  Both
+ * lines of a rename go by the source, even when the owner changes, as
+ * do other MAILBOX records for the new name in the same batch, so one
+ * worker sees them together and can RENAME on the replica.
+ * Each shard log is worked by its own child, which is an ordinary
+ * rolling sync_client with its own replica connection, work file,
+ * reconnect and restart logic.  A child that dies is started again
+ * after a delay that doubles with each failure, so one broken user
+ * holds up only the users that hash alongside it.
+ */
+struct sync_shard {
+    char *log;		/* the parent appends here */
+    char *work;		/* the child renames the log to this */
+    pid_t pid;
+    time_t respawn;	/* not before */
+    int backoff;
+    struct buf pending;
+    ino_t ino;		/* shard log we last appended to */
+    time_t queued;	/* oldest record still in 'log' */
+    time_t working;	/* oldest record in 'work' */
+};
+
+static struct sync_shard *sync_shards = NULL;
+static int sync_nshards = 0;
+
+#define SHARD_BACKOFF_MIN 15
+#define SHARD_BACKOFF_MAX 960
+#define SHARD_REPORT_INTERVAL 60
+
+static void stop_shards(void)
+{
+    int i;
+
+    for (i = 0; i < sync_nshards; i++) {
+	if (sync_shards[i].pid > 0) kill(sync_shards[i].pid, SIGQUIT);
+    }
+    for (i = 0; i < sync_nshards; i++) {
+	if (sync_shards[i].pid > 0) waitpid(sync_shards[i].pid, NULL, 0);
+	sync_shards[i].pid = 0;
+    }
+}
+
+/* Which shard does a sync log record belong to?  The second line of a
+ * rename ("MAILBOX new old") goes with the first, by its source name;
+ * 'renamed' is then set to the new name.  Other records for a name in
+ * 'moved' go to the shard recorded there. */
+static int shard_of(const char *line, int len, hash_table *moved,
+		    struct buf *renamed)
+{
+    static struct buf type, arg1, arg2;
+    struct protstream *input;
+    char name[MAX_MAILBOX_BUFFER];
+    const char *key, *deletedprefix;
+    char *start, *p;
+    void *rock;
+    size_t plen;
+    int c;
+
+    input = prot_readmap(line, len);
+    c = getword(input, &type);
+    buf_reset(&arg1);
+    buf_reset(&arg2);
+    if (c == ' ') c = getastring(input, 0, &arg1);
+    if (c == ' ') getastring(input, 0, &arg2);
+    prot_free(input);
+
+    ucase(type.s);
+    key = buf_cstring(&arg1);
+    if (renamed) buf_reset(renamed);
+    if (!strcmp(type.s, "MAILBOX")) {
+	if (arg2.len) {
+	    if (renamed) buf_copy(renamed, &arg1);
+	    key = buf_cstring(&arg2);
+	}
+	else if (moved && (rock = hash_lookup(key, moved))) {
+	    return (unsigned long) rock - 1;
+	}
+    }
+
+    if (strcmp(type.s, "USER") && strcmp(type.s, "META") &&
+	strcmp(type.s, "SIEVE") && strcmp(type.s, "SEEN") &&
+	strcmp(type.s, "SUB") && strcmp(type.s, "UNSUB")) {
+	/* MAILBOX, QUOTA, ANNOTATION: find the owner, looking
+	 * through the deleted namespace */
+	strlcpy(name, key, sizeof(name));
+	start = name;
+	if (config_virtdomains && (p = strchr(name, '!'))) start = p + 1;
+	deletedprefix = config_getstring(IMAPOPT_DELETEDPREFIX);
+	plen = strlen(deletedprefix);
+	if (mboxlist_delayed_delete_isenabled() &&
+	    !strncmp(start, deletedprefix, plen) && start[plen] == '.') {
+	    memmove(start, start + plen + 1, strlen(start + plen + 1) + 1);
+	}
+
+	if (!(key = mboxname_to_userid(name))) {
+	    /* shared mailboxes go by their top level */
+	    if ((p = strchr(start, '.'))) *p = '\0';
+	    key = name;
+	}
+    }
+
+    return crc32_cstring(key) % sync_nshards;
+}
+
+/* Append a batch of records to a shard log, the same way sync_log does */
+static int shard_append(struct sync_shard *shard)
+{
+    struct stat sbuffile, sbuffd;
+    int fd = -1, retries = 0;
+
+    while (retries++ < SYNC_LOG_RETRIES) {
+	fd = open(shard->log, O_WRONLY|O_APPEND|O_CREAT, 0640);
+	if (fd < 0 && errno == ENOENT) {
+	    if (!cyrus_mkdir(shard->log, 0755)) {
+		fd = open(shard->log, O_WRONLY|O_APPEND|O_CREAT, 0640);
+	    }
+	}
+	if (fd < 0) {
+	    syslog(LOG_ERR, "Failed to open %s: %m", shard->log);
+	    return IMAP_IOERROR;
+	}
+
+	if (lock_blocking(fd) == -1) {
+	    syslog(LOG_ERR, "Failed to lock %s: %m", shard->log);
+	    close(fd);
+	    return IMAP_IOERROR;
+	}
+
+	/* Check that the worker didn't take it while we were waiting */
+	if ((fstat(fd, &sbuffd) == 0) &&
+	    (stat(shard->log, &sbuffile) == 0) &&
+	    (sbuffd.st_ino == sbuffile.st_ino))
+	    break;
+
+	close(fd);
+	fd = -1;
+    }
+    if (fd < 0) {
+	syslog(LOG_ERR, "Failed to lock %s after %d attempts",
+	       shard->log, retries);
+	return IMAP_IOERROR;
+    }
+
+    if (retry_write(fd, shard->pending.s, shard->pending.len) < 0 ||
+	fsync(fd) < 0) {
+	syslog(LOG_ERR, "Failed to write %s: %m", shard->log);
+	close(fd);
+	return IMAP_IOERROR;
+    }
+    close(fd);
+
+    shard->ino = sbuffd.st_ino;
+    buf_reset(&shard->pending);
+
+    return 0;
+}
+
+/* Split one sync log work file across the shard logs */
+static int do_dispatch(const char *filename, time_t started)
+{
+    hash_table dups, moved;
+    const char *base = NULL, *line, *eol;
+    unsigned long len = 0;
+    struct stat sbuf;
+    struct buf key = BUF_INITIALIZER;
+    struct buf renamed = BUF_INITIALIZER;
+    int fd, i, r = 0;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Failed to open %s: %m", filename);
+	return IMAP_IOERROR;
+    }
+
+    /* wait for anyone still appending */
+    if (lock_blocking(fd) < 0 || fstat(fd, &sbuf) < 0) {
+	syslog(LOG_ERR, "Failed to lock %s: %m", filename);
+	close(fd);
+	return IMAP_IOERROR;
+    }
+
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, filename, NULL);
+    construct_hash_table(&dups, 1024, 1);
+    construct_hash_table(&moved, 64, 1);
+
+    /* the commit of a renamed mailbox also logs its new name on its
+     * own; that has to go where the rename goes, or the new owner's
+     * worker copies the mailbox over before the rename is seen */
+    for (line = base; line < base + len; line = eol + 1) {
+	eol = memchr(line, '\n', base + len - line);
+	if (!eol) eol = base + len - 1;
+
+	if (eol - line < 8 || strncmp(line, "MAILBOX ", 8) ||
+	    !memchr(line + 8, ' ', eol - line - 8)) continue;
+
+	i = shard_of(line, eol - line + 1, NULL, &renamed);
+	if (renamed.len) {
+	    hash_insert(buf_cstring(&renamed),
+			(void *) (unsigned long) (i + 1), &moved);
+	}
+    }
+
+    for (line = base; line < base + len; line = eol + 1) {
+	eol = memchr(line, '\n', base + len - line);
+	if (!eol) eol = base + len - 1;	/* unterminated last line */
+
+	if (eol == line || (eol == line + 1 && *line == '\r')) continue;
+
+	buf_setmap(&key, line, eol - line + 1);
+	if (hash_lookup(buf_cstring(&key), &dups)) continue;
+	hash_insert(buf_cstring(&key), (void *) 1, &dups);
+
+	i = shard_of(line, eol - line + 1, &moved, NULL);
+	buf_appendmap(&sync_shards[i].pending, line, eol - line + 1);
+	if (*eol != '\n') buf_putc(&sync_shards[i].pending, '\n');
+    }
+
+    free_hash_table(&dups, NULL);
+    free_hash_table(&moved, NULL);
+    map_free(&base, &len);
+    close(fd);
+    buf_free(&key);
+    buf_free(&renamed);
+
+    for (i = 0; i < sync_nshards; i++) {
+	if (!sync_shards[i].pending.len) continue;
+	if ((r = shard_append(&sync_shards[i]))) break;
+	if (!sync_shards[i].queued) sync_shards[i].queued = started;
+    }
+
+    return r;
+}
+
+/* Notice what the workers have picked up and finished since last time */
+static void shard_progress(time_t now, time_t *lastreport)
+{
+    struct sync_shard *shard;
+    struct stat sbuf;
+    struct buf report = BUF_INITIALIZER;
+    time_t oldest;
+    int i, behind = 0;
+
+    for (i = 0; i < sync_nshards; i++) {
+	shard = &sync_shards[i];
+
+	if (shard->queued && (stat(shard->log, &sbuf) < 0 ||
+			      sbuf.st_ino != shard->ino)) {
+	    /* the worker renamed it, so it has finished the last one */
+	    shard->working = shard->queued;
+	    shard->queued = 0;
+	}
+	if (shard->working && stat(shard->work, &sbuf) < 0) {
+	    shard->working = 0;
+	    shard->backoff = 0;
+	}
+
+	oldest = shard->working ? shard->working : shard->queued;
+	if (oldest) behind = 1;
+	buf_printf(&report, " %d:%ds", i, oldest ? (int) (now - oldest) : 0);
+    }
+
+    if (behind && (verbose_logging ||
+		   now - *lastreport >= SHARD_REPORT_INTERVAL)) {
+	syslog(LOG_INFO, "replication lag per shard:%s", buf_cstring(&report));
+	if (verbose) printf("replication lag per shard:%s\n",
+			    buf_cstring(&report));
+	*lastreport = now;
+    }
+
+    buf_free(&report);
+}
+
+static void start_shard(int i, const char *channel,
+			unsigned long timeout, unsigned long min_delta)
+{
+    struct sync_shard *shard = &sync_shards[i];
+    char lockname[MAX_MAILBOX_PATH+1];
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid == -1) {
+	syslog(LOG_ERR, "fork() for shard %d failed: %m", i);
+	shard->respawn = time(NULL) + SHARD_BACKOFF_MIN;
+	return;
+    }
+    if (pid) {
+	shard->pid = pid;
+	return;
+    }
+
+    /* child: only one worker per shard, ever */
+    sync_nshards = 0;
+    snprintf(lockname, sizeof(lockname), "%s.lock", shard->log);
+    fd = open(lockname, O_RDWR|O_CREAT, 0640);
+    if (fd < 0 && errno == ENOENT && !cyrus_mkdir(lockname, 0755))
+	fd = open(lockname, O_RDWR|O_CREAT, 0640);
+    if (fd < 0 || lock_nonblocking(fd) < 0) {
+	syslog(LOG_ERR, "shard %d: %s is locked by another worker",
+	       i, lockname);
+	_exit(1);
+    }
+
+    /* don't share database file descriptors with the parent */
+    annotatemore_close();
+    quotadb_close();
+    mboxlist_close();
+    mboxlist_open(NULL);
+    quotadb_open(NULL);
+    annotatemore_open(NULL);
+
+    do_daemon(shard->log, shard->work, NULL, channel, timeout, min_delta);
+    shut_down(1);
+}
+
+void do_daemon_shards(const char *sync_log_file, const char *sync_shutdown_file,
+		      const char *channel, int nshards,
+		      unsigned long timeout, unsigned long min_delta)
+{
+    struct sync_shard *shard;
+    char *work_file_name;
+    struct stat sbuf;
+    time_t now, lastreport = 0;
+    pid_t pid;
+    int i, r = 0, status;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sync_shards = xzmalloc(nshards * sizeof(struct sync_shard));
+    sync_nshards = nshards;
+    for (i = 0; i < nshards; i++) {
+	shard = &sync_shards[i];
+	shard->log = xmalloc(strlen(sync_log_file)+20);
+	snprintf(shard->log, strlen(sync_log_file)+20,
+		 "%s-shard%d", sync_log_file, i);
+	shard->work = xmalloc(strlen(shard->log)+10);
+	snprintf(shard->work, strlen(shard->log)+10, "%s-work", shard->log);
+	/* a work file left by an earlier run means the shard is behind */
+	if (stat(shard->work, &sbuf) == 0) shard->working = time(NULL);
+    }
+
+    work_file_name = xmalloc(strlen(sync_log_file)+20);
+    snprintf(work_file_name, strlen(sync_log_file)+20,
+	     "%s-%d", sync_log_file, getpid());
+
+    while (1) {
+	now = time(NULL);
+
+	signals_poll();
+
+	/* Check for shutdown file */
+	if (sync_shutdown_file && !stat(sync_shutdown_file, &sbuf)) {
+	    unlink(sync_shutdown_file);
+	    break;
+	}
+
+	/* Reap workers, and (re)start them when they're due */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	    for (i = 0; i < nshards; i++) {
+		shard = &sync_shards[i];
+		if (shard->pid != pid) continue;
+
+		shard->pid = 0;
+		shard->backoff = shard->backoff ?
+		    MIN(shard->backoff * 2, SHARD_BACKOFF_MAX) :
+		    SHARD_BACKOFF_MIN;
+		shard->respawn = now + shard->backoff;
+		if (WIFSIGNALED(status))
+		    syslog(LOG_ERR, "shard %d worker %d killed by signal %d, "
+			   "restarting in %d seconds",
+			   i, (int) pid, WTERMSIG(status), shard->backoff);
+		else
+		    syslog(LOG_ERR, "shard %d worker %d exited (%d), "
+			   "restarting in %d seconds",
+			   i, (int) pid, WEXITSTATUS(status), shard->backoff);
+	    }
+	}
+	for (i = 0; i < nshards; i++) {
+	    shard = &sync_shards[i];
+	    if (!shard->pid && now >= shard->respawn)
+		start_shard(i, channel, timeout, min_delta);
+	}
+
+	if (stat(work_file_name, &sbuf) == 0) {
+	    syslog(LOG_NOTICE,
+		   "Reprocessing sync log file %s", work_file_name);
+	}
+	else if (stat(sync_log_file, &sbuf) == 0) {
+	    if (rename(sync_log_file, work_file_name) < 0) {
+		syslog(LOG_ERR, "Rename %s -> %s failed: %m",
+		       sync_log_file, work_file_name);
+		r = IMAP_IOERROR;
+		break;
+	    }
+	}
+	else {
+	    shard_progress(now, &lastreport);
+	    if (min_delta > 0) {
+		sleep(min_delta);
+	    } else {
+		usleep(100000);    /* 1/10th second */
+	    }
+	    continue;
+	}
+
+	if ((r = do_dispatch(work_file_name, now))) {
+	    syslog(LOG_ERR, "Dispatching sync log file %s failed: %s",
+		   work_file_name, error_message(r));
+	    break;
+	}
+	if (unlink(work_file_name) < 0) {
+	    syslog(LOG_ERR, "Unlink %s failed: %m", work_file_name);
+	    r = IMAP_IOERROR;
+	    break;
+	}
+
+	shard_progress(now, &lastreport);
+	if (min_delta > 0) sleep(min_delta);
+    }
+
+    stop_shards();
+
+    for (i = 0; i < nshards; i++) {
+	free(sync_shards[i].log);
+	free(sync_shards[i].work);
+	buf_free(&sync_shards[i].pending);
+    }
+    free(sync_shards);
+    sync_shards = NULL;
+    sync_nshards = 0;
+    free(work_file_name);
 }
 
 /* ====================================================================== */
@@ -2741,6 +3701,7 @@ int main(int argc, char **argv)
     int   wait     = 0;
     int   timeout  = 600;
     int   min_delta = 0;
+    int   nshards;
     const char *sync_log_file;
     const char *channel = NULL;
     const char *sync_shutdown_file = NULL;
@@ -3036,7 +3997,13 @@ int main(int argc, char **argv)
 	    if (!min_delta)
 		min_delta = get_intconfig(channel, "sync_repeat_interval");
 
-	    do_daemon(sync_log_file, sync_shutdown_file, channel, timeout, min_delta);
+	    nshards = get_intconfig(channel, "sync_shards");
+	    if (nshards > 1)
+		do_daemon_shards(sync_log_file, sync_shutdown_file, channel,
+				 nshards, timeout, min_delta);
+	    else
+		do_daemon(sync_log_file, NULL, sync_shutdown_file,
+			  channel, timeout, min_delta);
 	}
 
 	break;
@@ -62,6 +62,24 @@
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#if HAVE_DIRENT_H
+# include <dirent.h>
+#else
+# define dirent direct
+# if HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# if HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# if HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
 
 #include "assert.h"
 #include "sync_log.h"
@@ -79,6 +97,71 @@ static const char *suppressed_channel = NULL;
 static char *channel_base;
 static char *channel_end;
 
+/*
+ * Log files held open between events.
+ *
+ * Writers take a shared lock, so they no longer queue behind each
+ * other: every record goes out in a single O_APPEND write.  The
+ * sync_client daemon renames the log away and then takes an exclusive
+ * lock on it, which waits for anyone still appending.  A writer that
+ * gets its lock afterwards sees that the name now refers to a new file
+ * and reopens.
+ *
+ * The fsync is a group commit, coordinated through "<log>.sync": it
+ * records which file was last synced and how long it was when that
+ * fsync began.  A writer whose record already lies inside that length
+ * is done; otherwise it syncs the whole file on behalf of everyone who
+ * has appended so far.  Writers arriving while an fsync is in progress
+ * wait on the lock and usually find themselves covered by it.
+ */
+struct sync_log_file {
+    char *channel;
+    int fd;
+    int markfd;
+    struct sync_log_file *next;
+};
+
+struct sync_log_mark {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+};
+
+static struct sync_log_file *log_files = NULL;
+
+static struct sync_log_file *sync_log_file(const char *channel)
+{
+    struct sync_log_file *lf;
+
+    for (lf = log_files; lf; lf = lf->next) {
+	if (!channel && !lf->channel) return lf;
+	if (channel && lf->channel && !strcmp(channel, lf->channel))
+	    return lf;
+    }
+
+    lf = xzmalloc(sizeof(struct sync_log_file));
+    lf->channel = channel ? xstrdup(channel) : NULL;
+    lf->fd = -1;
+    lf->markfd = -1;
+    lf->next = log_files;
+    log_files = lf;
+
+    return lf;
+}
+
+static void sync_log_closeall(void)
+{
+    struct sync_log_file *lf;
+
+    while ((lf = log_files)) {
+	log_files = lf->next;
+	if (lf->fd != -1) close(lf->fd);
+	if (lf->markfd != -1) close(lf->markfd);
+	free(lf->channel);
+	free(lf);
+    }
+}
+
 void sync_log_init(void)
 {
     char *p;
@@ -116,6 +199,7 @@ void sync_log_suppress_channel(const char *channelname)
 
 void sync_log_done(void)
 {
+    sync_log_closeall();
     free(channel_base);
     channel_base = NULL;
 }
@@ -134,12 +218,160 @@ char *sync_log_fname(const char *channel)
     return buf;
 }
 
+static int sync_log_markfd(struct sync_log_file *lf, const char *fname)
+{
+    char markname[MAX_MAILBOX_PATH+1];
+
+    if (lf->markfd == -1) {
+	snprintf(markname, sizeof(markname), "%s.sync", fname);
+	lf->markfd = open(markname, O_RDWR|O_CREAT, 0640);
+	if (lf->markfd != -1) fcntl(lf->markfd, F_SETFD, FD_CLOEXEC);
+    }
+
+    return lf->markfd;
+}
+
+/*
+ * Remove "<log>.<pid>.NEW" files left behind by writers that died
+ * between creating one and linking it into place.
+ */
+static void sync_log_sweep(const char *fname)
+{
+    char dirname[MAX_MAILBOX_PATH+1], path[MAX_MAILBOX_PATH+1];
+    const char *base, *p;
+    char *end;
+    size_t baselen;
+    struct dirent *dirent;
+    DIR *dirp;
+    long pid;
+
+    strlcpy(dirname, fname, sizeof(dirname));
+    base = strrchr(fname, '/');
+    if (!base) return;
+    dirname[base - fname] = '\0';
+    base++;
+    baselen = strlen(base);
+
+    dirp = opendir(dirname);
+    if (!dirp) return;
+
+    while ((dirent = readdir(dirp)) != NULL) {
+	p = dirent->d_name;
+	if (strncmp(p, base, baselen) || p[baselen] != '.') continue;
+
+	pid = strtol(p + baselen + 1, &end, 10);
+	if (end == p + baselen + 1 || strcmp(end, ".NEW")) continue;
+
+	/* its creator may still be about to link it */
+	if (pid == getpid() || kill((pid_t) pid, 0) == 0 || errno != ESRCH)
+	    continue;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname, p);
+	if (!unlink(path))
+	    syslog(LOG_NOTICE, "sync_log: removed stale %s", path);
+    }
+
+    closedir(dirp);
+}
+
+/*
+ * Create a new log.  It is put in place with link() only after the
+ * sync mark has been cleared, so nobody can mistake an old mark for
+ * one of this file's (inode numbers get reused once the sync_client
+ * daemon has consumed and removed a log).
+ */
+static int sync_log_create(struct sync_log_file *lf, const char *fname)
+{
+    char tmpname[MAX_MAILBOX_PATH+1];
+    int fd, markfd, r, saved_errno;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.NEW", fname, (int) getpid());
+    fd = open(tmpname, O_RDWR|O_APPEND|O_CREAT|O_TRUNC, 0640);
+    if (fd < 0 && errno == ENOENT) {
+	if (!cyrus_mkdir(tmpname, 0755)) {
+	    fd = open(tmpname, O_RDWR|O_APPEND|O_CREAT|O_TRUNC, 0640);
+	}
+    }
+    if (fd < 0) return -1;
+
+    /* a new log is rare enough to look for litter from crashed writers */
+    sync_log_sweep(fname);
+
+    markfd = sync_log_markfd(lf, fname);
+    if (markfd != -1) {
+	if (lock_blocking(markfd) == -1 || ftruncate(markfd, 0) == -1) {
+	    saved_errno = errno;
+	    lock_unlock(markfd);
+	    close(fd);
+	    unlink(tmpname);
+	    errno = saved_errno;
+	    return -1;
+	}
+	lock_unlock(markfd);
+    }
+
+    r = link(tmpname, fname);
+    saved_errno = errno;
+    unlink(tmpname);
+    if (r == -1) {
+	close(fd);
+	/* somebody else beat us to it */
+	if (saved_errno == EEXIST) return open(fname, O_RDWR|O_APPEND);
+	errno = saved_errno;
+	return -1;
+    }
+
+    return fd;
+}
+
+/* Make everything up to 'end' in the open log durable */
+static void sync_log_flush(struct sync_log_file *lf, const char *fname,
+			   off_t end)
+{
+    struct sync_log_mark mark;
+    struct stat sbuf;
+    int markfd = sync_log_markfd(lf, fname);
+
+    if (markfd == -1 || lock_blocking(markfd) == -1 ||
+	fstat(lf->fd, &sbuf) == -1) {
+	/* can't coordinate, just sync our own */
+	if (markfd != -1) lock_unlock(markfd);
+	if (fsync(lf->fd) < 0)
+	    syslog(LOG_ERR, "fsync() of %s failed: %s",
+		   fname, strerror(errno));
+	return;
+    }
+
+    if (pread(markfd, &mark, sizeof(mark), 0) == sizeof(mark) &&
+	mark.dev == sbuf.st_dev && mark.ino == sbuf.st_ino &&
+	mark.size >= end) {
+	/* someone else's fsync already covered us */
+	lock_unlock(markfd);
+	return;
+    }
+
+    memset(&mark, 0, sizeof(mark));
+    mark.dev = sbuf.st_dev;
+    mark.ino = sbuf.st_ino;
+    mark.size = sbuf.st_size;
+
+    if (fsync(lf->fd) < 0)
+	syslog(LOG_ERR, "fsync() of %s failed: %s",
+	       fname, strerror(errno));
+    else if (pwrite(markfd, &mark, sizeof(mark), 0) != sizeof(mark))
+	syslog(LOG_ERR, "write() to %s.sync failed: %s",
+	       fname, strerror(errno));
+
+    lock_unlock(markfd);
+}
+
 static void sync_log_base(const char *channel, const char *string)
 {
-    int fd;
+    struct sync_log_file *lf;
     struct stat sbuffile, sbuffd;
     int retries = 0;
     const char *fname;
+    off_t end;
 
     /* are we being supressed? */
     if (!sync_log_enabled) return;
@@ -147,49 +379,62 @@ static void sync_log_base(const char *channel, const char *string)
 	return;
 
     fname = sync_log_fname(channel);
+    lf = sync_log_file(channel);
 
     while (retries++ < SYNC_LOG_RETRIES) {
-	fd = open(fname, O_WRONLY|O_APPEND|O_CREAT, 0640);
-	if (fd < 0 && errno == ENOENT) {
-	    if (!cyrus_mkdir(fname, 0755)) {
-		fd = open(fname, O_WRONLY|O_APPEND|O_CREAT, 0640);
+	if (lf->fd == -1) {
+	    lf->fd = open(fname, O_RDWR|O_APPEND);
+	    if (lf->fd < 0 && errno == ENOENT)
+		lf->fd = sync_log_create(lf, fname);
+	    if (lf->fd < 0) {
+		syslog(LOG_ERR,
+		       "sync_log(): Unable to write to log file %s: %s",
+		       fname, strerror(errno));
+		return;
 	    }
-	}
-	if (fd < 0) {
-	    syslog(LOG_ERR, "sync_log(): Unable to write to log file %s: %s",
-		   fname, strerror(errno));
-	    return;
+	    fcntl(lf->fd, F_SETFD, FD_CLOEXEC);
 	}
 
-	if (lock_blocking(fd) == -1) {
+	if (lock_shared(lf->fd) == -1) {
 	    syslog(LOG_ERR, "sync_log(): Failed to lock %s for %s: %m",
 		   fname, string);
-	    close(fd);
+	    close(lf->fd);
+	    lf->fd = -1;
 	    return;
 	}
 
-	/* Check that the file wasn't renamed after it was opened above */
-	if ((fstat(fd, &sbuffd) == 0) &&
+	/* Check that the file wasn't renamed since we opened it */
+	if ((fstat(lf->fd, &sbuffd) == 0) &&
 	    (stat(fname, &sbuffile) == 0) &&
-	    (sbuffd.st_ino == sbuffile.st_ino))
+	    (sbuffd.st_ino == sbuffile.st_ino) &&
+	    (sbuffd.st_dev == sbuffile.st_dev))
 	    break;
 
-	close(fd);
+	close(lf->fd);
+	lf->fd = -1;
     }
     if (retries >= SYNC_LOG_RETRIES) {
-	close(fd);
+	if (lf->fd != -1) close(lf->fd);
+	lf->fd = -1;
 	syslog(LOG_ERR,
 	       "sync_log(): Failed to lock %s for %s after %d attempts",
 	       fname, string, retries);
 	return;
     }
 
-    if (retry_write(fd, string, strlen(string)) < 0)
+    if (retry_write(lf->fd, string, strlen(string)) < 0) {
 	syslog(LOG_ERR, "write() to %s failed: %s",
 	       fname, strerror(errno));
+	lock_unlock(lf->fd);
+	return;
+    }
+    end = lseek(lf->fd, 0, SEEK_CUR);
+
+    lock_unlock(lf->fd);
 
-    (void)fsync(fd); /* paranoia */
-    close(fd);
+    /* still durable before we return, even if the file has been
+     * renamed (or consumed and unlinked) in the meantime */
+    sync_log_flush(lf, fname, end);
 }
 
 static const char *sync_quote_name(const char *name)
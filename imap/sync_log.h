@@ -65,8 +65,10 @@ void sync_log(const char *fmt, ...);
 #define sync_log_mailbox(name) \
     sync_log("MAILBOX %s\n", name)
 
+/* the second line names its source too (readers ignore it), so that a
+ * sharded sync_client keeps both halves of a rename together */
 #define sync_log_mailbox_double(name1, name2) \
-    sync_log("MAILBOX %s\nMAILBOX %s\n", name1, name2)
+    sync_log("MAILBOX %s\nMAILBOX %s %s\n", name1, name2, name1)
 
 #define sync_log_quota(name) \
     sync_log("QUOTA %s\n", name)
@@ -94,7 +96,8 @@ void sync_log_channel(const char *channel, const char *fmt, ...);
     sync_log_channel(channel, "MAILBOX %s\n", name)
 
 #define sync_log_mailbox_double_channel(channel, name1, name2) \
-    sync_log_channel(channel, "MAILBOX %s\nMAILBOX %s\n", name1, name2)
+    sync_log_channel(channel, "MAILBOX %s\nMAILBOX %s %s\n", \
+		     name1, name2, name1)
 
 #define sync_log_quota_channel(channel, name) \
     sync_log_channel(channel, "QUOTA %s\n", name)
@@ -138,6 +138,7 @@ struct protstream *sync_in = NULL;
 static int sync_logfd = -1;
 static int sync_starttls_done = 0;
 static int sync_compress_done = 0;
+static char sync_tag[16];	/* "<tag> " of the command being answered */
 
 /* commands that have specific names */
 static void cmdloop(void);
@@ -151,6 +152,7 @@ static void cmd_compress(char *alg);
 static void cmd_get(struct dlist *kl);
 static void cmd_apply(struct dlist *kl,
 		      struct sync_reserve_list *reserve_list);
+static void inventory_free(void);
 
 void usage(void);
 void shut_down(int code) __attribute__ ((noreturn));
@@ -226,6 +228,8 @@ static void sync_reset(void)
     }
     sync_starttls_done = 0;
 
+    inventory_free();
+
     if(saslprops.iplocalport) {
        free(saslprops.iplocalport);
        saslprops.iplocalport = NULL;
@@ -321,6 +325,10 @@ static void dobanner(void)
 	    prot_printf(sync_out, "* COMPRESS DEFLATE\r\n");
 	}
 #endif
+
+	prot_printf(sync_out, "* PIPELINING\r\n");
+	prot_printf(sync_out, "* INVENTORY\r\n");
+	prot_printf(sync_out, "* CRCRANGES\r\n");
     }
 
     prot_printf(sync_out,
@@ -588,14 +596,25 @@ static void cmdloop(void)
     reserve_list = sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
 
     for (;;) {
-        prot_flush(sync_out);
+	/* hold responses back while pipelined commands are queued */
+	if (!sync_in->cnt) prot_flush(sync_out);
 
 	/* Parse command name */
 	if ((c = getword(sync_in, &cmd)) == EOF)
             break;
 
+	/* Optional numeric tag, echoed on the completion response */
+	sync_tag[0] = '\0';
+	if (c == ' ' && Uisdigit(cmd.s[0]) &&
+	    strspn(cmd.s, "0123456789") == strlen(cmd.s) &&
+	    strlen(cmd.s) < sizeof(sync_tag) - 1) {
+	    snprintf(sync_tag, sizeof(sync_tag), "%s ", cmd.s);
+	    if ((c = getword(sync_in, &cmd)) == EOF)
+		break;
+	}
+
 	if (!cmd.s[0]) {
-	    prot_printf(sync_out, "BAD Null command\r\n");
+	    prot_printf(sync_out, "%sBAD Null command\r\n", sync_tag);
 	    eatline(sync_in, c);
 	    continue;
 	}
@@ -609,6 +628,15 @@ static void cmdloop(void)
 	/* Must be an admin */
 	if (sync_userid && !sync_userisadmin) goto noperm;
 
+	/* only APPLY may be pipelined */
+	if (sync_tag[0] && strcmp(cmd.s, "Apply")) {
+	    prot_printf(sync_out,
+			"%sBAD IMAP_PROTOCOL_ERROR %s may not be tagged\r\n",
+			sync_tag, cmd.s);
+	    eatline(sync_in, c);
+	    continue;
+	}
+
 	switch (cmd.s[0]) {
 	case 'A':
 	    if (!strcmp(cmd.s, "Authenticate")) {
@@ -643,7 +671,7 @@ static void cmdloop(void)
 		    dlist_free(&kl);
 		}
 		else
-		    prot_printf(sync_out, "BAD IMAP_PROTOCOL_ERROR Failed to parse APPLY line\r\n");
+		    prot_printf(sync_out, "%sBAD IMAP_PROTOCOL_ERROR Failed to parse APPLY line\r\n", sync_tag);
 		continue;
 	    }
 	    break;
@@ -731,28 +759,28 @@ static void cmdloop(void)
 
         }
 
-	prot_printf(sync_out, "BAD IMAP_PROTOCOL_ERROR Unrecognized command\r\n");
+	prot_printf(sync_out, "%sBAD IMAP_PROTOCOL_ERROR Unrecognized command\r\n", sync_tag);
 	eatline(sync_in, c);
 	continue;
 
     nologin:
-	prot_printf(sync_out, "NO Please authenticate first\r\n");
+	prot_printf(sync_out, "%sNO Please authenticate first\r\n", sync_tag);
 	eatline(sync_in, c);
 	continue;
 
     noperm:
-	prot_printf(sync_out, "NO %s\r\n",
+	prot_printf(sync_out, "%sNO %s\r\n", sync_tag,
 		    error_message(IMAP_PERMISSION_DENIED));
 	eatline(sync_in, c);
 	continue;
 
     missingargs:
-	prot_printf(sync_out, "BAD Missing required argument to %s\r\n", cmd.s);
+	prot_printf(sync_out, "%sBAD Missing required argument to %s\r\n", sync_tag, cmd.s);
 	eatline(sync_in, c);
 	continue;
 
     extraargs:
-	prot_printf(sync_out, "BAD Unexpected extra arguments to %s\r\n", cmd.s);
+	prot_printf(sync_out, "%sBAD Unexpected extra arguments to %s\r\n", sync_tag, cmd.s);
 	eatline(sync_in, c);
 	continue;
     }
@@ -970,6 +998,7 @@ static void cmd_compress(char *alg)
     prot_flush(sync_out);
     prot_setcompress(sync_in);
     prot_setcompress(sync_out);
+    prot_setcompresslevel(sync_out, config_getint(IMAPOPT_SYNC_COMPRESS_LEVEL));
     sync_compress_done = 1;
 }
 #else
@@ -1118,6 +1147,212 @@ void reserve_folder(const char *part, const char *mboxname,
     mailbox_close(&mailbox);
 }
 
+/*
+ * Replica-wide GUID inventory.
+ *
+ * Built on the first GET INVENTORY of a session by reading every
+ * mailbox index, and used by RESERVE to find messages outside the
+ * folders the client names - after a user is renamed or moved to
+ * another partition on the master, say.  The client gets a bloom
+ * filter of the same GUIDs so it only asks about likely hits.
+ */
+
+struct inventory_guid {
+    unsigned char value[MESSAGE_GUID_SIZE];
+    uint32_t mbox;
+    uint32_t size;
+};
+
+static struct {
+    int built;
+    struct inventory_guid *guids;
+    unsigned long count;
+    unsigned long alloc;
+    char **mboxes;
+    uint32_t nmbox;
+    uint32_t mboxalloc;
+} inventory;
+
+static void inventory_free(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < inventory.nmbox; i++)
+	free(inventory.mboxes[i]);
+    free(inventory.mboxes);
+    free(inventory.guids);
+    memset(&inventory, 0, sizeof(inventory));
+}
+
+static int inventory_cmp(const void *a, const void *b)
+{
+    return memcmp(((const struct inventory_guid *)a)->value,
+		  ((const struct inventory_guid *)b)->value,
+		  MESSAGE_GUID_SIZE);
+}
+
+static int inventory_addmbox(char *name,
+			     int matchlen __attribute__((unused)),
+			     int maycreate __attribute__((unused)),
+			     void *rock __attribute__((unused)))
+{
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    struct inventory_guid *item;
+    uint32_t recno;
+    int found = 0;
+
+    /* directory stubs and the like */
+    if (mailbox_open_irl(name, &mailbox))
+	return 0;
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	if (mailbox_read_index_record(mailbox, recno, &record))
+	    continue;
+	if (record.system_flags & FLAG_UNLINKED)
+	    continue;
+
+	if (inventory.count == inventory.alloc) {
+	    inventory.alloc += 4096;
+	    inventory.guids = xrealloc(inventory.guids, inventory.alloc *
+				       sizeof(struct inventory_guid));
+	}
+	item = &inventory.guids[inventory.count++];
+	memcpy(item->value, record.guid.value, MESSAGE_GUID_SIZE);
+	item->mbox = inventory.nmbox;
+	item->size = record.size;
+	found = 1;
+    }
+
+    if (found) {
+	if (inventory.nmbox == inventory.mboxalloc) {
+	    inventory.mboxalloc += 256;
+	    inventory.mboxes = xrealloc(inventory.mboxes,
+					inventory.mboxalloc * sizeof(char *));
+	}
+	inventory.mboxes[inventory.nmbox++] = xstrdup(name);
+    }
+
+    mailbox_close(&mailbox);
+
+    return 0;
+}
+
+static int do_getinventory(struct dlist *kin __attribute__((unused)))
+{
+    struct message_guid guid;
+    struct dlist *kl;
+    unsigned char *filter;
+    uint32_t nbits;
+    unsigned long i;
+
+    if (!inventory.built) {
+	mboxlist_findall(NULL, "*", 1, NULL, NULL, inventory_addmbox, NULL);
+	qsort(inventory.guids, inventory.count,
+	      sizeof(struct inventory_guid), inventory_cmp);
+	inventory.built = 1;
+	syslog(LOG_INFO, "inventory: %lu messages in %u mailboxes",
+	       inventory.count, inventory.nmbox);
+    }
+
+    if (inventory.count > 0xfffffff8UL / SYNC_INVENTORY_BITS_PER_GUID)
+	nbits = 0xfffffff8UL;
+    else
+	nbits = inventory.count * SYNC_INVENTORY_BITS_PER_GUID;
+    if (nbits < 64) nbits = 64;
+    nbits = (nbits + 7) & ~7;
+
+    filter = xzmalloc(nbits / 8);
+    for (i = 0; i < inventory.count; i++) {
+	memcpy(guid.value, inventory.guids[i].value, MESSAGE_GUID_SIZE);
+	sync_inventory_add(filter, nbits, &guid);
+    }
+
+    kl = dlist_kvlist(NULL, "INVENTORY");
+    dlist_num(kl, "COUNT", inventory.count);
+    dlist_num(kl, "BITS", nbits);
+    dlist_buf(kl, "FILTER", (const char *)filter, nbits / 8);
+    sync_send_response(kl, sync_out);
+    dlist_free(&kl);
+    free(filter);
+
+    return 0;
+}
+
+struct inventory_wanted {
+    struct sync_msgid *item;
+    uint32_t size;
+};
+
+static int wanted_cmp(const void *a, const void *b)
+{
+    const struct sync_msgid *ia = ((const struct inventory_wanted *)a)->item;
+    const struct sync_msgid *ib = ((const struct inventory_wanted *)b)->item;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/* reserve whatever the inventory can find that the named folders
+ * didn't have */
+static void reserve_inventory(const char *part, struct dlist *gl,
+			      struct sync_msgid_list *part_list)
+{
+    struct sync_name_list *folder_names = sync_name_list_create();
+    struct sync_name *folder;
+    struct inventory_guid key, *found;
+    struct message_guid tmp_guid;
+    struct inventory_wanted *wanted;
+    struct dlist *i;
+    const char *name;
+    unsigned long bytes = 0;
+    int nwanted = 0, n = 0, j;
+
+    for (i = gl->head; i; i = i->next)
+	n++;
+    wanted = xmalloc(n * sizeof(struct inventory_wanted));
+    n = 0;
+
+    for (i = gl->head; i; i = i->next) {
+	if (!message_guid_decode(&tmp_guid, i->sval))
+	    continue;
+	wanted[nwanted].item = sync_msgid_lookup(part_list, &tmp_guid);
+	if (!wanted[nwanted].item || wanted[nwanted].item->mark)
+	    continue;
+	memcpy(key.value, tmp_guid.value, MESSAGE_GUID_SIZE);
+	found = bsearch(&key, inventory.guids, inventory.count,
+			sizeof(struct inventory_guid), inventory_cmp);
+	if (!found)
+	    continue;
+	wanted[nwanted++].size = found->size;
+	name = inventory.mboxes[found->mbox];
+	if (!sync_name_lookup(folder_names, name))
+	    sync_name_list_add(folder_names, name);
+    }
+
+    for (folder = folder_names->head;
+	 part_list->marked < part_list->count && folder;
+	 folder = folder->next) {
+	reserve_folder(part, folder->name, part_list);
+    }
+
+    /* the same GUID may be listed more than once: count each once */
+    qsort(wanted, nwanted, sizeof(struct inventory_wanted), wanted_cmp);
+    for (j = 0; j < nwanted; j++) {
+	if (!wanted[j].item->mark)
+	    continue;
+	if (j && wanted[j].item == wanted[j-1].item)
+	    continue;
+	n++;
+	bytes += wanted[j].size;
+    }
+    if (n)
+	syslog(LOG_INFO, "RESERVE: %d messages (%lu bytes) found elsewhere "
+	       "on replica", n, bytes);
+
+    free(wanted);
+    sync_name_list_free(&folder_names);
+}
+
 static int do_reserve(struct dlist *kl, struct sync_reserve_list *reserve_list)
 {
     struct message_guid tmp_guid;
@@ -1168,6 +1403,10 @@ static int do_reserve(struct dlist *kl, struct sync_reserve_list *reserve_list)
 	reserve_folder(partition, folder->name, part_list);
     }
 
+    /* and then anywhere else on the replica */
+    if (inventory.built && part_list->marked < part_list->count)
+	reserve_inventory(partition, gl, part_list);
+
     /* check if we missed any */
     kout = dlist_list(NULL, "MISSING");
     for (i = gl->head; i; i = i->next) {
@@ -1316,6 +1555,129 @@ static int mailbox_compare_update(struct mailbox *mailbox,
     return 0;
 }
 
+static int next_upload(struct dlist **kip, struct mailbox *mailbox,
+		       struct index_record *record)
+{
+    int r;
+
+    /* end of the list sorts after every real UID */
+    if (!*kip) {
+	record->uid = UINT32_MAX;
+	return 0;
+    }
+
+    r = parse_upload(*kip, mailbox, record);
+    if (r) {
+	syslog(LOG_ERR, "Failed to parse uploaded record");
+	return r;
+    }
+
+    *kip = (*kip)->next;
+    return 0;
+}
+
+/*
+ * Apply an already checked update by writing a new index and cache in
+ * a single pass and switching the mailbox over to them, rather than
+ * rewriting and appending one record at a time.  Must hold the mailbox
+ * namelock exclusively.  Nothing is changed until the switch, so on
+ * failure the caller can still fall back to mailbox_compare_update().
+ */
+static int mailbox_bulk_update(struct mailbox *mailbox, struct dlist *kr)
+{
+    struct mailbox_repack *repack = NULL;
+    struct index_record mrecord;
+    struct index_record rrecord;
+    struct dlist *ki = kr->head;
+    uint32_t recno;
+    int expunge_mode = config_getenum(IMAPOPT_EXPUNGE_MODE);
+    int immediate = (expunge_mode == IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE ||
+		     expunge_mode == IMAP_ENUM_EXPUNGE_MODE_DEFAULT);
+    int r;
+    int i;
+
+    r = mailbox_repack_setup(mailbox, &repack);
+    if (r) return r;
+
+    r = next_upload(&ki, mailbox, &mrecord);
+    if (r) goto fail;
+
+    /* existing records, with any updates merged in */
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	r = mailbox_read_index_record(mailbox, recno, &rrecord);
+	if (r) goto fail;
+
+	/* been marked for removal, just skip */
+	if (!rrecord.uid) continue;
+
+	/* expunged on the master before we ever saw them */
+	while (mrecord.uid < rrecord.uid) {
+	    r = next_upload(&ki, mailbox, &mrecord);
+	    if (r) goto fail;
+	}
+
+	if (mrecord.uid == rrecord.uid) {
+	    rrecord.modseq = mrecord.modseq;
+	    rrecord.last_updated = mrecord.last_updated;
+	    rrecord.internaldate = mrecord.internaldate;
+	    rrecord.system_flags = (mrecord.system_flags & ~FLAG_UNLINKED) |
+				   (rrecord.system_flags & FLAG_UNLINKED);
+	    for (i = 0; i < MAX_USER_FLAGS/32; i++)
+		rrecord.user_flags[i] = mrecord.user_flags[i];
+
+	    /* same as mailbox_rewrite_index_record() */
+	    if (immediate && (rrecord.system_flags & FLAG_EXPUNGED))
+		rrecord.system_flags |= FLAG_UNLINKED;
+	    if (rrecord.system_flags & FLAG_UNLINKED) {
+		if (expunge_mode == IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE)
+		    repack->i.options |= OPT_MAILBOX_NEEDS_REPACK;
+		repack->i.options |= OPT_MAILBOX_NEEDS_UNLINK;
+	    }
+
+	    r = next_upload(&ki, mailbox, &mrecord);
+	    if (r) goto fail;
+	}
+
+	/* unlinked records carry no cache */
+	if (!(rrecord.system_flags & FLAG_UNLINKED)) {
+	    r = mailbox_cacherecord(mailbox, &rrecord);
+	    if (r) goto fail;
+	}
+
+	r = mailbox_repack_add(repack, &rrecord);
+	if (r) goto fail;
+    }
+
+    /* and anything after LAST_UID is an append */
+    while (mrecord.uid != UINT32_MAX) {
+	if (mrecord.uid > mailbox->i.last_uid) {
+	    r = sync_copyfile(mailbox, &mrecord);
+	    if (!r) r = mailbox_repack_append(repack, &mrecord);
+	    if (r) {
+		syslog(LOG_ERR, "IOERROR: failed to append file %s %u",
+		       mailbox->name, mrecord.uid);
+		goto fail;
+	    }
+	}
+	r = next_upload(&ki, mailbox, &mrecord);
+	if (r) goto fail;
+    }
+
+    r = mailbox_repack_swap(&repack);
+    if (r) {
+	/* can't tell how far it got, so don't touch anything more */
+	syslog(LOG_ERR, "IOERROR: failed to switch %s to rebuilt index: %s",
+	       mailbox->name, error_message(r));
+	fatal("failed to switch to rebuilt index", EC_IOERR);
+    }
+
+    return 0;
+
+ fail:
+    mailbox_repack_abort(&repack);
+    return r;
+}
+
 static int do_mailbox(struct dlist *kin)
 {
     /* fields from the request */
@@ -1338,6 +1700,10 @@ static int do_mailbox(struct dlist *kin)
     struct mailbox *mailbox = NULL;
     uint32_t newcrc;
     struct dlist *kr;
+    struct dlist *ki;
+    int bulk_min = config_getint(IMAPOPT_SYNC_BULK_APPLY);
+    int nrecords = 0;
+    int exclusive = 0;
     int r;
 
     if (!dlist_getatom(kin, "UNIQUEID", &uniqueid))
@@ -1370,13 +1736,27 @@ static int do_mailbox(struct dlist *kin)
 	return IMAP_PROTOCOL_BAD_PARAMETERS;
 
     options = sync_parse_options(options_str);
- 
-    r = mailbox_open_iwl(mboxname, &mailbox);
+
+    for (ki = kr->head; ki; ki = ki->next)
+	nrecords++;
+
+    /* big updates get applied in bulk, if nobody else is using the
+     * mailbox right now */
+    r = IMAP_MAILBOX_LOCKED;
+    if (bulk_min > 0 && nrecords >= bulk_min) {
+	r = mailbox_open_advanced(mboxname, &mailbox,
+				  LOCK_NONBLOCKING, LOCK_EXCLUSIVE);
+	if (!r) exclusive = 1;
+    }
+    if (r == IMAP_MAILBOX_LOCKED)
+	r = mailbox_open_iwl(mboxname, &mailbox);
     if (r == IMAP_MAILBOX_NONEXISTENT) {
 	r = mboxlist_createsync(mboxname, 0, partition,
 				sync_userid, sync_authstate,
 				options, uidvalidity, acl,
 				uniqueid, &mailbox);
+	/* a new mailbox is created locked exclusively */
+	if (!r) exclusive = 1;
     }
     if (r) {
 	syslog(LOG_ERR, "Failed to open mailbox %s to update", mboxname);
@@ -1420,6 +1800,14 @@ static int do_mailbox(struct dlist *kin)
 	return r;
     }
 
+    if (exclusive && bulk_min > 0 && nrecords >= bulk_min &&
+	(uint32_t)nrecords >= mailbox->i.num_records / 4) {
+	r = mailbox_bulk_update(mailbox, kr);
+	if (!r) goto done;
+	syslog(LOG_ERR, "bulk update of %s failed, retrying by record: %s",
+	       mboxname, error_message(r));
+    }
+
     /* now we're committed to writing something no matter what happens! */
 
     r = mailbox_compare_update(mailbox, kr, 1);
@@ -1428,6 +1816,8 @@ static int do_mailbox(struct dlist *kin)
 	return r;
     }
 
+ done:
+
     mailbox_index_dirty(mailbox);
     assert(mailbox->i.last_uid <= last_uid);
     mailbox->i.last_uid = last_uid;
@@ -1541,19 +1931,93 @@ static int mailbox_cb(char *name,
     return r;
 }
 
+/* only the records in RANGES, if given */
 static int do_getfullmailbox(struct dlist *kin)
 {
     struct mailbox *mailbox = NULL;
-    struct dlist *kl = dlist_kvlist(NULL, "MAILBOX");
+    struct dlist *kl = NULL;
+    struct dlist *rl;
+    struct seq_range *ranges = NULL;
+    struct index_record record;
+    const char *mboxname = kin->sval;
+    int partial = (kin->head != NULL); /* a list, not just the name */
+    uint32_t recno;
+    int nranges = 0;
+    int i = 0;
     int r;
 
-    r = mailbox_open_irl(kin->sval, &mailbox);
-    if (r) return r;
+    if (partial) {
+	if (!dlist_getatom(kin, "MBOXNAME", &mboxname))
+	    return IMAP_PROTOCOL_BAD_PARAMETERS;
+	r = sync_parse_ranges(kin, "RANGES", &ranges, &nranges);
+	if (r) return r;
+    }
+
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r) goto done;
 
-    r = sync_mailbox(mailbox, NULL, NULL, kl, NULL, 1);
+    kl = dlist_kvlist(NULL, "MAILBOX");
+    r = sync_mailbox(mailbox, NULL, NULL, kl, NULL, !partial);
+    if (r || !partial) goto done;
+
+    rl = dlist_list(kl, "RECORD");
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	r = mailbox_read_index_record(mailbox, recno, &record);
+	if (r) goto done;
+	while (i < nranges && record.uid > ranges[i].high)
+	    i++;
+	if (i == nranges)
+	    break;
+	if (record.uid >= ranges[i].low)
+	    sync_print_record(rl, mailbox, &record);
+    }
+
+ done:
     if (!r) sync_send_response(kl, sync_out);
     dlist_free(&kl);
     mailbox_close(&mailbox);
+    free(ranges);
+
+    return r;
+}
+
+static int do_getcrcranges(struct dlist *kin)
+{
+    struct mailbox *mailbox = NULL;
+    struct dlist *kl;
+    struct dlist *cl;
+    struct seq_range *ranges = NULL;
+    uint32_t *crcs = NULL;
+    const char *mboxname;
+    int nranges;
+    int i;
+    int r;
+
+    if (!dlist_getatom(kin, "MBOXNAME", &mboxname))
+	return IMAP_PROTOCOL_BAD_PARAMETERS;
+    r = sync_parse_ranges(kin, "RANGES", &ranges, &nranges);
+    if (r) return r;
+
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r) goto done;
+
+    crcs = xmalloc((nranges + 1) * sizeof(uint32_t));
+    r = sync_crc_ranges(mailbox, ranges, nranges, crcs);
+    if (r) goto done;
+
+    kl = dlist_kvlist(NULL, "CRCRANGES");
+    dlist_atom(kl, "MBOXNAME", mailbox->name);
+    dlist_num(kl, "LAST_UID", mailbox->i.last_uid);
+    cl = dlist_list(kl, "CRC");
+    for (i = 0; i < nranges; i++)
+	dlist_num(cl, "CRC", crcs[i]);
+    sync_send_response(kl, sync_out);
+    dlist_free(&kl);
+
+ done:
+    mailbox_close(&mailbox);
+    free(crcs);
+    free(ranges);
 
     return r;
 }
@@ -2106,25 +2570,25 @@ static void print_response(int r)
 {
     switch (r) {
     case 0:
-	prot_printf(sync_out, "OK success\r\n");
+	prot_printf(sync_out, "%sOK success\r\n", sync_tag);
 	break;
     case IMAP_INVALID_USER:
-	prot_printf(sync_out, "NO IMAP_INVALID_USER No Such User\r\n");
+	prot_printf(sync_out, "%sNO IMAP_INVALID_USER No Such User\r\n", sync_tag);
 	break;
     case IMAP_MAILBOX_NONEXISTENT:
-	prot_printf(sync_out, "NO IMAP_MAILBOX_NONEXISTENT No Such Mailbox\r\n");
+	prot_printf(sync_out, "%sNO IMAP_MAILBOX_NONEXISTENT No Such Mailbox\r\n", sync_tag);
 	break;
     case IMAP_MAILBOX_CRC:
-	prot_printf(sync_out, "NO IMAP_MAILBOX_CRC Checksum Failure\r\n");
+	prot_printf(sync_out, "%sNO IMAP_MAILBOX_CRC Checksum Failure\r\n", sync_tag);
 	break;
     case IMAP_PROTOCOL_ERROR:
-	prot_printf(sync_out, "NO IMAP_PROTOCOL_ERROR Protocol error\r\n");
+	prot_printf(sync_out, "%sNO IMAP_PROTOCOL_ERROR Protocol error\r\n", sync_tag);
 	break;
     case IMAP_PROTOCOL_BAD_PARAMETERS:
-	prot_printf(sync_out, "NO IMAP_PROTOCOL_BAD_PARAMETERS near %s\r\n", dlist_lastkey());
+	prot_printf(sync_out, "%sNO IMAP_PROTOCOL_BAD_PARAMETERS near %s\r\n", sync_tag, dlist_lastkey());
 	break;
     default:
-	prot_printf(sync_out, "NO %s\r\n", error_message(r));
+	prot_printf(sync_out, "%sNO %s\r\n", sync_tag, error_message(r));
     }
 }
 
@@ -2188,12 +2652,16 @@ static void cmd_get(struct dlist *kin)
 
     if (!strcmp(kin->name, "ANNOTATION"))
 	r = do_getannotation(kin);
+    else if (!strcmp(kin->name, "CRCRANGES"))
+	r = do_getcrcranges(kin);
     else if (!strcmp(kin->name, "FETCH"))
 	r = do_fetch(kin);
     else if (!strcmp(kin->name, "FETCH_SIEVE"))
 	r = do_fetchsieve(kin);
     else if (!strcmp(kin->name, "FULLMAILBOX"))
 	r = do_getfullmailbox(kin);
+    else if (!strcmp(kin->name, "INVENTORY"))
+	r = do_getinventory(kin);
     else if (!strcmp(kin->name, "MAILBOXES"))
 	r = do_getmailboxes(kin);
     else if (!strcmp(kin->name, "META"))
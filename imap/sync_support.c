@@ -1336,6 +1336,153 @@ struct dlist *sync_parseline(struct protstream *in)
     return NULL;
 }
 
+/* GUIDs are already SHA1 digests: two words of one are independent
+ * enough to drive double hashing */
+static void inventory_hash(const struct message_guid *guid,
+			   uint32_t *h1, uint32_t *h2)
+{
+    const unsigned char *v = guid->value;
+
+    *h1 = ((uint32_t)v[0] << 24) | ((uint32_t)v[1] << 16) |
+	  ((uint32_t)v[2] << 8) | (uint32_t)v[3];
+    *h2 = ((uint32_t)v[4] << 24) | ((uint32_t)v[5] << 16) |
+	  ((uint32_t)v[6] << 8) | (uint32_t)v[7] | 1;
+}
+
+void sync_inventory_add(unsigned char *filter, uint32_t nbits,
+			const struct message_guid *guid)
+{
+    uint32_t h1, h2, bit;
+    int i;
+
+    inventory_hash(guid, &h1, &h2);
+    for (i = 0; i < SYNC_INVENTORY_HASHES; i++) {
+	bit = (h1 + i * h2) % nbits;
+	filter[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+int sync_inventory_test(const unsigned char *filter, uint32_t nbits,
+			const struct message_guid *guid)
+{
+    uint32_t h1, h2, bit;
+    int i;
+
+    inventory_hash(guid, &h1, &h2);
+    for (i = 0; i < SYNC_INVENTORY_HASHES; i++) {
+	bit = (h1 + i * h2) % nbits;
+	if (!(filter[bit / 8] & (1 << (bit % 8))))
+	    return 0;
+    }
+
+    return 1;
+}
+
+/* ====================================================================== */
+
+/* first record from 'recno' on with a UID of at least 'uid' */
+static int crc_ranges_seek(struct mailbox *mailbox, uint32_t uid,
+			   uint32_t *recnop)
+{
+    struct index_record record;
+    uint32_t low = *recnop;
+    uint32_t high = mailbox->i.num_records + 1;
+    uint32_t mid;
+    int r;
+
+    while (low < high) {
+	mid = low + (high - low) / 2;
+	r = mailbox_read_index_record(mailbox, mid, &record);
+	if (r) return r;
+	if (record.uid < uid)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+
+    *recnop = low;
+    return 0;
+}
+
+/* XOR of make_sync_crc() over the records in each range.  The ranges
+ * must be in ascending order and not overlap */
+int sync_crc_ranges(struct mailbox *mailbox,
+		    const struct seq_range *ranges, int nranges,
+		    uint32_t *crcs)
+{
+    struct index_record record;
+    uint32_t recno = 1;
+    int i;
+    int r;
+
+    for (i = 0; i < nranges; i++) {
+	crcs[i] = 0;
+
+	r = crc_ranges_seek(mailbox, ranges[i].low, &recno);
+	if (r) return r;
+
+	for (; recno <= mailbox->i.num_records; recno++) {
+	    r = mailbox_read_index_record(mailbox, recno, &record);
+	    if (r) return r;
+	    if (record.uid > ranges[i].high)
+		break;
+	    crcs[i] ^= make_sync_crc(mailbox, &record);
+	}
+    }
+
+    return 0;
+}
+
+void sync_print_ranges(struct dlist *kl, const char *name,
+		       const struct seq_range *ranges, int nranges)
+{
+    struct dlist *rl = dlist_list(kl, name);
+    int i;
+
+    for (i = 0; i < nranges; i++) {
+	dlist_num(rl, "LOW", ranges[i].low);
+	dlist_num(rl, "HIGH", ranges[i].high);
+    }
+}
+
+int sync_parse_ranges(struct dlist *kl, const char *name,
+		      struct seq_range **rangesp, int *nrangesp)
+{
+    struct seq_range *ranges = NULL;
+    struct dlist *rl;
+    struct dlist *ri;
+    int n = 0;
+    int alloc = 0;
+
+    if (!dlist_getlist(kl, name, &rl))
+	return IMAP_PROTOCOL_BAD_PARAMETERS;
+
+    for (ri = rl->head; ri; ri = ri->next->next) {
+	if (!ri->next)
+	    goto bad;
+	if (n == alloc) {
+	    alloc += 64;
+	    ranges = xrealloc(ranges, alloc * sizeof(struct seq_range));
+	}
+	ranges[n].low = ri->nval;
+	ranges[n].high = ri->next->nval;
+	/* in order, and no overlaps */
+	if (!ranges[n].low || ranges[n].low > ranges[n].high)
+	    goto bad;
+	if (n && ranges[n].low <= ranges[n-1].high)
+	    goto bad;
+	n++;
+    }
+
+    *rangesp = ranges;
+    *nrangesp = n;
+    return 0;
+
+ bad:
+    free(ranges);
+    return IMAP_PROTOCOL_BAD_PARAMETERS;
+}
+
 static int sync_send_file(struct mailbox *mailbox,
 			  struct index_record *record,
 			  struct sync_msgid_list *part_list,
@@ -1408,7 +1555,6 @@ int sync_mailbox(struct mailbox *mailbox,
 
     if (printrecords) {
 	struct index_record record;
-	struct dlist *il;
 	struct dlist *rl = dlist_list(kl, "RECORD");
 	uint32_t recno;
 	int send_file;
@@ -1453,20 +1599,27 @@ int sync_mailbox(struct mailbox *mailbox,
 		if (r) return r;
 	    }
 
-	    il = dlist_kvlist(rl, "RECORD");
-	    dlist_num(il, "UID", record.uid);
-	    dlist_modseq(il, "MODSEQ", record.modseq);
-	    dlist_date(il, "LAST_UPDATED", record.last_updated);
-	    sync_print_flags(il, mailbox, &record);
-	    dlist_date(il, "INTERNALDATE", record.internaldate);
-	    dlist_num(il, "SIZE", record.size);
-	    dlist_atom(il, "GUID", message_guid_encode(&record.guid));
+	    sync_print_record(rl, mailbox, &record);
 	}
     }
 
     return 0;
 }
 
+void sync_print_record(struct dlist *rl, struct mailbox *mailbox,
+		       struct index_record *record)
+{
+    struct dlist *il = dlist_kvlist(rl, "RECORD");
+
+    dlist_num(il, "UID", record->uid);
+    dlist_modseq(il, "MODSEQ", record->modseq);
+    dlist_date(il, "LAST_UPDATED", record->last_updated);
+    sync_print_flags(il, mailbox, record);
+    dlist_date(il, "INTERNALDATE", record->internaldate);
+    dlist_num(il, "SIZE", record->size);
+    dlist_atom(il, "GUID", message_guid_encode(&record->guid));
+}
+
 int sync_parse_response(const char *cmd, struct protstream *in,
 			struct dlist **klp)
 {
@@ -1530,8 +1683,11 @@ int sync_parse_response(const char *cmd, struct protstream *in,
     return IMAP_PROTOCOL_ERROR;
 }
 
-int sync_append_copyfile(struct mailbox *mailbox,
-			 struct index_record *record)
+/* put the reserved file for an uploaded record into the mailbox and
+ * parse it.  An expunged record whose file never arrived is marked
+ * unlinked instead */
+int sync_copyfile(struct mailbox *mailbox,
+		  struct index_record *record)
 {
     const char *fname, *destname;
     struct message_guid tmp_guid;
@@ -1552,7 +1708,7 @@ int sync_append_copyfile(struct mailbox *mailbox,
 	/* deal with unlinked master records */
 	if (record->system_flags & FLAG_EXPUNGED) {
 	    record->system_flags |= FLAG_UNLINKED;
-	    goto just_write;
+	    return 0;
 	}
 	syslog(LOG_ERR, "IOERROR: failed to parse %s", fname);
 	return r;
@@ -1572,7 +1728,17 @@ int sync_append_copyfile(struct mailbox *mailbox,
 	return r;
     }
 
- just_write:
+    return 0;
+}
+
+int sync_append_copyfile(struct mailbox *mailbox,
+			 struct index_record *record)
+{
+    int r;
+
+    r = sync_copyfile(mailbox, record);
+    if (r) return r;
+
     return mailbox_append_index_record(mailbox, record);
 }
 
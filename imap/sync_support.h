@@ -51,6 +51,7 @@
 #include "dlist.h"
 #include "prot.h"
 #include "mailbox.h"
+#include "sequence.h"
 
 #define SYNC_MSGID_LIST_HASH_SIZE        (65536)
 #define SYNC_MESSAGE_LIST_HASH_SIZE      (65536)
@@ -385,6 +386,36 @@ struct dlist *sync_parseline(struct protstream *in);
 
 /* ====================================================================== */
 
+/* GUID inventory: a bloom filter over every message file on a replica */
+
+#define SYNC_INVENTORY_BITS_PER_GUID 10
+#define SYNC_INVENTORY_HASHES 7
+
+void sync_inventory_add(unsigned char *filter, uint32_t nbits,
+			const struct message_guid *guid);
+int sync_inventory_test(const unsigned char *filter, uint32_t nbits,
+			const struct message_guid *guid);
+
+/* ====================================================================== */
+
+/* CRC ranges: the sync_crc of a mailbox split by UID range, so both
+ * ends can narrow a mismatch down to the records which differ.  Each
+ * round splits a differing range into SYNC_CRC_FANOUT parts, until it
+ * is no wider than SYNC_CRC_LEAF UIDs */
+
+#define SYNC_CRC_FANOUT 16
+#define SYNC_CRC_LEAF 64
+
+int sync_crc_ranges(struct mailbox *mailbox,
+		    const struct seq_range *ranges, int nranges,
+		    uint32_t *crcs);
+void sync_print_ranges(struct dlist *kl, const char *name,
+		       const struct seq_range *ranges, int nranges);
+int sync_parse_ranges(struct dlist *kl, const char *name,
+		      struct seq_range **rangesp, int *nrangesp);
+
+/* ====================================================================== */
+
 int addmbox(char *name, int matchlen, int maycreate, void *rock);
 int addmbox_sub(void *rockp, const char *key, int keylen,
 		const char *data __attribute__((unused)),
@@ -396,8 +427,13 @@ int sync_mailbox(struct mailbox *mailbox,
 		 struct dlist *kl, struct dlist *kupload,
 		 int printrecords);
 
+void sync_print_record(struct dlist *rl, struct mailbox *mailbox,
+		       struct index_record *record);
+
 int parse_upload(struct dlist *kr, struct mailbox *mailbox,
 		 struct index_record *record);
+int sync_copyfile(struct mailbox *mailbox,
+		  struct index_record *record);
 int sync_append_copyfile(struct mailbox *mailbox,
 			 struct index_record *record);
 
@@ -105,6 +105,11 @@
 /* System library. */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -118,10 +123,15 @@
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 /* Application-specific. */
 #include "assert.h"
+#include "cyr_lock.h"
 #include "nonblock.h"
+#include "retry.h"
 #include "xmalloc.h"
 #include "xstrlcat.h"
 #include "xstrlcpy.h"
@@ -136,6 +146,40 @@
 static struct db *sessdb = NULL;
 static int sess_dbopen = 0;
 
+/*
+ * Optional shared memory session cache (tls_session_cache_slots).
+ *
+ * A fixed array of slots in an mmap()ed file, shared by every server
+ * process.  A session lives in one of two neighbouring slots picked by
+ * its (random) session id; when both are taken the entry expiring
+ * first is evicted, so nothing ever needs pruning.  Readers take a
+ * shared lock on the file, writers an exclusive one.
+ */
+#define SHMCACHE_MAGIC "Cyrus TLS cache\n"
+#define SHMCACHE_DATALEN (2048 - 48)
+
+struct shmcache_header {
+    char magic[16];
+    unsigned long nslots;
+    char pad[64 - 16 - sizeof(unsigned long)];
+};
+
+struct shmcache_slot {
+    time_t expire;
+    unsigned short idlen;
+    unsigned short datalen;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char data[SHMCACHE_DATALEN];
+};
+
+static int sess_shmfd = -1;
+static struct shmcache_slot *sess_shm = NULL;
+static unsigned long sess_shmslots = 0;
+static size_t sess_shmlen = 0;
+
+/* set by ticket_key_cb() when a session was resumed from a ticket */
+static int ticket_resumed = 0;
+
 /* We must keep some of the info available */
 static const char hexcodes[] = "0123456789ABCDEF";
 
@@ -432,6 +476,194 @@ static int set_cert_stuff(SSL_CTX * ctx,
     return (1);
 }
 
+/*
+ * Map the shared memory session cache, creating it if necessary.
+ * The file is never shrunk or cleared once in use, since other
+ * processes may still have it mapped with a different slot count;
+ * entries hashed with an old count simply stop being found.
+ */
+static int shmcache_open(const char *fname, unsigned long nslots)
+{
+    struct shmcache_header hdr;
+    struct stat sbuf;
+    size_t len = sizeof(hdr) + nslots * sizeof(struct shmcache_slot);
+    void *base;
+    int fd;
+
+    fd = open(fname, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return -1;
+    }
+
+    if (lock_blocking(fd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+	close(fd);
+	return -1;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+	goto fail;
+    }
+
+    if (retry_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	memcmp(hdr.magic, SHMCACHE_MAGIC, sizeof(hdr.magic))) {
+	/* new (or foreign) file: start with an empty cache */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SHMCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.nslots = nslots;
+	if (ftruncate(fd, 0) == -1 || ftruncate(fd, len) == -1 ||
+	    lseek(fd, 0, SEEK_SET) == -1 ||
+	    retry_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	    syslog(LOG_ERR, "IOERROR: initializing %s: %m", fname);
+	    goto fail;
+	}
+    }
+    else if ((size_t) sbuf.st_size < len) {
+	/* more slots configured: grow, but keep what is there */
+	hdr.nslots = nslots;
+	if (ftruncate(fd, len) == -1 ||
+	    lseek(fd, 0, SEEK_SET) == -1 ||
+	    retry_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	    syslog(LOG_ERR, "IOERROR: growing %s: %m", fname);
+	    goto fail;
+	}
+    }
+    lock_unlock(fd);
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+	close(fd);
+	return -1;
+    }
+
+    sess_shmfd = fd;
+    sess_shm = (struct shmcache_slot *) ((char *) base + sizeof(hdr));
+    sess_shmslots = nslots;
+    sess_shmlen = len;
+
+    return 0;
+
+ fail:
+    lock_unlock(fd);
+    close(fd);
+    return -1;
+}
+
+static void shmcache_close(void)
+{
+    if (!sess_shm) return;
+
+    munmap((char *) sess_shm - sizeof(struct shmcache_header), sess_shmlen);
+    close(sess_shmfd);
+    sess_shm = NULL;
+    sess_shmfd = -1;
+}
+
+/* the two candidate slots for a session id */
+static struct shmcache_slot *shmcache_slot(const unsigned char *id,
+					   int idlen, int which)
+{
+    unsigned long h = 0;
+    int i;
+
+    for (i = 0; i < idlen; i++) h = h * 31 + id[i];
+
+    return &sess_shm[(h + which) % sess_shmslots];
+}
+
+static int shmcache_match(struct shmcache_slot *slot,
+			  const unsigned char *id, int idlen)
+{
+    return (slot->idlen == idlen && !memcmp(slot->id, id, idlen));
+}
+
+static int shmcache_store(const unsigned char *id, int idlen,
+			  const unsigned char *data, int datalen,
+			  time_t expire)
+{
+    struct shmcache_slot *slot, *victim = NULL;
+    int i;
+
+    /* sessions carrying large client certificates don't fit */
+    if (datalen > SHMCACHE_DATALEN) return -1;
+
+    if (lock_blocking(sess_shmfd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking TLS session cache: %m");
+	return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+	slot = shmcache_slot(id, idlen, i);
+	if (shmcache_match(slot, id, idlen)) {
+	    victim = slot;
+	    break;
+	}
+	/* empty slots have expire == 0 and are taken first */
+	if (!victim || slot->expire < victim->expire) victim = slot;
+    }
+
+    victim->expire = expire;
+    victim->idlen = idlen;
+    victim->datalen = datalen;
+    memcpy(victim->id, id, idlen);
+    memcpy(victim->data, data, datalen);
+
+    lock_unlock(sess_shmfd);
+
+    return 0;
+}
+
+/* copy a cached session into 'data'; returns its length or 0 */
+static int shmcache_fetch(const unsigned char *id, int idlen,
+			  unsigned char *data)
+{
+    struct shmcache_slot *slot;
+    int i, len = 0;
+
+    if (lock_shared(sess_shmfd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking TLS session cache: %m");
+	return 0;
+    }
+
+    for (i = 0; i < 2; i++) {
+	slot = shmcache_slot(id, idlen, i);
+	if (shmcache_match(slot, id, idlen)) {
+	    len = slot->datalen;
+	    memcpy(data, slot->data, len);
+	    break;
+	}
+    }
+
+    lock_unlock(sess_shmfd);
+
+    return len;
+}
+
+static void shmcache_remove(const unsigned char *id, int idlen)
+{
+    struct shmcache_slot *slot;
+    int i;
+
+    if (lock_blocking(sess_shmfd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking TLS session cache: %m");
+	return;
+    }
+
+    for (i = 0; i < 2; i++) {
+	slot = shmcache_slot(id, idlen, i);
+	if (shmcache_match(slot, id, idlen)) {
+	    slot->expire = 0;
+	    slot->idlen = 0;
+	    slot->datalen = 0;
+	}
+    }
+
+    lock_unlock(sess_shmfd);
+}
+
 /*
  * The new_session_cb() is called, whenever a new session has been
  * negotiated and session caching is enabled.  We save the session in
@@ -448,7 +680,7 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
 
     assert(sess);
 
-    if (!sess_dbopen) return 0;
+    if (!sess_dbopen && !sess_shm) return 0;
 
     /* find the size of the ASN1 representation of the session */
     len = i2d_SSL_SESSION(sess, NULL);
@@ -468,7 +700,12 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
     expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
     memcpy(data, &expire, sizeof(time_t));
 
-    if (len) {
+    if (len && sess_shm) {
+	/* store the session in the shared memory cache */
+	ret = shmcache_store(sess->session_id, sess->session_id_length,
+			     data, len + sizeof(time_t), expire);
+    }
+    else if (len) {
 	/* store the session in our database */
 	do {
 	    ret = DB->store(sessdb, (const char *) sess->session_id,
@@ -503,11 +740,16 @@ static void remove_session(unsigned char *id, int idlen)
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
     
-    if (!sess_dbopen) return;
+    if (!sess_dbopen && !sess_shm) return;
 
-    do {
-	ret = DB->delete(sessdb, (const char *) id, idlen, NULL, 1);
-    } while (ret == CYRUSDB_AGAIN);
+    if (sess_shm) {
+	shmcache_remove(id, idlen);
+    }
+    else {
+	do {
+	    ret = DB->delete(sessdb, (const char *) id, idlen, NULL, 1);
+	} while (ret == CYRUSDB_AGAIN);
+    }
 
     /* log this transaction */
     if (var_imapd_tls_loglevel > 0) {
@@ -550,15 +792,24 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     int len = 0;
     time_t expire = 0, now = time(0);
     SSL_SESSION *sess = NULL;
+    unsigned char shmdata[SHMCACHE_DATALEN];
 
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
 
-    if (!sess_dbopen) return NULL;
+    if (!sess_dbopen && !sess_shm) return NULL;
 
-    do {
-	ret = DB->fetch(sessdb, (const char *) id, idlen, &data, &len, NULL);
-    } while (ret == CYRUSDB_AGAIN);
+    if (sess_shm) {
+	len = shmcache_fetch(id, idlen, shmdata);
+	if (len) data = (const char *) shmdata;
+	ret = 0;
+    }
+    else {
+	do {
+	    ret = DB->fetch(sessdb, (const char *) id, idlen,
+			    &data, &len, NULL);
+	} while (ret == CYRUSDB_AGAIN);
+    }
 
     if (!ret && data) {
 	assert(len >= (int) sizeof(time_t));
@@ -595,6 +846,306 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     return sess;
 }
 
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+/*
+ * Stateless session tickets (RFC 5077).
+ *
+ * Ticket keys are never stored: the key for each rotation period
+ * ("epoch") is derived from that epoch's secret, and each secret is
+ * the hash of the one before it.  The config directory holds a single
+ * epoch and its secret, so every imapd/pop3d/etc process (and every
+ * host sharing the file) walks the same chain and issues and accepts
+ * the same tickets without talking to each other.  The key name
+ * carries the epoch, so tickets issued under an older key are still
+ * accepted for the session timeout and are then reissued under the
+ * current one.
+ *
+ * Once no ticket for an epoch can be valid any more, its secret is
+ * hashed away, in memory and in the file, and the chain can't be
+ * walked back: reading the file later doesn't open older tickets.
+ * Removing the file starts a new chain.
+ */
+#define TICKET_SECRET_LEN 48	/* SHA-384 */
+#define TICKET_FILE_LEN (4 + TICKET_SECRET_LEN)
+#define TICKET_NAME_LEN 16	/* fixed by OpenSSL */
+#define TICKET_AES_LEN 16	/* AES-128-CBC */
+#define TICKET_HMAC_LEN 32	/* HMAC-SHA256 */
+
+static unsigned char *ticket_chain = NULL;	/* secrets from ticket_base */
+static unsigned long ticket_nchain = 0;
+static unsigned long ticket_base = 0;		/* oldest epoch accepted */
+static unsigned long ticket_rotation = 0;	/* seconds per key */
+static unsigned long ticket_epochs = 0;		/* old keys still accepted */
+
+/* work out the rotation; returns 0 if tickets are enabled */
+static int ticket_config(int timeout)
+{
+    int rotation = config_getint(IMAPOPT_TLS_TICKET_ROTATION);
+
+    if (timeout > 1440) timeout = 1440; /* 24 hours max */
+    if (timeout <= 0 || rotation <= 0) return -1;
+
+    ticket_rotation = rotation * 60;
+    ticket_epochs = (timeout*60 + ticket_rotation - 1) / ticket_rotation;
+    return 0;
+}
+
+/* the oldest epoch whose tickets are still accepted */
+static unsigned long ticket_oldest(void)
+{
+    unsigned long now = time(0) / ticket_rotation;
+
+    return now > ticket_epochs ? now - ticket_epochs : 0;
+}
+
+/* step a secret on to the next epoch's, forgetting this one */
+static void ticket_ratchet(unsigned char *secret)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+
+    EVP_Digest(secret, TICKET_SECRET_LEN, md, &mdlen, EVP_sha384(), NULL);
+    memcpy(secret, md, TICKET_SECRET_LEN);
+    memset(md, 0, sizeof(md));
+}
+
+/*
+ * Write a new secret file.  A first one is linked into place, so that
+ * concurrent first users all end up with the same chain; later ones
+ * are renamed over the old.
+ */
+static void ticket_secret_write(const char *fname, unsigned long epoch,
+				const unsigned char *secret, int replace)
+{
+    char *tmpname, pidbuf[32];
+    unsigned char buf[TICKET_FILE_LEN];
+    int fd;
+
+    buf[0] = (epoch >> 24) & 0xff;
+    buf[1] = (epoch >> 16) & 0xff;
+    buf[2] = (epoch >> 8) & 0xff;
+    buf[3] = epoch & 0xff;
+    memcpy(buf + 4, secret, TICKET_SECRET_LEN);
+
+    snprintf(pidbuf, sizeof(pidbuf), ".NEW.%d", (int) getpid());
+    tmpname = strconcat(fname, pidbuf, (char *)NULL);
+
+    if ((fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", tmpname);
+    }
+    else {
+	if (retry_write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+	    fsync(fd) == -1) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", tmpname);
+	}
+	else if (replace) {
+	    if (rename(tmpname, fname) == -1) {
+		syslog(LOG_ERR, "IOERROR: renaming %s: %m", fname);
+	    }
+	}
+	else if (link(tmpname, fname) == -1 && errno != EEXIST) {
+	    syslog(LOG_ERR, "IOERROR: linking %s: %m", fname);
+	}
+	close(fd);
+	unlink(tmpname);
+    }
+
+    free(tmpname);
+    memset(buf, 0, sizeof(buf));
+}
+
+/* read the secret file; returns -1 if missing, -2 if unusable */
+static int ticket_secret_read(const char *fname, unsigned long *epoch,
+			      unsigned char *secret)
+{
+    unsigned char buf[TICKET_FILE_LEN];
+    struct stat sbuf;
+    int fd, n = -1;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+	if (errno == ENOENT) return -1;
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return -2;
+    }
+    if (fstat(fd, &sbuf) == 0 && sbuf.st_size == TICKET_FILE_LEN)
+	n = retry_read(fd, buf, sizeof(buf));
+    close(fd);
+
+    if (n != TICKET_FILE_LEN) {
+	memset(buf, 0, sizeof(buf));
+	return -2;
+    }
+
+    *epoch = ((unsigned long) buf[0] << 24) |
+	((unsigned long) buf[1] << 16) |
+	((unsigned long) buf[2] << 8) | buf[3];
+    memcpy(secret, buf + 4, TICKET_SECRET_LEN);
+    memset(buf, 0, sizeof(buf));
+    return 0;
+}
+
+/*
+ * Bring the secret file up to 'oldest': create it on first use if
+ * 'create' is set, or hash it forward once it is older than that.
+ * On success, 'epoch' and 'secret' hold the start of the chain.
+ */
+static int ticket_secret_sync(unsigned long oldest, int create,
+			      unsigned long *epoch, unsigned char *secret)
+{
+    char *fname;
+    int r;
+
+    fname = strconcat(config_dir, FNAME_TLSTICKETKEY, (char *)NULL);
+
+    r = ticket_secret_read(fname, epoch, secret);
+    if (r == 0 && *epoch < oldest) {
+	/* nothing older than 'oldest' can be opened, forget it */
+	while (*epoch < oldest) {
+	    ticket_ratchet(secret);
+	    (*epoch)++;
+	}
+	ticket_secret_write(fname, *epoch, secret, 1);
+    }
+    else if (r < 0 && create) {
+	if (r == -2) {
+	    syslog(LOG_NOTICE, "TLS server engine: replacing %s", fname);
+	}
+	if (RAND_bytes(secret, TICKET_SECRET_LEN) <= 0) {
+	    syslog(LOG_ERR, "TLS server engine: cannot generate ticket key");
+	}
+	else {
+	    ticket_secret_write(fname, oldest, secret, r == -2);
+
+	    /* whoever won the race, use what is there now */
+	    r = ticket_secret_read(fname, epoch, secret);
+	}
+	if (r) syslog(LOG_ERR, "IOERROR: reading %s: bad file", fname);
+    }
+
+    free(fname);
+    return r;
+}
+
+/* fill in the chain after its first secret */
+static void ticket_chain_fill(void)
+{
+    unsigned long i;
+
+    for (i = 1; i < ticket_nchain; i++) {
+	memcpy(ticket_chain + i * TICKET_SECRET_LEN,
+	       ticket_chain + (i - 1) * TICKET_SECRET_LEN, TICKET_SECRET_LEN);
+	ticket_ratchet(ticket_chain + i * TICKET_SECRET_LEN);
+    }
+}
+
+/* load the chain, covering every epoch a ticket may be presented for */
+static int ticket_chain_load(void)
+{
+    /* one extra period each side for clock skew between hosts */
+    ticket_nchain = ticket_epochs + 2;
+    ticket_chain = xmalloc(ticket_nchain * TICKET_SECRET_LEN);
+
+    if (ticket_secret_sync(ticket_oldest(), 1,
+			   &ticket_base, ticket_chain) != 0) {
+	free(ticket_chain);
+	ticket_chain = NULL;
+	return -1;
+    }
+    ticket_chain_fill();
+    return 0;
+}
+
+/* drop the secrets of epochs before 'oldest', here and on disk */
+static void ticket_chain_advance(unsigned long oldest)
+{
+    unsigned char secret[TICKET_SECRET_LEN];
+    unsigned long epoch;
+
+    if (oldest <= ticket_base) return;
+
+    while (ticket_base < oldest) {
+	ticket_ratchet(ticket_chain);
+	ticket_base++;
+    }
+    ticket_chain_fill();
+
+    ticket_secret_sync(oldest, 0, &epoch, secret);
+    memset(secret, 0, sizeof(secret));
+}
+
+/* derive the key name and AES/HMAC keys for an epoch in the chain */
+static void ticket_derive(unsigned long epoch, unsigned char *name,
+			  unsigned char *aeskey, unsigned char *hmackey)
+{
+    unsigned char msg[4], md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+
+    msg[0] = (epoch >> 24) & 0xff;
+    msg[1] = (epoch >> 16) & 0xff;
+    msg[2] = (epoch >> 8) & 0xff;
+    msg[3] = epoch & 0xff;
+
+    HMAC(EVP_sha512(),
+	 ticket_chain + (epoch - ticket_base) * TICKET_SECRET_LEN,
+	 TICKET_SECRET_LEN, msg, sizeof(msg), md, &mdlen);
+
+    /* name = epoch + check value, so foreign tickets are rejected early */
+    memcpy(name, msg, 4);
+    memcpy(name + 4, md, TICKET_NAME_LEN - 4);
+    memcpy(aeskey, md + 12, TICKET_AES_LEN);
+    memcpy(hmackey, md + 12 + TICKET_AES_LEN, TICKET_HMAC_LEN);
+
+    memset(md, 0, sizeof(md));
+}
+
+static int ticket_key_cb(SSL *ssl __attribute__((unused)),
+			 unsigned char *key_name, unsigned char *iv,
+			 EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    unsigned char name[TICKET_NAME_LEN];
+    unsigned char aeskey[TICKET_AES_LEN], hmackey[TICKET_HMAC_LEN];
+    unsigned long now = time(0) / ticket_rotation, epoch;
+    int r = 1;
+
+    ticket_chain_advance(ticket_oldest());
+
+    if (enc) {
+	/* issue a new ticket under the current key */
+	if (now < ticket_base || now >= ticket_base + ticket_nchain) return 0;
+	if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) <= 0)
+	    return -1;
+	ticket_derive(now, key_name, aeskey, hmackey);
+	EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, aeskey, iv);
+    }
+    else {
+	epoch = ((unsigned long) key_name[0] << 24) |
+	    ((unsigned long) key_name[1] << 16) |
+	    ((unsigned long) key_name[2] << 8) | key_name[3];
+
+	/* allow one period of clock skew between hosts */
+	if (epoch > now + 1 || epoch + ticket_epochs < now) return 0;
+	if (epoch < ticket_base || epoch >= ticket_base + ticket_nchain)
+	    return 0;
+
+	ticket_derive(epoch, name, aeskey, hmackey);
+	if (memcmp(name, key_name, TICKET_NAME_LEN)) return 0;
+
+	EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, aeskey, iv);
+
+	/* an older key is still good, but renew the ticket */
+	if (epoch < now) r = 2;
+	ticket_resumed = 1;
+    }
+    HMAC_Init_ex(hctx, hmackey, TICKET_HMAC_LEN, EVP_sha256(), NULL);
+
+    memset(aeskey, 0, sizeof(aeskey));
+    memset(hmackey, 0, sizeof(hmackey));
+
+    return r;
+}
+#endif /* SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB */
+
 /*
  * Seed the random number generator.
  */
@@ -632,6 +1183,7 @@ int     tls_init_serverengine(const char *ident,
     const char   *s_key_file;
     int    requirecert;
     int    timeout;
+    int    slots;
 
     if (tls_serverengine)
 	return (0);				/* already running */
@@ -697,24 +1249,49 @@ int     tls_init_serverengine(const char *ident,
 	SSL_CTX_sess_set_remove_cb(s_ctx, remove_session_cb);
 	SSL_CTX_sess_set_get_cb(s_ctx, get_session_cb);
 
-	fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
-
-	/* create the name of the db file */
-	if (!fname) {
-	    tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
-	    fname = tofree;
+	/* Prefer the shared memory cache, if configured */
+	slots = config_getint(IMAPOPT_TLS_SESSION_CACHE_SLOTS);
+	if (slots > 0) {
+	    tofree = strconcat(config_dir, FNAME_TLSSESSIONSHM, (char *)NULL);
+	    shmcache_open(tofree, slots);
+	    free(tofree);
+	    tofree = NULL;
 	}
 
-	r = (DB->open)(fname, CYRUSDB_CREATE, &sessdb);
-	if (r != 0) {
-	    syslog(LOG_ERR, "DBERROR: opening %s: %s",
-		   fname, cyrusdb_strerror(ret));
+	if (!sess_shm) {
+	    fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
+
+	    /* create the name of the db file */
+	    if (!fname) {
+		tofree = strconcat(config_dir, FNAME_TLSSESSIONS,
+				   (char *)NULL);
+		fname = tofree;
+	    }
+
+	    r = (DB->open)(fname, CYRUSDB_CREATE, &sessdb);
+	    if (r != 0) {
+		syslog(LOG_ERR, "DBERROR: opening %s: %s",
+		       fname, cyrusdb_strerror(r));
+	    }
+	    else
+		sess_dbopen = 1;
+
+	    free(tofree);
 	}
-	else
-	    sess_dbopen = 1;
+    }
 
-	free(tofree);
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    /*
+     * Without a shared key, OpenSSL would issue tickets that only the
+     * issuing process could decrypt, so either share one or don't.
+     */
+    if (ticket_config(timeout) == 0 && ticket_chain_load() == 0) {
+	SSL_CTX_set_tlsext_ticket_key_cb(s_ctx, ticket_key_cb);
+    }
+    else {
+	SSL_CTX_set_options(s_ctx, SSL_OP_NO_TICKET);
     }
+#endif
 
     cipher_list = config_getstring(IMAPOPT_TLS_CIPHER_LIST);
     if (!SSL_CTX_set_cipher_list(s_ctx, cipher_list)) {
@@ -821,6 +1398,9 @@ int tls_start_servertls(int readfd, int writefd, int timeout,
     int tls_cipher_usebits = 0;
     int tls_cipher_algbits = 0;
     SSL *tls_conn;
+    struct timeval hs_start, hs_end;
+    long hs_msec;
+    const char *reuse;
     int r = 0;
 
     assert(tls_serverengine);
@@ -863,6 +1443,9 @@ int tls_start_servertls(int readfd, int writefd, int timeout,
     if (var_imapd_tls_loglevel >= 3)
 	do_dump = 1;
 
+    ticket_resumed = 0;
+    gettimeofday(&hs_start, NULL);
+
     nonblock(readfd, 1);
     while (1) {
 	fd_set rfds;
@@ -936,6 +1519,10 @@ int tls_start_servertls(int readfd, int writefd, int timeout,
 	/* Should never get here */
     }
 
+    gettimeofday(&hs_end, NULL);
+    hs_msec = (hs_end.tv_sec - hs_start.tv_sec) * 1000 +
+	(hs_end.tv_usec - hs_start.tv_usec) / 1000;
+
     /* Only loglevel==4 dumps everything */
     if (var_imapd_tls_loglevel < 4)
 	do_dump = 0;
@@ -1002,19 +1589,22 @@ int tls_start_servertls(int readfd, int writefd, int timeout,
 	*layerbits = tls_cipher_usebits;
     }
 
+    /* full vs. abbreviated handshake, and where the session came from */
+    if (!SSL_session_reused(tls_conn)) reuse = "new";
+    else if (ticket_resumed) reuse = "reused ticket";
+    else reuse = "reused";
+
     if (authid && *authid) {
-	syslog(LOG_NOTICE, "starttls: %s with cipher %s (%d/%d bits %s)"
+	syslog(LOG_NOTICE, "starttls: %s with cipher %s (%d/%d bits %s, %ldms)"
 	                   " authenticated as %s", 
 	       tls_protocol, tls_cipher_name,
-	       tls_cipher_usebits, tls_cipher_algbits, 
-	       SSL_session_reused(tls_conn) ? "reused" : "new",
+	       tls_cipher_usebits, tls_cipher_algbits, reuse, hs_msec,
 	       *authid);
     } else {
-	syslog(LOG_NOTICE, "starttls: %s with cipher %s (%d/%d bits %s)"
+	syslog(LOG_NOTICE, "starttls: %s with cipher %s (%d/%d bits %s, %ldms)"
 	                   " no authentication", 
 	       tls_protocol, tls_cipher_name,
-	       tls_cipher_usebits, tls_cipher_algbits,
-	       SSL_session_reused(tls_conn) ? "reused" : "new");
+	       tls_cipher_usebits, tls_cipher_algbits, reuse, hs_msec);
     }
 
  done:
@@ -1073,6 +1663,8 @@ int tls_shutdown_serverengine(void)
 	sess_dbopen = 0;
     }
 
+    shmcache_close();
+
     return 0;
 
 }
@@ -1138,6 +1730,17 @@ int tls_prune_sessions(void)
     int ret;
     struct prunerock prock;
 
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    /* forget the ticket secrets nobody may use any more */
+    if (ticket_config(config_getint(IMAPOPT_TLS_SESSION_TIMEOUT)) == 0) {
+	unsigned char secret[TICKET_SECRET_LEN];
+	unsigned long epoch;
+
+	ticket_secret_sync(ticket_oldest(), 0, &epoch, secret);
+	memset(secret, 0, sizeof(secret));
+    }
+#endif
+
     fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
 
    /* create the name of the db file */
@@ -55,6 +55,12 @@ int tls_enabled(void);
 /* name of the SSL/TLS sessions database */
 #define FNAME_TLSSESSIONS "/tls_sessions.db"
 
+/* name of the shared memory SSL/TLS session cache */
+#define FNAME_TLSSESSIONSHM "/tls_sessions.shm"
+
+/* name of the secret from which session ticket keys are derived */
+#define FNAME_TLSTICKETKEY "/tls_ticket.key"
+
 #ifdef HAVE_SSL
 
 #include <openssl/ssl.h>
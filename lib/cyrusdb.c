@@ -96,10 +96,112 @@ void cyrusdb_init()
     }
 }
 
-void cyrusdb_done() 
+/*
+ * Per-user databases kept open between uses (userdb_cache_size).
+ *
+ * A long-lived process (imapd serving one session after another)
+ * otherwise opens and closes the same user's seen and subscription
+ * databases for every session.  Entries are keyed on backend and
+ * filename; an entry in use belongs to whoever opened it, an idle one
+ * is handed back out by the next open of the same file.  The backends
+ * already notice a file replaced underneath an open handle, so the
+ * only thing checked here is that the file still exists.
+ */
+struct dbcache_entry {
+    struct cyrusdb_backend *backend;
+    char *fname;
+    struct db *db;
+    int inuse;
+    unsigned long lastuse;
+};
+
+static struct dbcache_entry *dbcache = NULL;
+static int dbcache_size = 0;
+static unsigned long dbcache_clock = 0;
+
+static void dbcache_drop(struct dbcache_entry *e)
+{
+    (e->backend->close)(e->db);
+    free(e->fname);
+    memset(e, 0, sizeof(struct dbcache_entry));
+}
+
+int cyrusdb_cachedopen(struct cyrusdb_backend *backend,
+		       const char *fname, int flags, struct db **ret)
+{
+    struct dbcache_entry *e, *slot = NULL;
+    struct stat sbuf;
+    int i, r, shared = 0;
+
+    if (!dbcache) {
+	dbcache_size = libcyrus_config_getint(CYRUSOPT_USERDB_CACHE_SIZE);
+	if (dbcache_size <= 0) return (backend->open)(fname, flags, ret);
+	dbcache = xzmalloc(dbcache_size * sizeof(struct dbcache_entry));
+    }
+
+    for (i = 0; i < dbcache_size; i++) {
+	e = &dbcache[i];
+	if (!e->db) {
+	    if (!slot || slot->db) slot = e;
+	    continue;
+	}
+	if (e->backend == backend && !strcmp(e->fname, fname)) {
+	    if (e->inuse) {
+		/* opened twice; the backend may hand out the same handle */
+		shared = 1;
+		continue;
+	    }
+	    if (stat(fname, &sbuf) == 0) {
+		e->inuse = 1;
+		e->lastuse = ++dbcache_clock;
+		*ret = e->db;
+		return CYRUSDB_OK;
+	    }
+	    /* removed since we last used it */
+	    dbcache_drop(e);
+	    slot = e;
+	    continue;
+	}
+	if (e->inuse) continue;
+	if (!slot || (slot->db && e->lastuse < slot->lastuse)) slot = e;
+    }
+
+    r = (backend->open)(fname, flags, ret);
+    if (r || !slot || shared) return r;
+
+    /* remember it, evicting the least recently used idle entry */
+    if (slot->db) dbcache_drop(slot);
+    slot->backend = backend;
+    slot->fname = xstrdup(fname);
+    slot->db = *ret;
+    slot->inuse = 1;
+    slot->lastuse = ++dbcache_clock;
+
+    return r;
+}
+
+int cyrusdb_cachedclose(struct cyrusdb_backend *backend, struct db *db)
 {
     int i;
-    
+
+    for (i = 0; i < dbcache_size; i++) {
+	if (dbcache[i].db == db && dbcache[i].inuse) {
+	    dbcache[i].inuse = 0;
+	    return CYRUSDB_OK;
+	}
+    }
+
+    return (backend->close)(db);
+}
+
+void cyrusdb_done()
+{
+    int i;
+
+    for (i = 0; i < dbcache_size; i++) {
+	if (dbcache[i].db) dbcache_drop(&dbcache[i]);
+    }
+
     for(i=0; cyrusdb_backends[i]; i++) {
 	(cyrusdb_backends[i])->done();
     }
@@ -200,6 +200,12 @@ extern void cyrusdb_convert(const char *fromfname, const char *tofname,
 
 extern const char *cyrusdb_detect(const char *fname);
 
+/* open/close a per-user database through the userdb_cache_size LRU */
+extern int cyrusdb_cachedopen(struct cyrusdb_backend *backend,
+			      const char *fname, int flags, struct db **ret);
+extern int cyrusdb_cachedclose(struct cyrusdb_backend *backend,
+			       struct db *db);
+
 /* Start/Stop the backends */
 void cyrusdb_init();
 void cyrusdb_done();
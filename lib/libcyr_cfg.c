@@ -158,6 +158,10 @@ struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_USERDB_CACHE_SIZE,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
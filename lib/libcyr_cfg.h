@@ -116,6 +116,8 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Per-user databases to keep open between uses (0) */
+    CYRUSOPT_USERDB_CACHE_SIZE,
 
     CYRUSOPT_LAST
     
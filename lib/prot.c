@@ -43,6 +43,7 @@
  */
 
 #include <config.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -58,10 +59,14 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -283,7 +288,7 @@ sasl_conn_t *conn;
 void prot_unsetsasl(struct protstream *s)
 {
     s->conn = NULL;
-    s->maxplain = PROT_BUFSIZE;
+    s->maxplain = s->buf_size;
     s->saslssf = 0;
 }
 
@@ -326,7 +331,7 @@ int prot_setcompress(struct protstream *s)
 	        goto error;
 	}
 
-	s->zlevel = Z_DEFAULT_COMPRESSION;
+	s->zlevel = s->zdeflevel = Z_DEFAULT_COMPRESSION;
 	zr = deflateInit2(zstrm, s->zlevel, Z_DEFLATED,
 		          -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
     }
@@ -345,16 +350,17 @@ int prot_setcompress(struct protstream *s)
      * format defined here, the worst case expansion is 5 bytes per 32K-
      * byte block, i.e., a size increase of 0.015% for large data sets.
      *
-     * We say: maxplain can never be bigger than PROT_BUFSIZE, which
-     * is currently 4096, so adding 5 bytes will do it!
+     * We say: maxplain is no bigger than PROT_BUFSIZE_MAX, which
+     * is currently 64K, so adding 10 bytes will do it!
      * 
      * Add another spare byte and we'll never totally fill the buffer,
      * which saves a loop.
      *
      * NOTE: we do double check and handle buffer filling gracefully
-     * anyway, but starting with the right size is good.
+     * anyway (the output buffer may grow after this), but starting
+     * with the right size is good.
      */
-    s->zbuf_size = s->maxplain + 6;
+    s->zbuf_size = s->maxplain + 11;
     s->zbuf = (unsigned char *) xmalloc(sizeof(unsigned char) * s->zbuf_size);
     syslog(LOG_DEBUG, "created %scompress buffer of %u bytes",
 	   s->write ? "" : "de", s->zbuf_size);
@@ -369,6 +375,37 @@ error:
     return EOF;
 }
 
+/*
+ * Set the compression level used for compressible data on the output
+ * stream 's', which must already have compression enabled.
+ */
+int prot_setcompresslevel(struct protstream *s, int level)
+{
+    int zr;
+
+    assert(s->write && s->zstrm);
+
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+	level = Z_DEFAULT_COMPRESSION;
+
+    if (s->ptr != s->buf || s->zflush) {
+	/* compress any pending output at the old level */
+	if (prot_flush_internal(s, 1) == EOF) return EOF;
+    }
+
+    s->zdeflevel = level;
+    if (s->zlevel != Z_NO_COMPRESSION && s->zlevel != level) {
+	s->zlevel = level;
+	zr = deflateParams(s->zstrm, s->zlevel, Z_DEFAULT_STRATEGY);
+	if (zr != Z_OK) {
+	    s->error = xstrdup("Error setting compression level");
+	    return EOF;
+	}
+    }
+
+    return 0;
+}
+
 /* Table of incompressible file type signatures */
 static struct file_sig {
     const char *type;
@@ -378,8 +415,16 @@ static struct file_sig {
     { "GIF87a",	6, "GIF87a" },
     { "GIF89a",	6, "GIF89a" },
     { "GZIP",	2, "\x1F\x8B" },
-    { "JPEG",	4, "\xFF\xD8\xFF\xE0" },
+    { "JPEG",	3, "\xFF\xD8\xFF" },
     { "PNG",	8, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A" },
+    { "ZIP",	4, "PK\x03\x04" },
+    { "BZIP2",	3, "BZh" },
+    { "XZ",	6, "\xFD" "7zXZ\x00" },
+    { "7Z",	6, "7z\xBC\xAF\x27\x1C" },
+    { "ZSTD",	4, "\x28\xB5\x2F\xFD" },
+    { "RAR",	6, "Rar!\x1A\x07" },
+    { "OGG",	4, "OggS" },
+    { "MP3",	3, "ID3" },
     { NULL,	0, NULL }
 };
 
@@ -404,6 +449,12 @@ static int is_incompressible(const char *p, size_t n)
 
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_ZLIB
+#define prot_zpending(s) ((s)->zflush)
+#else
+#define prot_zpending(s) (0)
+#endif /* HAVE_ZLIB */
+
 /* Tell the protstream that the type of data is about to change.
  * Since we might want to look at the data, we only set a flag and delay
  * any changes to the stream layers until the next prot_write().
@@ -797,6 +848,39 @@ int prot_flush(struct protstream *s)
     return prot_flush_internal(s, 1);
 }
 
+/*
+ * Set the number of milliseconds for which prot_flush_pipelined() may
+ * hold back output on 's'.
+ */
+int prot_setflushdelay(struct protstream *s, int msec)
+{
+    assert(s->write);
+
+    s->flushdelay = msec > 0 ? msec : 0;
+    return 0;
+}
+
+/*
+ * Flush the output stream 's', unless the input stream 'in' already
+ * holds more (pipelined) input and the output has not been held for
+ * longer than the flush delay of 's'.  Responses to a burst of
+ * pipelined commands then go out (and get compressed) together.
+ */
+int prot_flush_pipelined(struct protstream *s, struct protstream *in)
+{
+    struct timeval now;
+    long held;
+
+    if (s->flushdelay && in && in->cnt > 0) {
+	gettimeofday(&now, NULL);
+	held = (now.tv_sec - s->flushmark.tv_sec) * 1000 +
+	    (now.tv_usec - s->flushmark.tv_usec) / 1000;
+	if (held >= 0 && held < s->flushdelay) return 0;
+    }
+
+    return prot_flush_internal(s, 1);
+}
+
 /* Do the logging part of prot_flush */
 static void prot_flush_log(struct protstream *s) 
 {
@@ -857,7 +941,7 @@ static int prot_flush_encode(struct protstream *s,
 		s->zbuf_size += PROT_BUFSIZE;
 	    }
 
-	    zr = deflate(s->zstrm, Z_SYNC_FLUSH);
+	    zr = deflate(s->zstrm, s->zlazy ? Z_NO_FLUSH : Z_SYNC_FLUSH);
 	    if (!(zr == Z_OK || zr == Z_STREAM_END || zr == Z_BUF_ERROR)) {
 		/* something went wrong */
 		syslog(LOG_ERR, "zlib deflate error: %d %s", zr, s->zstrm->msg);
@@ -873,6 +957,9 @@ static int prot_flush_encode(struct protstream *s,
 	     */
 	} while (!s->zstrm->avail_out);
 
+	/* a lazy flush may leave data in the compressor */
+	s->zflush = s->zlazy;
+
 	ptr = s->zbuf;
 	left = s->zbuf_size - s->zstrm->avail_out;
     }
@@ -920,6 +1007,11 @@ static int prot_flush_writebuffer(struct protstream *s,
 	cmdtime_netend();
     } while (n == -1 && errno == EINTR && !signals_poll());
 
+    if (n != -1) {
+	s->write_calls++;
+	s->write_bytes += n;
+    }
+
     return n;
 }
 
@@ -975,8 +1067,8 @@ int prot_flush_internal(struct protstream *s, int force)
 	    s->big_buffer = PROT_NO_FD;
 	}
 
-	/* Is there anything in the memory buffer? */
-	if(!left) {
+	/* Is there anything in the memory buffer (or the compressor)? */
+	if(!left && !prot_zpending(s)) {
 	    goto done;
 	}
 
@@ -991,7 +1083,7 @@ int prot_flush_internal(struct protstream *s, int force)
 	}
 
 	/* Write it to descriptor */
-	do {
+	while(left) {
 	    n = prot_flush_writebuffer(s, ptr, left);
 	    if(n == -1) {
 		s->error = xstrdup(strerror(errno));
@@ -1000,7 +1092,7 @@ int prot_flush_internal(struct protstream *s, int force)
 		ptr += n;
 		left -= n;
 	    }
-	} while(left);
+	}
     } else { /* Nonblocking */
 	/* If we've been feeding a bigbuffer, write out from the current
 	 * position as much as we can */
@@ -1022,8 +1114,9 @@ int prot_flush_internal(struct protstream *s, int force)
 	    }
 	}
 
-	/* If there isn't anything in the memory buffer, we're done now */
-	if(!left) {
+	/* If there isn't anything in the memory buffer (or the compressor),
+	 * we're done now */
+	if(!left && !prot_zpending(s)) {
 	    goto done;
 	}
 
@@ -1036,7 +1129,8 @@ int prot_flush_internal(struct protstream *s, int force)
 	    goto done;
 	}
 
-	if(s->big_buffer == PROT_NO_FD || s->bigbuf_pos == s->bigbuf_len) {
+	if(left &&
+	   (s->big_buffer == PROT_NO_FD || s->bigbuf_pos == s->bigbuf_len)) {
 	    /* No bigbuffer currently open (or we've written the current
 	       one to its entirety), so write what we can from memory */
 
@@ -1102,6 +1196,10 @@ int prot_flush_internal(struct protstream *s, int force)
     /* Reset the memory buffer -- should be done on EOF or on success. */
     s->ptr = s->buf;
     s->cnt = s->maxplain;
+
+    /* remember when output last went out in full */
+    if (s->flushdelay && !s->dontblock && !prot_zpending(s))
+	gettimeofday(&s->flushmark, NULL);
         
  done:
     /* are we done with the big buffer? If so, free it. This includes
@@ -1131,6 +1229,131 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+/*
+ * The buffer of 's' is full and more output is on its way: pass the
+ * data on without making the compressor emit a sync point for it.
+ */
+static int prot_flush_full(struct protstream *s)
+{
+    int r;
+
+#ifdef HAVE_ZLIB
+    s->zlazy = 1;
+    r = prot_flush_internal(s, 0);
+    s->zlazy = 0;
+#else
+    r = prot_flush_internal(s, 0);
+#endif /* HAVE_ZLIB */
+
+    return r;
+}
+
+/*
+ * Is the output stream 's' a plain blocking stream, so that data can
+ * go to the descriptor without passing through the memory buffer?
+ */
+static int prot_is_plain(struct protstream *s)
+{
+    if (!s->write || s->error || s->eof) return 0;
+    if (s->fd == PROT_NO_FD || s->logfd != PROT_NO_FD) return 0;
+    if (s->saslssf != 0) return 0;
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif /* HAVE_SSL */
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif /* HAVE_ZLIB */
+    /* nonblocking streams may need to spill into the bigbuffer */
+    if (s->dontblock || s->big_buffer != PROT_NO_FD) return 0;
+
+    return 1;
+}
+
+/*
+ * Grow the output buffer of 's' so that 'len' more bytes fit, doubling
+ * it up to PROT_BUFSIZE_MAX.  Streams with a SASL security layer stay
+ * at the size the layer asked for.  Returns 0 if the buffer is already
+ * as big as it may get.
+ */
+static int prot_grow(struct protstream *s, unsigned len)
+{
+    unsigned used = s->ptr - s->buf;
+    unsigned size = s->buf_size;
+
+    if (s->saslssf != 0 || size >= PROT_BUFSIZE_MAX) return 0;
+
+    do {
+	size *= 2;
+    } while (size - used <= len && size < PROT_BUFSIZE_MAX);
+
+    s->buf = (unsigned char *) xrealloc(s->buf, size);
+    s->ptr = s->buf + used;
+    s->cnt += size - s->buf_size;
+    s->buf_size = s->maxplain = size;
+
+    return 1;
+}
+
+/*
+ * Send the buffered output of 's' followed by the 'len' bytes at 'buf'
+ * to the descriptor in as few writev() calls as possible, without
+ * copying 'buf'.  Only for streams where prot_is_plain() holds.
+ */
+static int prot_flush_writev(struct protstream *s,
+			     const char *buf, unsigned len)
+{
+    struct iovec iov[2];
+    struct iovec *iovp = iov;
+    int niov = 0;
+    ssize_t n;
+
+    if (s->dontblock_isset) {
+	nonblock(s->fd, 0);
+	s->dontblock_isset = 0;
+    }
+
+    if (s->ptr != s->buf) {
+	iov[niov].iov_base = s->buf;
+	iov[niov++].iov_len = s->ptr - s->buf;
+    }
+    iov[niov].iov_base = (char *) buf;
+    iov[niov++].iov_len = len;
+
+    while (niov) {
+	cmdtime_netstart();
+	n = writev(s->fd, iovp, niov);
+	cmdtime_netend();
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    s->error = xstrdup(strerror(errno));
+	    break;
+	}
+
+	s->write_calls++;
+	s->write_bytes += n;
+
+	/* skip over what was written */
+	while (niov && (size_t) n >= iovp->iov_len) {
+	    n -= iovp->iov_len;
+	    iovp++;
+	    niov--;
+	}
+	if (niov) {
+	    iovp->iov_base = (char *) iovp->iov_base + n;
+	    iovp->iov_len -= n;
+	}
+    }
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+
+    if (s->error) return EOF;
+
+    s->bytes_out += len;
+    return 0;
+}
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -1145,7 +1368,7 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
 #ifdef HAVE_ZLIB
 	if (s->zstrm) {
 	    int zr = Z_OK;
-	    int zlevel = Z_DEFAULT_COMPRESSION;
+	    int zlevel = s->zdeflevel;
 
 	    if (is_incompressible(buf, len))
 		zlevel = Z_NO_COMPRESSION;
@@ -1154,7 +1377,7 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
 		s->zlevel = zlevel;
 
 		/* flush any pending data */
-		if (s->ptr != s->buf) {
+		if (s->ptr != s->buf || s->zflush) {
 		    if (prot_flush_internal(s, 1) == EOF) return EOF;
 		}
 
@@ -1171,15 +1394,21 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
 	s->boundary = 0;
     }
 
+    /* bulk output: let the buffer grow towards the high-water mark */
+    if (len >= s->cnt) prot_grow(s, len);
+
+    /* still doesn't fit: send it along with the buffer, uncopied */
+    if (len >= s->cnt && prot_is_plain(s))
+	return prot_flush_writev(s, buf, len);
+
     while (len >= s->cnt) {
-	/* XXX can we manage to write data from 'buf' without copying it
-	   to s->ptr ? */
 	memcpy(s->ptr, buf, s->cnt);
 	s->ptr += s->cnt;
+	s->bytes_out += s->cnt;
 	buf += s->cnt;
 	len -= s->cnt;
 	s->cnt = 0;
-	if (prot_flush_internal(s,0) == EOF) return EOF;
+	if (prot_flush_full(s) == EOF) return EOF;
     }
     memcpy(s->ptr, buf, len);
     s->ptr += len;
@@ -1196,6 +1425,91 @@ int prot_putbuf(struct protstream *s, struct buf *buf)
     return prot_write(s, buf->s, buf->len);
 }
 
+/*
+ * Can the output stream 's' hand file data straight to the kernel?
+ * Only when nothing between us and the socket needs to see the bytes:
+ * no TLS, no SASL security layer, no compression and no telemetry.
+ */
+int prot_can_sendfile(struct protstream *s)
+{
+#ifdef HAVE_SENDFILE
+    return prot_is_plain(s);
+#else
+    (void)s;
+    return 0;
+#endif /* HAVE_SENDFILE */
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes of the file open on
+ * 'fd' starting at 'offset'.  When prot_can_sendfile() allows it, any
+ * buffered output is flushed and the file data is passed to the kernel
+ * with sendfile(), otherwise it is read and sent through prot_write().
+ */
+int prot_sendfile(struct protstream *s, int fd, off_t offset, size_t len)
+{
+    char buf[PROT_BUFSIZE];
+    ssize_t n;
+
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+#ifdef HAVE_SENDFILE
+    if (prot_can_sendfile(s)) {
+	/* everything already queued must go out ahead of the file data */
+	if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+	/* there are no layers to adjust for the type of the data */
+	s->boundary = 0;
+
+	while (len) {
+	    cmdtime_netstart();
+	    n = sendfile(s->fd, fd, &offset, len);
+	    cmdtime_netend();
+
+	    if (n == -1) {
+		if (errno == EINTR && !signals_poll()) continue;
+		/* not supported for this file or socket, copy the rest */
+		if (errno == EINVAL || errno == ENOSYS) break;
+		s->error = xstrdup(strerror(errno));
+		return EOF;
+	    }
+	    if (n == 0) {
+		/* file shorter than advertised */
+		s->error = xstrdup("unexpected end of file");
+		return EOF;
+	    }
+
+	    len -= n;
+	    s->bytes_out += n;
+	    s->write_calls++;
+	    s->write_bytes += n;
+	}
+
+	if (!len) return 0;
+    }
+#endif /* HAVE_SENDFILE */
+
+    while (len) {
+	n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    s->error = xstrdup(strerror(errno));
+	    return EOF;
+	}
+	if (n == 0) {
+	    s->error = xstrdup("unexpected end of file");
+	    return EOF;
+	}
+	if (prot_write(s, buf, n) == EOF) return EOF;
+	offset += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
 /*
  * Stripped-down version of printf() that works on protection streams
  * Only understands '%lld', '%llu', '%ld', '%lu', '%d', %u', '%s',
@@ -1426,6 +1740,35 @@ int prot_read(struct protstream *s, char *buf, unsigned size)
     return size;
 }
 
+/*
+ * If a whole word (terminated by whitespace, a paren or a double quote,
+ * as getword() reads it) is already in the input buffer of 's', consume
+ * it and return a pointer to it, setting 'len'.  The terminator is left
+ * unread and the pointer is only valid until the next read.  Returns
+ * NULL, consuming nothing, if the word runs past the buffered data.
+ */
+const char *prot_bufword(struct protstream *s, unsigned *len)
+{
+    const unsigned char *p = s->ptr, *end = s->ptr + s->cnt;
+
+    assert(!s->write);
+
+    for (; p < end; p++) {
+	if (Uisspace(*p) || *p == '(' || *p == ')' || *p == '\"') {
+	    const char *word = (const char *)s->ptr;
+
+	    *len = p - s->ptr;
+	    s->ptr += *len;
+	    s->cnt -= *len;
+	    s->can_unget += *len;
+	    s->bytes_in += *len;
+	    return word;
+	}
+    }
+
+    return NULL;
+}
+
 /*
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
@@ -1754,8 +2097,8 @@ int prot_putc(int c, struct protstream *s)
     *s->ptr++ = c;
 
     s->bytes_out++;
-    if (--s->cnt == 0)
-	return prot_flush_internal(s,0);
+    if (--s->cnt == 0 && !prot_grow(s, 1))
+	return prot_flush_full(s);
 
     return 0;
 }
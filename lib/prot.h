@@ -49,6 +49,8 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/time.h>
 
 #include <sasl/sasl.h>
 
@@ -65,8 +67,14 @@
 #define PROT_BUFSIZE 4096
 /* #define PROT_BUFSIZE 8192 */
 
+/* High-water mark for output buffers, which grow under bulk output */
+#define PROT_BUFSIZE_MAX (16 * PROT_BUFSIZE)
+
 #define PROT_NO_FD -1
 
+/* Smallest write worth handing to prot_sendfile() instead of copying */
+#define PROT_SENDFILE_MIN (4 * PROT_BUFSIZE)
+
 struct protstream;
 struct prot_waitevent;
 
@@ -100,8 +108,10 @@ struct protstream {
     unsigned char *zbuf;
     unsigned int zbuf_size;
     /* Compress parameters */
-    int zlevel;
-    int zflush;
+    int zlevel;    /* current level */
+    int zdeflevel; /* level for compressible data */
+    int zflush;    /* compressor holds data not yet sync flushed */
+    int zlazy;     /* this flush need not emit a sync point */
 #endif /* HAVE_ZLIB */
 
     /* Big Buffer Information */
@@ -123,10 +133,14 @@ struct protstream {
     int read_timeout;
     time_t timeout_mark;
     struct protstream *flushonread;
+    int flushdelay; /* msec prot_flush_pipelined() may hold output */
+    struct timeval flushmark; /* when output last went out in full */
 
     int can_unget;
     int bytes_in;
     int bytes_out;
+    int write_calls;            /* write syscalls on fd */
+    unsigned long write_bytes;  /* bytes they wrote */
     int isclient;
 
     /* Events */
@@ -195,6 +209,13 @@ extern int prot_bytes_out(struct protstream *s);
 #define prot_bytes_in(s) ((s)->bytes_in)
 #define prot_bytes_out(s) ((s)->bytes_out)
 
+/* Get output syscall counts and the average size of those writes */
+extern int prot_write_calls(struct protstream *s);
+extern unsigned long prot_write_avg(struct protstream *s);
+#define prot_write_calls(s) ((s)->write_calls)
+#define prot_write_avg(s) \
+    ((s)->write_calls ? (s)->write_bytes / (s)->write_calls : 0)
+
 /* Set the SASL options for a protstream (requires authentication to
  * be complete for the given sasl_conn_t */
 extern int prot_setsasl(struct protstream *s, sasl_conn_t *conn);
@@ -213,6 +234,9 @@ int prot_setisclient(struct protstream *s, int val);
 #ifdef HAVE_ZLIB
 /* Enable (de)compression for a given protstream */
 int prot_setcompress(struct protstream *s);
+
+/* Set the zlib level for compressible output (-1 for the default) */
+int prot_setcompresslevel(struct protstream *s, int level);
 #endif /* HAVE_ZLIB */
 
 /* Tell the protstream that the type of data is about to change. */
@@ -248,9 +272,17 @@ extern int prot_fill(struct protstream *s);
 /* Force a flush of an output stream */
 extern int prot_flush(struct protstream *s);
 
+/* Flush an output stream unless pipelined input is waiting and the
+ * output is still within the delay set by prot_setflushdelay() */
+extern int prot_setflushdelay(struct protstream *s, int msec);
+extern int prot_flush_pipelined(struct protstream *s, struct protstream *in);
+
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
+extern int prot_sendfile(struct protstream *s, int fd, off_t offset,
+			 size_t len);
+extern int prot_can_sendfile(struct protstream *s);
 extern int prot_printf(struct protstream *, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
@@ -262,6 +294,7 @@ extern int prot_printliteral(struct protstream *out, const char *s,
 extern int prot_printstring(struct protstream *out, const char *s);
 extern int prot_printastring(struct protstream *out, const char *s);
 extern int prot_read(struct protstream *s, char *buf, unsigned size);
+extern const char *prot_bufword(struct protstream *s, unsigned *len);
 extern char *prot_fgets(char *buf, unsigned size, struct protstream *s);
 
 /* select() for protstreams */
@@ -89,6 +89,16 @@ struct variable4 cyrusMasterMIB_variables[] = {
   { SERVICEID           , ASN_INTEGER   , NOACCESS , var_serviceTable, 3, { 2,1,4 } },
 #define   SERVICECONNS          9
   { SERVICECONNS        , ASN_COUNTER   , NOACCESS , var_serviceTable, 3, { 2,1,5 } },
+#define   SERVICEREADY          10
+  { SERVICEREADY        , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,6 } },
+#define   SERVICEPREFORK        11
+  { SERVICEPREFORK      , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,7 } },
+#define   SERVICEQUEUE          12
+  { SERVICEQUEUE        , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,8 } },
+#define   SERVICESPAWNTIME      13
+  { SERVICESPAWNTIME    , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,9 } },
+#define   SERVICECONNRATE       14
+  { SERVICECONNRATE     , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,10 } },
 };
 /*    (L = length of the oidsuffix) */
 
@@ -238,6 +248,30 @@ var_serviceTable(struct variable *vp,
 	long_ret = Services[index - 1].nconnections;
 	return (unsigned char *) &long_ret;
 
+    case SERVICEREADY:
+	long_ret = Services[index - 1].ready_workers;
+	return (unsigned char *) &long_ret;
+
+    case SERVICEPREFORK:
+	long_ret = Services[index - 1].max_prefork &&
+	    Services[index - 1].prefork_target >
+	    Services[index - 1].desired_workers ?
+	    Services[index - 1].prefork_target :
+	    Services[index - 1].desired_workers;
+	return (unsigned char *) &long_ret;
+
+    case SERVICEQUEUE:
+	long_ret = Services[index - 1].accept_queue;
+	return (unsigned char *) &long_ret;
+
+    case SERVICESPAWNTIME:
+	long_ret = Services[index - 1].spawn_ready_ms;
+	return (unsigned char *) &long_ret;
+
+    case SERVICECONNRATE:
+	long_ret = Services[index - 1].conn_rate;
+	return (unsigned char *) &long_ret;
+
     default:
 	ERROR_MSG("");
     }
@@ -66,11 +66,15 @@
 #include <ctype.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <sysexits.h>
 #include <errno.h>
 #include <limits.h>
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 
 #ifndef INADDR_NONE
 #define INADDR_NONE 0xffffffff
@@ -171,11 +175,42 @@ struct centry {
     enum sstate service_state;	/* SERVICE_STATE_* */
     time_t janitor_deadline;	/* cleanup deadline */
     int si;			/* Services[] index */
+    struct timeval spawned;	/* fork time, until first AVAILABLE */
     struct centry *next;
 };
 static struct centry *ctable[child_table_size];
 static struct centry *cfreelist;
 
+/*
+ * Prefork autoscaling (maxprefork= in cyrus.conf).
+ *
+ * Once a second each service's connection arrival rate and listen
+ * queue depth are sampled.  By Little's law, the idle workers needed
+ * to absorb arrivals while replacements are still starting up is
+ * rate * spawn-to-ready time; that plus whatever is already queued
+ * becomes the prefork target.  The target grows immediately but only
+ * shrinks after AUTOSCALE_HOLDDOWN quiet seconds, and then by half
+ * the difference, so the pool doesn't flap.  Surplus idle workers
+ * simply time out on their own.
+ */
+#define AUTOSCALE_HOLDDOWN	30	/* secs before shrinking the target */
+#define AUTOSCALE_SPAWN_MS	1000	/* assumed spawn time until measured */
+
+#define WANTED_WORKERS(s) \
+    ((s)->max_prefork && (s)->prefork_target > (s)->desired_workers ? \
+     (s)->prefork_target : (s)->desired_workers)
+
+static int autoscaling = 0;		/* any service with maxprefork? */
+
+/* pull the autoscaled target back inside [desired_workers, max_prefork] */
+static void clamp_prefork_target(struct service *s)
+{
+    if (!s->max_prefork || s->prefork_target < s->desired_workers)
+	s->prefork_target = s->desired_workers;
+    else if (s->prefork_target > s->max_prefork)
+	s->prefork_target = s->max_prefork;
+}
+
 static int janitor_frequency = 1;	/* Janitor sweeps per second */
 static int janitor_position;		/* Entry to begin at in next sweep */
 static struct timeval janitor_mark;	/* Last time janitor did a sweep */
@@ -254,6 +289,7 @@ static struct centry *get_centry(void)
     cfreelist = cfreelist->next;
 
     t->janitor_deadline = 0;
+    t->spawned.tv_sec = t->spawned.tv_usec = 0;
 
     return t;
 }
@@ -308,6 +344,35 @@ int verify_service_file(char *const *filename)
     return statbuf.st_mode & S_IXUSR;
 }
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/*
+ * Client affinity (affinity= in cyrus.conf): instead of hashing the
+ * whole connection 4-tuple, pick the reuseport shard from the client
+ * address alone.  A client reconnecting from the same address then
+ * lands on the same shard, whose workers may still hold that user's
+ * databases open (userdb_cache_size in imapd.conf).
+ */
+static void reuseport_affinity(struct service *s, int nshards)
+{
+    struct sock_filter code[] = {
+	/* A = source address (its low 32 bits for IPv6) */
+	{ BPF_LD | BPF_W | BPF_ABS, 0, 0,
+	  SKF_NET_OFF + (s->family == AF_INET6 ? 20 : 12) },
+	/* return A % nshards, the index of the shard in the group */
+	{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nshards },
+	{ BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(s->socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		   (void *) &prog, sizeof(prog)) < 0) {
+	syslog(LOG_ERR, "unable to setsocketopt(SO_ATTACH_REUSEPORT_CBPF): %m");
+    }
+}
+#endif
+
 void service_create(struct service *s)
 {
     struct service service0, service;
@@ -317,7 +382,7 @@ void service_create(struct service *s)
     mode_t oldumask;
     int on = 1;
     int res0_is_local = 0;
-    int r;
+    int r, shard = 0, nshards = 1;
 
     if (s->associate > 0)
 	return;			/* service is already activated */
@@ -409,11 +474,15 @@ void service_create(struct service *s)
 	    s->exec = NULL;
 	    return;
 	}
+
+	if (s->shards > 1) nshards = s->shards;
     }
 
     memcpy(&service0, s, sizeof(struct service));
 
-    for (res = res0; res; res = res->ai_next) {
+    /* one listener per address, or nshards of them with SO_REUSEPORT */
+    for (res = res0; res;
+	 res = (++shard < nshards) ? res : (shard = 0, res->ai_next)) {
 	if (s->socket > 0) {
 	    memcpy(&service, &service0, sizeof(struct service));
 	    s = &service;
@@ -433,6 +502,16 @@ void service_create(struct service *s)
 	if (r < 0) {
 	    syslog(LOG_ERR, "unable to setsocketopt(SO_REUSEADDR): %m");
 	}
+#ifdef SO_REUSEPORT
+	if (nshards > 1) {
+	    /* let the kernel balance connections across the shards */
+	    r = setsockopt(s->socket, SOL_SOCKET, SO_REUSEPORT,
+			   (void *) &on, sizeof(on));
+	    if (r < 0) {
+		syslog(LOG_ERR, "unable to setsocketopt(SO_REUSEPORT): %m");
+	    }
+	}
+#endif
 #if defined(IPV6_V6ONLY) && !(defined(__FreeBSD__) && __FreeBSD__ < 3)
 	if (res->ai_family == AF_INET6) {
 	    r = setsockopt(s->socket, IPPROTO_IPV6, IPV6_V6ONLY,
@@ -481,6 +560,13 @@ void service_create(struct service *s)
 	s->ready_workers = 0;
 	s->associate = nsocket;
 	s->family = res->ai_family;
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	/* the first shard to listen creates the group, steer it */
+	if (nshards > 1 && shard == 0 && s->affinity) {
+	    reuseport_affinity(s, nshards);
+	}
+#endif
 	
 	get_statsock(s->stat);
 	
@@ -575,6 +661,7 @@ void spawn_service(const int si)
     int i;
     char path[PATH_MAX];
     static char name_env[100], name_env2[100];
+    static char nolock_env[] = "CYRUS_NOACCEPTLOCK=1";
     struct centry *c;
     struct service * const s = &Services[si];
     time_t now = time(NULL);
@@ -666,6 +753,8 @@ void spawn_service(const int si)
 	putenv(name_env);
 	snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
 	putenv(name_env2);
+	/* a SO_REUSEPORT shard is ours alone to accept on */
+	if (s->shards > 1) putenv(nolock_env);
 
 	execv(path, s->exec);
 	syslog(LOG_ERR, "couldn't exec %s: %m", path);
@@ -682,6 +771,7 @@ void spawn_service(const int si)
 	c->pid = p;
 	c->service_state = SERVICE_STATE_READY;
 	c->si = si;
+	gettimeofday(&c->spawned, NULL);
 	c->next = ctable[p % child_table_size];
 	ctable[p % child_table_size] = c;
 	break;
@@ -1134,6 +1224,23 @@ int read_msg(int fd, struct notify_message *msg)
     return 0;
 }
 
+/* fold a new child's fork-to-ready time into the service average */
+static void note_spawn_ready(struct service *s, struct centry *c)
+{
+    struct timeval now;
+    long ms;
+
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - c->spawned.tv_sec) * 1000 +
+	(now.tv_usec - c->spawned.tv_usec) / 1000;
+    c->spawned.tv_sec = 0;
+    if (ms < 0) return;
+    if (ms == 0) ms = 1;
+
+    if (!s->spawn_ready_ms) s->spawn_ready_ms = ms;
+    else s->spawn_ready_ms = (3 * s->spawn_ready_ms + ms) / 4;
+}
+
 void process_msg(const int si, struct notify_message *msg) 
 {
     struct centry *c;
@@ -1194,11 +1301,19 @@ void process_msg(const int si, struct notify_message *msg)
 	break;
     }
     
+    /* only a new child's first message can tell us it finished starting */
+    if (msg->message != MASTER_SERVICE_AVAILABLE) c->spawned.tv_sec = 0;
+
     /* process message, according to state machine */
     switch (msg->message) {
     case MASTER_SERVICE_AVAILABLE:
 	switch (c->service_state) {
 	case SERVICE_STATE_READY:
+	    if (c->spawned.tv_sec) {
+		/* new child is initialized and about to accept */
+		note_spawn_ready(s, c);
+		break;
+	    }
 	    /* duplicate message? */
 	    syslog(LOG_WARNING,
 		   "service %s pid %d in READY state: sent available message but it is already ready",
@@ -1358,6 +1473,71 @@ void process_msg(const int si, struct notify_message *msg)
 	       SERVICENAME(s->name), s->ready_workers);
 }
 
+/* number of connections waiting to be accepted on a listener */
+static int listen_queue_depth(int fd)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    /* for a listening socket Linux reports its accept queue here */
+    if (fd > 0 && !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+	return ti.tcpi_unacked;
+#endif
+
+    return 0;
+}
+
+/* sample demand and adjust prefork targets, at most once a second */
+void autoscale(time_t now)
+{
+    static time_t last = 0;
+    int i, need, elapsed, arrivals;
+    unsigned int spawn_ms;
+
+    if (!autoscaling || now <= last) return;
+    elapsed = last ? now - last : 1;
+    last = now;
+
+    for (i = 0; i < nservices; i++) {
+	struct service *s = &Services[i];
+
+	if (!s->exec || !s->max_prefork) continue;
+
+	/* arrivals per minute, smoothed over the last few seconds */
+	arrivals = s->nconnections - s->last_nconnections;
+	if (arrivals < 0) arrivals = 0;
+	s->last_nconnections = s->nconnections;
+	s->conn_rate = (s->conn_rate + 60 * arrivals / elapsed) / 2;
+
+	s->accept_queue = listen_queue_depth(s->socket);
+
+	spawn_ms = s->spawn_ready_ms ? s->spawn_ready_ms : AUTOSCALE_SPAWN_MS;
+	need = s->desired_workers + s->accept_queue +
+	    (s->conn_rate * spawn_ms + 59999) / 60000;
+	if (need > s->max_prefork) need = s->max_prefork;
+
+	if (need >= s->prefork_target) {
+	    if (need > s->prefork_target && need > s->desired_workers) {
+		syslog(LOG_INFO, "service %s: prefork %d -> %d "
+		       "(%u conn/min, %ums to spawn, %d queued)",
+		       SERVICENAME(s->name), s->prefork_target, need,
+		       s->conn_rate, spawn_ms, s->accept_queue);
+	    }
+	    s->prefork_target = need;
+	    s->scale_down_mark = now + AUTOSCALE_HOLDDOWN;
+	}
+	else if (now >= s->scale_down_mark) {
+	    need = s->prefork_target - (s->prefork_target - need + 1) / 2;
+	    if (verbose)
+		syslog(LOG_DEBUG, "service %s: prefork %d -> %d",
+		       SERVICENAME(s->name), s->prefork_target, need);
+	    s->prefork_target = need;
+	    s->scale_down_mark = now + AUTOSCALE_HOLDDOWN;
+	}
+    }
+}
+
 static char **tokenize(char *p)
 {
     char **tokens = NULL; /* allocated in increments of 10 */
@@ -1410,10 +1590,14 @@ void add_service(const char *name, struct entry *e, void *rock)
     int prefork = masterconf_getint(e, "prefork", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
+    int reuseport = masterconf_getint(e, "reuseport", 0);
+    int affinity = masterconf_getswitch(e, "affinity", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
     char *proto = xstrdup(masterconf_getstring(e, "proto", "tcp"));
     char *max = xstrdup(masterconf_getstring(e, "maxchild", "-1"));
     rlim_t maxfds = (rlim_t) masterconf_getint(e, "maxfds", 256);
+    int shards = 0, affine = 0;
     int reconfig = 0;
     int i, j;
 
@@ -1474,6 +1658,39 @@ void add_service(const char *name, struct entry *e, void *rock)
     }
     else if (Services[i].listen) reconfig = 1;
 
+    if (reuseport > 1 && listen[0] != '/' &&
+	(!strcmp(proto, "tcp") || !strcmp(proto, "tcp4") ||
+	 !strcmp(proto, "tcp6"))) {
+#ifdef SO_REUSEPORT
+	shards = reuseport;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	affine = affinity;
+#else
+	if (affinity) {
+	    syslog(LOG_WARNING, "WARNING: service '%s': "
+		   "affinity not supported on this platform -- ignored",
+		   name);
+	}
+#endif
+#else
+	syslog(LOG_WARNING, "WARNING: service '%s': "
+	       "reuseport not supported on this platform -- ignored",
+	       name);
+#endif
+    }
+
+    /* the listeners are only made when the service is created, and
+       children still serving on the old ones would strand connections
+       routed to them, so the running layout stays until a restart */
+    if (reconfig &&
+	(shards != Services[i].shards || affine != Services[i].affinity)) {
+	syslog(LOG_WARNING, "WARNING: service '%s': "
+	       "reuseport/affinity change needs a restart -- ignored",
+	       name);
+	shards = Services[i].shards;
+	affine = Services[i].affinity;
+    }
+
     if (!Services[i].name) Services[i].name = xstrdup(name);
     if (Services[i].listen) free(Services[i].listen);
     Services[i].listen = listen;
@@ -1506,14 +1723,36 @@ void add_service(const char *name, struct entry *e, void *rock)
 	if (Services[i].max_workers < 0) {
 	    Services[i].max_workers = INT_MAX;
 	}
+	if (maxprefork > 0 && maxprefork < prefork) maxprefork = prefork;
+	if (maxprefork > Services[i].max_workers)
+	    maxprefork = Services[i].max_workers;
+	Services[i].max_prefork = maxprefork > 0 ? maxprefork : 0;
+
+	Services[i].shards = shards;
+	Services[i].affinity = affine;
+	if (shards > 1) {
+	    /* the limits are for the service as a whole, split them */
+	    Services[i].desired_workers = (prefork + shards - 1) / shards;
+	    if (Services[i].max_workers != INT_MAX) {
+		Services[i].max_workers =
+		    (Services[i].max_workers + shards - 1) / shards;
+	    }
+	    Services[i].max_prefork =
+		(Services[i].max_prefork + shards - 1) / shards;
+	}
     } else {
 	/* udp */
 	if (prefork > 1) prefork = 1;
 	Services[i].desired_workers = prefork;
 	Services[i].max_workers = 1;
+	Services[i].max_prefork = 0;
     }
+    if (Services[i].max_prefork) autoscaling = 1;
  
     if (reconfig) {
+	/* keep a scaled-up pool within the new limits */
+	clamp_prefork_target(&Services[i]);
+
 	/* reconfiguring an existing service, update any other instances */
 	for (j = 0; j < nservices; j++) {
 	    if (Services[j].associate > 0 && Services[j].listen &&
@@ -1523,6 +1762,10 @@ void add_service(const char *name, struct entry *e, void *rock)
 		Services[j].desired_workers = Services[i].desired_workers;
 		Services[j].babysit = Services[i].babysit;
 		Services[j].max_workers = Services[i].max_workers;
+		Services[j].max_prefork = Services[i].max_prefork;
+		Services[j].shards = Services[i].shards;
+		Services[j].affinity = Services[i].affinity;
+		clamp_prefork_target(&Services[j]);
 	    }
 	}
     }
@@ -2069,7 +2312,7 @@ int main(int argc, char **argv)
 	    if (!in_shutdown) {
 		if (Services[i].exec /* enabled */ &&
 		    (Services[i].nactive < Services[i].max_workers) &&
-		    (Services[i].ready_workers < Services[i].desired_workers)) {
+		    (Services[i].ready_workers < WANTED_WORKERS(&Services[i]))) {
 		    spawn_service(i);
 		} else if (Services[i].exec
 			  && Services[i].babysit
@@ -2158,6 +2401,12 @@ int main(int argc, char **argv)
 	    tv.tv_usec = 0;
 	    tvptr = &tv;
 	}
+	if (autoscaling && (!tvptr || tv.tv_sec > 1)) {
+	    /* wake up to sample demand even when nothing happens */
+	    tv.tv_sec = 1;
+	    tv.tv_usec = 0;
+	    tvptr = &tv;
+	}
 
 #if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
 	if (tvptr == NULL) blockp = 1;
@@ -2202,7 +2451,8 @@ int main(int argc, char **argv)
 		Services[i].nactive < Services[i].max_workers) {
 		/* bring us up to desired_workers */
 		for (j = Services[i].ready_workers;
-		     j < Services[i].desired_workers; 
+		     j < WANTED_WORKERS(&Services[i]) &&
+			 Services[i].nactive < Services[i].max_workers;
 		     j++)
 		{
 		    spawn_service(i);
@@ -2217,6 +2467,7 @@ int main(int argc, char **argv)
 	}
 	now = time(NULL);
 	child_janitor(now);
+	autoscale(now);
 
 #ifdef HAVE_NETSNMP
 	run_alarms();
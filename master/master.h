@@ -19,6 +19,8 @@ struct service {
     /* multiple address family support */
     int associate;		/* are we primary or additional instance? */
     int family;			/* address family */
+    int shards;			/* SO_REUSEPORT listeners per address */
+    int affinity;		/* pick the shard by client address */
 
     /* communication info */
     int socket;			/* client/child communication channel */
@@ -40,6 +42,15 @@ struct service {
     /* fork rate computation */
     time_t last_interval_start;
     unsigned int interval_forks;
+
+    /* prefork autoscaling */
+    int max_prefork;		/* autoscaler ceiling, 0 = disabled */
+    int prefork_target;		/* num child processes the autoscaler wants */
+    int accept_queue;		/* connections waiting in the listen queue */
+    unsigned int spawn_ready_ms; /* avg time from fork to ready to accept */
+    unsigned int conn_rate;	/* avg connection arrivals per minute */
+    int last_nconnections;	/* nconnections at the last sample */
+    time_t scale_down_mark;	/* don't shrink prefork_target before this */
 };
 
 extern struct service *Services;
@@ -81,6 +92,12 @@ extern int nservices;
  * This field is intended to avoid duplicate free by doing free only when
  * associate is zero.
  *
+ * Services with reuseport=N in cyrus.conf get N listening sockets per
+ * address, all bound with SO_REUSEPORT, each in its own Service block
+ * (again told apart by associate).  The kernel spreads connections
+ * across them, and since every worker only ever accepts on its own
+ * shard, they need no accept lock.
+ *
  */
 
 #endif /* HAVE_MASTER_H */
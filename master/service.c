@@ -407,7 +407,13 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    /* a SO_REUSEPORT shard has no other acceptors to serialize with */
+    if (!getenv("CYRUS_NOACCEPTLOCK")) getlockfd(service, id);
+
+    /* tell master we're initialized; it times how long workers take
+       to become ready when deciding how far ahead to prefork */
+    notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
+
     for (;;) {
 	/* ok, listen to this socket until someone talks to us */
 